@@ -6,6 +6,10 @@
  */
  
 #include "ChariotEPLib.h"
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#endif
 
 #if UNO_HOST==1 || LEONARDO_HOST==1 || ESP8266_D1_R1_HOST==1 || ESP8266_D1_R2_HOST==1
 	SoftwareSerial ChariotClient(RX_PIN, TX_PIN);
@@ -15,10 +19,20 @@
 	#error Board type not supported by Chariot at this time--contact Tech Support.
 #endif
 
+static volatile bool eventReady;		// event line edge--see enableEventLine()
+
+// Chariot's answer to one of our own requests set off the event line too
+static inline void roundTripDone()
+{
+	eventReady = false;
+}
+
 ChariotEPClass::ChariotEPClass()
 {
 	chariotAvailable = false;
+	beginState = BEGIN_IDLE;
 	nextRsrcId = 0;
+	registryAddr = REGISTRY_OFF;
 }
 
 ChariotEPClass::~ChariotEPClass()
@@ -26,18 +40,69 @@ ChariotEPClass::~ChariotEPClass()
 	// do nothing
 }
 
-bool ChariotEPClass::begin(String& loc) 
+// CRCs for the resource registry--see registryHit()
+static uint16_t crc16Update(uint16_t crc, uint8_t b)
+{
+	uint8_t i;
+	
+	crc ^= (uint16_t)b << 8;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	return crc;
+}
+
+// CCITT CRC of s--never 0, which marks an empty entry
+static uint16_t crc16(const String& s, uint16_t crc = 0xFFFF)
+{
+	unsigned int i;
+	
+	for (i = 0; i < s.length(); i++)
+		crc = crc16Update(crc, s[i]);
+	return crc ? crc : 1;
+}
+
+bool ChariotEPClass::begin(String& loc, unsigned long timeoutMs) 
 {
 	String location;
 	String response;
-	if (begin())
-	{
-		location = "location=" + loc;
-		return localChariotCmd(location, response);
+	if (!begin(timeoutMs))
+		return false;
+		
+	// Chariot kept its location over a warm start
+	if (warmStart && (registry.location == crc16(loc)))
+		return true;
+	location = "location=" + loc;
+	if (!localChariotCmd(location, response))
+		return false;
+	registry.location = crc16(loc);
+	registrySave();
+	return true;
+}
+
+/*
+ * Bring up the channel and wait for Chariot, at most timeoutMs.
+ * Returns true once Chariot is ready; beginStatus() tells why not.
+ */
+bool ChariotEPClass::begin(unsigned long timeoutMs) 
+{
+	beginAsync(NULL, timeoutMs);
+	while (beginState < BEGIN_READY) {
+		delay(CHARIOT_POLL_MS);
+		beginStep();
 	}
+	return (beginState == BEGIN_READY);
 }
 
-bool ChariotEPClass::begin() 
+/*
+ * Start the channel and return at once: process() and run() bring Chariot
+ * up while the sketch starts its own network stack, then call onReady
+ * (may be NULL) with BEGIN_READY or, after timeoutMs, the timeout status.
+ * After a timeout Chariot is probed again every timeoutMs, and onReady
+ * is called once more if it comes up. Tasks, watches, rules etc. may be
+ * set up straight away and run meanwhile; createResource() and other
+ * Chariot round trips fail until Chariot is ready.
+ */
+bool ChariotEPClass::beginAsync(void (*onReady)(uint8_t status), unsigned long timeoutMs)
 {
 #if EP_DEBUG
 Serial.println("Testing for HW resources begins...");
@@ -113,22 +178,17 @@ Serial.println("Testing for HW resources complete.");
 	// This pin driven HIGH when Chariot is active
 	pinMode(CHARIOT_STATE_PIN, INPUT);
 	
-	while ((digitalRead(CHARIOT_STATE_PIN) == 0) || (!ChariotClient.available()))
-	{
-		delay(50);
-		SerialMon.print(".");
-	}
-	SerialMon.println();
-	chariotPrintResponse();
-	SerialMon.println(F("...Chariot online"));
-		
-	// Take Chariot's temp at startup and display.
-	SerialMon.print(F("\nSystem temp at startup: "));
-	SerialMon.print(readTMP275(CELSIUS), 2);
-	SerialMon.println('C');
-	SerialMon.println(F("\ntype \"help\" to see available Serial commands"));
-	SerialMon.println();	
-	chariotAvailable = true;
+	// Start Chariot's temp sensor--service() keeps its reading current
+#ifndef I_AM_EXCLUSIVE_I2C_OWNER
+	Wire.begin();
+#endif
+	tmpRes = TMP275_RES_12BIT;
+	tmpPeriod = TMP275_PERIOD_MS;
+	tmpConverting = false;
+	tmpValid = false;
+	tmpDue = millis();
+	tmp275Service();
+	chariotAvailable = false;
 
 	// initialize event resources--these are stored in Chariot
 	nextRsrcId = 0;
@@ -140,7 +200,153 @@ Serial.println("Testing for HW resources complete.");
 		putCallbacks[i] = NULL;
 		rsrcChariotBufSizes[i] = 0;
 	}	
-	chariotAvailable = true;
+	pinTableInit();
+	
+	for (i=0; i<MAX_WATCHES; i++) {
+		watches[i].edge = WATCH_OFF;
+	}
+	eventLinePin = NO_EVENT_LINE;
+	for (i=0; i<LIB_RSRC_COUNT; i++) {
+		libRsrcs[i] = -1;
+		libRsrcWanted[i] = false;
+	}
+	for (i=0; i<MAX_STATS; i++) {
+		stats[i].source = STATS_NONE;
+		stats[i].ewmaValid = false;
+	}
+	for (i=0; i<MAX_HISTORIES; i++) {
+		histories[i].source = STATS_NONE;
+	}
+	for (i=0; i<MAX_RULES; i++) {
+		rules[i].len = 0;
+	}
+	for (i=0; i<MAX_SENSORS; i++) {
+		sensors[i].used = false;
+	}
+	
+	// Timer wheel--the library's periodic work is its first task
+	for (i=0; i<MAX_TASKS; i++) {
+		tasks[i].fn = NULL;
+		tasks[i].linked = false;
+	}
+	memset(wheel, -1, sizeof(wheel));
+	wheelAt = millis();
+	wheelTick = 0;
+	tasksRun = false;
+	putEventRsrc = -1;
+	addTask(libTickTask, LIB_TICK_MS, LIB_TICK_MS);
+	
+	// Duty cycling is off until dutyCycle()--the first window opened at reset
+	dutySleepSecs = 0;
+	dutyAwakeMw = 0;
+	dutySleepUw = 0;
+	dutyWakeAt = 0;
+	dutyWaking = false;
+	memset(&duty, 0, sizeof(duty));
+#if defined(ESP8266)
+	// Deep sleep ends in a reset--pick up the cycle count and last cycle's figures
+	if (!ESP.rtcUserMemoryRead(0, (uint32_t *)&duty, sizeof(duty)) || (duty.magic != DUTY_RTC_MAGIC))
+		memset(&duty, 0, sizeof(duty));
+#endif
+
+	// Warm start if Chariot answers the probe, else wait for it to boot
+	registryLoad();
+	readyCallback = onReady;
+	beginTimeout = timeoutMs;
+	beginRetry = false;
+	beginAt = millis();
+	beginState = chariotProbe() ? BEGIN_PROBE : BEGIN_WAIT_STATE;
+	return true;
+}
+
+/*
+ * Bring-up steps, from begin(), process() and run():
+ *   BEGIN_PROBE       warm start probe sent--a health reply with no
+ *                     "Chariot ready" before it means a warm start
+ *   BEGIN_WAIT_STATE  CHARIOT_STATE_PIN is still low
+ *   BEGIN_WAIT_READY  waiting for "Chariot ready"
+ *   BEGIN_NO_STATE/BEGIN_NO_READY  timed out--probe again when another
+ *                     timeout has passed
+ */
+void ChariotEPClass::beginStep()
+{
+	String response;
+	
+	switch (beginState) {
+		case BEGIN_PROBE:
+			if (ChariotClient.available()) {
+				chariotGetResponse(response);
+				if (response.indexOf(F("ready")) != -1) {
+					warmStart = false;		// it was just booting--wait for the health reply
+					break;
+				}
+				if (response.startsWith(F("2.05")) || !warmStart) {
+					if (registry.count == 0)
+						warmStart = false;
+					beginDone(BEGIN_READY);
+					return;
+				}
+				warmStart = false;
+				beginState = BEGIN_WAIT_STATE;
+			} else if (millis() - probeAt >= CHARIOT_PROBE_MS) {
+				if (!warmStart) {
+					beginDone(BEGIN_READY);	// booted, health query lost
+					return;
+				}
+				warmStart = false;
+				beginState = BEGIN_WAIT_STATE;
+			}
+			break;
+		case BEGIN_WAIT_STATE:
+			if (digitalRead(CHARIOT_STATE_PIN) == 0)
+				break;
+			beginState = BEGIN_WAIT_READY;
+			// fall through
+		case BEGIN_WAIT_READY:
+			if (!ChariotClient.available())
+				break;
+			chariotPrintResponse();
+			beginDone(BEGIN_READY);
+			return;
+		case BEGIN_NO_STATE:
+		case BEGIN_NO_READY:
+			if (millis() - beginAt < beginTimeout)
+				return;
+			beginRetry = true;
+			beginAt = millis();
+			beginState = chariotProbe() ? BEGIN_PROBE : BEGIN_WAIT_STATE;
+			return;
+		default:
+			return;
+	}
+	if (millis() - beginAt >= beginTimeout) {
+		warmStart = false;
+		beginAt = millis();
+		beginDone((beginState == BEGIN_WAIT_READY) ? BEGIN_NO_READY : BEGIN_NO_STATE);
+	}
+}
+
+void ChariotEPClass::beginDone(uint8_t status)
+{
+	beginState = status;
+	if (status == BEGIN_READY) {
+		chariotAvailable = true;
+		if (warmStart) {
+			SerialMon.print(F("...Chariot still online--warm start, registry generation "));
+			SerialMon.println(registry.generation);
+		} else {
+			SerialMon.println(F("...Chariot online"));
+		}
+		SerialMon.println(F("\ntype \"help\" to see available Serial commands"));
+		SerialMon.println();
+	} else if (beginRetry) {
+		return;			// still down--said so the first time
+	} else {
+		SerialMon.print(F("...Chariot did not come online, status "));
+		SerialMon.println(status);
+	}
+	if (readyCallback != NULL)
+		readyCallback(status);
 }
 
 uint8_t ChariotEPClass::getArduinoModel() { return arduinoType; }
@@ -163,6 +369,18 @@ int ChariotEPClass::getIdFromURI(String& uri)
 	return -1;
 }
 
+// Match the first len chars of uri--e.g., the URI part of "event/x&param=y"
+int ChariotEPClass::getIdFromURI(const char *uri, uint8_t len)
+{
+	int i;
+	for (i=0; i < nextRsrcId; i++) {
+		if ((rsrcURIs[i].length() == len) && (strncmp(rsrcURIs[i].c_str(), uri, len) == 0)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
 int ChariotEPClass::allocResource()
 {
 	int handle = nextRsrcId;
@@ -220,15 +438,24 @@ int ChariotEPClass::setPutHandler(int handle, String * (*putCallback)(String& pu
 		
 }
 
+/*
+ * Register uri with Chariot and return its handle, or -1. A uri that was
+ * already created returns the same handle without a round trip--the first
+ * call's bufLen and attrib stand.
+ */
 int ChariotEPClass::createResource(const String& uri, uint8_t bufLen, const String& attrib)
 {
 	int rsrcNbr;
 	
-	if ((uri == NULL) || (bufLen == 0) || (bufLen > (MAX_BUFLEN-1)) 
-			          || (attrib == NULL) || (nextRsrcId == MAX_RESOURCES)) 
+	if ((uri == NULL) || (bufLen == 0) || (bufLen > (MAX_BUFLEN-1)) || (attrib == NULL) || !chariotAvailable) 
 	{
 		return -1;
 	}
+	// Already created, or still held by Chariot over a warm start?
+	if ((rsrcNbr = registryHit(uri, bufLen, attrib)) >= 0)
+		return rsrcNbr;
+	if (nextRsrcId == MAX_RESOURCES)
+		return -1;
 		
 	rsrcNbr = nextRsrcId;
 	nextRsrcId++;
@@ -254,6 +481,7 @@ int ChariotEPClass::createResource(const String& uri, uint8_t bufLen, const Stri
 	while (ChariotClient.available() == 0) ;  // wait on response
 	// Parse this for result of last resource operation
 	String input = ChariotClient.readStringUntil('\r');
+	roundTripDone();
 	int terminator = input.indexOf("<<");
 	if (terminator != -1)
 		input.remove(terminator, 2);
@@ -267,6 +495,7 @@ int ChariotEPClass::createResource(const String& uri, uint8_t bufLen, const Stri
 		nextRsrcId--;
 		return -1;
 	}
+	registryNote(rsrcNbr, bufLen);
 #if EP_DEBUG	
 	SerialMon.print(F("  "));
 	SerialMon.println(uri);
@@ -279,11 +508,15 @@ int ChariotEPClass::createResource(const __FlashStringHelper* uri, uint8_t bufLe
 {
 	int rsrcNbr;
 	
-	if ((uri == NULL) || (bufLen == 0) || (bufLen > (MAX_BUFLEN-1)) 
-			          || (attrib == NULL) || (nextRsrcId == MAX_RESOURCES)) 
+	if ((uri == NULL) || (bufLen == 0) || (bufLen > (MAX_BUFLEN-1)) || (attrib == NULL) || !chariotAvailable) 
 	{
 		return -1;
 	}
+	// Already created, or still held by Chariot over a warm start?
+	if ((rsrcNbr = registryHit(String(uri), bufLen, String(attrib))) >= 0)
+		return rsrcNbr;
+	if (nextRsrcId == MAX_RESOURCES)
+		return -1;
 		
 	rsrcNbr = nextRsrcId;
 	nextRsrcId++;
@@ -309,6 +542,7 @@ int ChariotEPClass::createResource(const __FlashStringHelper* uri, uint8_t bufLe
 	while (ChariotClient.available() == 0) ;  // wait on coap response
 	// Parse this for result of last resource operation
 	String input = ChariotClient.readStringUntil('\r');
+	roundTripDone();
 	int terminator = input.indexOf("<<");
 	if (terminator != -1)
 		input.remove(terminator, 2);
@@ -319,6 +553,7 @@ int ChariotEPClass::createResource(const __FlashStringHelper* uri, uint8_t bufLe
 		nextRsrcId--;
 		return -1;
 	}
+	registryNote(rsrcNbr, bufLen);
 #if EP_DEBUG	
 	SerialMon.print(F("    "));
 	SerialMon.println(String(uri));
@@ -326,6 +561,155 @@ int ChariotEPClass::createResource(const __FlashStringHelper* uri, uint8_t bufLe
 	return rsrcNbr;
 }
 
+/*----------------------------------------------------------------------*/
+/*
+ * Resource registry. The CRC of each registration is kept in EEPROM with
+ * a generation number that is bumped whenever an entry changes. Chariot
+ * can't be asked what it holds, so begin() takes it to still hold every
+ * registration in the registry if it answers without having rebooted
+ * (see chariotProbe()); createResource() calls that match their entry
+ * then skip the Chariot round trip. Any that don't are registered and
+ * their entry replaced. The registry is only kept if the sketch gives it
+ * a place with useRegistry(); otherwise EEPROM is left alone.
+ */
+
+/*
+ * Keep the registry in EEPROM (ESP8266: its flash emulation) at eeAddr,
+ * sizeof(registry_t) bytes. Call before begin(). false if it won't fit.
+ * On ESP8266 a sketch that keeps EEPROM.begin() open must size it to
+ * cover the registry too; it is committed, not ended, on a change.
+ */
+bool ChariotEPClass::useRegistry(int eeAddr)
+{
+#if defined(E2END)
+	if ((eeAddr < 0) || (eeAddr + sizeof(registry) > E2END + 1UL))
+		return false;
+#elif defined(ESP8266)
+	if ((eeAddr < 0) || (eeAddr + sizeof(registry) > 4096))		// EEPROM.begin()'s one flash sector
+		return false;
+#else
+	if (eeAddr < 0)
+		return false;
+#endif
+	registryAddr = eeAddr;
+	return true;
+}
+
+#if defined(ESP8266)
+/*
+ * The EEPROM session for the registry: the sketch's, if it has begun one--
+ * EEPROM.end() would drop it--or else one of our own. false if the sketch's
+ * is too small to hold the registry.
+ */
+static bool registryBegin(size_t size, bool *own)
+{
+	*own = (EEPROM.length() == 0);
+	if (*own)
+		EEPROM.begin(size);
+	return EEPROM.length() >= size;
+}
+#endif
+
+void ChariotEPClass::registryLoad()
+{
+	if (registryAddr == REGISTRY_OFF) {
+		memset(&registry, 0, sizeof(registry));
+		registry.magic = REGISTRY_MAGIC;
+		return;
+	}
+#if defined(ESP8266)
+	bool own;
+	
+	if (registryBegin(registryAddr + sizeof(registry), &own))
+		EEPROM.get(registryAddr, registry);
+	else
+		registry.magic = 0;						// starts empty
+	if (own)
+		EEPROM.end();
+#else
+	EEPROM.get(registryAddr, registry);
+#endif
+	if ((registry.magic != REGISTRY_MAGIC) || (registry.count > MAX_RESOURCES)) {
+		memset(&registry, 0, sizeof(registry));
+		registry.magic = REGISTRY_MAGIC;
+	}
+}
+
+void ChariotEPClass::registrySave()
+{
+	if (registryAddr == REGISTRY_OFF)
+		return;
+#if defined(ESP8266)
+	bool own;
+	
+	if (!registryBegin(registryAddr + sizeof(registry), &own)) {
+		SerialMon.println(F("Registry not saved--sketch's EEPROM.begin() too small"));
+		return;
+	}
+	EEPROM.put(registryAddr, registry);
+	if (own)
+		EEPROM.end();							// commits
+	else
+		EEPROM.commit();						// the sketch's session stays open
+#else
+	EEPROM.put(registryAddr, registry);			// only changed bytes are written
+#endif
+}
+
+/*
+ * Handle of uri if it was already created--or, over a warm start, if
+ * Chariot still holds the same registration in the next free slot. -1
+ * if it must be registered.
+ */
+int ChariotEPClass::registryHit(const String& uri, uint8_t bufLen, const String& attrib)
+{
+	int handle;
+	
+	if ((handle = getIdFromURI(uri.c_str(), uri.length())) >= 0)
+		return handle;
+	handle = nextRsrcId;
+	if (!warmStart || (handle >= registry.count) || (handle >= MAX_RESOURCES))
+		return -1;
+	if (registry.crc[handle] != crc16(attrib, crc16Update(crc16(uri), bufLen)))
+		return -1;
+	nextRsrcId++;
+	rsrcURIs[handle] = uri;
+	rsrcATTRs[handle] = attrib;
+	rsrcChariotBufSizes[handle] = min(bufLen, MAX_BUFLEN);
+	return handle;
+}
+
+// Record a registration Chariot accepted; EEPROM is only written on a change
+void ChariotEPClass::registryNote(int handle, uint8_t bufLen)
+{
+	uint16_t crc = crc16(rsrcATTRs[handle], crc16Update(crc16(rsrcURIs[handle]), bufLen));
+	
+	if ((registry.crc[handle] == crc) && (handle < registry.count))
+		return;
+	registry.crc[handle] = crc;
+	if (handle >= registry.count)
+		registry.count = handle + 1;
+	registry.generation++;
+	registrySave();
+}
+
+/*
+ * Warm start test: if Chariot is online, ask for its health. beginStep()
+ * takes an answer with no "Chariot ready" boot message before it to mean
+ * Chariot hasn't been reset--so it still holds the registry's
+ * registrations, if there are any.
+ */
+bool ChariotEPClass::chariotProbe()
+{
+	warmStart = false;
+	if ((digitalRead(CHARIOT_STATE_PIN) == 0) || ChariotClient.available())
+		return false;
+	ChariotClient.print(F("sys/health\n"));
+	probeAt = millis();
+	warmStart = true;
+	return true;
+}
+
 bool ChariotEPClass::triggerResourceEvent(int handle, String& eventVal, bool signalChariot)
 {
 	String ev = "";
@@ -338,6 +722,9 @@ bool ChariotEPClass::triggerResourceEvent(int handle, String& eventVal, bool sig
 #endif
 		return false;
 	}
+	statsParse(handle, eventVal);
+	if (!chariotAvailable)
+		return false;		// asleep, or not back up yet
 		
 	ev = "rsrc=";
 	ev += handle;
@@ -369,6 +756,7 @@ bool ChariotEPClass::triggerResourceEvent(int handle, String& eventVal, bool sig
 			delay(1);
 		}
 	}
+	roundTripDone();
 	
 	// Parse response for result of last resource operation
 	if (chariotResponse.indexOf("2.01") == -1)
@@ -391,7 +779,287 @@ bool ChariotEPClass::triggerResourceEvent(int handle, String& eventVal, bool sig
 	return true;
 }
 
+/*
+ * Handle of a library owned resource, creating it on first use.
+ * Creation is a round trip with Chariot, so this is only called from
+ * service(). Returns -1 if the resource could not be created.
+ */
+int ChariotEPClass::libResource(uint8_t id)
+{
+	int handle = -1;
+	
+	if (libRsrcs[id] != -1)
+		return (libRsrcs[id] < 0) ? -1 : libRsrcs[id];
+		
+	switch (id) {
+		case LIB_RSRC_WATCH:
+			handle = createResource(F("arduino/watch"), WATCH_RSRC_BUFLEN, F("title=\"Pin watch\"?get|obs"));
+			break;
+		case LIB_RSRC_SAMPLER:
+			handle = createResource(F("arduino/sampler"), SAMPLER_RSRC_BUFLEN, F("title=\"Analog sampler\"?get|obs"));
+			break;
+		case LIB_RSRC_RULES:
+			handle = createResource(F("arduino/rules"), RULES_RSRC_BUFLEN, F("title=\"Rules\"?get|obs"));
+			break;
+	}
+	libRsrcs[id] = (handle < 0) ? -2 : handle;	// -2: failed, don't retry
+	return handle;
+}
+
+/*
+ * Library background work--pin watch events, sample blocks, resource
+ * creation and the timer wheel tasks (TMP275 conversions, statistics
+ * windows, history tiers, scheduled sensors, rules and the sketch's own).
+ * Call from loop(), after process(), so the Chariot round trips made here
+ * don't collide with an inbound command--or just call run().
+ */
+void ChariotEPClass::service()
+{
+	uint8_t id;
+	
+	// Tasks, rules and sensors run whatever state Chariot is in
+	if (chariotAvailable) {
+		for (id = 0; id < LIB_RSRC_COUNT; id++) {
+			if (libRsrcWanted[id])
+				libResource(id);
+		}
+		watchService();
+		samplerService();
+	}
+	runTasks();
+}
+
+/*
+ * Everything a sketch's loop() needs: answer Chariot, then do the
+ * background work. Nothing here waits, so loop() needs no delay().
+ * With an event line, each pass ends in idle() sleep. With duty cycling,
+ * the pass that finds the wake window's work done puts host and Chariot
+ * to sleep.
+ */
+void ChariotEPClass::run()
+{
+	if (beginState != BEGIN_READY) {
+		beginStep();
+		service();
+		return;
+	}
+	if (dutyWaking) {
+		if ((digitalRead(CHARIOT_STATE_PIN) != 0) && ChariotClient.available()) {
+			chariotPrintResponse();		// "Chariot ready"
+			chariotAvailable = true;
+		} else if (millis() - dutyWakeAt >= DUTY_WAKE_MS) {
+			// No "Chariot ready"--if it is up it was never asleep; if not, the
+			// window's local work goes on and Chariot is woken next time
+			chariotAvailable = (digitalRead(CHARIOT_STATE_PIN) != 0);
+			SerialMon.println(F("Chariot did not signal ready after wake"));
+		} else {
+			service();
+			return;
+		}
+		dutyWaking = false;
+	}
+	if (commandPending())
+		process();
+	service();
+	if ((dutySleepSecs != 0) && !dutyPending()) {
+		dutySleep();
+		return;
+	}
+	if (eventLinePin != NO_EVENT_LINE)
+		idle();
+}
+
+// Periodic library work, each part checking its own deadlines
+void ChariotEPClass::libTickTask()
+{
+	ChariotEP.tmp275Service();
+	ChariotEP.statsService();
+	ChariotEP.histService();
+	ChariotEP.schedService();
+	ChariotEP.rulesService();
+}
+
+// Event value returned by a PUT callback--see process()
+void ChariotEPClass::putEventTask()
+{
+	ChariotEP.flushPutEvent();
+}
+
+void ChariotEPClass::flushPutEvent()
+{
+	int8_t id = putEventRsrc;
+	
+	if (id < 0)
+		return;
+	putEventRsrc = -1;
+	triggerResourceEvent(id, *putEventVal, true);
+}
+
+/*----------------------------------------------------------------------*/
+/*
+ * Timer wheel. Three levels of TW_SLOTS slots: level 0 slots are one tick
+ * (TW_TICK_MS) apart, level 1 slots TW_SLOTS ticks and level 2 slots
+ * TW_SLOTS^2 ticks. A task is linked into the slot of the level that spans
+ * its deadline; as the wheel turns, each higher level slot is cascaded
+ * into the levels below when its time comes. Deadlines beyond level 2
+ * are parked in its furthest slot and re-inserted when that comes up.
+ * Adding, cancelling and expiring a task never looks at other tasks.
+ */
+void ChariotEPClass::taskInsert(int8_t id, bool cascading)
+{
+	task_t *t = &tasks[id];
+	long d = (long)(t->due - wheelAt);
+	unsigned long ticks = (d <= 0) ? 0 : (d + TW_TICK_MS - 1) / TW_TICK_MS;
+	uint16_t at;
+	uint8_t level;
+	
+	// The current level 0 slot has been expired, unless this is a cascade
+	if ((ticks == 0) && !cascading)
+		ticks = 1;
+	if (ticks >= TW_SLOTS * TW_SLOTS * TW_SLOTS)
+		ticks = TW_SLOTS * TW_SLOTS * TW_SLOTS - 1;
+	at = wheelTick + ticks;
+	if (ticks < TW_SLOTS) {
+		level = 0;
+	} else if (ticks < TW_SLOTS * TW_SLOTS) {
+		level = 1;
+		at >>= TW_SLOT_BITS;
+	} else {
+		level = 2;
+		at >>= 2 * TW_SLOT_BITS;
+	}
+	at &= TW_SLOTS - 1;
+	t->next = wheel[level][at];
+	t->linked = true;
+	wheel[level][at] = id;
+}
+
+void ChariotEPClass::taskCascade(uint8_t level, uint8_t slot)
+{
+	int8_t id = wheel[level][slot], next;
+	
+	wheel[level][slot] = -1;
+	for (; id >= 0; id = next) {
+		next = tasks[id].next;
+		taskInsert(id, true);
+	}
+}
+
+/*
+ * Run fn in firstMs ms, then every periodMs ms (0: once). Tasks run from
+ * service()/run() and must not block. Returns the task id, or -1 if all
+ * MAX_TASKS are in use. Adding the same fn twice makes two tasks.
+ */
+int ChariotEPClass::addTask(void (*fn)(), unsigned long firstMs, unsigned long periodMs)
+{
+	int8_t id;
+	
+	if (fn == NULL)
+		return -1;
+	for (id = 0; id < MAX_TASKS; id++) {
+		// A cancelled task runTasks() hasn't reached yet still holds its slot
+		if ((tasks[id].fn == NULL) && !tasks[id].linked) {
+			tasks[id].fn = fn;
+			tasks[id].period = periodMs;
+			tasks[id].due = millis() + firstMs;
+			taskInsert(id, false);
+			return id;
+		}
+	}
+	return -1;
+}
+
+// Any task may be cancelled, from a task too--itself included
+bool ChariotEPClass::cancelTask(int id)
+{
+	uint8_t level, slot;
+	int8_t *link;
+	
+	if ((id < 0) || (id >= MAX_TASKS) || (tasks[id].fn == NULL))
+		return false;
+	tasks[id].fn = NULL;
+	for (level = 0; level < TW_LEVELS; level++) {
+		for (slot = 0; slot < TW_SLOTS; slot++) {
+			for (link = &wheel[level][slot]; *link >= 0; link = &tasks[*link].next) {
+				if (*link == id) {
+					*link = tasks[id].next;
+					tasks[id].linked = false;
+					return true;
+				}
+			}
+		}
+	}
+	return true;		// running now, or due this tick--runTasks() lets it go
+}
+
+// Turn the wheel up to millis(), running the tasks that come due
+void ChariotEPClass::runTasks()
+{
+	unsigned long now = millis();
+	int8_t id, next;
+	task_t *t;
+	void (*fn)();
+	bool periodic;
+	
+	tasksRun = true;
+	while ((long)(now - wheelAt) >= TW_TICK_MS) {
+		wheelAt += TW_TICK_MS;
+		wheelTick++;
+		if ((wheelTick & (TW_SLOTS * TW_SLOTS - 1)) == 0)
+			taskCascade(2, (wheelTick >> (2 * TW_SLOT_BITS)) & (TW_SLOTS - 1));
+		if ((wheelTick & (TW_SLOTS - 1)) == 0)
+			taskCascade(1, (wheelTick >> TW_SLOT_BITS) & (TW_SLOTS - 1));
+			
+		id = wheel[0][wheelTick & (TW_SLOTS - 1)];
+		wheel[0][wheelTick & (TW_SLOTS - 1)] = -1;
+		for (; id >= 0; id = next) {
+			t = &tasks[id];
+			next = t->next;
+			if ((fn = t->fn) == NULL) {
+				t->linked = false;			// cancelled since it was due
+				continue;
+			}
+			if ((long)(now - t->due) < 0) {
+				taskInsert(id, false);		// parked, or not quite due
+				continue;
+			}
+			periodic = (t->period != 0);
+			if (!periodic)
+				t->fn = NULL;
+			t->linked = false;
+			fn();
+			// Still this task, unless fn cancelled it--and not linked again
+			// by an addTask() that took its slot
+			if (periodic && (t->fn != NULL) && !t->linked) {
+				t->due += t->period;
+				if ((long)(millis() - t->due) >= 0)
+					t->due = millis() + t->period;		// overran--skip, don't burst
+				taskInsert(id, false);
+			}
+		}
+	}
+}
+
 /*----------------------------------------------------------------------*/
+/*
+ * Match "prefix" at the head of cmd (prefix in flash). The prefix may be
+ * followed by '/' (path form) or '?' (query form), which is also consumed.
+ * Returns the argument text that follows, or NULL if there is no match.
+ */
+static const char *cmdPrefix(const char *cmd, const char *prefix)
+{
+	size_t len = strlen_P(prefix);
+	
+	if (strncmp_P(cmd, prefix, len) != 0)
+		return NULL;
+	cmd += len;
+	if ((*cmd == '/') || (*cmd == '?'))
+		return cmd + 1;
+	if (*cmd == '\0')
+		return cmd;
+	return NULL;
+}
+
 #define BLIND_READ	(0)
 void ChariotEPClass::process() 
 {
@@ -403,8 +1071,14 @@ void ChariotEPClass::process()
   char firstChar;
 #endif
 
-  bool validCmd;
   int terminator;
+  const char *cmd, *args;
+
+  // Still bringing Chariot up--see beginAsync()
+  if (beginState != BEGIN_READY) {
+	beginStep();
+	return;
+  }
  
 #if (BLIND_READ==0)
   if (ChariotClient.available())
@@ -423,92 +1097,134 @@ void ChariotEPClass::process()
   {
 			command.remove(terminator, 2);
   }
-  
-  validCmd = command.startsWith(F("arduino/"), 0);
-  if (!validCmd) {
-	validCmd = command.startsWith(F("event/"), 0);
-  }
-  
-  if (!validCmd) {
-	SerialMon.print(F("Unrecognized input from Chariot: "));
-	SerialMon.println(command);
-	return;
-  }
+  cmd = command.c_str();
   
 #if EP_DEBUG 
   SerialMon.print(command);
 #endif
   
-  if (command.startsWith(F("arduino/"), 0)) {
-	  command.remove(0, 8);
+  if (strncmp_P(cmd, PSTR("arduino/"), 8) == 0) {
+	  cmd += 8;
 	  
 	  // is "digital" command?
-	  if (command.startsWith(F("digital/"), 0)) {
-		command.remove(0, 8);
-		digitalCommand(command);
+	  if ((args = cmdPrefix(cmd, PSTR("digital"))) != NULL) {
+		digitalCommand(args);
 		return; 
 	  }
 
 	  // is "analog" command?
-	  if (command.startsWith(F("analog/"), 0)) {
-		command.remove(0, 7);
-		analogCommand(command);
+	  if ((args = cmdPrefix(cmd, PSTR("analog"))) != NULL) {
+		analogCommand(args);
 		return; 
 	  }
 
 	  // is "mode" command?
-	  if (command.startsWith(F("mode/"), 0)) {
-		command.remove(0, 5);
-		modeCommand(command);
+	  if ((args = cmdPrefix(cmd, PSTR("mode"))) != NULL) {
+		modeCommand(args);
 		return; 
 	  }
-	  return;
-  }
 
-  // is "put" of parameters for event resource?
-  else {
-	  int id = -1;
-	  String param = "";
-	  if (command.startsWith(F("event/"), 0) != -1) {
-		param = command;
-		
-		int paramStart = param.indexOf('&');
-		if (paramStart != -1) {
-			param.remove(0, paramStart+1);
-			param.trim();
-			command.remove(paramStart, command.length()-1);
-#if EP_DEBUG
-  SerialMon.println(command);
-  SerialMon.println(param);
-#endif
-		} else {
-			SerialMon.println(F("PUT parameters did not arrive"));
-			SerialMon.println(command);
-			return;
-		}
-		
-		id = getIdFromURI(command);
-		if ((id != -1) && (putCallbacks[id] != NULL) &&( param != ""))
-		{
-			String *Str;
-			if ((Str = putCallbacks[id](param)) != NULL)
-			{
-				delay(250);
-				triggerResourceEvent(id, *Str, true);
-			}
-		}
+	  // is bulk "pins" command?
+	  if ((args = cmdPrefix(cmd, PSTR("pins"))) != NULL) {
+		pinsCommand(args);
+		return; 
+	  }
+
+	  // is whole "port" command?
+	  if ((args = cmdPrefix(cmd, PSTR("port"))) != NULL) {
+		portCommand(args);
+		return; 
+	  }
+
+	  // is pin "watch" command?
+	  if ((args = cmdPrefix(cmd, PSTR("watch"))) != NULL) {
+		watchCommand(args);
+		return; 
+	  }
+
+	  // is analog "sampler" command?
+	  if ((args = cmdPrefix(cmd, PSTR("sampler"))) != NULL) {
+		samplerCommand(args);
+		return; 
+	  }
+
+	  // is "history" read?
+	  if ((args = cmdPrefix(cmd, PSTR("history"))) != NULL) {
+		historyCommand(args);
+		return; 
+	  }
+
+	  // is "rules" command?
+	  if ((args = cmdPrefix(cmd, PSTR("rules"))) != NULL) {
+		rulesCommand(args);
+		return; 
+	  }
+
+	  // is scheduler ("sched") query?
+	  if ((args = cmdPrefix(cmd, PSTR("sched"))) != NULL) {
+		schedCommand(args);
+		return; 
+	  }
+
+	  // is "duty" cycle query?
+	  if ((args = cmdPrefix(cmd, PSTR("duty"))) != NULL) {
+		dutyCommand(args);
+		return; 
+	  }
+	  return;
+  }
+
+  // is "put" of parameters for event resource?
+  if (strncmp_P(cmd, PSTR("event/"), 6) == 0) {
+	int id;
+	const char *param = strchr(cmd, '&');
+	
+	if (param == NULL) {
+		SerialMon.println(F("PUT parameters did not arrive"));
+		SerialMon.println(command);
 		return;
-	  } 
+	}
+	
+	id = getIdFromURI(cmd, param - cmd);
+	param++;
+	while ((*param == ' ') || (*param == '\t'))
+		param++;
+#if EP_DEBUG
+	SerialMon.println(id);
+	SerialMon.println(param);
+#endif
+	if ((id != -1) && (putCallbacks[id] != NULL) && (*param != '\0'))
+	{
+		String paramStr(param);
+		String *Str;
+		
+		paramStr.trim();
+		if ((Str = putCallbacks[id](paramStr)) != NULL)
+		{
+			// Let Chariot finish the PUT before the event--from the
+			// timer wheel when the sketch runs it, else by waiting
+			flushPutEvent();
+			putEventRsrc = id;
+			putEventVal = Str;
+			if (!tasksRun || (addTask(putEventTask, PUT_EVENT_DELAY_MS, 0) < 0)) {
+				delay(PUT_EVENT_DELAY_MS);
+				flushPutEvent();
+			}
+		}
+	}
 #if EP_DEBUG
-	  else {
+	else {
 		SerialMon.print(F("Command: "));
 		SerialMon.print(command);
 		SerialMon.print(F(" not understood. ID was: "));
 		SerialMon.println(id);
-		return;
-	  }
+	}
 #endif
+	return;
   }
+  
+  SerialMon.print(F("Unrecognized input from Chariot: "));
+  SerialMon.println(command);
 }
 
 bool ChariotEPClass::coapRequest(coap_method_t method, String& host,  String& name,  
@@ -547,269 +1263,2507 @@ bool ChariotEPClass::coapRequest(coap_method_t method, String& host,  String& na
 		break;
 	}
 	
-	/* TEXT_PLAIN is the default for Chariot -- no need to send */
-	if (content != TEXT_PLAIN)
-	{
-		if (content == APPLICATION_JSON) 
-		{
-			coapUrl += ";ct=50";
+	/* TEXT_PLAIN is the default for Chariot -- no need to send */
+	if (content != TEXT_PLAIN)
+	{
+		if (content == APPLICATION_JSON) 
+		{
+			coapUrl += ";ct=50";
+		}
+		else 
+		{
+			SerialMon.println(F("coapRequest: Content Type not supported"));
+			return false;
+		}
+	}
+	
+	/* if we have options, we want them to look like: "name=name&val=val" */
+	if (opts.length())
+	{
+		coapUrl += String('&') + opts;
+	}
+	
+	/* Send the URL and return the response */
+	coapUrl += "\n\0";
+#if EP_DEBUG
+	SerialMon.print(F("coapRequest: sending URL: "));
+	SerialMon.println(coapUrl);
+#endif
+	
+	ChariotClient.print(coapUrl);
+	return chariotGetResponse(response);
+}
+int ChariotEPClass::coapResponseGet(String& response)
+{
+  char ch;
+  uint8_t ltSeen = 0;
+
+  response = "";
+  while (ltSeen < 2) {
+    if (ChariotClient.available() > 0) {
+      ch = (char)ChariotClient.read();
+  
+      if (ch != '<') {
+        response += ch;
+      }
+      else {
+        ltSeen++;
+      }
+    }
+  }
+  roundTripDone();
+  return ChariotClient.available();
+}
+
+/* search mote named "host" for resource */
+bool ChariotEPClass::coapSearchResources(String& mote, String& resource, String& response)
+{	
+	String opts = "";
+	String search = "search";
+	
+	if (resource.length() > 0)
+	{
+		opts = "name=" + resource;
+		return coapRequest(COAP_GET, mote, search, TEXT_PLAIN, opts, response);
+	}
+	return false;
+}
+
+/*
+ * Pin command responses are formatted into this buffer, not a String.
+ *  --longest is a full "arduino/pins" snapshot, see PIN_RESP_LEN
+ */
+static char pinResp[PIN_RESP_LEN];
+
+static char *fmtUint(char *p, unsigned long v)
+{
+	char digits[10];
+	uint8_t n = 0;
+	
+	do {
+		digits[n++] = '0' + (v % 10);
+		v /= 10;
+	} while (v);
+	while (n)
+		*p++ = digits[--n];
+	return p;
+}
+
+static char *respPut_P(char *p, const char *s)
+{
+	strcpy_P(p, s);
+	return p + strlen(p);
+}
+
+// Start a "Pin D13..." response
+static char *pinRespStart(char kind, int pin)
+{
+	char *p = respPut_P(pinResp, PSTR("Pin "));
+	*p++ = kind;
+	return fmtUint(p, pin);
+}
+
+static void pinRespSend(char *end)
+{
+	*end++ = '\n';
+	*end = '\0';
+	ChariotClient.write((const uint8_t *)pinResp, end - pinResp);
+}
+
+/*
+ * Precompute port register and bit mask for each remotely accessible pin
+ * so remote reads and writes skip the core's per-call pin lookups.
+ *  --AVR pins with a PWM timer stay on digitalWrite(), which turns PWM off.
+ */
+void ChariotEPClass::pinTableInit()
+{
+#if defined(__AVR__)
+	uint8_t pin;
+	
+	for (pin = 0; pin < CHARIOT_NUM_DIGITAL; pin++) {
+		pinMask[pin] = digitalPinToBitMask(pin);
+		if (digitalPinToTimer(pin) != NOT_ON_TIMER)
+			pinPort[pin] = NOT_A_PORT;
+		else
+			pinPort[pin] = digitalPinToPort(pin);
+	}
+#elif defined(ESP8266)
+	pwmPins = 0;
+#endif
+}
+
+void ChariotEPClass::fastDigitalWrite(uint8_t pin, uint8_t value)
+{
+#if defined(__AVR__)
+	uint8_t port = pinPort[pin];
+	
+	if (port != NOT_A_PORT) {
+		volatile uint8_t *out = portOutputRegister(port);
+		uint8_t oldSREG = SREG;
+		
+		cli();	// SoftwareSerial ISRs share these ports
+		if (value == LOW)
+			*out &= ~pinMask[pin];
+		else
+			*out |= pinMask[pin];
+		SREG = oldSREG;
+		return;
+	}
+#elif defined(ESP8266)
+	if (!(pwmPins & (1UL << pin))) {
+		if (pin < 16) {
+			if (value == LOW)
+				GPOC = (1UL << pin);
+			else
+				GPOS = (1UL << pin);
+		} else {
+			if (value == LOW)
+				GP16O &= ~1;
+			else
+				GP16O |= 1;
+		}
+		return;
+	}
+	pwmPins &= ~(1UL << pin);	// digitalWrite() stops the PWM waveform
+#endif
+	digitalWrite(pin, value);
+}
+
+int ChariotEPClass::fastDigitalRead(uint8_t pin)
+{
+#if defined(__AVR__)
+	uint8_t port = pinPort[pin];
+	
+	if (port != NOT_A_PORT)
+		return (*portInputRegister(port) & pinMask[pin]) ? HIGH : LOW;
+#elif defined(ESP8266)
+	if (pin < 16)
+		return GPIP(pin);
+	return GP16I & 1;
+#endif
+	return digitalRead(pin);
+}
+
+/* Parse and execute a local Arduino pin request */
+void ChariotEPClass::digitalCommand(const char *command) {
+  pin_cmd_t cmd;
+  char *response;
+
+  // Read pin number
+  if (pinCmdParse(command, PIN_KIND_DIGITAL, &cmd) == PIN_CMD_OK) {
+  
+#if EP_DEBUG 
+    SerialMon.print(F("pin="));
+    SerialMon.println(cmd.pin, DEC);
+#endif
+
+    // If value is not -1 it means we have an URL
+    // with a value like: "/digital/13/1"
+    if (cmd.value >= 0) {
+#if EP_DEBUG 
+      SerialMon.println(F("command is WRITE"));
+#endif
+      fastDigitalWrite(cmd.pin, cmd.value);
+    }
+    else {
+      cmd.value = fastDigitalRead(cmd.pin);
+#if EP_DEBUG 
+      SerialMon.println(F("command is READ"));
+#endif
+    }
+  
+    // Send pin response to requestor
+    response = pinRespStart('D', cmd.pin);
+    response = respPut_P(response, PSTR(" set to "));
+    response = fmtUint(response, cmd.value);
+    pinRespSend(response);
+  
+#if EP_DEBUG 
+    SerialMon.print(pinResp);
+#endif
+    return;
+  }
+  // Pin value not available.
+  SerialMon.print(F("digital command--pin values incorrect or missing. Pin = "));
+  SerialMon.print(cmd.pin);
+  SerialMon.print(F(" Value = "));
+  SerialMon.print(cmd.value);
+  SerialMon.print(F(" Status = "));
+  SerialMon.println(cmd.status);
+  SerialMon.println(F("Operation cancelled."));
+  // Return response
+  ChariotClient.print(F("Arduino could not complete digital pin request.<\n\0"));
+}
+
+static bool samplerOwnsPin(uint8_t pin);
+
+void ChariotEPClass::analogCommand(const char *command) {
+  pin_cmd_t cmd;
+  char *response;
+
+  // Read pin number
+  if (pinCmdParse(command, PIN_KIND_ANALOG, &cmd) == PIN_CMD_OK) {
+
+#if EP_DEBUG 
+  SerialMon.print(F("pin="));
+  SerialMon.println(cmd.pin, DEC);
+#endif
+
+  // Write is requested with a value like: "/analog/5/120"
+	if (cmd.value >= 0) {
+#if EP_DEBUG 
+		SerialMon.println(F("command is WRITE"));
+#endif
+		if (samplerOwnsPin(cmd.pin)) {
+			// analogWrite() would reprogram the sampler's timebase
+			ChariotClient.print(F("Arduino could not complete analog pin request.<\n\0"));
+			return;
+		}
+		analogWrite(cmd.pin, cmd.value);
+#if defined(ESP8266)
+		pwmPins |= (1UL << cmd.pin);
+#endif
+	}
+	else {
+		cmd.value = analogInput(cmd.pin);
+#if EP_DEBUG 
+  SerialMon.println(F("command is READ"));
+#endif
+		if (cmd.value < 0) {
+			// Sampler owns the ADC and isn't converting this channel
+			ChariotClient.print(F("Arduino could not complete analog pin request.<\n\0"));
+			return;
+		}
+	}
+
+	// Send pin response to requestor
+	response = pinRespStart('A', cmd.pin);
+	response = respPut_P(response, PSTR(" set to "));
+	response = fmtUint(response, cmd.value);
+	pinRespSend(response);
+  
+#if EP_DEBUG 
+  SerialMon.print(pinResp);
+#endif
+  } else { // Pin value not available.
+	SerialMon.print(F("analog command--pin values incorrect or missing. Pin = "));
+	SerialMon.print(cmd.pin);
+	SerialMon.print(F(" Value = "));
+	SerialMon.print(cmd.value);
+	SerialMon.print(F(" Status = "));
+	SerialMon.println(cmd.status);
+	SerialMon.println(F("Operation cancelled."));
+	// Return response
+	ChariotClient.print(F("Arduino could not complete analog pin request.<\n\0"));
+  }
+}
+
+void ChariotEPClass::modeCommand(const char *command) {
+  pin_cmd_t cmd;
+  char *response;
+  const char *mode;
+
+  // Read pin number and mode to set
+  if (pinCmdParse(command, PIN_KIND_MODE, &cmd) != PIN_CMD_OK) {
+#if EP_DEBUG 
+	SerialMon.print(F("Arduino remote error: invalid mode request: "));
+	SerialMon.println(command);
+#endif
+	ChariotClient.print(F("Arduino remote error: invalid mode "));
+	ChariotClient.print(command);
+	ChariotClient.print("<\n\0");
+	return;
+  }
+  
+#if EP_DEBUG 
+  SerialMon.print(F("pin="));
+  SerialMon.print(cmd.pin, DEC);
+  SerialMon.print(F(" val="));
+  SerialMon.println(cmd.value, DEC);
+#endif
+
+  pinMode(cmd.pin, cmd.value);
+  if (cmd.value == INPUT) {
+	mode = PSTR("INPUT");
+  } else if (cmd.value == OUTPUT) {
+	mode = PSTR("OUTPUT");
+  } else {
+	mode = PSTR("INPUT_PULLUP");
+  }
+  
+#if EP_DEBUG 
+  SerialMon.print(F("mode is "));
+  SerialMon.println((const __FlashStringHelper *)mode);
+#endif
+
+  // Send pin response to requestor
+  response = pinRespStart('D', cmd.pin);
+  response = respPut_P(response, PSTR(" configured as "));
+  response = respPut_P(response, mode);
+  pinRespSend(response);
+}
+
+/*
+ * Single pass, allocation-free tokenizer for remote pin commands.
+ *  --characters that end a number or word in either command form
+ */
+static inline bool tokEnd(char c)
+{
+	return (c == '\0') || (c == '/') || (c == '&') || (c == ';') ||
+		   (c == ' ') || (c == '\r') || (c == '\n');
+}
+
+/*
+ * Parse a decimal or "0x" hex number of at most 16 bits.
+ * Returns a pointer past the digits, or NULL if none were found.
+ */
+static const char *parseNum(const char *p, long *num)
+{
+	const char *start;
+	uint8_t base = 10;
+	long n = 0;
+	
+	if ((p[0] == '0') && ((p[1] == 'x') || (p[1] == 'X'))) {
+		base = 16;
+		p += 2;
+	}
+	for (start = p; ; p++) {
+		char c = *p;
+		uint8_t digit;
+		
+		if ((c >= '0') && (c <= '9')) {
+			digit = c - '0';
+		} else if ((base == 16) && ((c | 0x20) >= 'a') && ((c | 0x20) <= 'f')) {
+			digit = (c | 0x20) - 'a' + 10;
+		} else {
+			break;
+		}
+		n = n*base + digit;
+		if (n > 0xFFFFL)
+			return NULL;
+	}
+	if (p == start)
+		return NULL;
+	*num = n;
+	return p;
+}
+
+/*
+ * Parse a pin value: a number or, for pin modes, one of the mode words.
+ */
+static const char *parseVal(const char *p, int *value)
+{
+	long num;
+	
+	if (strncmp_P(p, PSTR("input_pullup"), 12) == 0) {
+		*value = INPUT_PULLUP;
+		return p + 12;
+	}
+	if (strncmp_P(p, PSTR("output"), 6) == 0) {
+		*value = OUTPUT;
+		return p + 6;
+	}
+	if (strncmp_P(p, PSTR("input"), 5) == 0) {
+		*value = INPUT;
+		return p + 5;
+	}
+	if (((p = parseNum(p, &num)) == NULL) || (num > 0x7FFF))
+		return NULL;
+	*value = (int)num;
+	return p;
+}
+
+/*
+ * Step over one token of a query string: "key=value" or a bare word
+ * such as "get". On return *key and *val delimit the token (*val is NULL
+ * for a bare word). Returns the next token, or NULL at the end of input.
+ * Every tokEnd() character but the end is a separator, so each call moves on.
+ */
+static const char *queryToken(const char *p, const char **key, uint8_t *keyLen, const char **val)
+{
+	while ((*p == '?') || (*p == '&') || (*p == ';') || (*p == ' ') || (*p == '/'))
+		p++;
+	if ((*p == '\0') || (*p == '\r') || (*p == '\n'))
+		return NULL;
+		
+	*key = p;
+	*val = NULL;
+	while (!tokEnd(*p) && (*p != '='))
+		p++;
+	*keyLen = p - *key;
+	if (*p == '=') {
+		*val = ++p;
+		while (!tokEnd(*p))
+			p++;
+	}
+	return p;
+}
+
+static inline bool keyIs(const char *key, uint8_t keyLen, const char *name)
+{
+	return (keyLen == strlen_P(name)) && (strncmp_P(key, name, keyLen) == 0);
+}
+
+/*
+ * Is pin one of the remotely accessible digital pins of this board?
+ */
+static bool digitalPinOk(int pin)
+{
+	if ((pin < 0) || (pin >= CHARIOT_NUM_DIGITAL))
+		return false;
+#ifdef CHARIOT_DIGITAL_MASK
+	return (CHARIOT_DIGITAL_MASK >> pin) & 1;
+#else
+	return true;
+#endif
+}
+
+/*
+ * Pins carrying the Chariot channel and event lines can't be driven remotely.
+ */
+bool ChariotEPClass::pinReserved(int pin)
+{
+	return (pin == RX_PIN) || (pin == TX_PIN) || (pin == CHARIOT_STATE_PIN) ||
+		   (pin == COAP_EVENT_INT_PIN) || (pin == RSRC_EVENT_INT_PIN);
+}
+
+/**
+ * Parse pin number and possible value parameter from command, in either
+ * the path form "13", "13/1", "13/output" or the query form
+ * "?get&pin=13", "put&pin=13&val=0". The command is not modified or copied.
+ * Unless kind is PIN_KIND_ANY the result is checked against this board's
+ * pin tables. Returns (and stores in cmd->status) a PIN_CMD_xxx code.
+ */
+uint8_t ChariotEPClass::pinCmdParse(const char *p, uint8_t kind, pin_cmd_t *cmd)
+{
+	long num;
+	
+	cmd->pin = -1;
+	cmd->value = -1;
+	cmd->status = PIN_CMD_BAD_SYNTAX;
+
+	if ((*p >= '0') && (*p <= '9')) {
+		/*
+		 * Do we have pin/value, pin/mode or simply pin?
+		 */
+		if (((p = parseNum(p, &num)) == NULL) || !tokEnd(*p))
+			return cmd->status;
+		cmd->pin = (int)num;
+		if ((*p == '/') && !tokEnd(p[1])) {
+			if (((p = parseVal(p+1, &cmd->value)) == NULL) || !tokEnd(*p))
+				return cmd->status;
+		}
+	} else {
+		const char *key, *val;
+		uint8_t keyLen;
+		
+		while ((p = queryToken(p, &key, &keyLen, &val)) != NULL) {
+			if (val == NULL)
+				continue;		// method word--"get" or "put"
+			if (keyIs(key, keyLen, PSTR("pin"))) {
+				if ((parseNum(val, &num) != p) || (num > 0x7FFF))
+					return cmd->status;
+				cmd->pin = (int)num;
+			} else if (keyIs(key, keyLen, PSTR("val"))) {
+				if (parseVal(val, &cmd->value) != p)
+					return cmd->status;
+			}
+		}
+		if (cmd->pin < 0)
+			return cmd->status;
+	}
+	
+	/*
+	 * Validate against the board pin tables
+	 */
+	switch (kind) {
+		case PIN_KIND_DIGITAL:
+			if (!digitalPinOk(cmd->pin))
+				return cmd->status = PIN_CMD_BAD_PIN;
+			if (cmd->value > HIGH)
+				return cmd->status = PIN_CMD_BAD_VALUE;
+			break;
+		case PIN_KIND_ANALOG:
+			if (cmd->value < 0) {
+				// read: analog input channel
+				if (cmd->pin >= CHARIOT_NUM_ANALOG)
+					return cmd->status = PIN_CMD_BAD_PIN;
+				break;
+			}
+			// write: PWM on a digital pin
+			if (!digitalPinOk(cmd->pin))
+				return cmd->status = PIN_CMD_BAD_PIN;
+			if (cmd->value > CHARIOT_PWM_MAX)
+				return cmd->status = PIN_CMD_BAD_VALUE;
+			break;
+		case PIN_KIND_MODE:
+			if (!digitalPinOk(cmd->pin))
+				return cmd->status = PIN_CMD_BAD_PIN;
+			if ((cmd->value != INPUT) && (cmd->value != OUTPUT) && (cmd->value != INPUT_PULLUP))
+				return cmd->status = PIN_CMD_BAD_VALUE;
+			break;
+		default:
+			break;
+	}
+	if ((kind != PIN_KIND_ANY) && (cmd->value >= 0) && pinReserved(cmd->pin))
+		return cmd->status = PIN_CMD_RESERVED;
+	
+	return cmd->status = PIN_CMD_OK;
+}
+
+/**
+ * Parse pin number and possible value parameter from command
+ *  --syntax only; see pinCmdParse() for range checked parsing.
+ */
+bool ChariotEPClass::pinValParse(String& command, int *pin, int *value) {
+	pin_cmd_t cmd;
+	
+	pinCmdParse(command.c_str(), PIN_KIND_ANY, &cmd);
+	*pin = cmd.pin;
+	*value = cmd.value;
+	return (cmd.status == PIN_CMD_OK);
+}
+
+/*
+ * Parse a pin list such as "2,3,8-12" or "all" ending at end, setting one
+ * bit per pin in bits. Digital lists are checked against the board pin
+ * table, analog lists against the number of analog channels.
+ */
+static bool parsePinList(const char *p, const char *end, uint8_t *bits, bool digital)
+{
+	long first, last;
+	uint8_t npins = digital ? CHARIOT_NUM_DIGITAL : CHARIOT_NUM_ANALOG;
+	
+	if ((end - p == 3) && (strncmp_P(p, PSTR("all"), 3) == 0)) {
+		for (first = 0; first < npins; first++) {
+			if (!digital || digitalPinOk(first))
+				bits[first >> 3] |= (1 << (first & 7));
+		}
+		return true;
+	}
+	while (p < end) {
+		if ((p = parseNum(p, &first)) == NULL)
+			return false;
+		last = first;
+		if ((*p == '-') && ((p = parseNum(p+1, &last)) == NULL))
+			return false;
+		if ((p < end) && (*p++ != ','))
+			return false;
+		if ((last < first) || (last >= npins))
+			return false;
+		for (; first <= last; first++) {
+			if (digital && !digitalPinOk(first))
+				return false;
+			bits[first >> 3] |= (1 << (first & 7));
+		}
+	}
+	return true;
+}
+
+static char *fmtHex(char *p, const uint8_t *bits, uint8_t nbits)
+{
+	int8_t nib;
+	bool leading = true;
+	
+	p = respPut_P(p, PSTR("0x"));
+	for (nib = (nbits+3)/4 - 1; nib >= 0; nib--) {
+		uint8_t v = (bits[nib >> 1] >> ((nib & 1) * 4)) & 0xF;
+		
+		if (leading && (v == 0) && (nib != 0))
+			continue;
+		leading = false;
+		*p++ = (v < 10) ? ('0' + v) : ('A' + v - 10);
+	}
+	return p;
+}
+
+/*
+ * Bulk pin access--one round trip for any set of pins:
+ *   arduino/pins?get&d=2,3,8-12&a=0,1  -> "Pins D=0x1F0C A=512,37"
+ *   arduino/pins?get&d=all&a=all       -> full I/O snapshot
+ *   arduino/pins?put&set=7,13&clr=6    -> drive pins, reply with their state
+ * D= is a bitmask indexed by pin number, A= lists the channels in order.
+ */
+void ChariotEPClass::pinsCommand(const char *command)
+{
+	uint8_t rd[PIN_BITS_LEN], set[PIN_BITS_LEN], clr[PIN_BITS_LEN];
+	uint8_t an[(CHARIOT_NUM_ANALOG+7)/8];
+	bool haveRd = false, haveAn = false;
+	const char *p = command, *key, *val;
+	uint8_t keyLen, pin;
+	char *response;
+	
+	memset(rd, 0, sizeof(rd));
+	memset(set, 0, sizeof(set));
+	memset(clr, 0, sizeof(clr));
+	memset(an, 0, sizeof(an));
+	
+	while ((p = queryToken(p, &key, &keyLen, &val)) != NULL) {
+		if (val == NULL)
+			continue;		// method word--"get" or "put"
+		if (keyIs(key, keyLen, PSTR("d"))) {
+			if (!parsePinList(val, p, rd, true))
+				goto pins_error;
+			haveRd = true;
+		} else if (keyIs(key, keyLen, PSTR("a"))) {
+			if (!parsePinList(val, p, an, false))
+				goto pins_error;
+			haveAn = true;
+		} else if (keyIs(key, keyLen, PSTR("set"))) {
+			if (!parsePinList(val, p, set, true))
+				goto pins_error;
+		} else if (keyIs(key, keyLen, PSTR("clr"))) {
+			if (!parsePinList(val, p, clr, true))
+				goto pins_error;
+		}
+	}
+	
+	// Check every write before driving any pin
+	for (pin = 0; pin < CHARIOT_NUM_DIGITAL; pin++) {
+		uint8_t bit = 1 << (pin & 7);
+		
+		if (((set[pin >> 3] | clr[pin >> 3]) & bit) && pinReserved(pin))
+			goto pins_error;
+	}
+	for (pin = 0; pin < CHARIOT_NUM_DIGITAL; pin++) {
+		uint8_t bit = 1 << (pin & 7);
+		
+		if (set[pin >> 3] & bit)
+			fastDigitalWrite(pin, HIGH);
+		else if (clr[pin >> 3] & bit)
+			fastDigitalWrite(pin, LOW);
+		else if (!(rd[pin >> 3] & bit))
+			continue;
+		haveRd = true;
+		rd[pin >> 3] = (rd[pin >> 3] & ~bit) | (fastDigitalRead(pin) ? bit : 0);
+	}
+	if (!haveRd && !haveAn)
+		goto pins_error;
+	
+	response = respPut_P(pinResp, PSTR("Pins"));
+	if (haveRd) {
+		response = respPut_P(response, PSTR(" D="));
+		response = fmtHex(response, rd, CHARIOT_NUM_DIGITAL);
+	}
+	if (haveAn) {
+		char sep = '=';
+		
+		response = respPut_P(response, PSTR(" A"));
+		for (pin = 0; pin < CHARIOT_NUM_ANALOG; pin++) {
+			if (an[pin >> 3] & (1 << (pin & 7))) {
+				*response++ = sep;
+				int v = analogInput(pin);
+				
+				if (v < 0)
+					goto pins_error;
+				response = fmtUint(response, v);
+				sep = ',';
+			}
+		}
+	}
+	pinRespSend(response);
+	return;
+	
+pins_error:
+	SerialMon.print(F("pins command--pin lists incorrect or missing: "));
+	SerialMon.println(command);
+	ChariotClient.print(F("Arduino could not complete pins request.<\n\0"));
+}
+
+/*
+ * Whole port access:
+ *   arduino/port?get&port=b                   -> "Port B=0x3F"
+ *   arduino/port?put&port=b&val=0x20&mask=0x30 (mask defaults to all bits)
+ * ESP8266 has one port, "gpio", covering GPIO0-15. Bits of pins reserved
+ * for the Chariot channel, and on ESP8266 unusable GPIOs, are never written.
+ */
+void ChariotEPClass::portCommand(const char *command)
+{
+	const char *p = command, *key, *val;
+	uint8_t keyLen, pin;
+	long value = -1, mask = 0xFFFF;
+	int port = -1;
+	uint16_t allowed = 0xFFFF;
+	char *response;
+	
+	while ((p = queryToken(p, &key, &keyLen, &val)) != NULL) {
+		if (val == NULL)
+			continue;		// method word--"get" or "put"
+		if (keyIs(key, keyLen, PSTR("port"))) {
+#if defined(ESP8266)
+			if ((p - val == 4) && (strncmp_P(val, PSTR("gpio"), 4) == 0))
+				port = 0;
+#else
+			if (p - val == 1)
+				port = (*val | 0x20) - 'a' + 1;		// PA is port 1
+#endif
+		} else if (keyIs(key, keyLen, PSTR("val"))) {
+			if (parseNum(val, &value) != p)
+				goto port_error;
+		} else if (keyIs(key, keyLen, PSTR("mask"))) {
+			if (parseNum(val, &mask) != p)
+				goto port_error;
+		}
+	}
+	
+#if defined(__AVR__)
+	if ((port < 1) || (port >= CHARIOT_NUM_PORTS) || (pgm_read_word(port_to_input_PGM + port) == NOT_A_PORT))
+		goto port_error;
+	for (pin = 0; pin < CHARIOT_NUM_DIGITAL; pin++) {
+		if ((digitalPinToPort(pin) == port) && pinReserved(pin))
+			allowed &= ~digitalPinToBitMask(pin);
+	}
+	if (value >= 0) {
+		volatile uint8_t *out = portOutputRegister(port);
+		uint8_t oldSREG = SREG;
+		
+		mask &= allowed;
+		cli();	// SoftwareSerial ISRs share these ports
+		*out = (*out & ~mask) | (value & mask);
+		SREG = oldSREG;
+	}
+	value = *portInputRegister(port);
+	
+	response = respPut_P(pinResp, PSTR("Port "));
+	*response++ = 'A' + port - 1;
+#elif defined(ESP8266)
+	if (port != 0)
+		goto port_error;
+	allowed = CHARIOT_DIGITAL_MASK & 0xFFFF;
+	for (pin = 0; pin < 16; pin++) {
+		if (pinReserved(pin) || (pwmPins & (1UL << pin)))
+			allowed &= ~(1 << pin);
+	}
+	if (value >= 0) {
+		mask &= allowed;
+		GPOS = value & mask;
+		GPOC = ~value & mask;
+	}
+	value = GPI & 0xFFFF;
+	
+	response = respPut_P(pinResp, PSTR("Port GPIO"));
+#endif
+	{
+		uint8_t bits[2] = { (uint8_t)value, (uint8_t)(value >> 8) };
+		
+		*response++ = '=';
+		response = fmtHex(response, bits, (value > 0xFF) ? 16 : 8);
+	}
+	pinRespSend(response);
+	return;
+	
+port_error:
+	SerialMon.print(F("port command--port or values incorrect: "));
+	SerialMon.println(command);
+	ChariotClient.print(F("Arduino could not complete port request.<\n\0"));
+}
+
+/*----------------------------------------------------------------------*/
+/*
+ * Pin watches. Each watched pin's interrupt queues (slot, level, time)
+ * in a single producer/single consumer ring: only the ISRs advance
+ * watchHead and only watchService() advances watchTail, so no locking
+ * is needed. watchService() debounces and publishes the changes.
+ */
+#ifndef ICACHE_RAM_ATTR
+#define ICACHE_RAM_ATTR
+#endif
+
+typedef struct {
+	uint8_t		slot;
+	uint8_t		level;
+	unsigned long ms;
+} watch_edge_t;
+
+static volatile watch_edge_t watchQueue[WATCH_QUEUE_LEN];
+static volatile uint8_t watchHead, watchTail;
+static volatile uint8_t watchDropped;
+static uint8_t watchIsrPin[MAX_WATCHES];
+
+static void ICACHE_RAM_ATTR watchEdge(uint8_t slot)
+{
+	uint8_t head = watchHead;
+	uint8_t next = (head + 1) & (WATCH_QUEUE_LEN - 1);
+	
+	if (next == watchTail) {
+		watchDropped++;		// queue full--the level is re-read when it drains
+		return;
+	}
+	watchQueue[head].slot = slot;
+	watchQueue[head].level = digitalRead(watchIsrPin[slot]);
+	watchQueue[head].ms = millis();
+	watchHead = next;
+}
+
+// One ISR per watch slot--only as many as this board has slots
+#if MAX_WATCHES > 4
+	#error MAX_WATCHES above 4 needs more watchIsrN()
+#endif
+static void ICACHE_RAM_ATTR watchIsr0() { watchEdge(0); }
+#if MAX_WATCHES > 1
+static void ICACHE_RAM_ATTR watchIsr1() { watchEdge(1); }
+#endif
+#if MAX_WATCHES > 2
+static void ICACHE_RAM_ATTR watchIsr2() { watchEdge(2); }
+#endif
+#if MAX_WATCHES > 3
+static void ICACHE_RAM_ATTR watchIsr3() { watchEdge(3); }
+#endif
+static void (* const watchIsrs[MAX_WATCHES])() = {
+	watchIsr0,
+#if MAX_WATCHES > 1
+	watchIsr1,
+#endif
+#if MAX_WATCHES > 2
+	watchIsr2,
+#endif
+#if MAX_WATCHES > 3
+	watchIsr3,
+#endif
+};
+
+/*
+ * Watch pin for level changes. edge is WATCH_CHANGE, WATCH_RISING or
+ * WATCH_FALLING; a new level must hold for debounceMs before it is
+ * published as "D<pin>=<level>@<millis>" on resource "arduino/watch".
+ * Watching a pin again changes its settings. Returns the watch slot,
+ * or -1 if the pin has no external interrupt or all slots are in use.
+ */
+int ChariotEPClass::watchPin(uint8_t pin, uint8_t edge, uint16_t debounceMs)
+{
+	int slot, freeSlot = -1;
+	watch_t *w;
+	
+	if ((edge == WATCH_OFF) || (edge > WATCH_FALLING) || !digitalPinOk(pin) || 
+			pinReserved(pin) || (digitalPinToInterrupt(pin) == NOT_AN_INTERRUPT) || (pin == eventLinePin))
+		return -1;
+		
+	for (slot = 0; slot < MAX_WATCHES; slot++) {
+		if (watches[slot].edge == WATCH_OFF) {
+			if (freeSlot < 0)
+				freeSlot = slot;
+		} else if (watches[slot].pin == pin) {
+			break;
+		}
+	}
+	if (slot == MAX_WATCHES) {
+		if (freeSlot < 0)
+			return -1;
+		slot = freeSlot;
+	}
+	
+	w = &watches[slot];
+	w->pin = pin;
+	w->edge = edge;
+	w->debounce = debounceMs;
+	w->stable = w->pending = digitalRead(pin);
+	watchIsrPin[slot] = pin;
+	attachInterrupt(digitalPinToInterrupt(pin), watchIsrs[slot], CHANGE);
+	
+	libRsrcWanted[LIB_RSRC_WATCH] = true;
+	return slot;
+}
+
+bool ChariotEPClass::unwatchPin(uint8_t pin)
+{
+	uint8_t slot;
+	
+	for (slot = 0; slot < MAX_WATCHES; slot++) {
+		if ((watches[slot].edge != WATCH_OFF) && (watches[slot].pin == pin)) {
+			detachInterrupt(digitalPinToInterrupt(pin));
+			watches[slot].edge = WATCH_OFF;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Drain the edge queue, then publish levels that have outlasted their
+ * debounce time--as many as fit in one resource event; the rest go next time.
+ */
+void ChariotEPClass::watchService()
+{
+	char payload[WATCH_RSRC_BUFLEN];
+	char *p = payload;
+	uint8_t slot;
+	watch_t *w;
+	unsigned long now;
+	
+	while (watchTail != watchHead) {
+		w = &watches[watchQueue[watchTail].slot];
+		if (watchQueue[watchTail].level != w->pending) {
+			w->pending = watchQueue[watchTail].level;
+			w->pendingAt = watchQueue[watchTail].ms;
+		}
+		watchTail = (watchTail + 1) & (WATCH_QUEUE_LEN - 1);
+	}
+	if (watchDropped) {
+		// Edges were lost--resynchronize with the pins
+		watchDropped = 0;
+		for (slot = 0; slot < MAX_WATCHES; slot++) {
+			w = &watches[slot];
+			if ((w->edge != WATCH_OFF) && (digitalRead(w->pin) != w->pending)) {
+				w->pending = !w->pending;
+				w->pendingAt = millis();
+			}
+		}
+	}
+	
+	now = millis();
+	for (slot = 0; slot < MAX_WATCHES; slot++) {
+		w = &watches[slot];
+		if ((w->edge == WATCH_OFF) || (w->pending == w->stable) || (now - w->pendingAt < w->debounce))
+			continue;
+		// "rsrc=NN%value=" + "D19=1@4294967295 " + '\n' must fit the resource buffer
+		if ((p - payload) + 18 > WATCH_RSRC_BUFLEN - 16)
+			break;
+		w->stable = w->pending;
+		if (((w->edge == WATCH_RISING) && !w->stable) || ((w->edge == WATCH_FALLING) && w->stable))
+			continue;
+		if (p != payload)
+			*p++ = ' ';
+		*p++ = 'D';
+		p = fmtUint(p, w->pin);
+		*p++ = '=';
+		*p++ = '0' + w->stable;
+		*p++ = '@';
+		p = fmtUint(p, w->pendingAt);
+	}
+	
+	if ((p != payload) && (libRsrcs[LIB_RSRC_WATCH] >= 0)) {
+		String event;
+		
+		*p = '\0';
+		event = payload;
+		triggerResourceEvent(libRsrcs[LIB_RSRC_WATCH], event, true);
+	}
+}
+
+/*
+ * Remote pin watches:
+ *   arduino/watch?put&pin=2&edge=change&debounce=20   (edge: change, rising, falling, off)
+ *   arduino/watch?get                                 -> "Watch D2=1 D18=0"
+ * Changes are published on resource "arduino/watch"--observe it for events.
+ */
+void ChariotEPClass::watchCommand(const char *command)
+{
+	const char *p = command, *key, *val;
+	uint8_t keyLen, slot;
+	long pin = -1, debounce = 0;
+	int edge = -1;
+	char *response;
+	
+	while ((p = queryToken(p, &key, &keyLen, &val)) != NULL) {
+		if (val == NULL)
+			continue;		// method word--"get" or "put"
+		if (keyIs(key, keyLen, PSTR("pin"))) {
+			if (parseNum(val, &pin) != p)
+				goto watch_error;
+		} else if (keyIs(key, keyLen, PSTR("debounce"))) {
+			if (parseNum(val, &debounce) != p)
+				goto watch_error;
+		} else if (keyIs(key, keyLen, PSTR("edge"))) {
+			if (keyIs(val, p - val, PSTR("change")))
+				edge = WATCH_CHANGE;
+			else if (keyIs(val, p - val, PSTR("rising")))
+				edge = WATCH_RISING;
+			else if (keyIs(val, p - val, PSTR("falling")))
+				edge = WATCH_FALLING;
+			else if (keyIs(val, p - val, PSTR("off")))
+				edge = WATCH_OFF;
+			else
+				goto watch_error;
+		}
+	}
+	
+	if (pin >= 0) {
+		if (edge < 0)
+			edge = WATCH_CHANGE;
+		if (edge == WATCH_OFF) {
+			if (!unwatchPin(pin))
+				goto watch_error;
+		} else if (watchPin(pin, edge, debounce) < 0) {
+			goto watch_error;
+		}
+	}
+	
+	response = respPut_P(pinResp, PSTR("Watch"));
+	for (slot = 0; slot < MAX_WATCHES; slot++) {
+		if (watches[slot].edge != WATCH_OFF) {
+			response = respPut_P(response, PSTR(" D"));
+			response = fmtUint(response, watches[slot].pin);
+			*response++ = '=';
+			*response++ = '0' + watches[slot].stable;
+		}
+	}
+	pinRespSend(response);
+	return;
+	
+watch_error:
+	SerialMon.print(F("watch command--pin or edge incorrect: "));
+	SerialMon.println(command);
+	ChariotClient.print(F("Arduino could not complete watch request.<\n\0"));
+}
+
+/*----------------------------------------------------------------------*/
+/*
+ * Event line. With Chariot's serial output also wired to an external
+ * interrupt pin, the start bit of each command interrupts the host:
+ * eventReady is set and any idle() sleep ends, so a command is handled
+ * as soon as it arrives rather than on the next pass of loop(). Every
+ * byte Chariot sends interrupts, its answers to the host's own requests
+ * too, so an edge alone is never taken for a command.
+ */
+static void ICACHE_RAM_ATTR eventLineIsr()
+{
+	eventReady = true;
+}
+
+/*
+ * Take commands by interrupt on pin, jumpered to Chariot's serial output
+ * (the Arduino's channel RX pin). Returns false if pin has no external
+ * interrupt or is in use.
+ */
+bool ChariotEPClass::enableEventLine(uint8_t pin)
+{
+	uint8_t slot;
+	
+	if (!digitalPinOk(pin) || pinReserved(pin) || (digitalPinToInterrupt(pin) == NOT_AN_INTERRUPT))
+		return false;
+	for (slot = 0; slot < MAX_WATCHES; slot++) {
+		if ((watches[slot].edge != WATCH_OFF) && (watches[slot].pin == pin))
+			return false;
+	}
+	disableEventLine();
+	pinMode(pin, INPUT);
+	eventLinePin = pin;
+	eventReady = ChariotClient.available();
+	attachInterrupt(digitalPinToInterrupt(pin), eventLineIsr, FALLING);
+	return true;
+}
+
+void ChariotEPClass::disableEventLine()
+{
+	if (eventLinePin == NO_EVENT_LINE)
+		return;
+	detachInterrupt(digitalPinToInterrupt(eventLinePin));
+	eventLinePin = NO_EVENT_LINE;
+}
+
+// A command has started to arrive--process() waits for the rest of it
+bool ChariotEPClass::commandPending()
+{
+	eventReady = false;
+	return (available() > 0);
+}
+
+/*
+ * Sleep until the next interrupt--an event line edge, serial input or
+ * the millis() tick--unless a command is already waiting. Idle mode
+ * keeps the clocks and UARTs running, so no serial input is lost.
+ * ESP8266 only yields.
+ */
+void ChariotEPClass::idle()
+{
+#if defined(__AVR__)
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	cli();
+	if (!eventReady && !ChariotClient.available()) {
+		sleep_enable();
+		sei();				// takes effect after sleep_cpu(), so no wakeup is missed
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+#else
+	yield();
+#endif
+}
+
+/*----------------------------------------------------------------------*/
+/*
+ * Analog sampler. On AVR, Timer1 runs in CTC mode at the conversion rate
+ * and its compare B match auto-triggers the ADC; the ADC interrupt stores
+ * the result and selects the next channel before the next trigger. Results
+ * fill two blocks in turn--while service() publishes one the other fills.
+ * A block that completes before the previous one was taken is dropped and
+ * counted; its sequence number is skipped so the receiver sees the gap.
+ * ESP8266 has no triggered ADC, so service() polls A0 on schedule.
+ */
+static volatile uint16_t smpBlock[2][SAMPLER_BLOCK_LEN];
+static volatile uint8_t smpSeq[2];
+static volatile uint8_t smpReady;			// bit per block waiting for service()
+static volatile uint8_t smpFill, smpPos;	// block being filled
+static volatile uint8_t smpSeqNext, smpOverruns;
+static volatile uint8_t smpChanIdx, smpSets;
+static volatile uint16_t smpSum[CHARIOT_NUM_ANALOG];
+static volatile uint16_t smpLast[CHARIOT_NUM_ANALOG];
+static uint8_t smpChan[CHARIOT_NUM_ANALOG];	// channels sampled, in order
+static uint8_t smpNumChan, smpBlockLen, smpAvg;
+static uint16_t smpRate;					// sample sets/s, 0 when stopped
+#if !defined(__AVR__)
+static unsigned long smpNextAt, smpPeriod;	// micros()
+#endif
+
+/*
+ * Store one conversion for channel smpChan[smpChanIdx]. Each output
+ * sample is the average of smpAvg conversions; a block holds whole sets.
+ */
+static void ICACHE_RAM_ATTR samplerStore(uint16_t v)
+{
+	uint8_t i = smpChanIdx;
+	
+	smpLast[i] = v;
+	smpSum[i] += v;
+	if (++i < smpNumChan) {
+		smpChanIdx = i;
+		return;
+	}
+	smpChanIdx = 0;
+	if (++smpSets < smpAvg)
+		return;
+	smpSets = 0;
+	for (i = 0; i < smpNumChan; i++) {
+		smpBlock[smpFill][smpPos++] = smpSum[i] / smpAvg;
+		smpSum[i] = 0;
+	}
+	if (smpPos < smpBlockLen)
+		return;
+	smpPos = 0;
+	if (smpReady) {
+		smpOverruns++;		// other block not published yet--drop this one
+		smpSeqNext++;
+		return;
+	}
+	smpSeq[smpFill] = smpSeqNext++;
+	smpReady = 1 << smpFill;
+	smpFill ^= 1;
+}
+
+#if defined(__AVR__)
+static void adcSelect(uint8_t ch)
+{
+#if defined(analogPinToChannel)
+	ch = analogPinToChannel(ch);
+#endif
+#if defined(MUX5)
+	ADCSRB = (ADCSRB & ~_BV(MUX5)) | ((ch & 8) ? _BV(MUX5) : 0);
+#endif
+	ADMUX = _BV(REFS0) | (ch & 7);		// AVcc reference, as analogReference(DEFAULT)
+}
+
+ISR(ADC_vect)
+{
+	uint16_t v = ADC;
+	
+	TIFR1 = _BV(OCF1B);		// the trigger is the flag's rising edge--re-arm it
+	samplerStore(v);
+	adcSelect(smpChan[smpChanIdx]);
+}
+#endif
+
+/*
+ * analogRead(), unless the sampler owns the ADC; then the channel's
+ * latest conversion, or -1 if the channel isn't being sampled.
+ */
+int ChariotEPClass::analogInput(uint8_t ch)
+{
+#if defined(__AVR__)
+	uint8_t i;
+	int v;
+	
+	if (smpRate) {
+		for (i = 0; i < smpNumChan; i++) {
+			if (smpChan[i] == ch) {
+				noInterrupts();
+				v = smpLast[i];
+				interrupts();
+				return v;
+			}
+		}
+		return -1;
+	}
+#endif
+	return analogRead(ch);
+}
+
+/*
+ * True while the sampler runs and pin's PWM comes from Timer1.
+ */
+static bool samplerOwnsPin(uint8_t pin)
+{
+#if defined(__AVR__)
+	uint8_t timer;
+	
+	if (!smpRate)
+		return false;
+	timer = digitalPinToTimer(pin);
+#if defined(TIMER1C)
+	if (timer == TIMER1C)
+		return true;
+#endif
+	return (timer == TIMER1A) || (timer == TIMER1B);
+#else
+	return false;
+#endif
+}
+
+static char *fmtHexN(char *p, uint16_t v, uint8_t digits)
+{
+	while (digits--) {
+		uint8_t nib = (v >> (digits * 4)) & 0xF;
+		*p++ = (nib < 10) ? ('0' + nib) : ('A' + nib - 10);
+	}
+	return p;
+}
+
+/*
+ * Sample the analog channels in the channels bitmask rateHz times a second,
+ * averaging avg conversions per published sample (1 = no averaging, so the
+ * published rate is rateHz/avg). Blocks are published on resource
+ * "arduino/sampler" as "<seq>:" followed by 3 hex digits per sample, sets of
+ * channels interleaved in ascending channel order.
+ * On AVR Timer1 is taken while sampling: no PWM on its pins (D9/D10 on UNO,
+ * D11/D12 on Mega; remote analog writes to them are refused) and analogRead()
+ * must not be called--remote analog reads return the sampler's latest
+ * conversion instead. At most SAMPLER_BLOCK_LEN channels, so a block holds
+ * at least one whole set.
+ */
+bool ChariotEPClass::startSampler(uint16_t rateHz, uint16_t channels, uint8_t avg)
+{
+	uint8_t ch, n = 0;
+	uint32_t conv;
+	
+	stopSampler();
+	if (avg == 0)
+		avg = 1;
+	for (ch = 0; ch < CHARIOT_NUM_ANALOG; ch++) {
+		if (channels & (1U << ch))
+			smpChan[n++] = ch;
+	}
+	conv = (uint32_t)rateHz * n;
+	if ((n == 0) || (n > SAMPLER_BLOCK_LEN) || (conv == 0) || (conv > SAMPLER_MAX_RATE) || (avg > SAMPLER_MAX_AVG) ||
+			((uint32_t)channels >> CHARIOT_NUM_ANALOG))
+		return false;
+		
+	smpNumChan = n;
+	smpAvg = avg;
+	smpBlockLen = (SAMPLER_BLOCK_LEN / n) * n;
+	smpFill = smpPos = smpReady = 0;
+	smpChanIdx = smpSets = smpSeqNext = smpOverruns = 0;
+	for (ch = 0; ch < n; ch++) {
+		smpSum[ch] = 0;
+		smpLast[ch] = 0;
+	}
+	smpRate = rateHz;
+	libRsrcWanted[LIB_RSRC_SAMPLER] = true;
+	
+#if defined(__AVR__)
+	{
+		// Slowest prescaler that still fits the period in 16 bits
+		uint32_t ticks = F_CPU / 8 / conv;
+		uint8_t cs = _BV(CS11);
+		
+		if (ticks > 65536UL) {
+			ticks = F_CPU / 64 / conv;
+			cs = _BV(CS11) | _BV(CS10);
+		}
+		if (ticks > 65536UL) {
+			ticks = F_CPU / 1024 / conv;
+			cs = _BV(CS12) | _BV(CS10);
+		}
+		TCCR1B = 0;
+		TCCR1A = 0;
+		TCNT1 = 0;
+		OCR1A = ticks - 1;
+		OCR1B = ticks - 1;
+		TIFR1 = _BV(OCF1B);
+		adcSelect(smpChan[0]);
+		ADCSRB = (ADCSRB & ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0))) | _BV(ADTS2) | _BV(ADTS0);	// Timer1 compare B
+		ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+		TCCR1B = _BV(WGM12) | cs;
+	}
+#else
+	smpPeriod = 1000000UL / conv;
+	smpNextAt = micros();
+#endif
+	return true;
+}
+
+void ChariotEPClass::stopSampler()
+{
+	if (!smpRate)
+		return;
+#if defined(__AVR__)
+	// Hand the ADC and Timer1 back as wiring.c set them up
+	ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+	ADCSRB &= ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0));
+	TCCR1B = _BV(CS11) | _BV(CS10);
+	TCCR1A = _BV(WGM10);
+#endif
+	smpRate = 0;
+}
+
+/*
+ * Publish a completed block. The block is copied out and released before
+ * the Chariot round trip so the ADC can refill it meanwhile.
+ */
+void ChariotEPClass::samplerService()
+{
+	char payload[SAMPLER_RSRC_BUFLEN];
+	char *p = payload;
+	uint8_t blk, i;
+	
+	if (!smpRate)
+		return;
+		
+#if !defined(__AVR__)
+	// Catch up on conversions due, at most a block's worth per call
+	for (i = 0; (i < SAMPLER_BLOCK_LEN) && ((long)(micros() - smpNextAt) >= 0); i++) {
+		smpNextAt += smpPeriod;
+		samplerStore(analogRead(A0));
+	}
+	if ((long)(micros() - smpNextAt) >= 0) {
+		smpNextAt = micros();		// fell behind--skip ahead rather than burst
+		smpOverruns++;
+	}
+#endif
+
+	if (!smpReady || (libRsrcs[LIB_RSRC_SAMPLER] < 0))
+		return;
+	blk = (smpReady & 1) ? 0 : 1;
+	p = fmtHexN(p, smpSeq[blk], 2);
+	*p++ = ':';
+	for (i = 0; i < smpBlockLen; i++)
+		p = fmtHexN(p, smpBlock[blk][i], 3);
+	*p = '\0';
+	noInterrupts();
+	smpReady = 0;
+	interrupts();
+	
+	String event = payload;
+	triggerResourceEvent(libRsrcs[LIB_RSRC_SAMPLER], event, true);
+}
+
+/*
+ * Remote sampler control:
+ *   arduino/sampler?put&rate=500&ch=0,1&avg=4   start (ch defaults to 0, avg to 1)
+ *   arduino/sampler?put&rate=0                  stop
+ *   arduino/sampler?get                         -> "Sampler rate=500 ch=0,1 avg=4 ovr=0"
+ * Observe resource "arduino/sampler" for the sample blocks.
+ */
+void ChariotEPClass::samplerCommand(const char *command)
+{
+	const char *p = command, *key, *val;
+	uint8_t keyLen, ch;
+	uint8_t an[(CHARIOT_NUM_ANALOG+7)/8];
+	uint16_t channels = 0;
+	long rate = -1, avg = 1;
+	char *response;
+	
+	memset(an, 0, sizeof(an));
+	while ((p = queryToken(p, &key, &keyLen, &val)) != NULL) {
+		if (val == NULL)
+			continue;		// method word--"get" or "put"
+		if (keyIs(key, keyLen, PSTR("rate"))) {
+			if (parseNum(val, &rate) != p)
+				goto sampler_error;
+		} else if (keyIs(key, keyLen, PSTR("avg"))) {
+			if (parseNum(val, &avg) != p)
+				goto sampler_error;
+		} else if (keyIs(key, keyLen, PSTR("ch"))) {
+			if (!parsePinList(val, p, an, false))
+				goto sampler_error;
+		}
+	}
+	for (ch = 0; ch < CHARIOT_NUM_ANALOG; ch++) {
+		if (an[ch >> 3] & (1 << (ch & 7)))
+			channels |= (1U << ch);
+	}
+	
+	if (rate == 0) {
+		stopSampler();
+	} else if (rate > 0) {
+		if (!startSampler(rate, channels ? channels : 1, avg))
+			goto sampler_error;
+	}
+	
+	response = respPut_P(pinResp, PSTR("Sampler"));
+	if (!smpRate) {
+		response = respPut_P(response, PSTR(" off"));
+	} else {
+		response = respPut_P(response, PSTR(" rate="));
+		response = fmtUint(response, smpRate);
+		response = respPut_P(response, PSTR(" ch"));
+		for (ch = 0; ch < smpNumChan; ch++) {
+			*response++ = ch ? ',' : '=';
+			response = fmtUint(response, smpChan[ch]);
+		}
+		response = respPut_P(response, PSTR(" avg="));
+		response = fmtUint(response, smpAvg);
+		response = respPut_P(response, PSTR(" ovr="));
+		response = fmtUint(response, smpOverruns);
+	}
+	pinRespSend(response);
+	return;
+	
+sampler_error:
+	SerialMon.print(F("sampler command--rate, channels or avg incorrect: "));
+	SerialMon.println(command);
+	ChariotClient.print(F("Arduino could not complete sampler request.<\n\0"));
+}
+
+/*----------------------------------------------------------------------*/
+/*
+ * Streaming statistics. Values of a source--a resource's event values or
+ * the TMP275 reading--are accumulated over tumbling windows in hundredths
+ * (fixed point) and each window's summary is published on a companion
+ * ".../stats" resource as "count,min,max,mean,variance,ewma".
+ */
+#define FMT_CENTI_MAX		13		// "-21474836.48" and its '\0'
+
+static char *fmtCenti(char *p, long v)
+{
+	unsigned long u;
+	
+	if (v < 0) {
+		*p++ = '-';
+		u = 0UL - (unsigned long)v;		// LONG_MIN too
+	} else {
+		u = v;
+	}
+	p = fmtUint(p, u / 100);
+	*p++ = '.';
+	*p++ = '0' + (u / 10) % 10;
+	*p++ = '0' + u % 10;
+	return p;
+}
+
+/*
+ * First number in s, such as the 23.5 of {"temp":23.5}, in hundredths.
+ */
+static bool parseCenti(const char *s, long *centi)
+{
+	long v = 0;
+	uint8_t frac = 0;
+	bool neg = false, dot = false;
+	
+	// A '-' right before the first digit makes it negative
+	for (; *s && !isdigit(*s); s++)
+		neg = (*s == '-');
+	if (!*s)
+		return false;
+	for (; *s; s++) {
+		if (isdigit(*s)) {
+			if (frac == 2)
+				continue;
+			if (v > 20000000L)
+				return false;
+			v = v * 10 + (*s - '0');
+			if (dot)
+				frac++;
+		} else if ((*s == '.') && !dot) {
+			dot = true;
+		} else {
+			break;
+		}
+	}
+	for (; frac < 2; frac++) {
+		if (v > 214748364L)
+			return false;		// won't fit a long in hundredths
+		v *= 10;
+	}
+	*centi = neg ? -v : v;
+	return true;
+}
+
+/*
+ * Keep statistics on a source over windows of windowSecs seconds. source
+ * is a resource handle--the first number in each value passed to
+ * triggerResourceEvent() for it is accumulated--or STATS_TMP275 for Chariot's
+ * temp sensor (C). Creates the companion resource "<uri>/stats", or
+ * "arduino/tmp275/stats". Returns the companion's handle, or -1.
+ */
+int ChariotEPClass::attachStats(int source, uint16_t windowSecs)
+{
+	stats_t *st = NULL;
+	String uri;
+	int handle;
+	uint8_t i;
+	
+	if ((windowSecs == 0) || ((source != STATS_TMP275) && ((source < 0) || (source >= nextRsrcId))))
+		return -1;
+	for (i = 0; i < MAX_STATS; i++) {
+		if (stats[i].source == STATS_NONE) {
+			st = &stats[i];
+			break;
+		}
+	}
+	if (st == NULL)
+		return -1;
+		
+	if (source == STATS_TMP275) {
+		uri = F("arduino/tmp275/stats");
+	} else {
+		uri = rsrcURIs[source];
+		uri += F("/stats");
+	}
+	String attr = F("title=\"n,min,max,mean,var,ewma\"?get|obs");
+	if ((handle = createResource(uri, STATS_RSRC_BUFLEN, attr)) < 0)
+		return -1;
+		
+	st->source = source;
+	st->handle = handle;
+	st->window = windowSecs;
+	st->windowAt = millis();
+	st->count = 0;
+	return handle;
+}
+
+/*
+ * Add a value, in hundredths, to the statistics kept on source.
+ */
+void ChariotEPClass::statsAdd(int source, long centi)
+{
+	stats_t *st;
+	uint8_t i;
+	
+	for (i = 0; i < MAX_STATS; i++) {
+		st = &stats[i];
+		if ((st->source != source) || (source == STATS_NONE))
+			continue;
+		if (st->count == 0) {
+			st->min = st->max = centi;
+			st->sum = 0;
+			st->sumSq = 0;
+		}
+		if (st->count == 0xFFFF)
+			continue;
+		st->count++;
+		if (centi < st->min)
+			st->min = centi;
+		if (centi > st->max)
+			st->max = centi;
+		st->sum += centi;
+		st->sumSq += (int64_t)centi * centi;
+		if (!st->ewmaValid) {
+			st->ewma = centi * 16;
+			st->ewmaValid = true;
+		} else {
+			st->ewma += (centi * 16 - st->ewma) / STATS_EWMA_DIV;
+		}
+	}
+}
+
+// Statistics and history of a resource's event values--see triggerResourceEvent()
+void ChariotEPClass::statsParse(int source, const String& value)
+{
+	long centi;
+	
+	if (parseCenti(value.c_str(), &centi)) {
+		statsAdd(source, centi);
+		histAdd(source, centi);
+	}
+}
+
+/*
+ * Publish the summaries of windows that have ended and start new ones.
+ * Windows without samples publish nothing.
+ */
+void ChariotEPClass::statsService()
+{
+	char payload[STATS_RSRC_BUFLEN];
+	char field[FMT_CENTI_MAX];
+	long fields[5];
+	stats_t *st;
+	uint8_t i, f;
+	int64_t var;
+	int len;
+	
+	for (i = 0; i < MAX_STATS; i++) {
+		st = &stats[i];
+		if ((st->source == STATS_NONE) || (millis() - st->windowAt < st->window * 1000UL))
+			continue;
+		st->windowAt += st->window * 1000UL;
+		if (st->count == 0)
+			continue;
+			
+		// variance in hundredths of units^2: (sumSq - sum^2/n)/n is in centi^2
+		var = (st->sumSq - (int64_t)st->sum * st->sum / st->count) / st->count / 100;
+		fields[0] = st->min;
+		fields[1] = st->max;
+		fields[2] = st->sum / (long)st->count;
+		fields[3] = (var > 2147483647LL) ? 2147483647L : (long)var;
+		fields[4] = st->ewma / 16;
+		
+		// "rsrc=NN%value=" and '\n' take 16 of the resource buffer
+		len = snprintf_P(payload, STATS_RSRC_BUFLEN - 16, PSTR("%u"), st->count);
+		st->count = 0;
+		for (f = 0; (f < 5) && (len < STATS_RSRC_BUFLEN - 16); f++) {
+			*fmtCenti(field, fields[f]) = '\0';
+			len += snprintf_P(payload + len, STATS_RSRC_BUFLEN - 16 - len, PSTR(",%s"), field);
+		}
+		if (len >= STATS_RSRC_BUFLEN - 16) {
+			SerialMon.println(F("statsService: summary too long, window dropped"));
+			continue;
+		}
+		
+		String event = payload;
+		triggerResourceEvent(st->handle, event, true);
+	}
+}
+
+/*----------------------------------------------------------------------*/
+/*
+ * History rings. Each source keeps two tiers: every value (HIST_TIER_RAW)
+ * and the average of each period (HIST_TIER_AVG). A ring is a byte stream
+ * of deltas from the previous value, one byte each; HIST_ESC and a 16 bit
+ * delta when that doesn't fit; or HIST_ESC, HIST_ESC_ABS and the 32 bit
+ * value when neither does. The oldest records are dropped to make room.
+ * base is the value preceding the oldest record.
+ */
+static uint8_t histByte(hist_ring_t *r, uint8_t *pos)
+{
+	uint8_t b = r->buf[*pos];
+	
+	*pos = (*pos + 1) % HIST_RING_LEN;
+	return b;
+}
+
+static int32_t histDecode(hist_ring_t *r, uint8_t *pos, int32_t prev)
+{
+	uint8_t b = histByte(r, pos), i;
+	uint16_t d;
+	uint32_t v;
+	
+	if (b != HIST_ESC)
+		return prev + (int8_t)b;
+	d = histByte(r, pos) << 8;
+	d |= histByte(r, pos);
+	if (d != HIST_ESC_ABS)
+		return prev + (int16_t)d;
+	for (i = 0, v = 0; i < 4; i++)
+		v = (v << 8) | histByte(r, pos);
+	return (int32_t)v;
+}
+
+static void histPut(hist_ring_t *r, int32_t v)
+{
+	int64_t delta = (int64_t)v - r->last;
+	uint8_t need, i;
+	uint8_t tail;
+	
+	if ((r->count == 0) || (delta < -32767L) || (delta > 32767L))
+		need = 7;
+	else if ((delta < -127) || (delta > 127))
+		need = 3;
+	else
+		need = 1;
+	
+	while (HIST_RING_LEN - r->used < need) {
+		tail = (r->head + HIST_RING_LEN - r->used) % HIST_RING_LEN;
+		r->base = histDecode(r, &tail, r->base);
+		r->used = (r->head + HIST_RING_LEN - tail) % HIST_RING_LEN;
+		r->count--;
+	}
+	if (need == 1) {
+		r->buf[r->head] = (uint8_t)delta;
+	} else {
+		r->buf[r->head] = HIST_ESC;
+		if (need == 3) {
+			r->buf[(r->head + 1) % HIST_RING_LEN] = (uint16_t)delta >> 8;
+			r->buf[(r->head + 2) % HIST_RING_LEN] = delta & 0xFF;
+		} else {
+			r->buf[(r->head + 1) % HIST_RING_LEN] = HIST_ESC_ABS >> 8;
+			r->buf[(r->head + 2) % HIST_RING_LEN] = HIST_ESC_ABS & 0xFF;
+			for (i = 0; i < 4; i++)
+				r->buf[(r->head + 3 + i) % HIST_RING_LEN] = (uint32_t)v >> (24 - 8 * i);
+		}
+	}
+	r->head = (r->head + need) % HIST_RING_LEN;
+	r->used += need;
+	r->count++;
+	r->last = v;
+	r->lastAt = millis();
+}
+
+/*
+ * Keep a history of source (a resource handle or STATS_TMP275, as for
+ * attachStats()): its recent values, and averages over avgSecs periods.
+ * Read it back with arduino/history. Returns the history slot, or -1.
+ */
+int ChariotEPClass::attachHistory(int source, uint16_t avgSecs)
+{
+	uint8_t i;
+	hist_t *h;
+	
+	if ((avgSecs == 0) || ((source != STATS_TMP275) && ((source < 0) || (source >= nextRsrcId))))
+		return -1;
+	for (i = 0; i < MAX_HISTORIES; i++) {
+		h = &histories[i];
+		if (h->source == STATS_NONE) {
+			memset(h, 0, sizeof(hist_t));
+			h->source = source;
+			h->period = avgSecs;
+			h->periodAt = millis();
+			return i;
+		}
+	}
+	return -1;
+}
+
+void ChariotEPClass::histAdd(int source, long centi)
+{
+	uint8_t i;
+	hist_t *h;
+	
+	for (i = 0; i < MAX_HISTORIES; i++) {
+		h = &histories[i];
+		if ((h->source != source) || (source == STATS_NONE))
+			continue;
+		histPut(&h->tier[HIST_TIER_RAW], centi);
+		h->sum += centi;
+		h->n++;
+	}
+}
+
+// Close the averaging periods that have ended
+void ChariotEPClass::histService()
+{
+	uint8_t i;
+	hist_t *h;
+	
+	for (i = 0; i < MAX_HISTORIES; i++) {
+		h = &histories[i];
+		if ((h->source == STATS_NONE) || (millis() - h->periodAt < h->period * 1000UL))
+			continue;
+		h->periodAt += h->period * 1000UL;
+		if (h->n) {
+			histPut(&h->tier[HIST_TIER_AVG], h->sum / h->n);
+			h->sum = 0;
+			h->n = 0;
+		}
+	}
+}
+
+/*
+ * Read back a history a page at a time:
+ *   arduino/history?get&src=event/x&tier=1&from=0&count=8
+ *       -> "History n=24 age=12 period=60 v=23.50,23.44,..."
+ * src is the source resource's URI or "tmp275"; tier 0 is every value,
+ * tier 1 the period averages. from counts back from the newest entry (0),
+ * and the page lists the count entries ending there, oldest first. n is
+ * the number of entries held, age the seconds since the newest.
+ */
+void ChariotEPClass::historyCommand(const char *command)
+{
+	const char *p = command, *key, *val;
+	uint8_t keyLen, i, pos, first;
+	long tier = HIST_TIER_RAW, from = 0, count = HIST_PAGE_MAX;
+	int source = STATS_NONE;
+	hist_t *h = NULL;
+	hist_ring_t *r;
+	int32_t v;
+	char resp[HIST_RESP_LEN];
+	char *response;
+	
+	while ((p = queryToken(p, &key, &keyLen, &val)) != NULL) {
+		if (val == NULL)
+			continue;		// method word--"get"
+		if (keyIs(key, keyLen, PSTR("src"))) {
+			// a URI--take its '/'s too
+			while ((*p == '/') || !tokEnd(*p))
+				p++;
+			if (keyIs(val, p - val, PSTR("tmp275")))
+				source = STATS_TMP275;
+			else if ((source = getIdFromURI(val, p - val)) < 0)
+				goto history_error;
+		} else if (keyIs(key, keyLen, PSTR("tier"))) {
+			if ((parseNum(val, &tier) != p) || (tier >= HIST_TIERS))
+				goto history_error;
+		} else if (keyIs(key, keyLen, PSTR("from"))) {
+			if (parseNum(val, &from) != p)
+				goto history_error;
+		} else if (keyIs(key, keyLen, PSTR("count"))) {
+			if ((parseNum(val, &count) != p) || (count == 0))
+				goto history_error;
+		}
+	}
+	for (i = 0; i < MAX_HISTORIES; i++) {
+		if ((histories[i].source == source) && (source != STATS_NONE))
+			h = &histories[i];
+	}
+	if (h == NULL)
+		goto history_error;
+	r = &h->tier[tier];
+	if (count > HIST_PAGE_MAX)
+		count = HIST_PAGE_MAX;
+	if (from >= r->count)
+		count = 0;
+	else if (count > r->count - from)
+		count = r->count - from;
+	first = r->count - from - count;
+	
+	response = respPut_P(resp, PSTR("History n="));
+	response = fmtUint(response, r->count);
+	response = respPut_P(response, PSTR(" age="));
+	response = fmtUint(response, r->count ? (millis() - r->lastAt) / 1000 : 0);
+	response = respPut_P(response, PSTR(" period="));
+	response = fmtUint(response, (tier == HIST_TIER_AVG) ? h->period : 0);
+	response = respPut_P(response, PSTR(" v"));
+	pos = (r->head + HIST_RING_LEN - r->used) % HIST_RING_LEN;
+	v = r->base;
+	for (i = 0; i < first + count; i++) {
+		v = histDecode(r, &pos, v);
+		if (i >= first) {
+			*response++ = (i == first) ? '=' : ',';
+			response = fmtCenti(response, v);
+		}
+	}
+	*response++ = '\n';
+	*response = '\0';
+	ChariotClient.print(resp);
+	return;
+	
+history_error:
+	SerialMon.print(F("history command--source or range incorrect: "));
+	SerialMon.println(command);
+	ChariotClient.print(F("Arduino could not complete history request.<\n\0"));
+}
+
+/*----------------------------------------------------------------------*/
+/*
+ * Rule engine. A rule's condition is stack bytecode without jumps, so its
+ * cost is bounded by RULE_CODE_LEN; operands are pushed and operators
+ * (LT, GT, EQ, NEQ, ADD, SUB, MPY, MOD and RULE_AND/OR/NOT) pop two (or
+ * one) and push the result. Conditions are checked when the code is
+ * installed, so evaluation needs no checks.
+ */
+
+static uint8_t hexNibble(char c)
+{
+	return (c <= '9') ? (c - '0') : ((c | 0x20) - 'a' + 10);
+}
+
+// Operand bytes following each opcode, or -1 if it isn't one
+static int8_t ruleOperands(uint8_t op)
+{
+	switch (op) {
+		case VAL:			return 2;
+		case RULE_DPIN:
+		case RULE_APIN:
+		case RULE_SENSOR:	return 1;
+		case RULE_TMP275:
+		case RULE_NOT:
+		case LT: case GT: case EQ: case NEQ:
+		case ADD: case SUB: case MPY: case MOD:
+		case RULE_AND: case RULE_OR:
+							return 0;
+	}
+	return -1;
+}
+
+// Change in stack depth made by op
+static int8_t ruleDepth(uint8_t op)
+{
+	switch (op) {
+		case VAL: case RULE_DPIN: case RULE_APIN: case RULE_SENSOR: case RULE_TMP275:
+			return 1;
+		case RULE_NOT:
+			return 0;
+	}
+	return -1;
+}
+
+/*
+ * Install a rule in slot id: when the condition code has been true for
+ * hold consecutive checks, made every everyMs, do action (RULE_ACT_SET or
+ * RULE_ACT_CLR of actPin, and/or RULE_ACT_NOTIFY on resource "arduino/rules").
+ * The rule fires again only after the condition has gone false.
+ * Returns false if the code or action is invalid.
+ */
+bool ChariotEPClass::setRule(uint8_t id, const uint8_t *code, uint8_t len, uint8_t hold,
+							 uint16_t everyMs, uint8_t action, uint8_t actPin)
+{
+	uint8_t i;
+	int8_t n, depth = 0;
+	rule_t *r;
+	
+	if ((id >= MAX_RULES) || (len == 0) || (len > RULE_CODE_LEN))
+		return false;
+	for (i = 0; i < len; i += n + 1) {
+		if ((n = ruleOperands(code[i])) < 0 || (i + n >= len))
+			return false;
+		if ((code[i] == RULE_DPIN) && !digitalPinOk(code[i+1]))
+			return false;
+		if ((code[i] == RULE_APIN) && (code[i+1] >= CHARIOT_NUM_ANALOG))
+			return false;
+		if ((code[i] == RULE_SENSOR) && (code[i+1] >= MAX_SENSORS))
+			return false;
+		depth += ruleDepth(code[i]);
+		if ((depth < 1) || (depth > RULE_STACK))
+			return false;
+	}
+	if (depth != 1)
+		return false;
+	if ((action & (RULE_ACT_SET | RULE_ACT_CLR)) && (!digitalPinOk(actPin) || pinReserved(actPin)))
+		return false;
+		
+	r = &rules[id];
+	memcpy(r->code, code, len);
+	r->len = len;
+	r->hold = hold ? hold : 1;
+	r->every = everyMs;
+	r->action = action;
+	r->actPin = actPin;
+	r->run = 0;
+	r->fired = false;
+	r->lastAt = millis();
+	if (action & RULE_ACT_NOTIFY)
+		libRsrcWanted[LIB_RSRC_RULES] = true;
+	return true;
+}
+
+bool ChariotEPClass::clearRule(uint8_t id)
+{
+	if ((id >= MAX_RULES) || (rules[id].len == 0))
+		return false;
+	rules[id].len = 0;
+	return true;
+}
+
+long ChariotEPClass::ruleEval(const rule_t *r)
+{
+	long stack[RULE_STACK];
+	int8_t sp = -1;
+	uint8_t i, op;
+	long b;
+	
+	for (i = 0; i < r->len; i++) {
+		op = r->code[i];
+		switch (op) {
+			case VAL:
+				stack[++sp] = (int16_t)((r->code[i+1] << 8) | r->code[i+2]);
+				i += 2;
+				continue;
+			case RULE_DPIN:
+				stack[++sp] = fastDigitalRead(r->code[++i]);
+				continue;
+			case RULE_APIN:
+				stack[++sp] = analogInput(r->code[++i]);
+				continue;
+			case RULE_SENSOR:
+				stack[++sp] = sensors[r->code[++i]].last;
+				continue;
+			case RULE_TMP275:
+				stack[++sp] = readTMP275Centi(CELSIUS);
+				continue;
+			case RULE_NOT:
+				stack[sp] = !stack[sp];
+				continue;
+		}
+		b = stack[sp--];
+		switch (op) {
+			case LT:		stack[sp] = stack[sp] < b;		break;
+			case GT:		stack[sp] = stack[sp] > b;		break;
+			case EQ:		stack[sp] = stack[sp] == b;		break;
+			case NEQ:		stack[sp] = stack[sp] != b;		break;
+			case ADD:		stack[sp] += b;					break;
+			case SUB:		stack[sp] -= b;					break;
+			case MPY:		stack[sp] *= b;					break;
+			case MOD:		stack[sp] = b ? stack[sp] % b : 0;	break;
+			case RULE_AND:	stack[sp] = stack[sp] && b;		break;
+			case RULE_OR:	stack[sp] = stack[sp] || b;		break;
+		}
+	}
+	return stack[0];
+}
+
+/*
+ * Check the rules that are due. Each fires on its condition's rising
+ * edge, after hold checks; notifications report both edges.
+ */
+void ChariotEPClass::rulesService()
+{
+	char payload[RULES_RSRC_BUFLEN];
+	char *p = payload;
+	uint8_t id;
+	rule_t *r;
+	bool was;
+	
+	for (id = 0; id < MAX_RULES; id++) {
+		r = &rules[id];
+		if ((r->len == 0) || (millis() - r->lastAt < r->every))
+			continue;
+		// "R3=1@4294967295 " per rule; with no room left the rest wait
+		// for the next check, so no change of state goes unpublished
+		if ((r->action & RULE_ACT_NOTIFY) && ((p - payload) + 17 > RULES_RSRC_BUFLEN - 16))
+			break;
+		r->lastAt = millis();
+		was = r->fired;
+		if (ruleEval(r)) {
+			if (r->run < 255)
+				r->run++;
+			if (!r->fired && (r->run >= r->hold)) {
+				r->fired = true;
+				if (r->action & RULE_ACT_SET)
+					fastDigitalWrite(r->actPin, HIGH);
+				else if (r->action & RULE_ACT_CLR)
+					fastDigitalWrite(r->actPin, LOW);
+			}
+		} else {
+			r->run = 0;
+			r->fired = false;
 		}
-		else 
-		{
-			SerialMon.println(F("coapRequest: Content Type not supported"));
-			return false;
+		if ((r->fired != was) && (r->action & RULE_ACT_NOTIFY)) {
+			if (p != payload)
+				*p++ = ' ';
+			*p++ = 'R';
+			p = fmtUint(p, id);
+			*p++ = '=';
+			*p++ = '0' + r->fired;
+			*p++ = '@';
+			p = fmtUint(p, r->lastAt);
 		}
 	}
 	
-	/* if we have options, we want them to look like: "name=name&val=val" */
-	if (opts.length())
-	{
-		coapUrl += String('&') + opts;
+	if ((p != payload) && (libRsrcs[LIB_RSRC_RULES] >= 0)) {
+		String event;
+		
+		*p = '\0';
+		event = payload;
+		triggerResourceEvent(libRsrcs[LIB_RSRC_RULES], event, true);
 	}
+}
+
+/*
+ * Remote rules:
+ *   arduino/rules?put&id=0&code=10090DAC021107090001030A&hold=3&act=set&pin=13&notify=1
+ *       "tmp275 > 35.00 and pin 7 == 1" for 3 checks (every defaults to 1000ms):
+ *       set pin 13 and notify
+ *   arduino/rules?put&id=0&code=         delete rule 0
+ *   arduino/rules?get                    -> "Rules R0=1/3 R1=0/0" (fired/consecutive true checks)
+ * code is the condition bytecode in hex; act is set, clr or none.
+ */
+void ChariotEPClass::rulesCommand(const char *command)
+{
+	const char *p = command, *key, *val, *h;
+	uint8_t keyLen, id;
+	uint8_t code[RULE_CODE_LEN];
+	uint8_t len = 0, action = 0;
+	long ruleId = -1, hold = 1, every = 1000, pin = 0, notify = 0;
+	bool haveCode = false;
+	char *response;
 	
-	/* Send the URL and return the response */
-	coapUrl += "\n\0";
-#if EP_DEBUG
-	SerialMon.print(F("coapRequest: sending URL: "));
-	SerialMon.println(coapUrl);
-#endif
+	while ((p = queryToken(p, &key, &keyLen, &val)) != NULL) {
+		if (val == NULL)
+			continue;		// method word--"get" or "put"
+		if (keyIs(key, keyLen, PSTR("id"))) {
+			if (parseNum(val, &ruleId) != p)
+				goto rules_error;
+		} else if (keyIs(key, keyLen, PSTR("hold"))) {
+			if ((parseNum(val, &hold) != p) || (hold > 255))
+				goto rules_error;
+		} else if (keyIs(key, keyLen, PSTR("every"))) {
+			if ((parseNum(val, &every) != p) || (every > 0xFFFFL))
+				goto rules_error;
+		} else if (keyIs(key, keyLen, PSTR("pin"))) {
+			if ((parseNum(val, &pin) != p) || (pin >= CHARIOT_NUM_DIGITAL))
+				goto rules_error;
+		} else if (keyIs(key, keyLen, PSTR("notify"))) {
+			if ((parseNum(val, &notify) != p) || (notify > 1))
+				goto rules_error;
+		} else if (keyIs(key, keyLen, PSTR("act"))) {
+			if (keyIs(val, p - val, PSTR("set")))
+				action |= RULE_ACT_SET;
+			else if (keyIs(val, p - val, PSTR("clr")))
+				action |= RULE_ACT_CLR;
+			else if (!keyIs(val, p - val, PSTR("none")))
+				goto rules_error;
+		} else if (keyIs(key, keyLen, PSTR("code"))) {
+			haveCode = true;
+			for (h = val; (h + 1 < p) && isxdigit(h[0]) && isxdigit(h[1]); h += 2) {
+				if (len == RULE_CODE_LEN)
+					goto rules_error;
+				code[len++] = (hexNibble(h[0]) << 4) | hexNibble(h[1]);
+			}
+			if (h != p)
+				goto rules_error;
+		}
+	}
+	if (notify)
+		action |= RULE_ACT_NOTIFY;
+		
+	if (haveCode) {
+		if ((ruleId < 0) || (ruleId >= MAX_RULES))
+			goto rules_error;
+		if (len == 0)
+			clearRule(ruleId);
+		else if (!setRule(ruleId, code, len, hold, every, action, pin))
+			goto rules_error;
+	}
 	
-	ChariotClient.print(coapUrl);
-	return chariotGetResponse(response);
+	response = respPut_P(pinResp, PSTR("Rules"));
+	for (id = 0; id < MAX_RULES; id++) {
+		if (rules[id].len) {
+			response = respPut_P(response, PSTR(" R"));
+			response = fmtUint(response, id);
+			*response++ = '=';
+			*response++ = '0' + rules[id].fired;
+			*response++ = '/';
+			response = fmtUint(response, rules[id].run);
+		}
+	}
+	pinRespSend(response);
+	return;
+	
+rules_error:
+	SerialMon.print(F("rules command--id, code, action or a value out of range: "));
+	SerialMon.println(command);
+	ChariotClient.print(F("Arduino could not complete rules request.<\n\0"));
 }
-int ChariotEPClass::coapResponseGet(String& response)
-{
-  char ch;
-  uint8_t ltSeen = 0;
 
-  response = "";
-  while (ltSeen < 2) {
-    if (ChariotClient.available() > 0) {
-      ch = (char)ChariotClient.read();
-  
-      if (ch != '<') {
-        response += ch;
-      }
-      else {
-        ltSeen++;
-      }
-    }
-  }
-  return ChariotClient.available();
+/*----------------------------------------------------------------------*/
+/*
+ * Adaptive sensor scheduler. Each sensor is sampled at a period between
+ * its bounds: long enough that a sample differs from the last by about
+ * tol at the observed rate of change, and short enough for two samples
+ * before the value could reach the nearest rule threshold. A value that
+ * stops changing backs off gradually; one that moves fast or nears a
+ * threshold drops straight to the period it needs.
+ */
+
+/*
+ * Nearest threshold a rule compares operand (RULE_TMP275 or RULE_SENSOR id)
+ * against, as "operand VAL n16 compare". Returns false if there is none.
+ */
+bool ChariotEPClass::ruleThreshold(uint8_t op, uint8_t arg, long value, long *dist)
+{
+	uint8_t id, i, n;
+	const uint8_t *c;
+	long t, d;
+	bool found = false;
+	
+	for (id = 0; id < MAX_RULES; id++) {
+		c = rules[id].code;
+		for (i = 0; i < rules[id].len; i += n + 1) {
+			n = ruleOperands(c[i]);
+			if ((c[i] != op) || ((n == 1) && (c[i+1] != arg)))
+				continue;
+			if ((i + n + 4 >= rules[id].len) || (c[i+n+1] != VAL))
+				continue;
+			if ((c[i+n+4] < LT) || ((c[i+n+4] > EQ) && (c[i+n+4] != NEQ)))
+				continue;
+			t = (int16_t)((c[i+n+2] << 8) | c[i+n+3]);
+			d = (t > value) ? (t - value) : (value - t);
+			if (!found || (d < *dist))
+				*dist = d;
+			found = true;
+		}
+	}
+	return found;
 }
 
-/* search mote named "host" for resource */
-bool ChariotEPClass::coapSearchResources(String& mote, String& resource, String& response)
-{	
-	String opts = "";
-	String search = "search";
+// Next period for s, whose value just changed by delta over dt ms
+uint16_t ChariotEPClass::sensorAdapt(sensor_t *s, long delta, unsigned long dt)
+{
+	unsigned long period, rate;
+	long dist;
+	bool near = ruleThreshold(s->read ? RULE_SENSOR : RULE_TMP275, s - sensors, s->last, &dist);
 	
-	if (resource.length() > 0)
-	{
-		opts = "name=" + resource;
-		return coapRequest(COAP_GET, mote, search, TEXT_PLAIN, opts, response);
+	if (delta < 0)
+		delta = -delta;
+	if ((delta == 0) || (dt == 0)) {
+		// steady--back off, unless within tol of a threshold
+		period = (near && (dist <= s->tol)) ? s->period : s->period + s->period / 4;
+	} else {
+		rate = (delta * 1000UL) / dt;		// hundredths per second
+		if (rate == 0)
+			rate = 1;
+		period = (s->tol * 1000UL) / rate;
+		if (near && ((dist * 500UL) / rate < period))
+			period = (dist * 500UL) / rate;
+		if (period > 2UL * s->period)
+			period = 2UL * s->period;
 	}
-	return false;
+	return constrain(period, (unsigned long)s->minMs, (unsigned long)s->maxMs);
 }
 
-/* Parse and execute a local Arduino pin request */
-void ChariotEPClass::digitalCommand(String& command) {
-  int pin, value;
-   String response;
+/*
+ * Sample a sensor adaptively between minMs and maxMs, tol being the change,
+ * in hundredths, worth a sample. read returns the value in hundredths; it
+ * is published on resource source (if >= 0) and can be tested by rules with
+ * RULE_SENSOR. With read NULL and source STATS_TMP275 the scheduler sets
+ * the TMP275's conversion period instead. Returns the sensor id, or -1.
+ */
+int ChariotEPClass::scheduleSensor(long (*read)(), int source, uint16_t minMs, uint16_t maxMs, uint16_t tol)
+{
+	uint8_t id;
+	sensor_t *s;
+	
+	if ((minMs == 0) || (minMs > maxMs) || ((read == NULL) && (source != STATS_TMP275)) ||
+			((read != NULL) && (source >= nextRsrcId)))
+		return -1;
+	for (id = 0; id < MAX_SENSORS; id++) {
+		s = &sensors[id];
+		if (!s->used) {
+			s->used = true;
+			s->read = read;
+			s->source = source;
+			s->minMs = minMs;
+			s->maxMs = maxMs;
+			s->period = minMs;
+			s->tol = tol ? tol : 1;
+			s->valid = false;
+			s->lastAt = millis() - minMs;		// sample now
+			if (read == NULL)
+				tmpPeriod = minMs;
+			return id;
+		}
+	}
+	return -1;
+}
 
-  // Read pin number
-  if (pinValParse(command, &pin, &value)) {
-  
-#if EP_DEBUG 
-    SerialMon.print(F("pin="));
-    SerialMon.println(pin, DEC);
-#endif
+// Current sampling period of sensor id, ms, or 0
+uint16_t ChariotEPClass::sensorPeriod(uint8_t id)
+{
+	return ((id < MAX_SENSORS) && sensors[id].used) ? sensors[id].period : 0;
+}
 
-    // If value is not -1 it means we have an URL
-    // with a value like: "/digital/13/1"
-    if (value >= 0) {
-#if EP_DEBUG 
-      SerialMon.println(F("command is WRITE"));
-#endif
-	  if (value > 1)
-		goto error;
+void ChariotEPClass::schedService()
+{
+	char payload[FMT_CENTI_MAX];
+	uint8_t id;
+	sensor_t *s;
+	long v;
+	unsigned long at;
+	
+	for (id = 0; id < MAX_SENSORS; id++) {
+		s = &sensors[id];
+		if (!s->used)
+			continue;
+		if (s->read == NULL) {
+			// TMP275: adapt when its state machine has a new reading
+			if (!tmpValid || (s->valid && (tmpAt == s->lastAt)))
+				continue;
+			v = readTMP275Centi(CELSIUS);
+			at = tmpAt;
+		} else {
+			if (millis() - s->lastAt < s->period)
+				continue;
+			v = s->read();
+			at = millis();
+		}
+		if (s->valid)
+			s->period = sensorAdapt(s, v - s->last, at - s->lastAt);
+		s->last = v;
+		s->lastAt = at;
+		s->valid = true;
 		
-      digitalWrite(pin, value);
-    }
-    else {
-      value = digitalRead(pin);
-#if EP_DEBUG 
-      SerialMon.println(F("command is READ"));
-#endif
-    }
-  
-    // Send pin response to requestor
-    response = "Pin D";
-    response += pin;
-    response += " set to ";
-    response += value;
-    response += "\n\0";
-    ChariotClient.print(response);
-  
-#if EP_DEBUG 
-    SerialMon.println(response);
-#endif
-    return;
-  }
-error: // Pin value not available.
-  SerialMon.print(F("digital command--pin values incorrect or missing. Pin = "));
-  SerialMon.print(pin);
-  SerialMon.print(F(" Value = "));
-  SerialMon.println(value);
-  SerialMon.println(F("Operation cancelled."));
-  // Return response
-  ChariotClient.print(F("Arduino could not complete digital pin request.<\n\0"));
+		if (s->read == NULL) {
+			tmpPeriod = s->period;
+		} else if (s->source >= 0) {
+			*fmtCenti(payload, v) = '\0';
+			String event = payload;
+			triggerResourceEvent(s->source, event, true);
+		}
+	}
 }
 
-void ChariotEPClass::analogCommand(String& command) {
-  int pin, value;
-  String response;
+/*
+ * Scheduler state:
+ *   arduino/sched?get   -> "Sched S0=1000 S1=250" (current periods, ms)
+ */
+void ChariotEPClass::schedCommand(const char *command)
+{
+	uint8_t id;
+	char *response;
+	
+	response = respPut_P(pinResp, PSTR("Sched"));
+	for (id = 0; id < MAX_SENSORS; id++) {
+		if (sensors[id].used) {
+			response = respPut_P(response, PSTR(" S"));
+			response = fmtUint(response, id);
+			*response++ = '=';
+			response = fmtUint(response, sensors[id].period);
+		}
+	}
+	pinRespSend(response);
+}
 
-  // Read pin number
-  if (pinValParse(command, &pin, &value)) {
+/*----------------------------------------------------------------------*/
+/*
+ * Duty cycling. Each wake window runs until its work is done--a command
+ * or event on its way, a one-shot task (the sketch's outbound requests
+ * among them), a TMP275 conversion, a scheduled sensor that is due--and
+ * at least dutyMinMs have passed, or dutyMaxMs whatever is left. Then
+ * Chariot is sent "sys/sleep=" and the host sleeps: ESP8266 in deep sleep,
+ * which ends in a reset (D0 wired to RST), AVR in power-down, woken by
+ * the watchdog. Chariot drops requests while it sleeps--they cannot be
+ * queued for the next window.
+ */
+#if defined(__AVR__)
+extern volatile unsigned long timer0_millis;	// wiring.c--stopped in power-down
 
-#if EP_DEBUG 
-  SerialMon.print(F("pin="));
-  SerialMon.println(pin, DEC);
+#if CHARIOT_WDT_ISR
+static volatile bool wdtWoke;
+
+ISR(WDT_vect)
+{
+	wdtWoke = true;
+}
 #endif
 
-  // Write is requested with a value like: "/analog/5/120"
-	if (value >= 0) {
-#if EP_DEBUG 
-		SerialMon.println(F("command is WRITE"));
+static const uint8_t wdtSecs[4] = { 8, 4, 2, 1 };
+static const uint8_t wdtPrescale[4] = {
+	_BV(WDP3) | _BV(WDP0), _BV(WDP3), _BV(WDP2) | _BV(WDP1) | _BV(WDP0), _BV(WDP2) | _BV(WDP1)
+};
+
+/*
+ * Power down for secs in watchdog steps of 8, 4, 2 and 1s, then move
+ * millis() on by the time slept so timer wheel deadlines, sensor periods
+ * and statistics windows carry on. The watchdog oscillator is only good
+ * to about 10%. A step cut short by another interrupt is not counted--how
+ * long it ran isn't known--so millis() falls behind rather than runs ahead.
+ * With the sketch's own WDT_vect, every step is taken to have run out.
+ */
+static void powerDown(unsigned long secs)
+{
+	uint8_t adc = ADCSRA;
+	uint8_t i;
+	
+	ADCSRA &= ~_BV(ADEN);
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	while (secs != 0) {
+		for (i = 0; wdtSecs[i] > secs; i++)
+			;
+		cli();
+		wdt_reset();
+		MCUSR &= ~_BV(WDRF);
+		WDTCSR = _BV(WDCE) | _BV(WDE);
+		WDTCSR = _BV(WDIE) | wdtPrescale[i];	// interrupt only--no reset
+#if CHARIOT_WDT_ISR
+		wdtWoke = false;
 #endif
-		analogWrite(pin, value);
-	}
-	else {
-		value = analogRead(pin);
-#if EP_DEBUG 
-  SerialMon.println(F("command is READ"));
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+		wdt_disable();
+		cli();
+#if CHARIOT_WDT_ISR
+		if (wdtWoke)
 #endif
+			timer0_millis += wdtSecs[i] * 1000UL;
+		sei();
+		secs -= wdtSecs[i];
 	}
+	ADCSRA = adc;
+}
+#endif
 
-	// Send pin response to requestor
-	response = "Pin A";
-	response += pin;
-	response += " set to ";
-	response += value;
-	response += "\n\0";
-	ChariotClient.print(response);
-  
-#if EP_DEBUG 
-  SerialMon.println(response);
+/*
+ * Sleep sleepSecs between wake windows of minAwakeMs to maxAwakeMs, from
+ * run(). sleepSecs 0 turns duty cycling off. Returns false if the host
+ * can't sleep or the window is empty.
+ */
+bool ChariotEPClass::dutyCycle(unsigned long sleepSecs, uint16_t minAwakeMs, uint16_t maxAwakeMs)
+{
+	if (sleepSecs != 0) {
+#if !defined(__AVR__) && !defined(ESP8266)
+		return false;
 #endif
-  } else { // Pin value not available.
-	SerialMon.print(F("analog command--pin values incorrect or missing. Pin = "));
-	SerialMon.print(pin);
-	SerialMon.print(F(" Value = "));
-	SerialMon.println(value);
-	SerialMon.println(F("Operation cancelled."));
-	// Return response
-	ChariotClient.print(F("Arduino could not complete analog pin request.<\n\0"));
-  }
+		if ((maxAwakeMs == 0) || (maxAwakeMs < minAwakeMs))
+			return false;
+	}
+	dutySleepSecs = sleepSecs;
+	dutyMinMs = minAwakeMs;
+	dutyMaxMs = maxAwakeMs;
+	return true;
 }
 
-void ChariotEPClass::modeCommand(String& command) {
-  int pin; int value;
-  String response, mode;
+// Board and sensor draw, for the energy per cycle figures
+void ChariotEPClass::dutyPower(uint16_t awakeMw, uint16_t sleepUw)
+{
+	dutyAwakeMw = awakeMw;
+	dutySleepUw = sleepUw;
+}
 
-  // Read pin number and mode to set
-  if (pinValParse(command, &pin, &value)) {
-  
-#if EP_DEBUG 
-  SerialMon.print(F("pin="));
-  SerialMon.print(pin, DEC);
-  SerialMon.print(F(" val="));
-  SerialMon.println(value, DEC);
-#endif
-
-  if (value == INPUT) {
-    pinMode(pin, INPUT);
-	mode = "INPUT";
-  } else if (value  == OUTPUT) {
-    pinMode(pin, OUTPUT);
-	mode = "OUTPUT";
-  } else if (value == INPUT_PULLUP) {
-    pinMode(pin, INPUT_PULLUP);
-	mode = "INPUT_PULLUP";
-  } else {
-	goto mode_error;
-  }
-  
- #if EP_DEBUG 
-	SerialMon.print(F("mode is "));
-	SerialMon.println(mode);
-#endif
+// Is there wake window work left?
+bool ChariotEPClass::dutyPending()
+{
+	unsigned long awake = millis() - dutyWakeAt;
+	uint8_t id;
+	
+	if (awake < dutyMinMs)
+		return true;
+	if (awake >= dutyMaxMs)
+		return false;
+	if (eventReady || ChariotClient.available() || (putEventRsrc >= 0) || (smpRate != 0) || tmpConverting)
+		return true;
+	for (id = 0; id < MAX_TASKS; id++) {
+		if ((tasks[id].fn != NULL) && (tasks[id].period == 0))
+			return true;
+	}
+	for (id = 0; id < MAX_SENSORS; id++) {
+		if (sensors[id].used && (sensors[id].read != NULL) &&
+			(millis() - sensors[id].lastAt >= sensors[id].period))
+			return true;
+	}
+	return false;
+}
 
-    // Send pin response to requestor
-    response = "Pin D";
-    response += pin;
-    response += " configured as ";
-    response += mode;
-    response += "\n\0";
-    ChariotClient.print(response);
-    return;
-  }
-#if EP_DEBUG 
-  SerialMon.print(F("Arduino remote error: invalid mode requested: "));
-  SerialMon.println(mode);
+void ChariotEPClass::dutySleep()
+{
+	char cmd[24];
+	char *p;
+	
+	duty.cycles++;
+	duty.awakeMs = millis() - dutyWakeAt;
+	duty.sleepMs = dutySleepSecs * 1000;
+	duty.energyUj = duty.awakeMs * dutyAwakeMw + dutySleepSecs * dutySleepUw;
+	
+	p = respPut_P(cmd, PSTR("sys/sleep="));
+	p = fmtUint(p, dutySleepSecs + DUTY_CHARIOT_MARGIN_S);
+	*p++ = '\n';
+	*p = '\0';
+	ChariotClient.print(cmd);
+	SerialMon.print(F("Duty cycle sleep (s): "));
+	SerialMon.println(dutySleepSecs);
+	SerialMon.flush();
+#if defined(ESP8266)
+	duty.magic = DUTY_RTC_MAGIC;
+	ESP.rtcUserMemoryWrite(0, (uint32_t *)&duty, sizeof(duty));
+	ESP.deepSleep(dutySleepSecs * 1000000ULL, WAKE_RF_DEFAULT);
+	delay(100);		// reset follows
+#elif defined(__AVR__)
+	powerDown(dutySleepSecs);
+	dutyWakeAt = millis();
+	chariotAvailable = false;
+	dutyWaking = true;
+	chariotSignal(COAP_EVENT_INT_PIN);
 #endif
-mode_error:
-  ChariotClient.print(F("Arduino remote error: invalid mode "));
-  ChariotClient.print(mode);
-  ChariotClient.print("<\n\0");
 }
 
-/**
- * Parse pin number and possible value parameter from command
+/*
+ * Duty cycle figures:
+ *   arduino/duty?get   -> "Duty N=12 W=850 S=60000 E=95120"
+ *     (cycles, last window ms, sleep ms, energy of the last cycle uJ)
  */
- bool ChariotEPClass::pinValParse(String& command, int *pin, int *value) {
-  int slash, secondSlash;
-   
-  /**
-   * Do we have /pin/value, /pin/mode or simply pin?
-   */
-   slash = command.indexOf('/');
-   if (slash != -1) {
-       String pinStr, valStr;
-       int valStrlen;
-       
-       pinStr = valStr = command;
-       valStr.remove(0, slash+1);
-       secondSlash = valStr.indexOf('/');
-       if (secondSlash != -1) {
-          valStr.remove(secondSlash, valStr.length()-1);
-       }
-       valStrlen = valStr.length();
-       pinStr.remove(slash, pinStr.length()-1);
-       *pin = pinStr.toInt();
-       if (valStrlen) {
-			if (valStr.indexOf("input_pullup") != -1) {
-				*value = INPUT_PULLUP;
-			} else if (valStr.indexOf("output") != -1) {
-				*value = OUTPUT;
-			} else if (valStr.indexOf("input") != -1) {
-				*value = INPUT;
-			} else {
-				*value = valStr.toInt();
-			}
-       } else {
-        *value = -1;
-       }
-       return true;
-   } else {
-     *pin = command.toInt();
-	 *value = -1;
-     return true;
-   }
-   
-error:
-  return false;
+void ChariotEPClass::dutyCommand(const char *command)
+{
+	char *response;
+	
+	response = respPut_P(pinResp, PSTR("Duty N="));
+	response = fmtUint(response, duty.cycles);
+	response = respPut_P(response, PSTR(" W="));
+	response = fmtUint(response, duty.awakeMs);
+	response = respPut_P(response, PSTR(" S="));
+	response = fmtUint(response, duty.sleepMs);
+	response = respPut_P(response, PSTR(" E="));
+	response = fmtUint(response, duty.energyUj);
+	pinRespSend(response);
 }
 
 /* 
@@ -818,11 +3772,10 @@ error:
  * Chariot will respond with "Chariot ready"
  */
 void ChariotEPClass::chariotSignal(int pin) {
-  noInterrupts();
+  // Interrupts stay on--the pulse needs no precision and serial input mustn't stall
   digitalWrite(pin, LOW);
-  delay(1);
+  delayMicroseconds(CHARIOT_SIGNAL_US);
   digitalWrite(pin, HIGH);
-  interrupts();
 }
 
 void ChariotEPClass::chariotPrintResponse()
@@ -1060,6 +4013,7 @@ bool ChariotEPClass::chariotGetResponse(String& response)
 	{
 		response = "5.04 TIMEOUT";
 		ChariotClient.flush();
+		roundTripDone();
 		return false;
 	}
   }
@@ -1075,53 +4029,117 @@ bool ChariotEPClass::chariotGetResponse(String& response)
       }
     }
   };
+  roundTripDone();
   return true;
 }
 /*-------------------------------------------------------------------------------------------------*/
 /* There isn't a really good reason for this to be here. A separate sensors library should be used.*/
 /* --although TMP275 is in the EP...                                                               */
 /*-------------------------------------------------------------------------------------------------*/
-float ChariotEPClass::readTMP275(uint8_t units)
+/*
+ * TMP275 registers and config bits (TI SBOS363)
+ */
+#define TMP275_REG_TEMP			0
+#define TMP275_REG_CONFIG		1
+#define TMP275_CFG_SD			0x01	// shutdown between one-shot conversions
+#define TMP275_CFG_OS			0x80	// start a one-shot conversion
+
+// Worst case conversion time, ms, by resolution (9..12 bits)
+static const uint16_t tmp275ConvMs[4] = { 38, 75, 150, 300 };
+
+/*
+ * Select TMP275 resolution (TMP275_RES_9BIT..TMP275_RES_12BIT--0.5C in
+ * 38ms to 0.0625C in 300ms) and how often, in ms, a new conversion is made.
+ */
+void ChariotEPClass::configTMP275(uint8_t resolution, uint16_t periodMs)
 {
-  char tempHighByte, tempLowByte;
-  double temperature;
-  long t;
+	tmpRes = resolution & 3;
+	tmpPeriod = periodMs;
+	if (!tmpConverting)
+		tmpDue = millis();		// convert at the new resolution now
+}
 
-#ifndef I_AM_EXCLUSIVE_I2C_OWNER
-  // init I2C
-  Wire.begin();
-#endif
-  Wire.beginTransmission(TMP275_ADDRESS);
-  Wire.write(1);
-  Wire.write(B11100001);
-  Wire.endTransmission();
-  Wire.beginTransmission(TMP275_ADDRESS);
-  Wire.write(0);
-  Wire.endTransmission();
-  Wire.requestFrom(TMP275_ADDRESS,2);
-  delay(250);
-  tempHighByte = Wire.read();
-  tempLowByte  = Wire.read();
-
-  t = word(tempHighByte,tempLowByte)/16;
-  temperature = (t/10)*625; // TMP275 is accurate to .0625C
-  temperature /= 1000.0;
-  
+/*
+ * TMP275 state machine: the sensor stays in shutdown except for a one-shot
+ * conversion every tmpPeriod ms, which is read back once its worst case
+ * conversion time has passed. Neither step waits on the sensor.
+ */
+void ChariotEPClass::tmp275Service()
+{
+	unsigned long now = millis();
+	uint8_t hi, lo;
+	
+	if ((long)(now - tmpDue) < 0)
+		return;
+		
+	if (!tmpConverting) {
+		Wire.beginTransmission(TMP275_ADDRESS);
+		Wire.write(TMP275_REG_CONFIG);
+		Wire.write(TMP275_CFG_OS | (tmpRes << 5) | TMP275_CFG_SD);
+		if (Wire.endTransmission() == 0) {
+			tmpConverting = true;
+			tmpDue = now + tmp275ConvMs[tmpRes];
+		} else {
+			tmpDue = now + tmpPeriod;		// no answer--try again next period
+		}
+		return;
+	}
+	
+	tmpConverting = false;
+	tmpDue = now + tmpPeriod;
+	Wire.beginTransmission(TMP275_ADDRESS);
+	Wire.write(TMP275_REG_TEMP);
+	if ((Wire.endTransmission() != 0) || (Wire.requestFrom(TMP275_ADDRESS, 2) != 2))
+		return;
+	hi = Wire.read();
+	lo = Wire.read();
+	
+	// 12 bit two's complement, left justified: 1/16 C per count
+	tmpRaw = (int16_t)(((uint16_t)hi << 8) | lo) >> 4;
+	tmpAt = now;
+	tmpValid = true;
+	statsAdd(STATS_TMP275, readTMP275Centi(CELSIUS));
+	histAdd(STATS_TMP275, readTMP275Centi(CELSIUS));
+	
 #define TMP275_TRIGGER_DEBUG (0)
 #if TMP275_TRIGGER_DEBUG
 SerialMon.print(F("TMP275 bits: "));
-SerialMon.print(t, BIN); Serial.print("  0x"); Serial.println(t, HEX);
+SerialMon.print(tmpRaw, BIN); Serial.print("  0x"); Serial.println(tmpRaw, HEX);
 #endif
+}
 
-  if (units == FAHRENHEIT) {
-      temperature = temperature*1.8 + 32.0;
-  } 
-  Wire.endTransmission(true); // Let go of the bus
-#ifndef I_AM_EXCLUSIVE_I2C_OWNER
-  // terminate I2C
-  //Wire.end();
-#endif
-  return (float)temperature;
+/*
+ * Latest TMP275 temperature in hundredths of a degree--no I2C traffic.
+ * Returns 0 until the first conversion completes (see tmp275Timestamp()).
+ */
+long ChariotEPClass::readTMP275Centi(uint8_t units)
+{
+	long centiC = ((long)tmpRaw * 625 + (tmpRaw < 0 ? -50 : 50)) / 100;	// 0.0625C per count
+	
+	if (!tmpValid)
+		return 0;
+	if (units == FAHRENHEIT)
+		return (centiC * 9) / 5 + 3200;
+	if (units == KELVIN)
+		return centiC + 27315;
+	return centiC;
+}
+
+/*
+ * Latest TMP275 temperature. Also advances the conversion state machine,
+ * so sketches that don't call service() still see fresh values--one
+ * conversion period behind. Only the very first call waits for a conversion.
+ */
+float ChariotEPClass::readTMP275(uint8_t units)
+{
+	unsigned long start = millis();
+	
+	tmp275Service();
+	while (!tmpValid && (millis() - start < 2 * tmp275ConvMs[TMP275_RES_12BIT])) {
+		delay(5);
+		tmp275Service();
+	}
+	return readTMP275Centi(units) / 100.0;
 }
 
 ChariotEPClass ChariotEP; // Create an object
\ No newline at end of file
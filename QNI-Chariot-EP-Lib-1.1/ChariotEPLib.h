@@ -10,6 +10,7 @@
 #include <Arduino.h>
 #include <Wire.h>    			// the Arduino I2C library
 #include <SoftwareSerial.h>
+#include <EEPROM.h>
 #include "coap-constants.h"
 
 /*
@@ -65,6 +66,20 @@
 	#define TX_PIN			D7
 	#define MAX_RESOURCES	32
 
+	// Remotely accessible pins: GPIO0,2,4,5,12-16 (GPIO1/3 are Serial, 6-11 are flash)
+	#define CHARIOT_NUM_DIGITAL	17
+	#define CHARIOT_DIGITAL_MASK	0x1F035UL
+	#define CHARIOT_NUM_ANALOG	1
+	#define CHARIOT_PWM_MAX		PWMRANGE
+	#define CHARIOT_NUM_PORTS	0		// GPIO0-15 as one 16 bit port "gpio"
+	#define MAX_WATCHES			4		// any GPIO but GPIO16 can interrupt
+	#define MAX_STATS			4
+	#define MAX_HISTORIES		4
+	#define HIST_RING_LEN		64		// bytes per tier
+	#define MAX_RULES			4
+	#define MAX_SENSORS			4
+	#define MAX_TASKS			8		// timer wheel, library's included
+
 #elif defined(ESP8266_D1_R2)    // WeMos D1 R2
 	 /*
 	  * For the WeMos D1/R2:
@@ -95,6 +110,20 @@
 	#define TX_PIN			D5
 	#define MAX_RESOURCES	32
 
+	// Remotely accessible pins: GPIO0,2,4,5,12-16 (GPIO1/3 are Serial, 6-11 are flash)
+	#define CHARIOT_NUM_DIGITAL	17
+	#define CHARIOT_DIGITAL_MASK	0x1F035UL
+	#define CHARIOT_NUM_ANALOG	1
+	#define CHARIOT_PWM_MAX		PWMRANGE
+	#define CHARIOT_NUM_PORTS	0		// GPIO0-15 as one 16 bit port "gpio"
+	#define MAX_WATCHES			4		// any GPIO but GPIO16 can interrupt
+	#define MAX_STATS			4
+	#define MAX_HISTORIES		4
+	#define HIST_RING_LEN		64		// bytes per tier
+	#define MAX_RULES			4
+	#define MAX_SENSORS			4
+	#define MAX_TASKS			8		// timer wheel, library's included
+
 #elif defined(HAVE_HWSERIAL3)
 	// MEGA Host
     #define LEONARDO_HOST   0
@@ -104,6 +133,20 @@
 	#define ESP8266_D1_R2_HOST	0
 	#define MAX_RESOURCES	16	// dynamic limit of Chariot 
     #define ChariotClient Serial3
+	#define RX_PIN			15		// Serial3--reserved for the Chariot channel
+	#define TX_PIN			14
+
+	#define CHARIOT_NUM_DIGITAL	70	// D0..D53 + A0..A15 as D54..D69
+	#define CHARIOT_NUM_ANALOG	16
+	#define CHARIOT_PWM_MAX		255
+	#define CHARIOT_NUM_PORTS	13		// PA(1)..PL(12), no PI
+	#define MAX_WATCHES			3		// D2, D18, D19 (D3 is an event pin, D20/21 are I2C)
+	#define MAX_STATS			4
+	#define MAX_HISTORIES		4
+	#define HIST_RING_LEN		64		// bytes per tier
+	#define MAX_RULES			4
+	#define MAX_SENSORS			4
+	#define MAX_TASKS			8		// timer wheel, library's included
 	
 #elif !defined(HAVE_HWSERIAL0) && defined(HAVE_HWSERIAL1)
     // LEONARDO Host  
@@ -117,6 +160,18 @@
 	#define TX_PIN			12//4 -- problem using pin 4?
 	#define MAX_RESOURCES	6
 
+	#define CHARIOT_NUM_DIGITAL	30
+	#define CHARIOT_NUM_ANALOG	12
+	#define CHARIOT_PWM_MAX		255
+	#define CHARIOT_NUM_PORTS	7
+	#define MAX_WATCHES			2
+	#define MAX_STATS			2
+	#define MAX_HISTORIES		1
+	#define HIST_RING_LEN		32		// bytes per tier
+	#define MAX_RULES			2
+	#define MAX_SENSORS			2
+	#define MAX_TASKS			4		// timer wheel, library's included
+
 #elif (defined(HAVE_HWSERIAL0) && !defined(HAVE_HWSERIAL1))
     // UNO Host
     #define LEONARDO_HOST   0
@@ -127,6 +182,18 @@
 	#define RX_PIN			11
 	#define TX_PIN			12
 	#define MAX_RESOURCES	4
+
+	#define CHARIOT_NUM_DIGITAL	20	// D0..D13 + A0..A5 as D14..D19
+	#define CHARIOT_NUM_ANALOG	6
+	#define CHARIOT_PWM_MAX		255
+	#define CHARIOT_NUM_PORTS	5		// PB(2), PC(3), PD(4)
+	#define MAX_WATCHES			1		// INT0 on D2 (D3 is an event pin)
+	#define MAX_STATS			2
+	#define MAX_HISTORIES		1
+	#define HIST_RING_LEN		32		// bytes per tier
+	#define MAX_RULES			2
+	#define MAX_SENSORS			2
+	#define MAX_TASKS			4		// timer wheel, library's included
 #else
   #error Board type not supported by Chariot at this time--contact Qualia Networks Tech Support.
 #endif
@@ -155,11 +222,51 @@
 #define MAX_URI_LEN				32
 #define MAX_ATTR_LEN			48
 
+/*
+ * Resource registry--see registryHit(). Kept in EEPROM (flash on ESP8266)
+ * at the address given to useRegistry(), so a warm start can skip
+ * re-registering with Chariot. Off unless the sketch asks for it.
+ */
+#define REGISTRY_OFF			(-1)
+#define REGISTRY_MAGIC			0xC5E1
+#define CHARIOT_POLL_MS			1		// begin()'s wait for Chariot
+#define CHARIOT_PROBE_MS		2540	// warm start probe reply
+
+/*
+ * Channel bring-up status--see beginAsync() and beginStatus().
+ * BEGIN_TIMEOUT_MS is the default for begin()'s and beginAsync()'s timeout;
+ * after a timeout Chariot is probed again every timeout.
+ */
+#ifndef BEGIN_TIMEOUT_MS
+#define BEGIN_TIMEOUT_MS		30000
+#endif
+#define BEGIN_IDLE				0		// begin() not called
+#define BEGIN_PROBE				1		// warm start probe sent
+#define BEGIN_WAIT_STATE		2		// CHARIOT_STATE_PIN still low
+#define BEGIN_WAIT_READY		3		// Chariot up, no "Chariot ready" yet
+#define BEGIN_READY				4
+#define BEGIN_NO_STATE			5		// timed out: CHARIOT_STATE_PIN never went high
+#define BEGIN_NO_READY			6		// timed out: Chariot up but silent
+
+typedef struct {
+	uint16_t	magic;
+	uint16_t	generation;				// bumped whenever an entry changes
+	uint16_t	location;				// CRC of begin(loc)'s location, 0: none
+	uint8_t		count;					// handles with an entry
+	uint16_t	crc[MAX_RESOURCES];		// CRC of each registration's uri, maxlen and attr
+} registry_t;
+
 #define	TMP275_ADDRESS			0x48
 #define FAHRENHEIT    			1
 #define CELSIUS       			2
 #define KELVIN        			3
 
+#define TMP275_RES_9BIT			0	// 0.5C, 38ms conversion
+#define TMP275_RES_10BIT		1
+#define TMP275_RES_11BIT		2
+#define TMP275_RES_12BIT		3	// 0.0625C, 300ms conversion
+#define TMP275_PERIOD_MS		1000	// default time between conversions
+
 #define JSON          			50  // see CoAP RFC7252
 
 #define LT            			1
@@ -170,7 +277,26 @@
 #define MPY						6
 #define MOD						7
 #define NEQ						8
-#define VAL						9
+#define VAL						9		// rules: followed by a 16 bit value, high byte first
+
+/*
+ * Rule engine opcodes beyond the operators above--see setRule()
+ */
+#define RULE_AND				10
+#define RULE_OR					11
+#define RULE_NOT				12
+#define RULE_TMP275				16		// push TMP275 reading, hundredths C
+#define RULE_DPIN				17		// followed by pin: push its level
+#define RULE_APIN				18		// followed by channel: push analog reading
+#define RULE_SENSOR				19		// followed by id: push scheduled sensor's last value
+
+#define RULE_ACT_SET			0x01	// drive actPin HIGH when the rule fires
+#define RULE_ACT_CLR			0x02	// drive actPin LOW when the rule fires
+#define RULE_ACT_NOTIFY			0x04	// publish on "arduino/rules"
+
+#define RULE_CODE_LEN			16
+#define RULE_STACK				4
+#define RULES_RSRC_BUFLEN		63
 
 #define ON            			true
 #define OFF           			false
@@ -181,13 +307,211 @@
 #define MINUTES       			1
 #define SECONDS       			2
 
+/*
+ * Remote pin commands--pinCmdParse() validates against the board pin tables above
+ */
+#define PIN_KIND_ANY			0	// syntax only, no range checks
+#define PIN_KIND_DIGITAL		1
+#define PIN_KIND_ANALOG			2
+#define PIN_KIND_MODE			3
+
+#define PIN_CMD_OK				0
+#define PIN_CMD_BAD_SYNTAX		1
+#define PIN_CMD_BAD_PIN			2
+#define PIN_CMD_BAD_VALUE		3
+#define PIN_CMD_RESERVED		4	// pin carries the Chariot channel or event lines
+
+// Bulk pin reads: one bit per digital pin, one value per analog channel
+#define PIN_BITS_LEN			((CHARIOT_NUM_DIGITAL+7)/8)
+#define PIN_RESP_LEN			(40 + CHARIOT_NUM_DIGITAL/4 + CHARIOT_NUM_ANALOG*5)
+
+typedef struct {
+	int		pin;
+	int		value;		// -1 when no value was given (read)
+	uint8_t	status;		// PIN_CMD_xxx
+} pin_cmd_t;
+
+/*
+ * Pin watches--see watchPin(). Edges are queued by the pin's interrupt
+ * and published, once debounced, on the library resource "arduino/watch".
+ */
+#define WATCH_OFF				0
+#define WATCH_CHANGE			1
+#define WATCH_RISING			2
+#define WATCH_FALLING			3
+
+#define WATCH_QUEUE_LEN			8		// power of 2
+#define WATCH_RSRC_BUFLEN		48
+
+typedef struct {
+	uint8_t		pin;
+	uint8_t		edge;		// WATCH_xxx
+	uint16_t	debounce;	// ms a new level must hold before it is published
+	uint8_t		stable;		// last published level
+	uint8_t		pending;	// level waiting out the debounce time
+	unsigned long pendingAt;	// millis() of the edge that set pending
+} watch_t;
+
+/*
+ * Analog sampler--see startSampler(). Blocks of samples are published
+ * on the library resource "arduino/sampler".
+ */
+#define SAMPLER_BLOCK_LEN		15		// "<seq>:" + 3 hex digits per sample fits the resource
+#define SAMPLER_RSRC_BUFLEN		63
+#define SAMPLER_MAX_AVG			64		// keeps the 16 bit sums of 10 bit samples exact
+#if defined(ESP8266)
+#define SAMPLER_MAX_RATE		1000	// conversions/s--polled from service()
+#else
+#define SAMPLER_MAX_RATE		4000	// conversions/s--ADC at 125kHz takes 104us each
+#endif
+
+/*
+ * Streaming statistics--see attachStats(). Values are kept in hundredths.
+ */
+#define STATS_NONE				(-1)
+#define STATS_TMP275			(-2)	// source: Chariot's TMP275, C
+#define STATS_RSRC_BUFLEN		63
+#define STATS_EWMA_DIV			8		// EWMA weight of a new value is 1/8
+
+typedef struct {
+	int8_t		source;		// resource handle, STATS_TMP275 or STATS_NONE
+	int8_t		handle;		// companion ".../stats" resource
+	uint16_t	window;		// seconds
+	unsigned long windowAt;	// millis() the current window began
+	uint16_t	count;
+	long		min, max;
+	long		sum;
+	int64_t		sumSq;
+	long		ewma;		// 1/16 hundredths, carried across windows
+	bool		ewmaValid;
+} stats_t;
+
+/*
+ * History rings--see attachHistory(). Values are kept in hundredths, as
+ * 32 bit numbers: one byte deltas where they fit, else three byte deltas,
+ * else the whole value.
+ */
+#define HIST_TIER_RAW			0		// every value
+#define HIST_TIER_AVG			1		// period averages
+#define HIST_TIERS				2
+#define HIST_ESC				0x80	// next two bytes are a 16 bit delta...
+#define HIST_ESC_ABS			0x8000	// ...or this, and then the 32 bit value
+#define HIST_PAGE_MAX			8		// values per arduino/history reply
+#define HIST_RESP_LEN			(40 + HIST_PAGE_MAX*13)
+
+typedef struct {
+	uint8_t		buf[HIST_RING_LEN];
+	uint8_t		head;		// next byte written
+	uint8_t		used;		// bytes held
+	uint8_t		count;		// values held
+	int32_t		base;		// value preceding the oldest held
+	int32_t		last;		// newest value
+	unsigned long lastAt;	// millis() of the newest value
+} hist_ring_t;
+
+typedef struct {
+	int8_t		source;		// as for stats_t
+	uint16_t	period;		// seconds per HIST_TIER_AVG value
+	unsigned long periodAt;	// millis() the current period began
+	int64_t		sum;		// values in the current period
+	uint16_t	n;
+	hist_ring_t	tier[HIST_TIERS];
+} hist_t;
+
+typedef struct {
+	uint8_t		code[RULE_CODE_LEN];
+	uint8_t		len;		// 0: slot unused
+	uint8_t		hold;		// consecutive true checks before firing
+	uint8_t		run;		// consecutive true checks so far
+	uint8_t		action;		// RULE_ACT_xxx
+	uint8_t		actPin;
+	bool		fired;
+	uint16_t	every;		// ms between checks
+	unsigned long lastAt;	// millis() of the last check
+} rule_t;
+
+/*
+ * Adaptive sensor scheduler--see scheduleSensor()
+ */
+typedef struct {
+	bool		used;
+	long		(*read)();	// value in hundredths; NULL for the TMP275
+	int8_t		source;		// resource the value is published on, or STATS_NONE
+	uint16_t	minMs, maxMs;
+	uint16_t	period;		// current, ms
+	uint16_t	tol;		// change worth a sample, hundredths
+	long		last;
+	unsigned long lastAt;	// millis() of last
+	bool		valid;
+} sensor_t;
+
+/*
+ * Timer wheel--see addTask(). 3 levels of 16 slots at 8ms per tick
+ * reach 32.7s; later deadlines are re-parked until due.
+ */
+#define TW_TICK_MS				8
+#define TW_SLOT_BITS			4
+#define TW_SLOTS				(1 << TW_SLOT_BITS)
+#define TW_LEVELS				3
+#define LIB_TICK_MS				20		// library's periodic work
+#define PUT_EVENT_DELAY_MS		250		// PUT response to Chariot before its event
+#define CHARIOT_SIGNAL_US		1000	// event line pulse width
+
+typedef struct {
+	void		(*fn)();	// NULL: free
+	unsigned long period;	// ms, 0: run once
+	unsigned long due;		// millis()
+	int8_t		next;		// next task in the same wheel slot, -1 ends
+	bool		linked;		// on a wheel slot, or on the one runTasks() is expiring
+} task_t;
+
+/*
+ * Event line--see enableEventLine()
+ */
+#define NO_EVENT_LINE			0xFF
+
+/*
+ * Duty cycling--see dutyCycle(). Chariot is told to sleep a little longer
+ * than the host, which wakes it on the event pin at the start of each window.
+ * A window whose Chariot hasn't said "Chariot ready" in DUTY_WAKE_MS goes on
+ * without waiting.
+ * On AVR the library defines WDT_vect to wake from power-down, and to tell
+ * its wakes from other interrupts'. Set CHARIOT_WDT_ISR to 0 here (or with
+ * -D on the compile line--a sketch #define doesn't reach the library) if the
+ * sketch defines its own; every wake is then taken to be the watchdog's.
+ */
+#define DUTY_CHARIOT_MARGIN_S	2
+#define DUTY_WAKE_MS			5000
+#ifndef CHARIOT_WDT_ISR
+#define CHARIOT_WDT_ISR			1
+#endif
+#define DUTY_RTC_MAGIC			0xC4D07C1Eul	// ESP8266 RTC memory holds duty_t over deep sleep
+
+typedef struct {
+	uint32_t	magic;
+	uint32_t	cycles;
+	uint32_t	awakeMs;	// last window
+	uint32_t	sleepMs;
+	uint32_t	energyUj;	// last cycle, from the dutyPower() figures
+} duty_t;
+
+/*
+ * Resources the library creates for itself on first use (see libResource())
+ */
+#define LIB_RSRC_WATCH			0
+#define LIB_RSRC_SAMPLER		1
+#define LIB_RSRC_RULES			2
+#define LIB_RSRC_COUNT			3
+
 class ChariotEPClass
 {
   public:
     ChariotEPClass();
 	~ChariotEPClass();
-    bool begin();
-	bool begin(String& loc);
+    bool begin(unsigned long timeoutMs = BEGIN_TIMEOUT_MS);
+	bool begin(String& loc, unsigned long timeoutMs = BEGIN_TIMEOUT_MS);
+	bool beginAsync(void (*onReady)(uint8_t status), unsigned long timeoutMs = BEGIN_TIMEOUT_MS);
+	inline uint8_t beginStatus() { return beginState; }
 	int available();
 	void process();
 	bool coapRequest(coap_method_t method, String& host,  String& resource,  
@@ -195,6 +519,7 @@ class ChariotEPClass
 	bool coapSearchResources(String& mote,  String& resource, String& response);
 	int coapResponseGet(String& response);
 	bool pinValParse(String& command, int *pin, int *value);
+	uint8_t pinCmdParse(const char *command, uint8_t kind, pin_cmd_t *cmd);
 	int allocResource();
 	int setResourceBuflen(int id, uint8_t maxBufLen);
 	int setResourceUri(int id, const String& uri);
@@ -208,10 +533,39 @@ class ChariotEPClass
 	bool chariotGetResponse(String& response);
 	void serialChariotCmdHelp();
 	int getIdFromURI(String& uri);
+	int getIdFromURI(const char *uri, uint8_t len);
 	int setPutHandler(int handle, String * (*putCallback)(String& putCmd));
 	uint8_t getMotes(String (&motes)[MAX_MOTES]);
 	uint8_t getArduinoModel();
+	void service();
+	int watchPin(uint8_t pin, uint8_t edge, uint16_t debounceMs);
+	bool unwatchPin(uint8_t pin);
+	bool startSampler(uint16_t rateHz, uint16_t channels, uint8_t avg);
+	void stopSampler();
 	float readTMP275(uint8_t units);
+	long readTMP275Centi(uint8_t units);
+	void configTMP275(uint8_t resolution, uint16_t periodMs);
+	int attachStats(int source, uint16_t windowSecs);
+	void statsAdd(int source, long centi);
+	int attachHistory(int source, uint16_t avgSecs);
+	bool setRule(uint8_t id, const uint8_t *code, uint8_t len, uint8_t hold,
+				 uint16_t everyMs, uint8_t action, uint8_t actPin);
+	bool clearRule(uint8_t id);
+	int scheduleSensor(long (*read)(), int source, uint16_t minMs, uint16_t maxMs, uint16_t tol);
+	uint16_t sensorPeriod(uint8_t id);
+	void run();
+	int addTask(void (*fn)(), unsigned long firstMs, unsigned long periodMs);
+	bool cancelTask(int id);
+	bool enableEventLine(uint8_t pin);
+	void disableEventLine();
+	void idle();
+	bool dutyCycle(unsigned long sleepSecs, uint16_t minAwakeMs, uint16_t maxAwakeMs);
+	void dutyPower(uint16_t awakeMw, uint16_t sleepUw);
+	inline unsigned long dutyEnergy() { return duty.energyUj; }	// uJ, last cycle
+	inline bool warmStarted() { return warmStart; }	// begin() found Chariot's resources in place
+	inline uint16_t registryGeneration() { return registry.generation; }
+	bool useRegistry(int eeAddr);
+	inline unsigned long tmp275Timestamp() { return tmpAt; }	// millis() of the cached reading
 	void enableDebugMsgs();
 	void disableDebugMsgs();
 	inline bool strip_205_CONTENT(String& response) {
@@ -226,6 +580,16 @@ class ChariotEPClass
   private:
 	uint8_t arduinoType;
 	bool chariotAvailable;
+	
+	// Channel bring-up--see beginStep()
+	uint8_t beginState;
+	unsigned long beginAt;
+	unsigned long beginTimeout;
+	bool beginRetry;						// timed out once--probing again quietly
+	unsigned long probeAt;
+	void (*readyCallback)(uint8_t status);
+	void beginStep();
+	void beginDone(uint8_t status);
 	uint8_t maxBufLen;
 	bool 	debug;
 
@@ -237,10 +601,112 @@ class ChariotEPClass
 	String * (*putCallbacks[MAX_RESOURCES])(String& putCmd);
 
 	uint8_t rsrcChariotBufSizes[MAX_RESOURCES];
+	
+	// Resource registry--lets a warm start skip createResource() round trips
+	registry_t registry;
+	int registryAddr;						// EEPROM address, or REGISTRY_OFF
+	bool warmStart;
+	void registryLoad();
+	void registrySave();
+	int registryHit(const String& uri, uint8_t bufLen, const String& attrib);
+	void registryNote(int handle, uint8_t bufLen);
+	bool chariotProbe();
 
-	void digitalCommand(String& command);
-	void analogCommand(String& command);
-	void modeCommand(String& command);
+	void digitalCommand(const char *command);
+	void analogCommand(const char *command);
+	void modeCommand(const char *command);
+	void pinsCommand(const char *command);
+	void portCommand(const char *command);
+	void watchCommand(const char *command);
+	void samplerCommand(const char *command);
+	
+	// Pin watches
+	watch_t watches[MAX_WATCHES];
+	void watchService();
+	void samplerService();
+	int analogInput(uint8_t ch);
+	
+	// TMP275 one-shot conversions--see tmp275Service()
+	int16_t tmpRaw;				// 1/16 C
+	bool tmpValid;
+	bool tmpConverting;
+	uint8_t tmpRes;
+	uint16_t tmpPeriod;
+	unsigned long tmpDue;		// millis() the next step is due
+	unsigned long tmpAt;		// millis() of tmpRaw
+	void tmp275Service();
+	
+	// Statistics windows
+	stats_t stats[MAX_STATS];
+	void statsService();
+	void statsParse(int source, const String& value);
+	
+	// History rings
+	hist_t histories[MAX_HISTORIES];
+	void histAdd(int source, long centi);
+	void histService();
+	void historyCommand(const char *command);
+	
+	// Rules
+	rule_t rules[MAX_RULES];
+	long ruleEval(const rule_t *r);
+	void rulesService();
+	void rulesCommand(const char *command);
+	
+	// Scheduled sensors
+	sensor_t sensors[MAX_SENSORS];
+	bool ruleThreshold(uint8_t op, uint8_t arg, long value, long *dist);
+	uint16_t sensorAdapt(sensor_t *s, long delta, unsigned long dt);
+	void schedService();
+	void schedCommand(const char *command);
+	
+	// Timer wheel
+	task_t tasks[MAX_TASKS];
+	int8_t wheel[TW_LEVELS][TW_SLOTS];
+	unsigned long wheelAt;		// millis() of wheelTick
+	uint16_t wheelTick;
+	bool tasksRun;				// the sketch calls service() or run()
+	void taskInsert(int8_t id, bool cascading);
+	void taskCascade(uint8_t level, uint8_t slot);
+	void runTasks();
+	static void libTickTask();
+	
+	uint8_t eventLinePin;		// NO_EVENT_LINE: poll available()
+	bool commandPending();
+	
+	// PUT callback's event, sent PUT_EVENT_DELAY_MS after the PUT
+	int8_t putEventRsrc;
+	String *putEventVal;
+	static void putEventTask();
+	void flushPutEvent();
+	
+	// Duty cycling--host and Chariot sleep together between wake windows
+	unsigned long dutySleepSecs;	// 0: off
+	uint16_t dutyMinMs, dutyMaxMs;
+	uint16_t dutyAwakeMw, dutySleepUw;
+	unsigned long dutyWakeAt;		// millis() the host woke
+	bool dutyWaking;				// Chariot signalled, "Chariot ready" not yet seen
+	duty_t duty;
+	bool dutyPending();
+	void dutySleep();
+	void dutyCommand(const char *command);
+	
+	// Library owned resources, created from service() when first needed
+	int8_t libRsrcs[LIB_RSRC_COUNT];
+	bool libRsrcWanted[LIB_RSRC_COUNT];
+	int libResource(uint8_t id);
+	bool pinReserved(int pin);
+	
+	// Direct port access for remote pin commands--see pinTableInit()
+#if defined(__AVR__)
+	uint8_t pinPort[CHARIOT_NUM_DIGITAL];	// NOT_A_PORT: PWM timer pin, use digitalWrite()
+	uint8_t pinMask[CHARIOT_NUM_DIGITAL];
+#elif defined(ESP8266)
+	uint32_t pwmPins;						// pins last driven by analogCommand()
+#endif
+	void pinTableInit();
+	void fastDigitalWrite(uint8_t pin, uint8_t value);
+	int fastDigitalRead(uint8_t pin);
 	void chariotSignal(int pin);
 	void chariotPrintResponse();
 };
@@ -4,27 +4,40 @@
 
 #define DEBUG 1
 
-struct Frame {
-    bool isMasked;
-    bool isFinal;
-    byte opcode;
-    byte mask[4];
-    byte length;
-    char data[0x7d];
-} frame;
+// Handshake headers, a bit each in m_hs.headers
+#define HS_UPGRADE      0x01
+#define HS_CONNECTION   0x02
+#define HS_VERSION      0x04
+#define HS_HOST         0x08
+#define HS_KEY          0x10
+#define HS_ALL          0x1f
+
+/*
+ * Frame header: FIN and opcode, then the length--7 bits, or 126 and a
+ * 16 bit length. Returns the header size.
+ */
+static byte frameHeader(byte *header, byte opcode, uint16_t length)
+{
+    header[0] = opcode;
+    if (length < 126) {
+        header[1] = length;
+        return 2;
+    }
+    header[1] = 126;
+    header[2] = length >> 8;
+    header[3] = length & 0xff;
+    return 4;
+}
 
 WebSocketServer::WebSocketServer(const char *urlPrefix, int inPort, byte maxConnections) :
     m_server(inPort),
     m_socket_urlPrefix(urlPrefix),
-    m_maxConnections(maxConnections),
-    m_connectionCount(0)
+    m_maxConnections(min(maxConnections, (byte)WS_MAX_CONNECTIONS)),
+    m_next(0)
 {
-    m_connections = new WebSocket*[ m_maxConnections ];
-    for( byte x=0; x < m_maxConnections; x++ )
-        m_connections[x] = NULL;
-
     onConnect = NULL;
     onData = NULL;
+    onBinary = NULL;
     onDisconnect = NULL;
 }
 
@@ -34,6 +47,9 @@ void WebSocketServer::registerConnectCallback(Callback *callback) {
 void WebSocketServer::registerDataCallback(DataCallback *callback) {
     onData = callback;
 }
+void WebSocketServer::registerBinaryCallback(DataCallback *callback) {
+    onBinary = callback;
+}
 void WebSocketServer::registerDisconnectCallback(Callback *callback) {
     onDisconnect = callback;
 }
@@ -44,84 +60,115 @@ void WebSocketServer::begin() {
 
 byte WebSocketServer::connectionCount()
 {
-    return m_connectionCount;
+    byte count = 0;
+
+    for( byte x=0; x < m_maxConnections; x++ )
+    {
+        if( m_connections[x].isConnected() )
+            count++;
+    }
+    return count;
 }
 
-void WebSocketServer::send( char *data, byte length )
+void WebSocketServer::send( const char *data, uint16_t length )
 {
-    m_server.write((uint8_t) 0x81); // Txt frame opcode
-    m_server.write((uint8_t) length); // Length of data
-    m_server.write( (const uint8_t *)data, length );
+    for( byte x=0; x < m_maxConnections; x++ )
+    {
+        if( m_connections[x].isConnected() )
+            m_connections[x].send(data, length);
+    }
 }
 
 void WebSocketServer::listen() {
-    // First check existing connections:
-    for( byte x=0; x < m_maxConnections; x++ )
+    // First serve existing connections, starting with a different one
+    // each time so none is always last
+    for( byte n=0; n < m_maxConnections; n++ )
     {
-        if( !m_connections[x] )
-            continue;
+        WebSocket *s = &m_connections[(m_next + n) % m_maxConnections];
 
-        WebSocket *s = m_connections[x];
-        if( !s->isConnected() )
-        {
-            m_connectionCount--;
-            delete s;
-            m_connections[x] = NULL;
-            continue;
-        }
-        s->listen();
+        if( s->state != WebSocket::DISCONNECTED )
+            s->listen();
     }
+    m_next = (m_next + 1) % m_maxConnections;
 
+    // available() also returns clients we have that still have data waiting
     EthernetClient cli = m_server.available();
-    if( !cli )
-        return;
-  
-    // Find a slot:
-    for( byte x=0; x < m_maxConnections; x++ )
+    if( cli )
     {
-        if( m_connections[x] )
-            continue;
+        byte free = m_maxConnections;
 
-        WebSocket *s = new WebSocket(this, cli);
-        m_connections[x] = s;
-        m_connectionCount++;
+        for( byte x=0; x < m_maxConnections; x++ )
+        {
+            if( m_connections[x].state == WebSocket::DISCONNECTED )
+            {
+                if( free == m_maxConnections )
+                    free = x;
+            }
+            else if( m_connections[x].client == cli )
+            {
+                free = m_maxConnections + 1;    // ours
+                break;
+            }
+        }
+        if( free < m_maxConnections )
+        {
+            m_connections[free].attach(this, cli);
 #if DEBUG
-        Serial.println(F("Websocket client connected."));
+            Serial.println(F("Websocket client connected."));
 #endif
-        return;
-    }
-
-    // No room!
+        }
+        else if( free == m_maxConnections )
+        {
+            // No room!
 #if DEBUG
-    Serial.println(F("Cannot accept new websocket client, maxConnections reached!"));
+            Serial.println(F("Cannot accept new websocket client, maxConnections reached!"));
 #endif
-    cli.stop();
+            cli.stop();
+        }
+    }
+
+    flush();
 }
 
-WebSocket::WebSocket( WebSocketServer *server, EthernetClient cli ) :
-    m_server(server),
-    client(cli)
+void WebSocketServer::flush()
 {
-    if( doHandshake() )
-    {
-        state = CONNECTED;
-        if( m_server->onConnect )
-            m_server->onConnect(*this);
+    for( byte x=0; x < m_maxConnections; x++ )
+        m_connections[x].flushQueue();
+}
 
-        return;
-    }
+WebSocket::WebSocket() :
+    m_server(NULL),
+    state(DISCONNECTED),
+    m_txHead(0),
+    m_txCount(0)
+{
+}
 
-    disconnectStream();
+void WebSocket::attach( WebSocketServer *server, EthernetClient cli )
+{
+    m_server = server;
+    client = cli;
+    state = HANDSHAKE;
+    m_since = millis();
+    m_hs.lineLength = 0;
+    m_hs.headers = 0;
+    m_parse = P_OPCODE;
+    m_msgOpcode = 0;
+    m_msgLength = 0;
+    m_streaming = false;
+    m_dropping = false;
+    m_txHead = 0;
+    m_txCount = 0;
 }
 
 void WebSocket::listen()
 {
-    if( !client.available() )
-        return;
-
-    if( !getFrame() )
-        // Got unhandled frame, disconnect
+    if( m_dropping )
         disconnectStream();
+    else if( state == HANDSHAKE )
+        handshake();
+    else if( state == CONNECTED )
+        getFrame();
 }
 
 bool WebSocket::isConnected() {
@@ -133,62 +180,91 @@ void WebSocket::disconnectStream() {
 #if DEBUG
     Serial.println(F("Disconnecting"));
 #endif
+    bool wasConnected = (state == CONNECTED);
+
+    // What the client won't take now is dropped with it
+    flushQueue();
     state = DISCONNECTED;
-    if( m_server->onDisconnect )
+    if( wasConnected && m_server->onDisconnect )
         m_server->onDisconnect(*this);
 
     client.flush();
-    delay(1);
     client.stop();
 }
 
-bool WebSocket::doHandshake() {
-    char temp[128];
-    char key[80];
-    char bite;
-    
-    bool hasUpgrade = false;
-    bool hasConnection = false;
-    bool isSupportedVersion = false;
-    bool hasHost = false;
-    bool hasKey = false;
+void WebSocket::handshake() {
+    int bite;
 
-    byte counter = 0;
     while ((bite = client.read()) != -1) {
-        temp[counter++] = bite;
-
-        if (counter > 2 && (bite == '\n' || counter >= 127)) { // EOL got, or too long header. temp should now contain a header string
-            temp[counter - 2] = 0; // Terminate string before CRLF
-            
-            #if DEBUG
-                Serial.print("Got header: ");
-                Serial.println(temp);
-            #endif
-            
-            // Ignore case when comparing and allow 0-n whitespace after ':'. See the spec:
-            // http://www.w3.org/Protocols/rfc2616/rfc2616-sec4.html
-            if (!hasUpgrade && strstr_P(temp, PSTR("Upgrade: "))) {
-                // OK, it's a websockets handshake for sure
-                hasUpgrade = true;	
-            } else if (!hasConnection && strstr_P(temp, PSTR("Connection: "))) {
-                hasConnection = true;
-            } else if (!hasHost && strstr_P(temp, PSTR("Host: "))) {
-                hasHost = true;
-            } else if (!hasKey && strstr_P(temp, PSTR("Sec-WebSocket-Key: "))) {
-                hasKey = true;
-                strtok(temp, " ");
-                strcpy(key, strtok(NULL, " "));
-            } else if (!isSupportedVersion && strstr_P(temp, PSTR("Sec-WebSocket-Version: ")) && strstr_P(temp, PSTR("13"))) {
-                isSupportedVersion = true;
+        if (bite != '\n') {
+            if (m_hs.lineLength < WS_LINE_LEN - 1)
+                m_hs.line[m_hs.lineLength++] = bite;
+            continue;
+        }
+        // EOL got--terminate the header string before CRLF
+        if ((m_hs.lineLength > 0) && (m_hs.line[m_hs.lineLength - 1] == '\r'))
+            m_hs.lineLength--;
+        m_hs.line[m_hs.lineLength] = 0;
+        if (m_hs.lineLength == 0) {
+            // Blank line ends the headers
+            if (doHandshake()) {
+                state = CONNECTED;
+                if( m_server->onConnect )
+                    m_server->onConnect(*this);
+            } else {
+                disconnectStream();
             }
-            
-            counter = 0; // Start saving new header string
+            return;
         }
+        headerLine();
+        m_hs.lineLength = 0;
     }
 
+    if (millis() - m_since > WS_HANDSHAKE_MS) {
+#if DEBUG
+        Serial.println(F("Handshake timed out."));
+#endif
+        disconnectStream();
+    }
+}
+
+void WebSocket::headerLine() {
+    char *p;
+
+#if DEBUG
+    Serial.print("Got header: ");
+    Serial.println(m_hs.line);
+#endif
+            
+    // Ignore case when comparing and allow 0-n whitespace after ':'. See the spec:
+    // http://www.w3.org/Protocols/rfc2616/rfc2616-sec4.html
+    if (strstr_P(m_hs.line, PSTR("Upgrade: "))) {
+        // OK, it's a websockets handshake for sure
+        m_hs.headers |= HS_UPGRADE;
+    } else if (strstr_P(m_hs.line, PSTR("Connection: "))) {
+        m_hs.headers |= HS_CONNECTION;
+    } else if (strstr_P(m_hs.line, PSTR("Host: "))) {
+        m_hs.headers |= HS_HOST;
+    } else if ((p = strstr_P(m_hs.line, PSTR("Sec-WebSocket-Key: "))) != NULL) {
+        p += sizeof("Sec-WebSocket-Key: ") - 1;
+        while (*p == ' ')
+            p++;
+        strncpy(m_hs.key, p, WS_KEY_LEN);
+        m_hs.key[WS_KEY_LEN] = 0;
+        m_hs.headers |= HS_KEY;
+    } else if (strstr_P(m_hs.line, PSTR("Sec-WebSocket-Version: ")) && strstr_P(m_hs.line, PSTR("13"))) {
+        m_hs.headers |= HS_VERSION;
+    }
+}
+
+bool WebSocket::doHandshake() {
+    char key[WS_KEY_LEN + 37];
+    char temp[32];
+
     // Assert that we have all headers that are needed. If so, go ahead and
     // send response headers.
-    if (hasUpgrade && hasConnection && isSupportedVersion && hasHost && hasKey) {
+    if (m_hs.headers == HS_ALL) {
+        strcpy(key, m_hs.key);
         strcat_P(key, PSTR("258EAFA5-E914-47DA-95CA-C5AB0DC85B11")); // Add the omni-valid GUID
         Sha1.init();
         Sha1.print(key);
@@ -201,15 +277,15 @@ bool WebSocket::doHandshake() {
         // Nope, failed handshake. Disconnect
 #if DEBUG
         Serial.print(F("Handshake failed! Upgrade:"));
-        Serial.print( hasUpgrade );
+        Serial.print( (m_hs.headers & HS_UPGRADE) != 0 );
         Serial.print(F(", Connection:"));
-        Serial.print( hasConnection );
+        Serial.print( (m_hs.headers & HS_CONNECTION) != 0 );
         Serial.print(F(", Host:"));
-        Serial.print( hasHost );
+        Serial.print( (m_hs.headers & HS_HOST) != 0 );
         Serial.print(F(", Key:"));
-        Serial.print( hasKey );
+        Serial.print( (m_hs.headers & HS_KEY) != 0 );
         Serial.print(F(", Version:"));
-        Serial.println( isSupportedVersion );
+        Serial.println( (m_hs.headers & HS_VERSION) != 0 );
 #endif
         return false;
     }
@@ -217,99 +293,249 @@ bool WebSocket::doHandshake() {
     return true;
 }
 
-bool WebSocket::getFrame() {
-    byte bite;
-    
-    // Get opcode
-    bite = client.read();
-        
-    frame.opcode = bite & 0xf; // Opcode
-    frame.isFinal = bite & 0x80; // Final frame?
-    // Determine length (only accept <= 125 (0x7d) for now)
-    bite = client.read();
-    frame.length = bite & 0x7f; // Length of payload
-    if (frame.length > 125) {
+void WebSocket::getFrame() {
+    int bite;
+    byte b;
+
+    while ((bite = client.read()) != -1) {
+        switch (m_parse) {
+            case P_OPCODE:
+                m_opcode = bite;
+                m_parse = P_LENGTH;
+                break;
+
+            case P_LENGTH:
+                // Clients must mask
+                if (!(bite & 0x80)) {
+                    sendClose(WS_CLOSE_PROTOCOL);
+                    return;
+                }
+                m_frameLength = bite & 0x7f;
+                m_framePos = 0;
+                if (m_frameLength == 127) {
 #if DEBUG
-        Serial.print(F("Too big frame to handle. Length: "));
-        Serial.println(frame.length);
+                    Serial.println(F("64 bit frame length, too big to handle."));
 #endif
-        client.write((uint8_t) 0x08);
-        client.write((uint8_t) 0x02);
-        client.write((uint8_t) 0x03);
-        client.write((uint8_t) 0xf1);
-        return false;
-    }
-    // Client should always send mask, but check just to be sure
-    frame.isMasked = bite & 0x80;
-    if (frame.isMasked) {
-        frame.mask[0] = client.read();
-        frame.mask[1] = client.read();
-        frame.mask[2] = client.read();
-        frame.mask[3] = client.read();
+                    sendClose(WS_CLOSE_TOO_BIG);
+                    return;
+                }
+                if (m_frameLength == 126) {
+                    m_frameLength = 0;
+                    m_parse = P_LENGTH16;
+                } else {
+                    m_parse = P_MASK;
+                }
+                break;
+
+            case P_LENGTH16:
+                m_frameLength = (m_frameLength << 8) | bite;
+                if (++m_framePos == 2) {
+                    m_framePos = 0;
+                    m_parse = P_MASK;
+                }
+                break;
+
+            case P_MASK:
+                m_mask[m_framePos++] = bite;
+                if (m_framePos == 4) {
+                    m_framePos = 0;
+                    if (!frameStart())
+                        return;
+                }
+                break;
+
+            case P_PAYLOAD:
+                b = bite ^ m_mask[m_framePos & 3];
+                if (m_opcode & 0x08) {
+                    if (m_pong)
+                        m_ping[m_framePos] = b;
+                } else {
+                    m_msgData[m_msgLength + m_framePos] = b;
+                }
+                if ((++m_framePos == m_frameLength) && !frameEnd())
+                    return;
+                break;
+        }
     }
+}
 
-    // Clear any frame data that may have come previously
-    memset(frame.data, 0, sizeof(frame.data)/sizeof(char));
+bool WebSocket::frameStart() {
+    byte opcode = m_opcode & 0x0f;
 
-    
-    // Get message bytes and unmask them if necessary
-    for (int i = 0; i < frame.length; i++) {
-        if (frame.isMasked) {
-            frame.data[i] = client.read() ^ frame.mask[i % 4];
+    m_parse = P_PAYLOAD;
+
+    // Control frames are never fragmented, but may come between fragments
+    if (m_opcode & 0x08) {
+        if (!(m_opcode & 0x80) || (m_frameLength > 125)) {
+            sendClose(WS_CLOSE_PROTOCOL);
+            return false;
+        }
+        // A ping's payload is kept for the pong, queued whole in frameEnd()
+        // so nothing sent meanwhile can land inside it
+        m_pong = (opcode == 0x09) && (m_frameLength <= WS_MAX_PING);
+    } else {
+        // Data frame: the first fragment has the opcode, the rest are continuations
+        if (opcode == 0x00) {
+            if (m_msgOpcode == 0) {
+                sendClose(WS_CLOSE_PROTOCOL);
+                return false;
+            }
         } else {
-            frame.data[i] = client.read();
+            if (m_msgOpcode != 0) {
+                sendClose(WS_CLOSE_PROTOCOL);
+                return false;
+            }
+            m_msgOpcode = opcode;
+            m_msgLength = 0;
         }
-    }
-    
-    //
-    // Frame complete!
-    //
-    
-    if (!frame.isFinal) {
-        // We don't handle fragments! Close and disconnect.
+        if (m_frameLength > WS_MAX_MESSAGE - m_msgLength) {
 #if DEBUG
-        Serial.println(F("Non-final frame, doesn't handle that."));
+            Serial.print(F("Too big message to handle. Length: "));
+            Serial.println(m_msgLength + m_frameLength);
 #endif
-        client.print((uint8_t) 0x08);
-        client.write((uint8_t) 0x02);
-        client.write((uint8_t) 0x03);
-        client.write((uint8_t) 0xf1);
-        return false;
+            sendClose(WS_CLOSE_TOO_BIG);
+            return false;
+        }
     }
+    return (m_frameLength > 0) ? true : frameEnd();
+}
 
-    switch (frame.opcode) {
-        case 0x01: // Txt frame
-            // Call the user provided function
-            if( m_server->onData )
-                m_server->onData(*this, frame.data, frame.length);
-            break;
-            
-        case 0x08:
+bool WebSocket::frameEnd() {
+    byte opcode;
+    byte header[2];
+
+    m_parse = P_OPCODE;
+    if (m_opcode & 0x08) {
+        if ((m_opcode & 0x0f) == 0x08) {
             // Close frame. Answer with close and terminate tcp connection
-            // TODO: Receive all bytes the client might send before closing? No?
 #if DEBUG
             Serial.println(F("Close frame received. Closing in answer."));
 #endif
-            client.write((uint8_t) 0x08);
+            sendClose(WS_CLOSE_NORMAL);
             return false;
+        }
+        // Answer a ping if there's room; a missed pong is only a missed pong
+        if (m_pong && (sendSpace() >= 2 + m_frameLength)) {
+            header[0] = 0x8a;
+            header[1] = m_frameLength;
+            enqueue(header, 2);
+            enqueue(m_ping, m_frameLength);
+        }
+        return true;    // ping answered, or pong skipped
+    }
+
+    m_msgLength += m_frameLength;
+    if (!(m_opcode & 0x80))
+        return true;
+
+    //
+    // Message complete!
+    //
+    opcode = m_msgOpcode;
+    m_msgOpcode = 0;
+    m_msgData[m_msgLength] = 0;
+
+    switch (opcode) {
+        case 0x01: // Txt frame
+            // Call the user provided function
+            if( m_server->onData )
+                m_server->onData(*this, m_msgData, m_msgLength);
             break;
             
+        case 0x02: // Binary frame
+            if( m_server->onBinary ) {
+                m_server->onBinary(*this, m_msgData, m_msgLength);
+                break;
+            }
+            // fall through
         default:
-            // Unexpected. Ignore. Probably should blow up entire universe here, but who cares.
+            // Not handled
 #if DEBUG
-            Serial.println(F("Unhandled frame ignored."));
+            Serial.println(F("Unhandled frame."));
 #endif
-			return false;
+            sendClose(WS_CLOSE_UNSUPPORTED);
             break;
     }
-    return true;
+    return false;       // let the other connections have a turn
 }
 
+void WebSocket::sendClose(uint16_t code)
+{
+    byte close[4] = { 0x88, 0x02, (byte)(code >> 8), (byte)(code & 0xff) };
 
+    // Goes out if the client takes enough of the queue to make room
+    if (makeRoom(sizeof(close)))
+        enqueue(close, sizeof(close));
+    disconnectStream();
+}
 
-bool WebSocket::send(char *data, byte length)
+uint16_t WebSocket::sendSpace()
 {
-    if( state != CONNECTED )
+    return WS_TX_QUEUE - m_txCount;
+}
+
+void WebSocket::enqueue(const byte *data, uint16_t length)
+{
+    uint16_t tail;
+
+    while (length--) {
+        tail = m_txHead + m_txCount++;
+        if (tail >= WS_TX_QUEUE)
+            tail -= WS_TX_QUEUE;
+        m_txQueue[tail] = *data++;
+    }
+}
+
+// Set once any client's availableForWrite() is above 0: from then on 0
+// means full, not "this Ethernet library can't tell"
+static bool s_roomKnown = false;
+
+// Writes as many queued bytes as the client takes without waiting.
+// Returns true if any are left.
+bool WebSocket::flushQueue()
+{
+    uint16_t length, sent = 0;
+    int room;
+
+    while (m_txCount != 0) {
+        room = client.availableForWrite();
+        if (room > 0) {
+            s_roomKnown = true;
+        } else if (s_roomKnown || (sent >= WS_TX_CHUNK)) {
+            break;
+        } else {
+            room = WS_TX_CHUNK - sent;
+        }
+        length = min(m_txCount, (uint16_t)(WS_TX_QUEUE - m_txHead));
+        length = min(length, (uint16_t)room);
+        client.write(m_txQueue + m_txHead, length);
+        m_txHead += length;
+        if (m_txHead == WS_TX_QUEUE)
+            m_txHead = 0;
+        m_txCount -= length;
+        sent += length;
+    }
+    return (m_txCount != 0);
+}
+
+// True once the queue has room for length more bytes. If the Ethernet
+// library can't say what a client takes, this writes until there is.
+bool WebSocket::makeRoom(uint16_t length)
+{
+    if (sendSpace() >= length)
+        return true;
+    flushQueue();
+    while (!s_roomKnown && (sendSpace() < length) && client.connected())
+        flushQueue();
+    return (sendSpace() >= length);
+}
+
+bool WebSocket::sendFrame(byte opcode, const char *data, uint16_t length)
+{
+    byte header[4];
+    byte headerLength = frameHeader(header, opcode, length);
+
+    if( (state != CONNECTED) || m_dropping )
     {
 #if DEBUG
         Serial.println(F("No connection to client, no data sent."));
@@ -317,8 +543,49 @@ bool WebSocket::send(char *data, byte length)
         return false;
     }
 
-    client.write((uint8_t) 0x81); // Txt frame opcode
-    client.write((uint8_t) length); // Length of data
-    client.write( (const uint8_t *)data, length );
+    // No waiting on a full queue: a client that won't take enough of it
+    // now is too slow to keep
+    if (!makeRoom(headerLength + length)) {
+#if DEBUG
+        Serial.println(F("Client too slow, disconnecting."));
+#endif
+        m_dropping = true;
+        return false;
+    }
+    enqueue(header, headerLength);
+    enqueue((const byte *)data, length);
+    return true;
+}
+
+bool WebSocket::send(const char *data, uint16_t length)
+{
+    return sendStream(data, length, true);
+}
+
+bool WebSocket::sendBinary(const char *data, uint16_t length)
+{
+    return sendStream(data, length, true, true);
+}
+
+bool WebSocket::sendStream(const char *data, uint16_t length, bool final, bool binary)
+{
+    // Fragments must fit the queue with their header
+    const uint16_t most = WS_TX_QUEUE - 4;
+    uint16_t piece;
+    byte opcode;
+
+    do {
+        piece = min(length, most);
+        length -= piece;
+
+        // Txt or binary opcode on the first fragment, continuation after; FIN on the last
+        opcode = m_streaming ? 0x00 : (binary ? 0x02 : 0x01);
+        m_streaming = !(final && (length == 0));
+        if (!m_streaming)
+            opcode |= 0x80;
+        if (!sendFrame(opcode, data, piece))
+            return false;
+        data += piece;
+    } while (length > 0);
     return true;
 }
@@ -51,11 +51,160 @@ www.codebender.cc
 // CRLF characters to terminate lines/handshakes in headers.
 #define CRLF "\r\n"
 
-class WebSocket;
+// Largest message, fragments reassembled, taken from a client. Longer
+// ones are refused with close code 1009. Outgoing messages have no limit.
+#ifndef WS_MAX_MESSAGE
+#define WS_MAX_MESSAGE 125
+#endif
+#if WS_MAX_MESSAGE > 255
+#error WS_MAX_MESSAGE must fit the DataCallback length
+#endif
+
+// Connection pool size--the W5100 has 4 sockets, one of them listening.
+#ifndef WS_MAX_CONNECTIONS
+#define WS_MAX_CONNECTIONS 4
+#endif
+
+// Per connection send queue, written out as the client takes it. Frames
+// bigger than the queue are sent in fragments. A client that can't take
+// enough of its queue to make room for the next frame is too slow and is
+// dropped, rather than holding up the others.
+#ifndef WS_TX_QUEUE
+#define WS_TX_QUEUE 256
+#endif
+
+// Ethernet before 2.0 can't say how much a client takes (availableForWrite()
+// is always 0). Until some client has said, WS_TX_CHUNK is written to each
+// connection per flush--which may wait on that client, as writes always did.
+#define WS_TX_CHUNK 64
+
+// Largest ping answered--its payload is held until the pong can go whole.
+#ifndef WS_MAX_PING
+#define WS_MAX_PING 125
+#endif
+
+// Handshake: header lines are cut at WS_LINE_LEN, and a client that hasn't
+// finished its headers in WS_HANDSHAKE_MS is dropped.
+#define WS_LINE_LEN 64
+#define WS_KEY_LEN 24           // base64 of the 16 byte key
+#define WS_HANDSHAKE_MS 2000
+
+// Close codes (RFC 6455, 7.4.1)
+#define WS_CLOSE_NORMAL       1000
+#define WS_CLOSE_PROTOCOL     1002
+#define WS_CLOSE_UNSUPPORTED  1003
+#define WS_CLOSE_TOO_BIG      1009
+
+class WebSocketServer;
+
+class WebSocket {
+    WebSocketServer *m_server;
+
+public:
+    // Constructor--connections live in the server's pool.
+    WebSocket();
+
+    // Are we connected?
+    bool isConnected();
+	
+    // Embeds data in frame and queues it for the client.
+    bool send(const char *str, uint16_t length);
+
+    // Sends a message in pieces as they become available, so it never
+    // has to be held whole: each call sends one fragment, and the call
+    // with final set ends the message. The first sets text or binary.
+    bool sendStream(const char *str, uint16_t length, bool final, bool binary = false);
+
+    // Embeds data in a binary frame and queues it for the client.
+    bool sendBinary(const char *data, uint16_t length);
+
+    // Room in the send queue.
+    uint16_t sendSpace();
+
+private:
+friend class WebSocketServer;
+    EthernetClient client;
+    enum State {DISCONNECTED, HANDSHAKE, CONNECTED} state;
+    unsigned long m_since;      // millis() the client connected
+
+    // Takes a new client into this pool slot.
+    void attach(WebSocketServer *server, EthernetClient cli);
+
+    // Handle incoming data--the handshake, then up to one message.
+    void listen();
+
+    // Frame parser, fed a byte at a time as data arrives
+    enum Parse {P_OPCODE, P_LENGTH, P_LENGTH16, P_MASK, P_PAYLOAD} m_parse;
+    byte m_opcode;              // FIN and opcode of the current frame
+    uint16_t m_frameLength;
+    uint16_t m_framePos;
+    byte m_mask[4];
+    bool m_pong;                // ping payload going into m_ping
+    byte m_ping[WS_MAX_PING];
+
+    // Message being reassembled from fragments; the handshake uses the
+    // same space for its header line and key.
+    byte m_msgOpcode;           // 0: none
+    byte m_msgLength;
+    union {
+        char m_msgData[WS_MAX_MESSAGE + 1];
+        struct {
+            char line[WS_LINE_LEN];
+            char key[WS_KEY_LEN + 1];
+            byte lineLength;
+            byte headers;       // bit per required header seen
+        } m_hs;
+    };
+
+    // A sendStream() message is under way
+    bool m_streaming;
+
+    // Too slow to keep--dropped in the next listen(), not from inside a send
+    bool m_dropping;
+
+    // Send queue
+    byte m_txQueue[WS_TX_QUEUE];
+    uint16_t m_txHead;
+    uint16_t m_txCount;
+
+    // Reads header lines as they arrive; answers once they are all in.
+    void handshake();
+
+    // Checks a header line for the ones the handshake needs.
+    void headerLine();
+
+    // Discovers if the client's header is requesting an upgrade to a
+    // websocket connection, and answers it.
+    bool doHandshake();
+
+    // Feeds arrived bytes to the frame parser. Returns after a message
+    // is delivered, so other connections get their turn.
+    void getFrame();
+
+    // Frame header and payload parsed. Return false to stop parsing--a
+    // message was delivered, or the connection closed.
+    bool frameStart();
+    bool frameEnd();
+
+    // Queues a close frame with code and disconnects.
+    void sendClose(uint16_t code);
+
+    // Queues one frame: header with opcode and 7 or 16 bit length, then data.
+    bool sendFrame(byte opcode, const char *str, uint16_t length);
+
+    // Queue handling
+    void enqueue(const byte *data, uint16_t length);
+    bool flushQueue();
+    bool makeRoom(uint16_t length);
+
+    // Disconnect user gracefully.
+    void disconnectStream();
+};
+
 class WebSocketServer {
 public:
     // Constructor.
-    WebSocketServer(const char *urlPrefix = "/", int inPort = 1337, byte maxConnections = 4);
+    WebSocketServer(const char *urlPrefix = "/", int inPort = 1337, byte maxConnections = WS_MAX_CONNECTIONS);
     
     // Callback functions definition.
     typedef void DataCallback(WebSocket &socket, char *socketString, byte frameLength);
@@ -63,6 +212,7 @@ public:
     
     // Callbacks
     void registerDataCallback(DataCallback *callback);
+    void registerBinaryCallback(DataCallback *callback);  // else binary is refused
     void registerConnectCallback(Callback *callback);
     void registerDisconnectCallback(Callback *callback);
     
@@ -72,60 +222,32 @@ public:
     // Main listener for incoming data. Should be called from the loop.
     void listen();
 
+    // Writes what each client will take now of its send queue; the rest
+    // waits for the next listen().
+    void flush();
+
     // Connection count
     byte connectionCount();
 
     // Broadcast to all connected clients.
-    void send(char *str, byte length);
+    void send(const char *str, uint16_t length);
 
 private:
     EthernetServer m_server;
     const char *m_socket_urlPrefix;
-    int m_maxConnections;
-
-    byte m_connectionCount;
+    byte m_maxConnections;
+    byte m_next;                // connection served first in the next listen()
 
-    // Pointer array of clients:
-    WebSocket **m_connections;
+    // Connection pool--no heap
+    WebSocket m_connections[WS_MAX_CONNECTIONS];
 
 protected:
 friend class WebSocket;
     // Pointer to the callback function the user should provide
     DataCallback *onData;
+    DataCallback *onBinary;
     Callback *onConnect;
     Callback *onDisconnect;
 };
 
-class WebSocket {
-    WebSocketServer *m_server;
-
-public:
-    // Constructor.
-    WebSocket(WebSocketServer *server, EthernetClient cli);
-
-    // Are we connected?
-    bool isConnected();
-	
-    // Embeds data in frame and sends to client.
-    bool send(char *str, byte length);
-
-    // Handle incoming data.
-    void listen();
-
-private:
-    EthernetClient client;
-    enum State {DISCONNECTED, CONNECTED} state;
-
-    // Discovers if the client's header is requesting an upgrade to a
-    // websocket connection.
-    bool doHandshake();
-    
-    // Reads a frame from client. Returns false if user disconnects, 
-    // or unhandled frame is received. Server must then disconnect, or an error occurs.
-    bool getFrame();
-
-    // Disconnect user gracefully.
-    void disconnectStream();
-};
-
 #endif
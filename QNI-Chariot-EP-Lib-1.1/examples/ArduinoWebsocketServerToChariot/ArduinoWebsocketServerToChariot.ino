@@ -14,9 +14,18 @@
   response strings from Chariot or command input from the Serial Monitor are conveyed to the backend for
   processing. Some modifications have been made to "Websocket-Arduino, a simple websocket implementation
   for Arduino" (see its source code for copyright notices):
-    1.) Frames are limited to 125B. Data sent to websocket will be so-segmented.
+    1.) Frames may use 16 bit extended lengths and be fragmented. Responses are streamed to the
+        websocket as fragments as they arrive from Chariot.
     2.) In the WebsocketServer constructor, the port number used is 1337. This is also used by default in 
-        our websocket frontend. 
+        our websocket frontend.
+    3.) Binary frames are taken as requests in the sketch's compact binary format (see README). 
+
+  Limitation: Chariot's responses carry no request id, so they are matched to requests by order.
+  A request not answered CHARIOT_REQ_TIMEOUT_MILLIS after Chariot got to it (after the one before
+  it was answered) gets "5.04 Gateway Timeout", and the next response from Chariot is taken to be
+  its late answer and dropped. If that answer never comes, matching starts again once nothing has
+  arrived for another CHARIOT_REQ_TIMEOUT_MILLIS; until then a response may be dropped in its
+  place, and the requests after it answered one behind.
         
   by George Wayne, Qualia Networks  Incorporated
  */
@@ -35,14 +44,21 @@
 static bool debug = false;
 
 #define MAX_CHARIOT_CMD_LEN   (128-1)
-#define MAX_CHARIOT_IO_MILLIS (500)
-#define MAX_CONCURRENT_CHARIOT_MSGS (4)
-
-void coapResponse(WebSocket &socket);
+#define MAX_CHARIOT_IO_MILLIS (500)     // silence that ends a response early
+#define MAX_CONCURRENT_CHARIOT_MSGS (4)   // requests in flight to Chariot
+#define CHARIOT_REQ_TIMEOUT_MILLIS (30000)
+#define MAX_OBSERVES (4)                  // resources observed upstream at once
+
+void chariotRequest(WebSocket &socket, String &request, long tag);
+void observeLeave(int8_t n, int8_t slot);
+bool observeCancel(int8_t n);
+void observeFree(int8_t n);
+void reply(WebSocket &socket, long tag, const char *text);
+void chariotResponse();
 // Enable websocket debug tracing to Serial port. See Websocket.h.
 #define DEBUG
 
-// Here we define a maximum framelength to 125 bytes--see RFC 
+// Responses are streamed to the websocket in fragments of this size
 #define MAX_DATA_FRAME_LENGTH 125
 
 #include <WebSocket.h>
@@ -56,11 +72,77 @@ WebSocketServer wsServer;
 #define MAX_WEB_SOCKETS (4) // See <websocket.h>
 WebSocket *openSockets[MAX_WEB_SOCKETS]  = {NULL};
 
+/*
+ * Request broker. Chariot answers requests in the order it gets them and
+ * carries no request tag, so each request from a socket is queued here
+ * and the next response goes back to the socket at the head of the queue.
+ * Observe notifications ("TKN=") go to the sockets that have observed.
+ * A client may tag a command "#<n> ..."; its response then starts "#<n> ".
+ */
+typedef struct {
+  int8_t slot;          // openSockets slot of the requester, -1: gone
+  int8_t obs;           // observes[] entry it registers, -1: none
+  int8_t cancels;       // observes[] entry its GET cancels, -1: none
+  long tag;             // client's tag, -1: none
+  uint32_t started;
+} chariot_req_t;
+
+chariot_req_t inFlight[MAX_CONCURRENT_CHARIOT_MSGS];
+byte inFlightHead = 0, inFlightCount = 0;
+uint32_t headSince;       // when Chariot got to the head of inFlight
+byte lateResponses = 0;   // timed out requests whose answers may still come--dropped
+uint32_t lateSince;       // last timeout, or late answer dropped
+
+/*
+ * Observe fan-out. However many sockets observe a resource, there is one
+ * observe of it over the mesh, and each notification goes to them all.
+ * A plain GET of the resource cancels the upstream observe (as in RFC
+ * 7641), for every socket in it, so only the last one out sends one. The
+ * entry stays until that GET is answered: notifications still on their
+ * way then match it and go to no one.
+ */
+#define MAX_OBSERVE_LAST (48)             // longest notification kept for GETs
+
+typedef struct {
+  String resource;      // URL up to the '?', "": entry free
+  String token;         // Chariot's TKN, "": registration in flight
+  String last;          // latest notification less its token, "" if none or too long
+  byte sockets;         // bit per openSockets slot, 0: being cancelled
+  bool cancelled;       // its cancelling GET is on its way
+} observe_t;
+
+observe_t observes[MAX_OBSERVES];
+
+/*
+ * Binary mode. A socket that sends a binary request gets binary messages
+ * from then on, each a fixed header and then the payload as Chariot sent
+ * it, minus the status:
+ *   [type][id hi][id lo][CoAP code][content format][latency hi][latency lo]
+ * A request is [BIN_REQUEST][id hi][id lo] and the URL or command; its
+ * response carries the same id. The code is CoAP's (2.05 is 0x45), 0 if
+ * the response has none, and the latency is ms to its first byte.
+ */
+#define BIN_REQUEST      0x01
+#define BIN_RESPONSE     0x02
+#define BIN_NOTIFICATION 0x03
+#define BIN_HEADER_LEN   7
+
+byte binarySockets = 0;   // bit per openSockets slot
+
+int8_t socketSlot(WebSocket *ws_p) {
+  int i;
+  for (i = 0; i < MAX_WEB_SOCKETS; i++) {
+    if (openSockets[i] == ws_p)
+      return i;
+  }
+  return -1;
+}
+
 void onConnect(WebSocket &socket) {
   WebSocket *ws_p = (WebSocket *)&socket;
 
   int i;
-  for (i = 0; i < MAX_WEB_SOCKETS-1; i++) {
+  for (i = 0; i < MAX_WEB_SOCKETS; i++) {
     if (ws_p == openSockets[i]) {
       SerialMon.println(F("ERROR! Websocket connection cannot be opened--no available slots."));
       return; // we already have this one cached (ERR)
@@ -68,7 +150,7 @@ void onConnect(WebSocket &socket) {
   }
 
   // Plug socket into first open slot in connection table.
-  for (i = 0; i < MAX_WEB_SOCKETS-1; i++) {
+  for (i = 0; i < MAX_WEB_SOCKETS; i++) {
     if (openSockets[i] == NULL) {
       openSockets[i] = ws_p;
       SerialMon.print(F("Websocket connection opened = "));
@@ -102,14 +184,21 @@ void onData(WebSocket &socket, char* dataString, byte frameLength)
 
   // Simplify all comparisons, make all input lower case.
   chariotUrlOrCmd.toLowerCase();
+
+  // Client's correlation tag?
+  long tag = -1;
+  if (chariotUrlOrCmd.startsWith("#")) {
+    tag = chariotUrlOrCmd.substring(1).toInt();
+    chariotUrlOrCmd.remove(0, chariotUrlOrCmd.indexOf(' ') + 1);
+    chariotUrlOrCmd.trim();
+  }
   
  /**
   * process coap:// and coap:// URI's here
   */
   if (chariotUrlOrCmd.indexOf(F("coap")) != -1) {
     chariotUrlOrCmd += "\n\0";    // terminate for Chariot
-    ChariotClient.print(chariotUrlOrCmd);
-    coapResponse(socket);
+    chariotRequest(socket, chariotUrlOrCmd, tag);
   }
     
  /**
@@ -118,9 +207,7 @@ void onData(WebSocket &socket, char* dataString, byte frameLength)
   else if (chariotUrlOrCmd.indexOf(F("chariot")) != -1) {
     chariotUrlOrCmd.remove(0, 8); // remove "chariot/"
     chariotUrlOrCmd += "\n\0";    // terminate for Chariot
-
-    ChariotClient.print(chariotUrlOrCmd);
-    coapResponse(socket);
+    chariotRequest(socket, chariotUrlOrCmd, tag);
   }
 
   /**
@@ -133,14 +220,43 @@ void onData(WebSocket &socket, char* dataString, byte frameLength)
 
 }
 
+/*
+ * Binary request--answered in binary from now on.
+ */
+void onBinary(WebSocket &socket, char* data, byte frameLength) 
+{
+  int8_t slot = socketSlot(&socket);
+  
+  if ((slot == -1) || (frameLength < 3) || (data[0] != BIN_REQUEST)) {
+    SerialMon.println(F("Binary message dropped--not a request"));
+    return;
+  }
+  binarySockets |= 1 << slot;
+
+  // The request id is its tag
+  String tagged = "#" + String(((byte)data[1] << 8) | (byte)data[2]) + " " + String(data + 3);
+  onData(socket, (char *)tagged.c_str(), tagged.length());
+}
+
 void onDisconnect(WebSocket &socket) {
   // Find and remove socket in connection table.
   WebSocket *ws_p = &socket;
 
-  int i;
-  for (i = 0; i < MAX_WEB_SOCKETS-1; i++) {
+  int i, r;
+  for (i = 0; i < MAX_WEB_SOCKETS; i++) {
     if (openSockets[i] == ws_p) {
       openSockets[i] = NULL;
+      
+      // Its responses still in flight are dropped when they come
+      binarySockets &= ~(1 << i);
+      for (r = 0; r < MAX_OBSERVES; r++) {
+        if (observes[r].sockets & (1 << i))
+          observeLeave(r, i);
+      }
+      for (r = 0; r < MAX_CONCURRENT_CHARIOT_MSGS; r++) {
+        if (inFlight[r].slot == i)
+          inFlight[r].slot = -1;
+      }
       SerialMon.print(F("Websocket connection closed = "));
       SerialMon.println(i);
       return;
@@ -166,6 +282,7 @@ void setup()
 
   wsServer.registerConnectCallback(&onConnect);
   wsServer.registerDataCallback(&onData);
+  wsServer.registerBinaryCallback(&onBinary);
   wsServer.registerDisconnectCallback(&onDisconnect);  
   wsServer.begin();
   
@@ -174,42 +291,39 @@ void setup()
 }
 
 void loop() {
-  int more, msgNdx;
-  String responseStr[MAX_CONCURRENT_CHARIOT_MSGS];   
-  
+  int8_t n;
+
   /*
-   * asynchronous response(s) arrived?
+   * Response(s) or notification arrived?
    */
-   more = ChariotClient.available();
-   msgNdx = 0;
-   while (more && (msgNdx < MAX_CONCURRENT_CHARIOT_MSGS-1)) {
-      more = ChariotEP.coapResponseGet(responseStr[msgNdx++]);
-   }
-
-  if (msgNdx) {
-    int x;
-    for (x = 0; x < msgNdx; x++)
-    {
-      if (responseStr[x].indexOf("TKN=") != -1) {
-        SerialMon.print(F("OBS rcvd: "));
-        SerialMon.println(responseStr[x]);
-      }
-      
-      if (wsServer.connectionCount() > 0) {
-        int i;
-        WebSocket *ws_p;
-        char *response = (char *)responseStr[x].c_str();
-
-        for (i = 0; i < MAX_WEB_SOCKETS-1; i++) {
-          if (ws_p = openSockets[i]) {
-            ws_p->send(response, responseStr[x].length());
-          }
-        }
-      }
-      else {
-        SerialMon.println(responseStr[x]);
-      }
+  if (ChariotClient.available()) {
+    chariotResponse();
+  }
+
+  // Requests Chariot never answered
+  if (inFlightCount && (millis() - headSince > CHARIOT_REQ_TIMEOUT_MILLIS)) {
+    if (inFlight[inFlightHead].slot >= 0) {
+      reply(*openSockets[inFlight[inFlightHead].slot], inFlight[inFlightHead].tag, "5.04 Gateway Timeout\n");
     }
+    if (inFlight[inFlightHead].obs != -1)
+      observeFree(inFlight[inFlightHead].obs);      // never registered
+    else if (inFlight[inFlightHead].cancels != -1)
+      observeFree(inFlight[inFlightHead].cancels);
+    inFlightHead = (inFlightHead + 1) % MAX_CONCURRENT_CHARIOT_MSGS;
+    inFlightCount--;
+    lateResponses++;
+    lateSince = headSince = millis();
+  }
+  // Late answers that never came: match in order again
+  if (lateResponses && (millis() - lateSince > CHARIOT_REQ_TIMEOUT_MILLIS)) {
+    SerialMon.println(F("Late Chariot responses never came--resync"));
+    lateResponses = 0;
+  }
+
+  // Cancels that didn't fit in flight when the last observer left
+  for (n = 0; n < MAX_OBSERVES; n++) {
+    if (observes[n].resource.length() && !observes[n].sockets && !observes[n].cancelled)
+      observeCancel(n);
   }
   
   /* 
@@ -220,9 +334,8 @@ void loop() {
     ChariotEP.serialChariotCmd();
   }
   
-  // Should be called for each loop.
+  // Should be called for each loop--it never waits on a slow client.
   wsServer.listen();
-  delay(50);
 }
 
 /**
@@ -364,42 +477,384 @@ Serial.println(response);
 }
 
 /*
- * Process Chariot local and coap[s]:// responses
+ * Fill a binary header for a response that starts with text. Returns the
+ * length of its status ("2.05 CONTENT "), which the payload leaves out.
  */
-void coapResponse(WebSocket &socket) 
+byte binHeader(byte *header, byte type, long id, const char *text, byte len, uint32_t latency)
 {
-  String response = "";
-  uint32_t started, len = 0;
+  byte skip = 0, n;
+
+  if (id < 0)
+    id = 0;
+  if (latency > 0xffff)
+    latency = 0xffff;
+  header[0] = type;
+  header[1] = (id >> 8) & 0xff;
+  header[2] = id & 0xff;
+  header[3] = 0;
+  header[5] = (latency >> 8) & 0xff;
+  header[6] = latency & 0xff;
+  
+  if ((len >= 4) && isdigit(text[0]) && (text[1] == '.') && isdigit(text[2]) && isdigit(text[3])) {
+    header[3] = ((text[0] - '0') << 5) | ((text[2] - '0') * 10 + (text[3] - '0'));
+    for (skip = 4; (skip < len) && (text[skip] == ' '); skip++)
+      ;
+    // and the reason, if Chariot gave one
+    for (n = skip; (n < len) && (isupper(text[n]) || (text[n] == '_')); n++)
+      ;
+    if ((n > skip) && ((n == len) || (text[n] == ' '))) {
+      for (skip = n; (skip < len) && (text[skip] == ' '); skip++)
+        ;
+    }
+  }
+  
+  switch ((skip < len) ? text[skip] : 0) {
+    case '{':
+    case '[':
+      header[4] = APPLICATION_JSON;
+      break;
+    case '<':
+      header[4] = APPLICATION_LINK_FORMAT;
+      break;
+    default:
+      header[4] = TEXT_PLAIN;
+      break;
+  }
+  return skip;
+}
+
+// A response made here rather than by Chariot
+void reply(WebSocket &socket, long tag, const char *text)
+{
+  byte header[BIN_HEADER_LEN], len = strlen(text), skip;
+  int8_t slot = socketSlot(&socket);
+
+  if ((slot != -1) && (binarySockets & (1 << slot))) {
+    skip = binHeader(header, BIN_RESPONSE, tag, text, len, 0);
+    socket.sendStream((char *)header, BIN_HEADER_LEN, false, true);
+    socket.sendStream(text + skip, len - skip, true);
+  } else {
+    if (tag >= 0) {
+      String tagText = "#" + String(tag) + " ";
+      socket.sendStream(tagText.c_str(), tagText.length(), false);
+    }
+    socket.sendStream(text, len, true);
+  }
+}
+
+/*
+ * Queue a request for Chariot and send it on. Nothing waits for the
+ * response--chariotResponse() routes it when it comes. False if the
+ * queue is full.
+ */
+bool brokerSend(int8_t slot, String &request, long tag, int8_t obs, int8_t cancels)
+{
+  chariot_req_t *req;
+
+  if (inFlightCount == MAX_CONCURRENT_CHARIOT_MSGS)
+    return false;
+  req = &inFlight[(inFlightHead + inFlightCount) % MAX_CONCURRENT_CHARIOT_MSGS];
+  req->slot = slot;
+  req->obs = obs;
+  req->cancels = cancels;
+  req->tag = tag;
+  req->started = millis();
+  if (!inFlightCount)
+    headSince = req->started;
+  inFlightCount++;
+  ChariotClient.print(request);
+  return true;
+}
+
+// Token after "TKN=" in a response, "" if none
+String observeToken(const char *response)
+{
+  const char *p = strstr(response, "TKN=");
+  String token;
+
+  if (p) {
+    for (p += 4; isalnum(*p); p++)
+      token += *p;
+  }
+  return token;
+}
+
+// Observe of a resource, -1 if none. One being cancelled is as good as gone.
+int8_t observeFind(String &resource)
+{
+  int8_t n;
+  for (n = 0; n < MAX_OBSERVES; n++) {
+    if (observes[n].resource.length() && !observes[n].cancelled && (observes[n].resource == resource))
+      return n;
+  }
+  return -1;
+}
+
+// Observe a notification belongs to, -1 if none
+int8_t observeByToken(const char *response)
+{
+  String token = observeToken(response);
+  int8_t n;
+
+  for (n = 0; token.length() && (n < MAX_OBSERVES); n++) {
+    if (observes[n].token == token)
+      return n;
+  }
+  return -1;
+}
+
+void observeFree(int8_t n)
+{
+  int r;
+
+  observes[n].resource = "";
+  observes[n].token = "";
+  observes[n].last = "";
+  observes[n].sockets = 0;
+  observes[n].cancelled = false;
+  for (r = 0; r < MAX_CONCURRENT_CHARIOT_MSGS; r++) {
+    if (inFlight[r].obs == n)
+      inFlight[r].obs = -1;
+    if (inFlight[r].cancels == n)
+      inFlight[r].cancels = -1;
+  }
+}
+
+// Keep a whole notification, less its token, to answer GETs with
+void observeLast(int8_t n, const char *fragment, byte len, bool done)
+{
+  String token = "TKN=" + observes[n].token;
+  int at;
 
-  started = millis();
-  ChariotEP.coapResponseGet(response);
+  observes[n].last = "";
+  if (!done || (len > MAX_OBSERVE_LAST))
+    return;
+  observes[n].last = fragment;
+  if ((at = observes[n].last.indexOf(token)) != -1) {
+    observes[n].last.remove(at, token.length());
+    while ((at < (int)observes[n].last.length()) && (observes[n].last[at] == ' '))
+      observes[n].last.remove(at, 1);
+  }
+}
+
+/*
+ * Cancel observe n upstream. False if there's no room in flight yet;
+ * loop() tries again, and the entry keeps its notifications till then.
+ */
+bool observeCancel(int8_t n)
+{
+  String cancel = observes[n].resource + "?get\n";
+
+  if (!brokerSend(-1, cancel, -1, -1, n))
+    return false;
+  observes[n].cancelled = true;
+  return true;
+}
+
+// Socket in slot leaves observe n--the last one out cancels it upstream
+void observeLeave(int8_t n, int8_t slot)
+{
+  observes[n].sockets &= ~(1 << slot);
+  if ((observes[n].sockets == 0) && !observeCancel(n))
+    SerialMon.println(F("Observe cancel waits--too many requests in flight"));
+}
+
+/*
+ * A request from a socket. An observe of a resource already observed
+ * joins it rather than going over the mesh. A GET of an observed resource
+ * ends the socket's observe, if it had one; it goes upstream only from the
+ * last one out, and anyone else gets the latest notification.
+ */
+void chariotRequest(WebSocket &socket, String &request, long tag)
+{
+  int8_t slot = socketSlot(&socket), n = -1;
+  String resource;
+
+  if (inFlightCount == MAX_CONCURRENT_CHARIOT_MSGS) {
+    reply(socket, tag, "5.03 Service Unavailable: too many requests in flight\n");
+    return;
+  }
+  resource = request.substring(0, request.indexOf('?'));
   
-  if (response.length() > 0) {
-    char *response_ptr = (char *)response.c_str();
-    String responseTime = String(millis()-started) + "(ms)\n";
-
-    if (response.length() > MAX_DATA_FRAME_LENGTH) {
-      int len = response.length();
-      int next = MAX_DATA_FRAME_LENGTH;
-       
-     while (next > 0) {
-        socket.send(response_ptr, next);
-        SerialMon.print(F("Sending "));
-        SerialMon.print(next);
-        SerialMon.print(F(" bytes at "));
-        SerialMon.print((int)response_ptr, HEX);
-        SerialMon.println();
-        len -= next;
-        response_ptr += next;
-        next = min(len, MAX_DATA_FRAME_LENGTH);
-        if (len > 0) {
-          delay(100);
-        }
+  if (request.indexOf(F("?obs")) != -1) {
+    if ((n = observeFind(resource)) != -1) {
+      observes[n].sockets |= 1 << slot;
+      if (observes[n].token.length()) {
+        String joined = "2.05 TKN=" + observes[n].token + " (shared)\n";
+        reply(socket, tag, joined.c_str());
       }
+      // else the registration's response goes to all who joined
+      return;
+    }
+    for (n = 0; (n < MAX_OBSERVES) && observes[n].resource.length(); n++)
+      ;
+    if (n == MAX_OBSERVES) {
+      reply(socket, tag, "5.03 Service Unavailable: too many observes\n");
+      return;
+    }
+    observes[n].resource = resource;
+    observes[n].sockets = 1 << slot;
+  } else if ((request.indexOf(F("?get")) != -1) && ((n = observeFind(resource)) != -1)) {
+    observes[n].sockets &= ~(1 << slot);
+    if (observes[n].sockets) {
+      if (observes[n].last.length())
+        reply(socket, tag, observes[n].last.c_str());
+      else
+        reply(socket, tag, "5.03 Service Unavailable: observed, no value yet\n");
+      return;
+    }
+    observes[n].cancelled = true;   // this GET cancels it upstream
+    brokerSend(slot, request, tag, -1, n);
+    return;
+  }
+  brokerSend(slot, request, tag, n, -1);
+}
+
+/*
+ * Read up to a fragment of Chariot's response. Returns true when the
+ * "<<" that ends it has been read, or when Chariot has sent nothing for
+ * MAX_CHARIOT_IO_MILLIS--the response is cut short there, so a reply
+ * that never ends can't hold up loop().
+ */
+bool chariotRead(char *fragment, byte *len, bool *ltPending)
+{
+  unsigned long heard = millis();
+  int ch;
+
+  // A held back '<' may go out with the next char--leave room for both
+  *len = 0;
+  while (*len < MAX_DATA_FRAME_LENGTH - 1) {
+    if ((ch = ChariotClient.read()) == -1) {
+      if (millis() - heard < MAX_CHARIOT_IO_MILLIS)
+        continue;
+      if (*ltPending) {
+        *ltPending = false;
+        fragment[(*len)++] = '<';
+      }
+      SerialMon.println(F("Chariot response timed out--ended short"));
+      return true;
+    }
+    heard = millis();
+    if (ch == '<') {
+      if (*ltPending)
+        return true;        // "<<" ends the response
+      *ltPending = true;
+      continue;
+    }
+    if (*ltPending) {
+      *ltPending = false;
+      fragment[(*len)++] = '<';
+    }
+    fragment[(*len)++] = ch;
+  }
+  return false;
+}
+
+// Stream a fragment to each socket in targets (bit per openSockets slot)
+void sendTo(byte targets, const char *data, byte len, bool final)
+{
+  int i;
+  for (i = 0; i < MAX_WEB_SOCKETS; i++) {
+    if ((targets & (1 << i)) && openSockets[i]) {
+      openSockets[i]->sendStream(data, len, final);
+    }
+  }
+}
+
+/*
+ * Route Chariot's next response: a notification to the observers, any
+ * other response to the socket at the head of the in-flight queue. The
+ * response goes out in fragments as it comes off the Chariot channel, so
+ * it is never held whole; the first is read before anything is sent, to
+ * tell which kind it is.
+ */
+void chariotResponse() 
+{
+  char fragment[MAX_DATA_FRAME_LENGTH + 1];
+  char binary[BIN_HEADER_LEN + MAX_DATA_FRAME_LENGTH];
+  chariot_req_t *req = NULL;
+  bool ltPending = false, done, requester;
+  byte len, skip, targets = 0;
+  uint32_t total;
+  int8_t n;
+  int i;
+
+  done = chariotRead(fragment, &len, &ltPending);
+  fragment[len] = '\0';
+
+  // A notification, unless it is the response to an observe registration
+  n = observeByToken(fragment);
+  if ((n != -1) || (strstr(fragment, "TKN=") && !(inFlightCount && (inFlight[inFlightHead].obs != -1)))) {
+    SerialMon.print(F("OBS rcvd: "));
+    SerialMon.println(fragment);
+    if (n != -1) {
+      targets = observes[n].sockets;
+      observeLast(n, fragment, len, done);
+    }
+    // else not one we know, or any longer--it goes to no one
+  } else if (lateResponses) {
+    // The answer to a request already timed out--it goes to no one
+    SerialMon.print(F("Late response dropped: "));
+    SerialMon.println(fragment);
+    lateResponses--;
+    lateSince = headSince = millis();
+  } else if (inFlightCount) {
+    req = &inFlight[inFlightHead];
+    if (req->slot >= 0)
+      targets = 1 << req->slot;
+    if (req->obs != -1) {
+      targets |= observes[req->obs].sockets;
+      if (strstr(fragment, "TKN=")) {
+        observes[req->obs].token = observeToken(fragment);
+        observeLast(req->obs, fragment, len, done);
+      } else {
+        observeFree(req->obs);    // not registered
+      }
+    } else if (req->cancels != -1) {
+      observeFree(req->cancels);  // its notifications have stopped
+    }
+  } else {
+    // Unsolicited--everyone gets it
+    for (i = 0; i < MAX_WEB_SOCKETS; i++) {
+      if (openSockets[i])
+        targets |= 1 << i;
+    }
+  }
+
+  // The first fragment goes out behind each socket's header or tag
+  total = len;
+  for (i = 0; (len || !done) && (i < MAX_WEB_SOCKETS); i++) {
+    if (!(targets & (1 << i)) || !openSockets[i])
+      continue;
+    requester = req && (req->slot == i);
+    if (binarySockets & (1 << i)) {
+      skip = binHeader((byte *)binary, requester ? BIN_RESPONSE : BIN_NOTIFICATION, requester ? req->tag : 0,
+                       fragment, len, requester ? millis() - req->started : 0);
+      memcpy(binary + BIN_HEADER_LEN, fragment + skip, len - skip);
+      openSockets[i]->sendStream(binary, BIN_HEADER_LEN + len - skip, done, true);
     } else {
-      socket.send(response_ptr, response.length());
+      if (requester && (req->tag >= 0)) {
+        String tag = "#" + String(req->tag) + " ";
+        openSockets[i]->sendStream(tag.c_str(), tag.length(), false);
+      }
+      openSockets[i]->sendStream(fragment, len, done);
+    }
+  }
+  while (!done) {
+    done = chariotRead(fragment, &len, &ltPending);
+    sendTo(targets, fragment, len, done);
+    total += len;
+  }
+  if (targets == 0)
+    SerialMon.println(F("Chariot response dropped--no one to send it to"));
+  
+  if (req) {
+    if (total && (req->slot >= 0) && !(binarySockets & (1 << req->slot))) {
+      String responseTime = String(millis() - req->started) + "(ms)\n";
+      openSockets[req->slot]->send(responseTime.c_str(), responseTime.length());
     }
-    response_ptr = (char *)responseTime.c_str();
-    socket.send(response_ptr, responseTime.length());
+    inFlightHead = (inFlightHead + 1) % MAX_CONCURRENT_CHARIOT_MSGS;
+    inFlightCount--;
+    headSince = millis();
   }
 }
@@ -29,6 +29,11 @@
 #define SerialMon if(debug)Serial
 static bool debug;
 
+#define SURVEY_PERIOD_MS  80000UL   // a survey of all motes about every 80 sec.
+#define SURVEY_STEP_MS    50        // between requests to Chariot, within a survey
+
+void surveyStep();
+
 void setup() {  
   Serial.begin(9600);
   Serial.println(F("Serial port is active"));
@@ -38,85 +43,102 @@ void setup() {
   //---Put Arduino resources on the air---
   String location = "Mega-RHS-lab-bench";
   ChariotEP.begin(location);
+
+  //---survey from run(), one request to Chariot per step
+  ChariotEP.addTask(surveyStep, SURVEY_PERIOD_MS, 0);
   
   Serial.println(F("Setup complete."));
 }
 
-static uint32_t loops = 0;
-
 void loop() {
   
-  //---answer RESTful API calls to access sense and actuator resources automatically---
-  if (ChariotEP.available()) {
-   ChariotEP.process();
-  }
+  //---answer RESTful API calls to access sense and actuator resources automatically,
+  //   and step the survey
+  ChariotEP.run();
 
   //---type 'sys/help' to see available commands
   if (Serial.available()) {
     ChariotEP.serialChariotCmd();
   }
+}
 
-  //---approximately every 80 sec.
-  if ((++loops % 2000)==0)
-  {
-    String motes[MAX_MOTES];
-    uint8_t status;
-
-    SerialMon.println(F("\n@----------------------------------------------------------------------------------------------@"));
-    SerialMon.print(F("...loops="));
-    SerialMon.println(loops/2000);
-
-#if UNO_HOST==1
-    delay(50);
-#endif
-
-    status = ChariotEP.getMotes(motes);
-    if (status > 0 && status <= 10)
-    {
-      int i, x;
-      String resource = "sensors/tmp275-c";
-      String location = "location";
-      String response;
-      String opts = "";
-     
-#if UNO_HOST==1
-          delay(100);
-#endif     
-      for (i=0; i<status; i++)
-      {
-          SerialMon.print(F("...searching mote: ")); SerialMon.print(motes[i]);
-          SerialMon.print(F(" for ")); SerialMon.println(resource);
-
-          // Search for resource to see if temp sensor exists 
-          if (ChariotEP.coapSearchResources(motes[i], resource, response))
-          {
-            // Get location of mote[i]
-            delay(50); 
-            ChariotEP.coapRequest(COAP_GET, motes[i], location, TEXT_PLAIN, opts, response);
-            ChariotEP.strip_205_CONTENT(response);
-            SerialMon.print(response);
-            SerialMon.print(F("--->"));
-
-            // Get temp for mote[i] 
-            delay(50);
-            ChariotEP.coapRequest(COAP_GET, motes[i], resource, TEXT_PLAIN, opts, response);
-            ChariotEP.strip_205_CONTENT(response);
-            SerialMon.println(response);
-            SerialMon.println();
-          }
-          else {
-            SerialMon.print(F("...error: search error returned for mote: "));
-            SerialMon.println(motes[i]);
-          }
-#if UNO_HOST==1
-          delay(100);
-#endif
+/*
+ * A survey: find the visible motes, then for each with a temp sensor
+ * show its location and temperature. Each step makes one request and
+ * schedules the next, so run() keeps answering in between.
+ */
+#define SURVEY_MOTES      0
+#define SURVEY_SEARCH     1
+#define SURVEY_LOCATION   2
+#define SURVEY_TEMP       3
+
+static String motes[MAX_MOTES];
+static uint8_t moteCount, mote;
+static uint8_t surveyState = SURVEY_MOTES;
+static uint32_t surveys = 0;
+
+void surveyStep() {
+  String resource = "sensors/tmp275-c";
+  String location = "location";
+  String response;
+  String opts = "";
+  unsigned long next = SURVEY_STEP_MS;
+
+  switch (surveyState) {
+    case SURVEY_MOTES:
+      SerialMon.println(F("\n@----------------------------------------------------------------------------------------------@"));
+      SerialMon.print(F("...surveys="));
+      SerialMon.println(++surveys);
+      moteCount = ChariotEP.getMotes(motes);
+      if (moteCount > 0 && moteCount <= 10) {
+        mote = 0;
+        surveyState = SURVEY_SEARCH;
+      } else {
+        SerialMon.println(F("...no motes visible this pass."));
+        next = SURVEY_PERIOD_MS;
+      }
+      break;
+
+    case SURVEY_SEARCH:
+      SerialMon.print(F("...searching mote: ")); SerialMon.print(motes[mote]);
+      SerialMon.print(F(" for ")); SerialMon.println(resource);
+
+      // Search for resource to see if temp sensor exists 
+      if (ChariotEP.coapSearchResources(motes[mote], resource, response)) {
+        surveyState = SURVEY_LOCATION;
+        break;
+      }
+      SerialMon.print(F("...error: search error returned for mote: "));
+      SerialMon.println(motes[mote]);
+      // on to the next mote
+      if (++mote < moteCount)
+        break;
+      surveyState = SURVEY_MOTES;
+      next = SURVEY_PERIOD_MS;
+      break;
+
+    case SURVEY_LOCATION:
+      // Get location of mote
+      ChariotEP.coapRequest(COAP_GET, motes[mote], location, TEXT_PLAIN, opts, response);
+      ChariotEP.strip_205_CONTENT(response);
+      SerialMon.print(response);
+      SerialMon.print(F("--->"));
+      surveyState = SURVEY_TEMP;
+      break;
+
+    case SURVEY_TEMP:
+      // Get temp for mote 
+      ChariotEP.coapRequest(COAP_GET, motes[mote], resource, TEXT_PLAIN, opts, response);
+      ChariotEP.strip_205_CONTENT(response);
+      SerialMon.println(response);
+      SerialMon.println();
+      if (++mote < moteCount) {
+        surveyState = SURVEY_SEARCH;
+      } else {
+        surveyState = SURVEY_MOTES;
+        next = SURVEY_PERIOD_MS;
       }
-    }
-    else { 
-      SerialMon.println(F("...no motes visible this pass."));
-    }
+      break;
   }
-  delay(75);
+  ChariotEP.addTask(surveyStep, next, 0);
 }
-
@@ -29,6 +29,10 @@
   coap://chariot.c350e.local/arduino/digital?get&pin=13           -> digitalRead(13)           
   coap://chariot.c350e.local/arduino/analog?get&pin=5             -> analogRead(5)
   coap://chariot.c350e.local/arduino/analog?put&pin=13&val=128    -> analogWrite(2, 123) //set PWM duty cycle
+  coap://chariot.c350e.local/arduino/pins?get&d=all&a=all         -> read every pin in one round trip
+  coap://chariot.c350e.local/arduino/pins?put&set=7,13&clr=6      -> digitalWrite(7|13, HIGH), digitalWrite(6, LOW)
+  coap://chariot.c350e.local/arduino/port?get&port=b              -> read PINB
+  coap://chariot.c350e.local/arduino/watch?put&pin=2&edge=change  -> publish pin 2 changes on arduino/watch (observe it)
  * 
  * by George Wayne, Qualia Networks Incorporated
  */
@@ -48,21 +52,21 @@ void setup() {
   //---Put Arduino resources on the air---
   ChariotEP.begin();
   
+  //---With Chariot's serial output also jumpered to D2, take commands by
+  //   interrupt and sleep between them--run() does both
+  //ChariotEP.enableEventLine(2);
+  
   SerialMon.println(F("Setup complete."));
 }
 
 void loop() {
   
-  //---answer RESTful API calls automatically---
-  if (ChariotEP.available()) {
-   ChariotEP.process();
-  }
+  //---answer RESTful API calls automatically, then pin watch events etc.---
+  ChariotEP.run();
 
   //---type 'sys/help' for available
   if (Serial.available()) {
     ChariotEP.serialChariotCmd();
   }
-  
-  delay(50);
 }
 
@@ -78,9 +78,7 @@ void loop() {
    * Answer remote RESTful GET, PUT, DELETE, OBSERVE API calls
    * transparently.
    */
-  if (ChariotEP.available()) {
-   ChariotEP.process();
-  }
+  ChariotEP.run();  // also keeps the TMP275 reading current
 
   /* 
    *  Filter your own inputs first--pass everthing else here.
@@ -100,7 +98,6 @@ void loop() {
       ChariotEP.triggerResourceEvent(eventHandle, triggeredVal, true); 
     }
   }
-  delay(50);
 }
 
 /*
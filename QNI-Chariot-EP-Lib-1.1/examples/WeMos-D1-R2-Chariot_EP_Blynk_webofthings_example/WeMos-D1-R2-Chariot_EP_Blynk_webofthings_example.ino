@@ -38,15 +38,14 @@
 
 #include <ESP8266WiFi.h>
 #include <BlynkSimpleEsp8266.h>
-#include <SimpleTimer.h>
 
 WidgetLED led1(V10);
 WidgetLED led2(V16);
-SimpleTimer timer;
 
 extern void blinkLedWidget();
 extern void updateTempDisplay();
 extern void widgetServiceTimer();
+extern void serialCmdTask();
 
 static uint8_t ledPin = D3;
 static int sliderVal = 0L;
@@ -56,6 +55,7 @@ static int sampleCountDn;
 static int sleepTimeSecs;
 static int samplesPerSleep;
 
+static bool serialCmdPending = false;
 static bool tempButton = false;
 static bool gpsButton = false;
 static bool accelButton = false;
@@ -92,7 +92,7 @@ void setup() {
 
   pinMode(ledPin, OUTPUT);     // Initialize the LED_BUILTIN pin as an output
   timerCountDn = sliderVal;
-  timer.setInterval(1000L, widgetServiceTimer); // Run every sec. Slider val determines interval.
+  ChariotEP.addTask(widgetServiceTimer, 1000L, 1000L); // Run every sec from run(). Slider val determines interval.
   SerialMon.println("Connected to Blynk Cloud!");
 }
 
@@ -383,22 +383,26 @@ void loop() {
    * Answer remote RESTful GET, PUT, DELETE, OBSERVE API calls
    * transparently.
    */
-  if (ChariotEP.available()) {
-   ChariotEP.process();
-  }
+  ChariotEP.run();  // also runs widgetServiceTimer() every second
 
   /* 
    *  Filter your own inputs first--pass everthing else here.
    *   --try typing 'sys/help' into the Serial window
    */
-  if (debug && Serial.available()) {
-    delay(50); // ESP8266 sending partial commands off to Chariot--slow it down
-    ChariotEP.serialChariotCmd();
+  if (debug && Serial.available() && !serialCmdPending) {
+    // ESP8266 sending partial commands off to Chariot--let the rest arrive first
+    serialCmdPending = (ChariotEP.addTask(serialCmdTask, 50, 0) >= 0);
   }
   
   /*
    * Run Blynk
    */
   Blynk.run();
-  timer.run();
+}
+
+// A command typed into the Serial window, 50ms after it started arriving
+void serialCmdTask()
+{
+  ChariotEP.serialChariotCmd();
+  serialCmdPending = false;
 }
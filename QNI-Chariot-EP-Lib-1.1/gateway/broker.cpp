@@ -0,0 +1,440 @@
+/*
+ * Chariot gateway: the serial link and the request broker.
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include "gateway.h"
+#include "../coap-constants.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+uint64_t nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+std::string tokenOf(const std::string &text)
+{
+	size_t at = text.find("TKN="), end;
+
+	if (at == std::string::npos)
+		return "";
+	for (end = at + 4; end < text.size() && isalnum((unsigned char)text[end]); end++)
+		;
+	return text.substr(at + 4, end - at - 4);
+}
+
+std::string valueOf(const std::string &text, size_t skip)
+{
+	std::string value = text.substr(skip), token = tokenOf(text);
+	size_t at, e;
+
+	if (!token.empty() && (at = value.find("TKN=" + token)) != std::string::npos) {
+		e = value.find_first_not_of(' ', at + 4 + token.size());
+		value.erase(at, e == std::string::npos ? std::string::npos : e - at);
+	}
+	while (!value.empty() && value[value.size() - 1] == ' ')
+		value.erase(value.size() - 1);
+	return value;
+}
+
+size_t binHeader(uint8_t *header, uint8_t type, long id, const std::string &text, unsigned latencyMs)
+{
+	size_t skip = 0, n, len = text.size();
+
+	if (id < 0)
+		id = 0;
+	if (latencyMs > 0xffff)
+		latencyMs = 0xffff;
+	header[0] = type;
+	header[1] = (id >> 8) & 0xff;
+	header[2] = id & 0xff;
+	header[3] = 0;
+	header[5] = (latencyMs >> 8) & 0xff;
+	header[6] = latencyMs & 0xff;
+
+	if (len >= 4 && isdigit((unsigned char)text[0]) && text[1] == '.' &&
+	    isdigit((unsigned char)text[2]) && isdigit((unsigned char)text[3])) {
+		header[3] = ((text[0] - '0') << 5) | ((text[2] - '0') * 10 + (text[3] - '0'));
+		for (skip = 4; skip < len && text[skip] == ' '; skip++)
+			;
+		// and the reason, if Chariot gave one
+		for (n = skip; n < len && (isupper((unsigned char)text[n]) || text[n] == '_'); n++)
+			;
+		if (n > skip && (n == len || text[n] == ' ')) {
+			for (skip = n; skip < len && text[skip] == ' '; skip++)
+				;
+		}
+	}
+
+	switch (skip < len ? text[skip] : 0) {
+	case '{':
+	case '[':
+		header[4] = APPLICATION_JSON;
+		break;
+	case '<':
+		header[4] = APPLICATION_LINK_FORMAT;
+		break;
+	default:
+		header[4] = TEXT_PLAIN;
+		break;
+	}
+	return skip;
+}
+
+/*---------------------------------------------------------------------------*/
+ChariotLink::ChariotLink() : linkFd(-1), ltPending(false)
+{
+}
+
+ChariotLink::~ChariotLink()
+{
+	if (linkFd != -1)
+		close(linkFd);
+}
+
+static speed_t baudRate(int baud)
+{
+	switch (baud) {
+	case 9600:   return B9600;
+	case 19200:  return B19200;
+	case 38400:  return B38400;
+	case 57600:  return B57600;
+	case 115200: return B115200;
+	default:     return B0;
+	}
+}
+
+bool ChariotLink::open(const char *tty, int baud)
+{
+	struct termios tio;
+	speed_t speed = baudRate(baud);
+
+	if (speed == B0) {
+		fprintf(stderr, "%s: unsupported baud rate %d\n", tty, baud);
+		return false;
+	}
+	linkFd = ::open(tty, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (linkFd == -1) {
+		fprintf(stderr, "%s: %s\n", tty, strerror(errno));
+		return false;
+	}
+	ttyName = tty;
+
+	// Raw 8N1, as the Arduino's serial port
+	if (tcgetattr(linkFd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tio.c_cflag &= ~CRTSCTS;
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+		tcsetattr(linkFd, TCSANOW, &tio);
+	}
+	return true;
+}
+
+void ChariotLink::send(const std::string &line)
+{
+	txBuf += line;
+	if (line.empty() || line[line.size() - 1] != '\n')
+		txBuf += '\n';
+}
+
+bool ChariotLink::flush()
+{
+	ssize_t n;
+
+	while (!txBuf.empty()) {
+		n = write(linkFd, txBuf.data(), txBuf.size());
+		if (n > 0) {
+			txBuf.erase(0, n);
+		} else if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+			break;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ChariotLink::readable(std::vector<std::string> &responses)
+{
+	char buf[512];
+	ssize_t n, i;
+	size_t b, e;
+
+	n = read(linkFd, buf, sizeof(buf));
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+		return false;
+
+	for (i = 0; i < n; i++) {
+		if (buf[i] == '<') {
+			if (!ltPending) {
+				ltPending = true;
+				continue;
+			}
+			// "<<" ends the response
+			ltPending = false;
+			for (b = 0; b < rxBuf.size() && isspace((unsigned char)rxBuf[b]); b++)
+				;
+			for (e = rxBuf.size(); e > b && isspace((unsigned char)rxBuf[e - 1]); e--)
+				;
+			responses.push_back(rxBuf.substr(b, e - b));
+			rxBuf.clear();
+			continue;
+		}
+		if (ltPending) {
+			ltPending = false;
+			rxBuf += '<';
+		}
+		rxBuf += buf[i];
+	}
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+Broker::Broker(ChariotLink &link, Sink &sink) : link(link), sink(sink)
+{
+}
+
+// Resource a request is for--its URL up to the '?'
+static std::string resourceOf(const std::string &line)
+{
+	return line.substr(0, line.find('?'));
+}
+
+// A notification as the answer to a GET
+static std::string withoutToken(const std::string &text)
+{
+	std::string token = tokenOf(text), out = text;
+	size_t at = token.empty() ? std::string::npos : out.find("TKN=" + token);
+
+	if (at != std::string::npos)
+		out.erase(at, std::min(out.find_first_not_of(' ', at + 4 + token.size()), out.size()) - at);
+	return out;
+}
+
+bool Broker::request(uint32_t client, long tag, const std::string &line)
+{
+	std::string resource = resourceOf(line);
+	std::map<std::string, Observe>::iterator obs;
+	Request get;
+
+	if (waitQ.size() >= GW_MAX_WAITING)
+		return false;
+
+	if (line.find("?obs") != std::string::npos) {
+		obs = observes.find(resource);
+		if (obs != observes.end()) {
+			// Already observed upstream--join it
+			obs->second.clients.insert(client);
+			if (!obs->second.last.empty())
+				sink.deliver(client, tag, obs->second.last, 0, false);
+			// else the registration's response goes to all who joined
+			return true;
+		}
+		observes[resource].clients.insert(client);
+		enqueue(client, tag, line, resource);
+		return true;
+	}
+
+	obs = observes.find(resource);
+	if (line.find("?get") != std::string::npos && obs != observes.end()) {
+		// A GET cancels the observe upstream, for everyone in it. Only the
+		// last one out sends it; anyone else is answered from the observe.
+		obs->second.clients.erase(client);
+		if (obs->second.clients.empty()) {
+			forget(resource);
+			enqueue(client, tag, line, "");
+		} else if (!obs->second.last.empty()) {
+			sink.deliver(client, tag, withoutToken(obs->second.last), 0, false);
+		} else {
+			get.client = client;
+			get.tag = tag;
+			get.line = line;
+			get.arrived = nowMs();
+			obs->second.gets.push_back(get);
+		}
+		return true;
+	}
+	enqueue(client, tag, line, "");
+	return true;
+}
+
+void Broker::enqueue(uint32_t client, long tag, const std::string &line, const std::string &observe)
+{
+	Request req;
+
+	req.client = client;
+	req.tag = tag;
+	req.line = line;
+	req.observe = observe;
+	req.arrived = nowMs();
+	waitQ.push_back(req);
+	dispatch();
+}
+
+// Moves waiting requests on to Chariot while there's room
+void Broker::dispatch()
+{
+	while (!waitQ.empty() && inFlight.size() < GW_MAX_IN_FLIGHT) {
+		inFlight.push_back(waitQ.front());
+		waitQ.pop_front();
+		inFlight.back().sent = nowMs();
+		link.send(inFlight.back().line);
+	}
+}
+
+void Broker::leave(uint32_t client)
+{
+	std::deque<Request>::iterator r;
+	std::vector<Request>::iterator g;
+	std::map<std::string, Observe>::iterator obs, next;
+
+	// Its responses still in flight are dropped when they come
+	for (r = inFlight.begin(); r != inFlight.end(); ++r) {
+		if (r->client == client)
+			r->client = 0;
+	}
+	for (r = waitQ.begin(); r != waitQ.end(); ) {
+		if (r->client == client && r->observe.empty())
+			r = waitQ.erase(r);
+		else
+			++r;
+	}
+	for (obs = observes.begin(); obs != observes.end(); obs = next) {
+		next = obs;
+		++next;
+		for (g = obs->second.gets.begin(); g != obs->second.gets.end(); ) {
+			if (g->client == client)
+				g = obs->second.gets.erase(g);
+			else
+				++g;
+		}
+		unobserve(obs->first, client);
+	}
+}
+
+// Client leaves an observe--the last one out cancels it upstream
+void Broker::unobserve(std::string resource, uint32_t client)
+{
+	std::map<std::string, Observe>::iterator obs = observes.find(resource);
+
+	if (obs == observes.end() || !obs->second.clients.erase(client) || !obs->second.clients.empty())
+		return;
+	forget(resource);
+	enqueue(0, -1, resource + "?get", "");
+}
+
+void Broker::forget(const std::string &resource)
+{
+	std::map<std::string, Observe>::iterator obs = observes.find(resource);
+	std::deque<Request>::iterator r;
+	std::vector<Request> gets;
+	size_t i;
+
+	if (obs == observes.end())
+		return;
+	if (!obs->second.token.empty())
+		tokens.erase(obs->second.token);
+	gets.swap(obs->second.gets);
+	observes.erase(obs);
+	// GETs that waited on it can go upstream now
+	for (i = 0; i < gets.size(); i++)
+		enqueue(gets[i].client, gets[i].tag, gets[i].line, "");
+
+	// A registration still under way registers nothing now
+	for (r = inFlight.begin(); r != inFlight.end(); ++r) {
+		if (r->observe == resource)
+			r->observe.clear();
+	}
+	for (r = waitQ.begin(); r != waitQ.end(); ++r) {
+		if (r->observe == resource)
+			r->observe.clear();
+	}
+}
+
+void Broker::response(const std::string &text)
+{
+	std::string token = tokenOf(text);
+	std::map<std::string, std::string>::iterator tok = tokens.find(token);
+	std::map<std::string, Observe>::iterator obs;
+	std::set<uint32_t>::iterator c;
+	Request req;
+	unsigned latency;
+	size_t i;
+
+	// A notification, unless it is the response to an observe registration
+	if (tok != tokens.end() ||
+	    (!token.empty() && !(!inFlight.empty() && !inFlight.front().observe.empty()))) {
+		if (tok == tokens.end()) {
+			fprintf(stderr, "%s: notification for no observe: %s\n", link.name().c_str(), text.c_str());
+			return;
+		}
+		obs = observes.find(tok->second);
+		obs->second.last = text;
+		sink.sample(tok->second, text);
+		for (c = obs->second.clients.begin(); c != obs->second.clients.end(); ++c)
+			sink.deliver(*c, -1, text, 0, true);
+		return;
+	}
+
+	if (inFlight.empty()) {
+		fprintf(stderr, "%s: %s\n", link.name().c_str(), text.c_str());
+		return;
+	}
+	req = inFlight.front();
+	inFlight.pop_front();
+	latency = nowMs() - req.arrived;
+	if (req.line.find("?get") != std::string::npos || req.line.find("?obs") != std::string::npos)
+		sink.sample(resourceOf(req.line), text);
+
+	if (!req.observe.empty() && (obs = observes.find(req.observe)) != observes.end()) {
+		if (!token.empty()) {
+			obs->second.token = token;
+			tokens[token] = req.observe;
+			obs->second.last = text;
+		}
+		for (c = obs->second.clients.begin(); c != obs->second.clients.end(); ++c) {
+			if (*c != req.client)
+				sink.deliver(*c, -1, text, 0, true);
+		}
+		for (i = 0; i < obs->second.gets.size(); i++)
+			sink.deliver(obs->second.gets[i].client, obs->second.gets[i].tag, withoutToken(text),
+			             nowMs() - obs->second.gets[i].arrived, false);
+		obs->second.gets.clear();
+		if (token.empty())
+			forget(req.observe);	// not registered
+	}
+	if (req.client)
+		sink.deliver(req.client, req.tag, text, latency, false);
+	dispatch();
+}
+
+void Broker::tick(uint64_t now)
+{
+	Request req;
+
+	// Requests Chariot never answered
+	while (!inFlight.empty() && now - inFlight.front().sent > GW_REQ_TIMEOUT_MS) {
+		req = inFlight.front();
+		inFlight.pop_front();
+		if (!req.observe.empty())
+			forget(req.observe);
+		if (req.client)
+			sink.deliver(req.client, req.tag, "5.04 Gateway Timeout", now - req.arrived, false);
+	}
+	dispatch();
+}
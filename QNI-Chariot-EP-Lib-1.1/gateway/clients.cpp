@@ -0,0 +1,405 @@
+/*
+ * Chariot gateway: client connections, raw TCP and WebSocket (RFC 6455).
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include "gateway.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define WS_GUID             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_HANDSHAKE    8192
+
+// Close codes (RFC 6455, 7.4.1)
+#define WS_CLOSE_NORMAL     1000
+#define WS_CLOSE_PROTOCOL   1002
+#define WS_CLOSE_TOO_BIG    1009
+
+/*---------------------------------------------------------------------------*/
+/*
+ * SHA-1 and base64, for the handshake's Sec-WebSocket-Accept only.
+ */
+static uint32_t rol(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static void sha1(const std::string &in, uint8_t digest[20])
+{
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	std::string m = in;
+	uint64_t bits = (uint64_t)in.size() * 8;
+	size_t blk;
+	int i;
+
+	m += (char)0x80;
+	while (m.size() % 64 != 56)
+		m += (char)0;
+	for (i = 7; i >= 0; i--)
+		m += (char)(bits >> (i * 8));
+
+	for (blk = 0; blk < m.size(); blk += 64) {
+		for (i = 0; i < 16; i++) {
+			w[i] = (uint32_t)(uint8_t)m[blk + i * 4] << 24 | (uint32_t)(uint8_t)m[blk + i * 4 + 1] << 16 |
+			       (uint32_t)(uint8_t)m[blk + i * 4 + 2] << 8 | (uint8_t)m[blk + i * 4 + 3];
+		}
+		for (i = 16; i < 80; i++)
+			w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+		for (i = 0; i < 80; i++) {
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			t = rol(a, 5) + f + e + k + w[i];
+			e = d; d = c; c = rol(b, 30); b = a; a = t;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+	}
+	for (i = 0; i < 20; i++)
+		digest[i] = h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+static std::string base64(const uint8_t *data, size_t len)
+{
+	static const char abc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	uint32_t v;
+	size_t i;
+
+	for (i = 0; i < len; i += 3) {
+		v = data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0) | (i + 2 < len ? data[i + 2] : 0);
+		out += abc[v >> 18];
+		out += abc[(v >> 12) & 0x3f];
+		out += i + 1 < len ? abc[(v >> 6) & 0x3f] : '=';
+		out += i + 2 < len ? abc[v & 0x3f] : '=';
+	}
+	return out;
+}
+
+/*---------------------------------------------------------------------------*/
+Conn::Conn(Gateway &gw, int fd, bool websocket) :
+	gw(gw), fd(fd), websocket(websocket), open(!websocket), binary(false),
+	closing(false), wantOut(false), msgOpcode(0)
+{
+}
+
+Conn::~Conn()
+{
+	if (fd != -1)
+		close(fd);
+}
+
+void Conn::event(uint32_t events)
+{
+	char buf[4096];
+	ssize_t n;
+	bool eof = false;
+
+	if (events & EPOLLOUT)
+		flush();
+	if (fd != -1 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+		for (;;) {
+			n = read(fd, buf, sizeof(buf));
+			if (n > 0) {
+				if (!closing)
+					rx.append(buf, n);
+				continue;
+			}
+			if (n == -1 && errno == EINTR)
+				continue;
+			eof = !(n == -1 && errno == EAGAIN);
+			break;
+		}
+		if (!websocket)
+			lines();
+		else if (!open)
+			handshake();
+		if (open && websocket)
+			frames();
+		// Whatever it asked is answered to no one
+		if (eof)
+			shutdown();
+	}
+	if (closing)
+		flush();
+}
+
+// Raw TCP: a request per line
+void Conn::lines()
+{
+	size_t nl;
+
+	while (!closing && (nl = rx.find('\n')) != std::string::npos) {
+		std::string line = rx.substr(0, nl);
+		rx.erase(0, nl + 1);
+		gw.request(*this, line, -1);
+	}
+	if (rx.size() > GW_MAX_REQUEST) {
+		send("4.13 Request Entity Too Large<<\n");
+		closing = true;
+		rx.clear();
+	}
+}
+
+void Conn::handshake()
+{
+	size_t end = rx.find("\r\n\r\n"), b, e, colon;
+	std::string key, name, value, upgrade;
+	uint8_t digest[20];
+
+	if (end == std::string::npos) {
+		if (rx.size() > WS_MAX_HANDSHAKE)
+			shutdown();
+		return;
+	}
+	for (b = rx.find("\r\n") + 2; b < end; b = e + 2) {
+		e = rx.find("\r\n", b);
+		colon = rx.find(':', b);
+		if (colon == std::string::npos || colon > e)
+			continue;
+		name = rx.substr(b, colon - b);
+		for (size_t i = 0; i < name.size(); i++)
+			name[i] = tolower((unsigned char)name[i]);
+		value = rx.substr(colon + 1, e - colon - 1);
+		value.erase(0, value.find_first_not_of(' '));
+		value.erase(value.find_last_not_of(' ') + 1);
+		if (name == "sec-websocket-key")
+			key = value;
+		else if (name == "upgrade")
+			upgrade = value;
+	}
+	rx.erase(0, end + 4);
+
+	if (key.empty() || strcasecmp(upgrade.c_str(), "websocket") != 0) {
+		send("HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n");
+		closing = true;
+		return;
+	}
+	sha1(key + WS_GUID, digest);
+	send("HTTP/1.1 101 Switching Protocols\r\n"
+	     "Upgrade: websocket\r\n"
+	     "Connection: Upgrade\r\n"
+	     "Sec-WebSocket-Accept: " + base64(digest, sizeof(digest)) + "\r\n\r\n");
+	open = true;
+}
+
+void Conn::frames()
+{
+	uint8_t opcode, closeCode[2];
+	uint64_t length;
+	size_t header;
+	const uint8_t *p;
+	std::string payload;
+
+	while (!closing && rx.size() >= 2) {
+		p = (const uint8_t *)rx.data();
+		opcode = p[0] & 0x0f;
+		length = p[1] & 0x7f;
+		header = 2;
+		if (!(p[1] & 0x80)) {
+			// Clients must mask
+			closeCode[0] = WS_CLOSE_PROTOCOL >> 8;
+			closeCode[1] = WS_CLOSE_PROTOCOL & 0xff;
+			frame(0x08, std::string((char *)closeCode, 2));
+			closing = true;
+			break;
+		}
+		if (length == 126) {
+			if (rx.size() < 4)
+				break;
+			length = p[2] << 8 | p[3];
+			header = 4;
+		} else if (length == 127) {
+			if (rx.size() < 10)
+				break;
+			length = 0;
+			for (int i = 0; i < 8; i++)
+				length = length << 8 | p[2 + i];
+			header = 10;
+		}
+		if (length > GW_MAX_REQUEST) {
+			closeCode[0] = WS_CLOSE_TOO_BIG >> 8;
+			closeCode[1] = WS_CLOSE_TOO_BIG & 0xff;
+			frame(0x08, std::string((char *)closeCode, 2));
+			closing = true;
+			break;
+		}
+		if (rx.size() < header + 4 + length)
+			break;
+
+		payload = rx.substr(header + 4, length);
+		for (size_t i = 0; i < payload.size(); i++)
+			payload[i] ^= p[header + (i % 4)];
+		bool fin = p[0] & 0x80;
+		rx.erase(0, header + 4 + length);
+
+		switch (opcode) {
+		case 0x08:      // close--answer with close
+			frame(0x08, payload.substr(0, 2));
+			closing = true;
+			break;
+		case 0x09:      // ping
+			frame(0x0a, payload);
+			break;
+		case 0x0a:      // pong
+			break;
+		default:
+			// Data: the first fragment has the opcode, the rest are continuations
+			if (opcode != 0x00) {
+				msgOpcode = opcode;
+				msg.clear();
+			}
+			msg += payload;
+			if (msg.size() > GW_MAX_REQUEST) {
+				closeCode[0] = WS_CLOSE_TOO_BIG >> 8;
+				closeCode[1] = WS_CLOSE_TOO_BIG & 0xff;
+				frame(0x08, std::string((char *)closeCode, 2));
+				closing = true;
+				break;
+			}
+			if (fin) {
+				message(msgOpcode, msg);
+				msg.clear();
+			}
+			break;
+		}
+	}
+}
+
+void Conn::message(uint8_t opcode, const std::string &data)
+{
+	if (opcode == 0x01) {
+		gw.request(*this, data, -1);
+	} else if (opcode == 0x02 && data.size() >= 3 && data[0] == BIN_REQUEST) {
+		// Binary request--answered in binary from now on
+		binary = true;
+		gw.request(*this, data.substr(3), (uint8_t)data[1] << 8 | (uint8_t)data[2]);
+	}
+}
+
+void Conn::frame(uint8_t opcode, const std::string &payload)
+{
+	std::string header;
+	size_t len = payload.size();
+	int i;
+
+	header += (char)(0x80 | opcode);
+	if (len < 126) {
+		header += (char)len;
+	} else if (len < 0x10000) {
+		header += (char)126;
+		header += (char)(len >> 8);
+		header += (char)(len & 0xff);
+	} else {
+		header += (char)127;
+		for (i = 7; i >= 0; i--)
+			header += (char)((uint64_t)len >> (i * 8));
+	}
+	send(header + payload);
+}
+
+void Conn::deliver(long tag, const std::string &text, unsigned latencyMs, bool notification)
+{
+	std::string tagged = (tag >= 0 && !binary) ? "#" + std::to_string(tag) + " " + text : text;
+	uint8_t header[BIN_HEADER_LEN];
+	size_t skip;
+	char ms[16];
+
+	if (!websocket) {
+		send(tagged + "<<\n");
+	} else if (binary) {
+		skip = binHeader(header, notification ? BIN_NOTIFICATION : BIN_RESPONSE, tag, text, latencyMs);
+		frame(0x02, std::string((char *)header, BIN_HEADER_LEN) + text.substr(skip));
+	} else {
+		// As the bridge: the response, then its time
+		frame(0x01, tagged);
+		if (!notification) {
+			snprintf(ms, sizeof(ms), "%u(ms)\n", latencyMs);
+			frame(0x01, ms);
+		}
+	}
+}
+
+void Conn::send(const std::string &data)
+{
+	if (fd == -1)
+		return;
+	tx += data;
+	if (tx.size() > GW_MAX_TX) {
+		fprintf(stderr, "client %u: too far behind, dropped\n", id());
+		shutdown();
+		return;
+	}
+	flush();
+}
+
+void Conn::flush()
+{
+	ssize_t n;
+
+	while (!tx.empty()) {
+		n = write(fd, tx.data(), tx.size());
+		if (n > 0) {
+			tx.erase(0, n);
+		} else if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && errno == EAGAIN) {
+			break;
+		} else {
+			shutdown();
+			return;
+		}
+	}
+	if (tx.empty() && closing) {
+		shutdown();
+		return;
+	}
+	if (wantOut != !tx.empty()) {
+		wantOut = !tx.empty();
+		gw.watch(fd, this, EPOLLIN | (wantOut ? (uint32_t)EPOLLOUT : 0), false);
+	}
+}
+
+void Conn::shutdown()
+{
+	if (fd == -1)
+		return;
+	gw.unwatch(fd);
+	close(fd);
+	fd = -1;
+	closing = true;
+	gw.closed(*this);
+}
+
+/*---------------------------------------------------------------------------*/
+void Listener::event(uint32_t)
+{
+	int cfd, one = 1;
+
+	while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		gw.accepted(cfd, websocket);
+	}
+	if (errno != EAGAIN && errno != EINTR)
+		perror("accept");
+}
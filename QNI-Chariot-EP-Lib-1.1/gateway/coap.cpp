@@ -0,0 +1,709 @@
+/*
+ * Chariot gateway: CoAP over UDP.
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include "coap.h"
+#include "../coap-constants.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define COAP_VERSION            1
+#define COAP_PAYLOAD_MARKER     0xFF
+#define COAP_CODE(c, d)         (((c) << 5) | (d))
+#define REQUEST_INCOMPLETE_4_08 COAP_CODE(4, 8)     // not in coap-constants.h
+
+/*---------------------------------------------------------------------------*/
+// An option's delta or length, with its extended bytes
+static bool optionNibble(unsigned nibble, const uint8_t *&p, const uint8_t *end, unsigned &value)
+{
+	if (nibble < 13) {
+		value = nibble;
+	} else if (nibble == 13) {
+		if (p + 1 > end)
+			return false;
+		value = 13 + p[0];
+		p += 1;
+	} else if (nibble == 14) {
+		if (p + 2 > end)
+			return false;
+		value = 269 + (p[0] << 8 | p[1]);
+		p += 2;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool CoapMessage::parse(const uint8_t *data, size_t len)
+{
+	const uint8_t *p = data + COAP_HEADER_LEN, *end = data + len;
+	unsigned tkl, delta, olen, number = 0;
+
+	if (len < COAP_HEADER_LEN || (data[0] & COAP_HEADER_VERSION_MASK) >> COAP_HEADER_VERSION_POSITION != COAP_VERSION)
+		return false;
+	type = (data[0] & COAP_HEADER_TYPE_MASK) >> COAP_HEADER_TYPE_POSITION;
+	tkl = data[0] & COAP_HEADER_TOKEN_LEN_MASK;
+	code = data[1];
+	mid = data[2] << 8 | data[3];
+	if (tkl > COAP_TOKEN_LEN || p + tkl > end)
+		return false;
+	token.assign((const char *)p, tkl);
+	p += tkl;
+
+	options.clear();
+	payload.clear();
+	while (p < end) {
+		if (*p == COAP_PAYLOAD_MARKER) {
+			if (++p == end)
+				return false;	// a marker with no payload
+			payload.assign((const char *)p, end - p);
+			break;
+		}
+		uint8_t b = *p++;
+		if (!optionNibble((b & COAP_HEADER_OPTION_DELTA_MASK) >> 4, p, end, delta) ||
+		    !optionNibble(b & COAP_HEADER_OPTION_SHORT_LENGTH_MASK, p, end, olen) || p + olen > end)
+			return false;
+		number += delta;
+		add(number, std::string((const char *)p, olen));
+		p += olen;
+	}
+	// An empty message is only its header
+	return code != 0 || (tkl == 0 && len == COAP_HEADER_LEN);
+}
+
+static void putNibble(std::string &out, size_t at, int shift, unsigned value)
+{
+	if (value < 13) {
+		out[at] |= value << shift;
+	} else if (value < 269) {
+		out[at] |= 13 << shift;
+		out += (char)(value - 13);
+	} else {
+		out[at] |= 14 << shift;
+		out += (char)((value - 269) >> 8);
+		out += (char)(value - 269);
+	}
+}
+
+std::string CoapMessage::serialize() const
+{
+	std::multimap<uint16_t, std::string>::const_iterator o;
+	std::string out;
+	unsigned last = 0;
+	size_t at;
+
+	out += (char)(COAP_VERSION << COAP_HEADER_VERSION_POSITION | type << COAP_HEADER_TYPE_POSITION | token.size());
+	out += (char)code;
+	out += (char)(mid >> 8);
+	out += (char)mid;
+	out += token;
+	for (o = options.begin(); o != options.end(); ++o) {
+		at = out.size();
+		out += (char)0;
+		putNibble(out, at, 4, o->first - last);
+		putNibble(out, at, 0, o->second.size());
+		out += o->second;
+		last = o->first;
+	}
+	if (!payload.empty()) {
+		out += (char)COAP_PAYLOAD_MARKER;
+		out += payload;
+	}
+	return out;
+}
+
+uint32_t CoapMessage::uint(uint16_t option) const
+{
+	std::multimap<uint16_t, std::string>::const_iterator o = options.find(option);
+	uint32_t value = 0;
+	size_t i;
+
+	if (o == options.end())
+		return 0;
+	for (i = 0; i < o->second.size() && i < 4; i++)
+		value = value << 8 | (uint8_t)o->second[i];
+	return value;
+}
+
+// In as few bytes as it takes--0 in none
+void CoapMessage::addUint(uint16_t option, uint32_t value)
+{
+	std::string bytes;
+
+	for (; value; value >>= 8)
+		bytes.insert(bytes.begin(), (char)(value & 0xff));
+	add(option, bytes);
+}
+
+/*---------------------------------------------------------------------------*/
+static std::string peerOf(const struct sockaddr_in6 &addr)
+{
+	return std::string((const char *)&addr.sin6_addr, sizeof(addr.sin6_addr)) +
+	       std::string((const char *)&addr.sin6_port, sizeof(addr.sin6_port));
+}
+
+static std::string midOf(uint16_t mid)
+{
+	std::string s;
+
+	s += (char)(mid >> 8);
+	s += (char)mid;
+	return s;
+}
+
+// Uri-Host is the mote only if it is a name, not the gateway's own address
+static bool isName(const std::string &host)
+{
+	return !host.empty() && host.find(':') == std::string::npos &&
+	       host.find_first_not_of("0123456789.") != std::string::npos;
+}
+
+CoapServer::CoapServer(Gateway &gw, int fd) : gw(gw), fd(fd), observeSeq(2)
+{
+	srand(time(NULL) ^ getpid());
+	nextMid = rand();
+}
+
+CoapServer::~CoapServer()
+{
+	std::map<std::string, Exchange *>::iterator e;
+
+	for (e = exchanges.begin(); e != exchanges.end(); ++e)
+		delete e->second;
+	close(fd);
+}
+
+void CoapServer::event(uint32_t)
+{
+	uint8_t buf[GW_COAP_MAX_MESSAGE];
+	struct sockaddr_in6 addr;
+	socklen_t alen;
+	CoapMessage msg;
+	ssize_t n;
+
+	for (;;) {
+		alen = sizeof(addr);
+		n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, &alen);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				perror("coap recvfrom");
+			break;
+		}
+		if (alen != sizeof(addr) || addr.sin6_family != AF_INET6)
+			continue;
+		if (msg.parse(buf, n)) {
+			received(addr, msg);
+		} else if (n >= COAP_HEADER_LEN && (buf[0] & COAP_HEADER_TYPE_MASK) >> COAP_HEADER_TYPE_POSITION == COAP_TYPE_CON &&
+		           (buf[0] & COAP_HEADER_VERSION_MASK) >> COAP_HEADER_VERSION_POSITION == COAP_VERSION) {
+			// A confirmable we can't make out is reset
+			msg = CoapMessage();
+			msg.type = COAP_TYPE_RST;
+			msg.mid = buf[2] << 8 | buf[3];
+			sendTo(addr, msg.serialize());
+		}
+	}
+}
+
+void CoapServer::received(const struct sockaddr_in6 &addr, const CoapMessage &msg)
+{
+	std::string peer = peerOf(addr);
+	std::map<std::string, Outbound>::iterator out;
+	std::map<std::string, Exchange *>::iterator ex;
+	CoapMessage rst;
+
+	if (msg.type == COAP_TYPE_ACK || msg.type == COAP_TYPE_RST) {
+		out = outbound.find(peer + midOf(msg.mid));
+		if (out == outbound.end())
+			return;
+		// A notification reset ends the observation
+		if (msg.type == COAP_TYPE_RST && (ex = exchanges.find(out->second.exchange)) != exchanges.end() &&
+		    ex->second->observing)
+			end(ex->second);
+		outbound.erase(out);
+		return;
+	}
+	if (msg.code == 0) {
+		// Ping
+		if (msg.type == COAP_TYPE_CON) {
+			rst.type = COAP_TYPE_RST;
+			rst.mid = msg.mid;
+			sendTo(addr, rst.serialize());
+		}
+		return;
+	}
+	if (msg.code >> 5 != 0)
+		return;		// a response; we ask nothing
+	request(addr, peer, msg);
+}
+
+bool CoapServer::translate(const CoapMessage &req, std::string &resource, std::string &line, uint8_t &error,
+                           std::string &why)
+{
+	std::multimap<uint16_t, std::string>::const_iterator o;
+	std::vector<std::string> path, query;
+	std::string host, uri, method;
+	bool command = false;
+	size_t i, q, b, e;
+
+	for (o = req.options.begin(); o != req.options.end(); ++o) {
+		switch (o->first) {
+		case COAP_OPTION_URI_HOST:
+			host = o->second;
+			break;
+		case COAP_OPTION_URI_PATH:
+			path.push_back(o->second);
+			break;
+		case COAP_OPTION_URI_QUERY:
+			query.push_back(o->second);
+			break;
+		case COAP_OPTION_PROXY_URI:
+			uri = o->second;
+			break;
+		case COAP_OPTION_URI_PORT:
+		case COAP_OPTION_OBSERVE:
+		case COAP_OPTION_CONTENT_FORMAT:
+		case COAP_OPTION_ACCEPT:
+		case COAP_OPTION_BLOCK1:
+		case COAP_OPTION_BLOCK2:
+		case COAP_OPTION_SIZE1:
+		case COAP_OPTION_SIZE2:
+			break;
+		default:
+			// Critical options are odd (RFC 7252, 5.4.1)
+			if (o->first & 1) {
+				error = BAD_OPTION_4_02;
+				why = "Unsupported option " + std::to_string(o->first);
+				return false;
+			}
+		}
+	}
+
+	if (!uri.empty()) {
+		if (uri.compare(0, 7, "coap://") != 0) {
+			error = PROXYING_NOT_SUPPORTED_5_05;
+			why = "Only coap:// URIs";
+			return false;
+		}
+		q = std::min(uri.find('?'), uri.size());
+		b = uri.find('/', 7);
+		host = uri.substr(7, std::min(b, q) - 7);
+		if (b < q) {
+			for (b++; ; b = e + 1) {
+				e = std::min(uri.find('/', b), q);
+				path.push_back(uri.substr(b, e - b));
+				if (e == q)
+					break;
+			}
+		}
+		for (b = q; b < uri.size(); b = e) {
+			e = uri.find('&', b + 1);
+			query.push_back(uri.substr(b + 1, e == std::string::npos ? std::string::npos : e - b - 1));
+		}
+	}
+
+	if (!isName(host)) {
+		host.clear();
+		if (!path.empty() && path[0] == "chariot")
+			command = true;
+		else if (!path.empty())
+			host = path[0];
+		if (!path.empty())
+			path.erase(path.begin());
+	}
+	if (host.empty() && !command) {
+		error = BAD_REQUEST_4_00;
+		why = "No mote: give its name as Uri-Host or first in the path";
+		return false;
+	}
+
+	resource = command ? "" : "coap://" + host + "/";
+	for (i = 0; i < path.size(); i++)
+		resource += (i ? "/" : "") + path[i];
+	if (command) {
+		if (req.code != COAP_GET || resource.empty()) {
+			error = METHOD_NOT_ALLOWED_4_05;
+			why = "Chariot commands are GETs";
+			return false;
+		}
+		line = resource;
+		for (i = 0; i < query.size(); i++)
+			line += (i ? "&" : "?") + query[i];
+		return true;
+	}
+
+	switch (req.code) {
+	case COAP_GET:    method = req.has(COAP_OPTION_OBSERVE) && req.uint(COAP_OPTION_OBSERVE) == 0 ? "obs" : "get"; break;
+	case COAP_POST:   method = "post"; break;
+	case COAP_PUT:    method = "put"; break;
+	case COAP_DELETE: method = "del"; break;
+	default:
+		error = METHOD_NOT_ALLOWED_4_05;
+		why = "";
+		return false;
+	}
+	line = resource + "?" + method;
+	for (i = 0; i < query.size(); i++)
+		line += "&" + query[i];
+	// Chariot takes a value in the query only
+	if (!req.payload.empty() && line.find("&val=") == std::string::npos)
+		line += "&val=" + req.payload;
+	if (line.size() > GW_MAX_REQUEST || line.find_first_of("\r\n") != std::string::npos) {
+		error = BAD_REQUEST_4_00;
+		why = "Request too long, or not one line";
+		return false;
+	}
+	return true;
+}
+
+void CoapServer::request(const struct sockaddr_in6 &addr, const std::string &peer, const CoapMessage &req)
+{
+	std::string seenKey = peer + midOf(req.mid), key = peer + req.token, resource, line, why;
+	std::map<std::string, Seen>::iterator s = seen.find(seenKey);
+	std::map<std::string, Exchange *>::iterator old;
+	std::map<std::string, Body>::iterator body;
+	CoapMessage resp;
+	Exchange *ex;
+	uint32_t block1, block2 = req.uint(COAP_OPTION_BLOCK2), size;
+	uint8_t error;
+
+	// A duplicate gets what the first got, once there is something
+	if (s != seen.end()) {
+		if (!s->second.reply.empty())
+			sendTo(addr, s->second.reply);
+		return;
+	}
+	remember(seenKey, "");
+
+	if (req.has(COAP_OPTION_BLOCK2))
+		block2 |= BLOCK_ASKED;
+	if (!translate(req, resource, line, error, why)) {
+		reply(addr, peer, req, error, why);
+		return;
+	}
+	CoapMessage r = req;
+
+	// Block1: the request's payload comes in blocks, and goes on when whole
+	if (req.has(COAP_OPTION_BLOCK1)) {
+		block1 = req.uint(COAP_OPTION_BLOCK1);
+		size = 16 << std::min(block1 & 7, 6u);
+		body = uploads.find(peer + resource);
+		if ((block1 >> 4) == 0) {
+			body = uploads.insert(std::make_pair(peer + resource, Body())).first;
+			body->second.payload.clear();
+		}
+		if (body == uploads.end() || body->second.payload.size() != (block1 >> 4) * size) {
+			reply(addr, peer, req, REQUEST_INCOMPLETE_4_08, "");
+			return;
+		}
+		body->second.payload += req.payload;
+		body->second.expires = nowMs() + GW_COAP_BODY_MS;
+		if (body->second.payload.size() > GW_MAX_REQUEST) {
+			uploads.erase(body);
+			reply(addr, peer, req, REQUEST_ENTITY_TOO_LARGE_4_13, "");
+			return;
+		}
+		if (block1 & 0x08) {
+			resp.code = CONTINUE_2_31;
+			resp.token = req.token;
+			resp.addUint(COAP_OPTION_BLOCK1, block1);
+			resp.type = req.type == COAP_TYPE_CON ? COAP_TYPE_ACK : COAP_TYPE_NON;
+			resp.mid = req.type == COAP_TYPE_CON ? req.mid : nextMid++;
+			sendTo(addr, resp.serialize());
+			remember(seenKey, resp.serialize());
+			return;
+		}
+		r.payload = body->second.payload;
+		uploads.erase(body);
+		translate(r, resource, line, error, why);
+	}
+
+	// Later blocks of a response come from the one kept
+	if ((block2 & ~BLOCK_ASKED) >> 4 > 0 && req.code == COAP_GET && !req.has(COAP_OPTION_OBSERVE) &&
+	    (body = bodies.find(peer + resource)) != bodies.end()) {
+		resp.token = req.token;
+		if (block(resp, peer + resource, block2, body->second.code, body->second.format, body->second.payload)) {
+			resp.type = req.type == COAP_TYPE_CON ? COAP_TYPE_ACK : COAP_TYPE_NON;
+			resp.mid = req.type == COAP_TYPE_CON ? req.mid : nextMid++;
+			sendTo(addr, resp.serialize());
+			remember(seenKey, resp.serialize());
+		} else {
+			reply(addr, peer, req, BAD_OPTION_4_02, "No such block");
+		}
+		return;
+	}
+
+	old = exchanges.find(key);
+	if (old != exchanges.end() && old->second->observing && old->second->resource == resource &&
+	    line.find("?get") != std::string::npos) {
+		// Deregistration: the observer's own ?get leaves the observe
+		ex = old->second;
+		ex->observing = false;
+	} else {
+		if (old != exchanges.end())
+			end(old->second);
+		ex = new Exchange(*this);
+		ex->addr = addr;
+		ex->peer = peer;
+		ex->key = key;
+		ex->token = req.token;
+		ex->resource = resource;
+		ex->observing = false;
+		ex->notes = 0;
+		gw.attach(*ex);
+		exchanges[key] = ex;
+	}
+	ex->mid = req.mid;
+	ex->con = req.type == COAP_TYPE_CON;
+	ex->acked = false;
+	ex->answered = false;
+	ex->registering = line.find("?obs") != std::string::npos;
+	ex->block2 = block2;
+	ex->block1.clear();
+	if (req.has(COAP_OPTION_BLOCK1))
+		ex->block1 = req.options.find(COAP_OPTION_BLOCK1)->second;
+	ex->arrived = nowMs();
+	gw.request(*ex, line, -1);
+}
+
+// A response made here, not by Chariot
+void CoapServer::reply(const struct sockaddr_in6 &addr, const std::string &peer, const CoapMessage &req,
+                       uint8_t code, const std::string &payload)
+{
+	CoapMessage resp;
+
+	resp.type = req.type == COAP_TYPE_CON ? COAP_TYPE_ACK : COAP_TYPE_NON;
+	resp.code = code;
+	resp.mid = req.type == COAP_TYPE_CON ? req.mid : nextMid++;
+	resp.token = req.token;
+	if (!payload.empty()) {
+		resp.addUint(COAP_OPTION_CONTENT_FORMAT, TEXT_PLAIN);
+		resp.payload = payload;
+	}
+	sendTo(addr, resp.serialize());
+	remember(peer + midOf(req.mid), resp.serialize());
+}
+
+void CoapServer::Exchange::deliver(long, const std::string &text, unsigned, bool notification)
+{
+	srv.answer(*this, text, notification);
+}
+
+/*
+ * A response or notification from the broker. Its status becomes the code;
+ * Chariot's observe token is its own business and is left out.
+ */
+void CoapServer::answer(Exchange &ex, const std::string &text, bool notification)
+{
+	uint8_t header[BIN_HEADER_LEN];
+	std::string payload, token = tokenOf(text);
+	uint8_t code;
+	size_t skip;
+	CoapMessage msg;
+	bool first = !ex.answered;
+
+	skip = binHeader(header, BIN_RESPONSE, 0, text, 0);
+	code = header[3] ? header[3] : (uint8_t)CONTENT_2_05;
+	payload = valueOf(text, skip);
+
+	if (!first && !(ex.observing && notification))
+		return;
+	if (first) {
+		ex.answered = true;
+		ex.observing = ex.registering && !token.empty() && (code >> 5) == 2;
+	} else if ((code >> 5) != 2) {
+		ex.observing = false;	// the observe is gone upstream
+	}
+
+	msg.code = code;
+	msg.token = ex.token;
+	if (ex.observing)
+		msg.addUint(COAP_OPTION_OBSERVE, observeSeq++ & 0xffffff);
+	if (!ex.block1.empty())
+		msg.add(COAP_OPTION_BLOCK1, ex.block1);
+	if (!block(msg, ex.peer + ex.resource, ex.observing ? 0 : ex.block2, code, header[4], payload)) {
+		msg = CoapMessage();
+		msg.code = BAD_OPTION_4_02;
+		msg.token = ex.token;
+	}
+
+	if (first && ex.con && !ex.acked) {
+		// Piggybacked on the ACK
+		msg.type = COAP_TYPE_ACK;
+		msg.mid = ex.mid;
+		sendTo(ex.addr, msg.serialize());
+		remember(ex.peer + midOf(ex.mid), msg.serialize());
+		ex.acked = true;
+	} else {
+		transmit(ex, msg, first ? ex.con : (++ex.notes % GW_COAP_CON_EVERY) == 0);
+	}
+	if (!ex.observing)
+		end(&ex);
+}
+
+/*
+ * Fills in the payload, or the block of it asked for (0: the first, if it
+ * takes more than one). False if there is no such block.
+ */
+bool CoapServer::block(CoapMessage &msg, const std::string &bodyKey, uint32_t block2, uint8_t code, uint8_t format,
+                       const std::string &payload)
+{
+	unsigned szx = (block2 & BLOCK_ASKED) ? std::min(block2 & 7, (uint32_t)GW_COAP_BLOCK_SZX) : GW_COAP_BLOCK_SZX;
+	unsigned size = 16 << szx;
+	uint32_t num = (block2 & ~BLOCK_ASKED) >> 4;
+	size_t at = (size_t)num * size;
+
+	if (!payload.empty() || code >> 5 == 2)
+		msg.addUint(COAP_OPTION_CONTENT_FORMAT, format);
+	if (!(block2 & BLOCK_ASKED) && payload.size() <= size) {
+		bodies.erase(bodyKey);
+		msg.payload = payload;
+		return true;
+	}
+	if (at >= payload.size() && num > 0) {
+		bodies.erase(bodyKey);
+		return false;
+	}
+	Body &body = bodies[bodyKey];
+	body.code = code;
+	body.format = format;
+	body.payload = payload;
+	body.expires = nowMs() + GW_COAP_BODY_MS;
+	msg.addUint(COAP_OPTION_BLOCK2, num << 4 | (at + size < payload.size() ? 0x08 : 0) | szx);
+	if (num == 0)
+		msg.addUint(COAP_OPTION_SIZE2, payload.size());
+	msg.payload = payload.substr(at, size);
+	return true;
+}
+
+// A response on its own, or a notification
+void CoapServer::transmit(Exchange &ex, CoapMessage &msg, bool con)
+{
+	msg.type = con ? COAP_TYPE_CON : COAP_TYPE_NON;
+	msg.mid = nextMid++;
+	if (!con && !ex.observing) {
+		sendTo(ex.addr, msg.serialize());
+		return;
+	}
+
+	Outbound &out = outbound[ex.peer + midOf(msg.mid)];
+	out.addr = ex.addr;
+	out.exchange = ex.key;
+	out.msg = msg.serialize();
+	out.con = con;
+	out.tries = 0;
+	out.timeoutMs = COAP_RESPONSE_TIMEOUT * 1000 * (1 + (COAP_RESPONSE_RANDOM_FACTOR - 1) * rand() / RAND_MAX);
+	out.due = nowMs() + (con ? out.timeoutMs : GW_COAP_RST_MS);
+	sendTo(ex.addr, out.msg);
+}
+
+void CoapServer::tick(uint64_t now)
+{
+	std::map<std::string, Exchange *>::iterator e;
+	std::map<std::string, Outbound>::iterator o, nexto;
+	std::map<std::string, Body>::iterator b, nextb;
+	std::map<std::string, Seen>::iterator s;
+	std::set<std::string> gone;                 // keys: an exchange may have several outbound
+	std::set<std::string>::iterator g;
+	CoapMessage ack;
+
+	// Confirmable requests still waiting on Chariot get an empty ACK
+	for (e = exchanges.begin(); e != exchanges.end(); ++e) {
+		Exchange &ex = *e->second;
+		if (ex.con && !ex.acked && !ex.answered && now - ex.arrived >= GW_COAP_ACK_DELAY_MS) {
+			ack = CoapMessage();
+			ack.type = COAP_TYPE_ACK;
+			ack.mid = ex.mid;
+			sendTo(ex.addr, ack.serialize());
+			remember(ex.peer + midOf(ex.mid), ack.serialize());
+			ex.acked = true;
+		}
+	}
+
+	for (o = outbound.begin(); o != outbound.end(); o = nexto) {
+		nexto = o;
+		++nexto;
+		if (o->second.due > now)
+			continue;
+		if (o->second.con && o->second.tries < COAP_MAX_RETRANSMIT) {
+			o->second.tries++;
+			o->second.timeoutMs *= 2;
+			o->second.due = now + o->second.timeoutMs;
+			sendTo(o->second.addr, o->second.msg);
+			continue;
+		}
+		// Never acknowledged: the observer is gone
+		if (o->second.con && (e = exchanges.find(o->second.exchange)) != exchanges.end() && e->second->observing)
+			gone.insert(o->second.exchange);
+		outbound.erase(o);
+	}
+	for (g = gone.begin(); g != gone.end(); ++g) {
+		if ((e = exchanges.find(*g)) != exchanges.end())
+			end(e->second);
+	}
+
+	for (b = bodies.begin(); b != bodies.end(); b = nextb) {
+		nextb = b;
+		++nextb;
+		if (b->second.expires <= now)
+			bodies.erase(b);
+	}
+	for (b = uploads.begin(); b != uploads.end(); b = nextb) {
+		nextb = b;
+		++nextb;
+		if (b->second.expires <= now)
+			uploads.erase(b);
+	}
+	while (!seenOrder.empty() &&
+	       ((s = seen.find(seenOrder.front())) == seen.end() || s->second.expires <= now)) {
+		if (s != seen.end())
+			seen.erase(s);
+		seenOrder.pop_front();
+	}
+}
+
+// A message id seen, and the reply to send its duplicates
+void CoapServer::remember(const std::string &key, const std::string &reply)
+{
+	std::map<std::string, Seen>::iterator s = seen.find(key);
+
+	if (s != seen.end()) {
+		s->second.reply = reply;
+		return;
+	}
+	if (seenOrder.size() >= GW_COAP_MAX_SEEN) {
+		seen.erase(seenOrder.front());
+		seenOrder.pop_front();
+	}
+	seen[key].reply = reply;
+	seen[key].expires = nowMs() + GW_COAP_LIFETIME_MS;
+	seenOrder.push_back(key);
+}
+
+void CoapServer::sendTo(const struct sockaddr_in6 &addr, const std::string &msg)
+{
+	if (sendto(fd, msg.data(), msg.size(), 0, (const struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+	    errno != EAGAIN)
+		perror("coap sendto");
+}
+
+// The exchange is done, or the observer gone
+void CoapServer::end(Exchange *ex)
+{
+	std::map<std::string, Exchange *>::iterator e = exchanges.find(ex->key);
+
+	if (e != exchanges.end() && e->second == ex)
+		exchanges.erase(e);
+	gw.detach(*ex);
+	delete ex;
+}
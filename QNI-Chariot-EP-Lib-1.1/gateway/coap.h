@@ -0,0 +1,150 @@
+/*
+ * Chariot gateway: CoAP over UDP (RFC 7252), with observe (RFC 7641) and
+ * block-wise transfer (RFC 7959).
+ *
+ * A CoAP request to the gateway becomes a URL on Chariot's serial channel,
+ * through the same broker as the connections. A GET of
+ *   coap://gw/chariot.c350e.local/sensors/tmp275-c
+ * is sent as
+ *   coap://chariot.c350e.local/sensors/tmp275-c?get
+ * The mote is the Uri-Host option if the client gave a name, else the first
+ * path segment; "chariot/..." is a command for Chariot itself. A GET with
+ * Observe 0 is an ?obs, and its notifications go back with the token it came
+ * with. A payload goes as "&val=", since Chariot takes values in the query
+ * only. Chariot's status ("2.05 CONTENT ...") becomes the response code.
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#ifndef CHARIOT_GATEWAY_COAP_H_
+#define CHARIOT_GATEWAY_COAP_H_
+
+#include "gateway.h"
+
+#include <netinet/in.h>
+
+#define GW_COAP_MAX_MESSAGE     1280        // a 1024 byte block and its options
+#define GW_COAP_BLOCK_SZX       6           // blocks of 16 << 6 = 1024 bytes at most
+#define GW_COAP_ACK_DELAY_MS    1000        // then an empty ACK, and the response on its own
+#define GW_COAP_CON_EVERY       16          // every 16th notification is confirmable
+#define GW_COAP_LIFETIME_MS     247000      // EXCHANGE_LIFETIME: message ids are remembered this long
+#define GW_COAP_MAX_SEEN        65536       // ...or until this many are
+#define GW_COAP_BODY_MS         60000       // a response is kept this long for its later blocks
+#define GW_COAP_SOCKET_BUF      (1 << 20)
+#define GW_COAP_RST_MS          30000       // a non-confirmable notification can be reset this long
+
+#define BLOCK_ASKED             0x80000000  // Block2 option present, whatever its value
+
+/*
+ * A CoAP message, parsed or to be serialized. Options are kept in order.
+ */
+struct CoapMessage {
+	uint8_t type;
+	uint8_t code;
+	uint16_t mid;
+	std::string token;
+	std::multimap<uint16_t, std::string> options;
+	std::string payload;
+
+	CoapMessage() : type(0), code(0), mid(0) {}
+
+	// False if it isn't a well-formed CoAP version 1 message
+	bool parse(const uint8_t *data, size_t len);
+	std::string serialize() const;
+
+	bool has(uint16_t option) const { return options.count(option) != 0; }
+	uint32_t uint(uint16_t option) const;
+	void add(uint16_t option, const std::string &value) { options.insert(std::make_pair(option, value)); }
+	void addUint(uint16_t option, uint32_t value);
+};
+
+class CoapServer : public Pollable {
+public:
+	CoapServer(Gateway &gw, int fd);
+	~CoapServer();
+
+	void event(uint32_t events);
+	void tick(uint64_t now);
+
+	/*
+	 * The Chariot request for a CoAP one: its resource, and the line that
+	 * goes to Chariot. False, with the response code and why, if there is none.
+	 */
+	static bool translate(const CoapMessage &req, std::string &resource, std::string &line, uint8_t &error,
+	                      std::string &why);
+
+private:
+	/*
+	 * A request on its way through the broker, or an observation. Known by
+	 * its peer and token.
+	 */
+	class Exchange : public Client {
+	public:
+		Exchange(CoapServer &srv) : srv(srv) {}
+		void deliver(long tag, const std::string &text, unsigned latencyMs, bool notification);
+
+		CoapServer &srv;
+		struct sockaddr_in6 addr;
+		std::string peer;
+		std::string key;        // peer and token
+		std::string token;
+		std::string resource;   // the URL up to its '?'
+		uint16_t mid;           // of the request
+		bool con;
+		bool acked;             // empty ACK sent; the response goes on its own
+		bool answered;
+		bool registering;       // Observe 0
+		bool observing;
+		unsigned notes;         // notifications sent
+		uint32_t block2;        // Block2 asked for, with BLOCK_ASKED
+		std::string block1;     // Block1 to echo, "" if none
+		uint64_t arrived;
+	};
+
+	// A confirmable message of ours awaiting its ACK, or a notification
+	// that may be reset
+	struct Outbound {
+		struct sockaddr_in6 addr;
+		std::string exchange;   // key of its exchange
+		std::string msg;
+		bool con;
+		unsigned tries;
+		unsigned timeoutMs;
+		uint64_t due;           // to resend, or forget
+	};
+	struct Seen {
+		std::string reply;      // "" until there is one
+		uint64_t expires;
+	};
+	struct Body {
+		uint8_t code;
+		uint8_t format;
+		std::string payload;
+		uint64_t expires;
+	};
+
+	Gateway &gw;
+	int fd;
+	uint16_t nextMid;
+	uint32_t observeSeq;
+	std::map<std::string, Exchange *> exchanges;    // by peer and token
+	std::map<std::string, Seen> seen;               // by peer and message id
+	std::deque<std::string> seenOrder;
+	std::map<std::string, Outbound> outbound;       // by peer and message id
+	std::map<std::string, Body> bodies;             // by peer and resource, for Block2
+	std::map<std::string, Body> uploads;            // by peer and resource, for Block1
+
+	void received(const struct sockaddr_in6 &addr, const CoapMessage &msg);
+	void request(const struct sockaddr_in6 &addr, const std::string &peer, const CoapMessage &req);
+	void reply(const struct sockaddr_in6 &addr, const std::string &peer, const CoapMessage &req,
+	           uint8_t code, const std::string &payload);
+	void answer(Exchange &ex, const std::string &text, bool notification);
+	bool block(CoapMessage &msg, const std::string &bodyKey, uint32_t block2, uint8_t code, uint8_t format,
+	           const std::string &payload);
+	void transmit(Exchange &ex, CoapMessage &msg, bool con);
+	void remember(const std::string &key, const std::string &reply);
+	void sendTo(const struct sockaddr_in6 &addr, const std::string &msg);
+	void end(Exchange *ex);
+};
+
+#endif /* CHARIOT_GATEWAY_COAP_H_ */
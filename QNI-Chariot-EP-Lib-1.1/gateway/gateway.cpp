@@ -0,0 +1,376 @@
+/*
+ * Chariot gateway: the epoll loop, and where requests go.
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include "gateway.h"
+#include "coap.h"
+#include "store.h"
+#include "../coap-constants.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#define GW_MAX_EVENTS       256
+
+volatile sig_atomic_t Gateway::stopping = 0;
+
+void Gateway::stop(int)
+{
+	stopping = 1;
+}
+
+/*---------------------------------------------------------------------------*/
+Gateway::Gateway() : epfd(epoll_create1(EPOLL_CLOEXEC)), directory(*this), nextId(0), coap(NULL), store(NULL)
+{
+	attach(directory);
+}
+
+Gateway::~Gateway()
+{
+	std::set<Conn *>::iterator c;
+	size_t i;
+
+	for (i = 0; i < shields.size(); i++)
+		shields[i]->stop();
+	for (c = conns.begin(); c != conns.end(); ++c)
+		delete *c;
+	delete coap;
+	delete store;
+	for (i = 0; i < dead.size(); i++)
+		delete dead[i];
+	for (i = 0; i < listeners.size(); i++)
+		delete listeners[i];
+	for (i = 0; i < shields.size(); i++)
+		delete shields[i];
+	close(epfd);
+}
+
+bool Gateway::addShield(const char *tty, int baud)
+{
+	Shield *shield;
+
+	if (shields.size() == GW_MAX_SHIELDS) {
+		fprintf(stderr, "%s: at most %d Chariots\n", tty, GW_MAX_SHIELDS);
+		return false;
+	}
+	shield = new Shield(*this);
+	if (!shield->open(tty, baud)) {
+		delete shield;
+		return false;
+	}
+	shields.push_back(shield);
+	watch(shield->readyFd(), shield, EPOLLIN, true);
+	return true;
+}
+
+bool Gateway::listen(int port, bool websocket)
+{
+	struct sockaddr_in addr;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return false;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || ::listen(fd, SOMAXCONN) == -1) {
+		fprintf(stderr, "port %d: %s\n", port, strerror(errno));
+		close(fd);
+		return false;
+	}
+	listeners.push_back(new Listener(*this, fd, websocket));
+	watch(fd, listeners.back(), EPOLLIN, true);
+	return true;
+}
+
+bool Gateway::listenCoap(int port)
+{
+	struct sockaddr_in6 addr;
+	int fd, off = 0, buf = GW_COAP_SOCKET_BUF;
+
+	// Dual stack: IPv4 peers come as mapped addresses
+	fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return false;
+	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+	// Room for a burst of requests while the loop is busy
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "coap port %d: %s\n", port, strerror(errno));
+		close(fd);
+		return false;
+	}
+	coap = new CoapServer(*this, fd);
+	watch(fd, coap, EPOLLIN, true);
+	return true;
+}
+
+bool Gateway::openStore(const char *path)
+{
+	store = new Store;
+	return store->open(path);
+}
+
+void Gateway::watch(int fd, Pollable *p, uint32_t events, bool add)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = p;
+	epoll_ctl(epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+}
+
+void Gateway::unwatch(int fd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void Gateway::attach(Client &client)
+{
+	// Ids are never 0--that's the broker's own
+	do {
+		if (++nextId == 0)
+			nextId = 1;
+	} while (clients.count(nextId));
+	client.clientId = nextId;
+	clients[nextId] = &client;
+}
+
+void Gateway::detach(Client &client)
+{
+	if (client.clientId && clients.erase(client.clientId))
+		leaving.push_back(client.clientId);
+	client.clientId = 0;
+}
+
+void Gateway::accepted(int fd, bool websocket)
+{
+	Conn *conn = new Conn(*this, fd, websocket);
+
+	attach(*conn);
+	conns.insert(conn);
+	watch(fd, conn, EPOLLIN, true);
+}
+
+void Gateway::closed(Conn &conn)
+{
+	detach(conn);
+	conns.erase(&conn);
+	dead.push_back(&conn);
+}
+
+// Mote a request is for, "" if none
+static std::string moteOf(const std::string &line)
+{
+	size_t at;
+
+	if (line.compare(0, 7, "coap://") != 0)
+		return "";
+	at = line.find_first_of("/?", 7);
+	return line.substr(7, at == std::string::npos ? std::string::npos : at - 7);
+}
+
+/*
+ * A request from a client. As on the Arduino bridge, a text request may be
+ * tagged "#<n> ...", and "chariot/..." is a command for Chariot itself--the
+ * first, or the n'th with "chariot/<n>/...". A request for a mote goes to the
+ * Chariot that has it, and "sys/motes" without a number lists them all.
+ */
+void Gateway::request(Client &client, std::string line, long tag)
+{
+	size_t b, e;
+	int shield = 0;
+	bool named = false;	// "chariot/<n>/..."
+
+	b = line.find_first_not_of(" \t\r\n");
+	e = line.find_last_not_of(" \t\r\n");
+	line = (b == std::string::npos) ? "" : line.substr(b, e - b + 1);
+	if (tag < 0 && line.size() > 1 && line[0] == '#') {
+		tag = strtol(line.c_str() + 1, NULL, 10);
+		b = line.find(' ');
+		line = (b == std::string::npos) ? "" : line.substr(line.find_first_not_of(' ', b));
+	}
+	if (line.compare(0, 8, "chariot/") == 0) {
+		line.erase(0, 8);
+		for (b = 0; b < line.size() && isdigit((unsigned char)line[b]); b++)
+			;
+		if (b > 0 && b < line.size() && line[b] == '/') {
+			shield = atoi(line.c_str());
+			named = true;
+			line.erase(0, b + 1);
+		}
+	}
+	if (line.empty())
+		return;
+
+	if (line.compare(0, 6, "store/") == 0) {
+		storeCommand(client, tag, line);
+		return;
+	}
+	if (line == "sys/motes" && !named && shields.size() > 1) {
+		directory.ask(client, tag);
+		return;
+	}
+	if (line.compare(0, 7, "coap://") == 0)
+		shield = directory.shieldOf(moteOf(line));
+	if (shield >= (int)shields.size()) {
+		client.deliver(tag, "4.04 Not Found: no Chariot " + std::to_string(shield), 0, false);
+		return;
+	}
+	if (!send(shield, client.id(), tag, line))
+		client.deliver(tag, "5.03 Service Unavailable: too many requests waiting", 0, false);
+}
+
+bool Gateway::send(int shield, uint32_t client, long tag, const std::string &line)
+{
+	return shields[shield]->request(client, tag, line);
+}
+
+// A value a mote reported, for the store
+void Gateway::sample(const std::string &resource, const std::string &text)
+{
+	uint8_t header[BIN_HEADER_LEN];
+	std::string value;
+	size_t skip;
+
+	if (!store || resource.compare(0, 7, "coap://") != 0)
+		return;
+	skip = binHeader(header, BIN_RESPONSE, 0, text, 0);
+	value = valueOf(text, skip);
+	if (header[3] == CONTENT_2_05 && !value.empty())
+		store->add(resource, value, Store::wallMs());
+}
+
+// Seconds since the epoch, or before now if negative; 0 is now
+static uint64_t when(const std::string &query, const char *name, long otherwise)
+{
+	size_t at = ("&" + query).find(std::string("&") + name + "=");
+	long t = at == std::string::npos ? otherwise : strtol(query.c_str() + at + strlen(name) + 1, NULL, 10);
+
+	return t > 0 ? (uint64_t)t * 1000 : Store::wallMs() - (uint64_t)(-t) * 1000;
+}
+
+/*
+ * Queries of the store:
+ *   store/series                                    each series, its samples and time span
+ *   store/query?res=<prefix>[&from=-3600][&to=0][&max=n]
+ * Times are seconds since the epoch, or before now if negative.
+ */
+void Gateway::storeCommand(Client &client, long tag, const std::string &line)
+{
+	size_t q = line.find('?'), at, e;
+	std::string query = q == std::string::npos ? "" : line.substr(q + 1), prefix;
+	size_t max = GW_STORE_MAX_QUERY;
+
+	if (!store) {
+		client.deliver(tag, "4.04 Not Found: no store (chariot-gw -s)", 0, false);
+		return;
+	}
+	if (line.compare(0, q, "store/series") == 0) {
+		client.deliver(tag, "2.05 CONTENT " + store->list(), 0, false);
+		return;
+	}
+	if (line.compare(0, q, "store/query") != 0) {
+		client.deliver(tag, "4.04 Not Found: " + line, 0, false);
+		return;
+	}
+	at = ("&" + query).find("&res=");
+	if (at != std::string::npos) {
+		e = query.find('&', at + 4);
+		prefix = query.substr(at + 4, e == std::string::npos ? std::string::npos : e - at - 4);
+	}
+	at = ("&" + query).find("&max=");
+	if (at != std::string::npos && strtoul(query.c_str() + at + 4, NULL, 10) > 0)
+		max = std::min(max, (size_t)strtoul(query.c_str() + at + 4, NULL, 10));
+	client.deliver(tag, "2.05 CONTENT " + store->query(prefix, when(query, "from", -3600), when(query, "to", 0), max),
+	               0, false);
+}
+
+void Gateway::deliver(uint32_t client, long tag, const std::string &text, unsigned latencyMs, bool notification)
+{
+	std::map<uint32_t, Client *>::iterator c = clients.find(client);
+
+	if (c != clients.end())
+		c->second->deliver(tag, text, latencyMs, notification);
+}
+
+int Gateway::run()
+{
+	struct epoll_event events[GW_MAX_EVENTS];
+	uint64_t now, lastTick = nowMs();
+	int n, i, lost = -1;
+	size_t s;
+
+	for (s = 0; s < shields.size(); s++) {
+		if (!shields[s]->start())
+			return 1;
+	}
+	if (shields.size() > 1)
+		directory.refresh(lastTick, shields.size());
+
+	while (!stopping && lost < 0) {
+		n = epoll_wait(epfd, events, GW_MAX_EVENTS, GW_TICK_MS);
+		if (n == -1 && errno != EINTR) {
+			perror("epoll_wait");
+			return 1;
+		}
+		for (i = 0; i < n; i++)
+			((Pollable *)events[i].data.ptr)->event(events[i].events);
+
+		// Clients gone during these events. If a queue is full, its
+		// worker is behind; the leave is tried again next time.
+		for (i = 0; i < (int)leaving.size(); ) {
+			for (s = 0; s < shields.size() && shields[s]->leave(leaving[i]); s++)
+				;
+			if (s < shields.size())
+				break;
+			leaving.erase(leaving.begin() + i);
+		}
+		for (i = 0; i < (int)dead.size(); i++)
+			delete dead[i];
+		dead.clear();
+
+		now = nowMs();
+		if (now - lastTick >= GW_TICK_MS) {
+			if (coap)
+				coap->tick(now);
+			if (store)
+				store->tick();
+			if (shields.size() > 1)
+				directory.refresh(now, shields.size());
+			lastTick = now;
+		}
+
+		// Requests queued to the workers
+		for (s = 0; s < shields.size(); s++) {
+			shields[s]->kick();
+			if (shields[s]->lost())
+				lost = s;
+		}
+	}
+	if (lost >= 0) {
+		fprintf(stderr, "%s: link lost\n", shields[lost]->name().c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,409 @@
+/*
+ * Chariot gateway for Linux.
+ *
+ * Attaches to a Chariot over a tty and speaks the text protocol ChariotEPClass
+ * uses on its serial channel: a URL or command per line out, and responses
+ * ending "<<" back. It serves that channel to WebSocket, raw TCP and CoAP
+ * clients from a single epoll loop. The clients share the channel. With more
+ * than one Chariot--each a mesh of its own--every Chariot gets a worker thread,
+ * and requests go to the one whose mesh has the mote. Chariot answers
+ * requests in the order it gets them and carries no request tag, so responses
+ * are matched to requests by order. A resource observed by any number of
+ * clients gets one observe over the mesh, and each notification goes to every
+ * client observing it. What motes report can be kept on disk and queried
+ * (store.h).
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#ifndef CHARIOT_GATEWAY_H_
+#define CHARIOT_GATEWAY_H_
+
+#include <signal.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define GW_WS_PORT          1337        // as the Arduino bridge
+#define GW_TCP_PORT         1338
+#define GW_BAUD             9600
+#define GW_MAX_IN_FLIGHT    4           // written to Chariot and not yet answered
+#define GW_MAX_WAITING      4096        // queued behind those
+#define GW_REQ_TIMEOUT_MS   30000
+#define GW_MAX_REQUEST      1024        // longest request line or message
+#define GW_MAX_TX           (1 << 20)   // a client this far behind is dropped
+#define GW_TICK_MS          100
+#define GW_MAX_SHIELDS      8           // Chariots, each on its own tty
+#define GW_QUEUE            8192        // messages between the loop and a Chariot's worker
+#define GW_DIRECTORY_MS     60000       // how often the motes are asked of every Chariot
+
+// Binary WebSocket messages, as the Arduino bridge's
+#define BIN_REQUEST         0x01
+#define BIN_RESPONSE        0x02
+#define BIN_NOTIFICATION    0x03
+#define BIN_HEADER_LEN      7
+
+uint64_t nowMs();
+
+// Fills a binary message header for a response that starts with its status
+// ("2.05 CONTENT ..."). Returns the length of the status, which is left out.
+size_t binHeader(uint8_t *header, uint8_t type, long id, const std::string &text, unsigned latencyMs);
+
+// "TKN=" token in a response, "" if none
+std::string tokenOf(const std::string &text);
+
+// A response's value: what follows its status (skip, as binHeader() gives
+// it), less the "TKN=" token
+std::string valueOf(const std::string &text, size_t skip);
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Where the broker's responses go. A client is known by a number, never 0;
+ * tag is the client's for the request, -1 if none.
+ */
+class Sink {
+public:
+	virtual ~Sink() {}
+	virtual void deliver(uint32_t client, long tag, const std::string &text, unsigned latencyMs, bool notification) = 0;
+
+	// What a resource reported, by notification or to a ?get or ?obs
+	virtual void sample(const std::string &, const std::string &) {}
+};
+
+/*---------------------------------------------------------------------------*/
+/*
+ * The serial channel to a Chariot. Non-blocking: send() queues, flush()
+ * writes what the tty takes, and readable() returns the responses completed.
+ */
+class ChariotLink {
+public:
+	ChariotLink();
+	~ChariotLink();
+
+	bool open(const char *tty, int baud);
+	int fd() const { return linkFd; }
+	const std::string &name() const { return ttyName; }
+
+	void send(const std::string &line);
+	bool pending() const { return !txBuf.empty(); }
+
+	// These return false if the link is lost
+	bool flush();
+	bool readable(std::vector<std::string> &responses);
+
+private:
+	int linkFd;
+	std::string ttyName;
+	std::string rxBuf, txBuf;
+	bool ltPending;             // a '<' that may start the "<<" terminator
+};
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Request broker: at most GW_MAX_IN_FLIGHT requests are written to Chariot
+ * at once, the rest wait their turn. Observes are shared per resource (the
+ * URL up to its '?'); a client leaves one with a plain ?get of the resource,
+ * or by leaving, and the last one out cancels it upstream with a ?get.
+ */
+class Broker {
+public:
+	Broker(ChariotLink &link, Sink &sink);
+
+	// False if too many are waiting
+	bool request(uint32_t client, long tag, const std::string &line);
+	void leave(uint32_t client);
+
+	void response(const std::string &text);
+	void tick(uint64_t now);
+
+	size_t waiting() const { return waitQ.size(); }
+
+private:
+	struct Request {
+		uint32_t client;        // 0: the broker's own, or the client left
+		long tag;
+		std::string line;
+		std::string observe;    // resource it registers, "" if none
+		uint64_t arrived;
+		uint64_t sent;          // to Chariot
+	};
+	struct Observe {
+		std::string token;      // "" until the registration is answered
+		std::string last;       // its latest value, for those who join
+		std::set<uint32_t> clients;
+		std::vector<Request> gets;      // waiting for the registration's answer
+	};
+
+	ChariotLink &link;
+	Sink &sink;
+	std::deque<Request> inFlight, waitQ;
+	std::map<std::string, Observe> observes;        // by resource
+	std::map<std::string, std::string> tokens;      // token: resource
+
+	void enqueue(uint32_t client, long tag, const std::string &line, const std::string &observe);
+	void dispatch();
+	void unobserve(std::string resource, uint32_t client);
+	void forget(const std::string &resource);
+};
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Lock-free queue for one thread that pushes and one that pops. N is a power
+ * of two.
+ */
+template <typename T, size_t N>
+class SpscQueue {
+public:
+	SpscQueue() : ring(N), head(0), tail(0) {}
+
+	// Moves the item in; false, and it is left alone, if the queue is full
+	bool push(T &item)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+
+		if (t - head.load(std::memory_order_acquire) == N)
+			return false;
+		ring[t & (N - 1)] = std::move(item);
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &item)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		item = std::move(ring[h & (N - 1)]);
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::vector<T> ring;
+	std::atomic<size_t> head;               // the consumer's
+	char pad[64];                           // ...on a cache line apart from
+	std::atomic<size_t> tail;               // the producer's
+};
+
+/*---------------------------------------------------------------------------*/
+// Anything in the epoll set
+class Pollable {
+public:
+	virtual ~Pollable() {}
+	virtual void event(uint32_t events) = 0;
+};
+
+class Gateway;
+
+/*
+ * A client of the broker: a connection, or a CoAP exchange. The gateway gives
+ * it its number when it is attached.
+ */
+class Client {
+public:
+	Client() : clientId(0) {}
+	virtual ~Client() {}
+	virtual void deliver(long tag, const std::string &text, unsigned latencyMs, bool notification) = 0;
+	uint32_t id() const { return clientId; }
+
+private:
+	friend class Gateway;
+	uint32_t clientId;
+};
+
+/*
+ * A client connection: raw TCP, which speaks Chariot's own protocol--a
+ * request per line, responses ending "<<"--or WebSocket, which speaks the
+ * Arduino bridge's: text messages, or binary ones with a fixed header.
+ * Either may tag a text request "#<n> ..."; its response then starts "#<n> ".
+ */
+class Conn : public Pollable, public Client {
+public:
+	Conn(Gateway &gw, int fd, bool websocket);
+	~Conn();
+
+	void event(uint32_t events);
+	void deliver(long tag, const std::string &text, unsigned latencyMs, bool notification);
+
+private:
+	Gateway &gw;
+	int fd;
+	bool websocket;
+	bool open;                  // handshake done
+	bool binary;                // WebSocket client has sent a binary request
+	bool closing;               // close once tx is written
+	bool wantOut;               // EPOLLOUT set
+	std::string rx, tx;
+	std::string msg;            // WebSocket message being reassembled
+	uint8_t msgOpcode;
+
+	void lines();
+	void handshake();
+	void frames();
+	void message(uint8_t opcode, const std::string &data);
+	void frame(uint8_t opcode, const std::string &payload);
+	void send(const std::string &data);
+	void flush();
+	void shutdown();
+};
+
+class Listener : public Pollable {
+public:
+	Listener(Gateway &gw, int fd, bool websocket) : gw(gw), fd(fd), websocket(websocket) {}
+	void event(uint32_t events);
+
+private:
+	Gateway &gw;
+	int fd;
+	bool websocket;
+};
+
+/*
+ * A Chariot, with its link and broker on a worker thread of their own. The
+ * loop hands it requests, and takes its responses, through lock-free queues,
+ * each with an eventfd to wake the other side.
+ */
+class Shield : public Pollable, private Sink {
+public:
+	Shield(Gateway &gw);
+	~Shield();
+
+	bool open(const char *tty, int baud);
+	bool start();
+	void stop();
+	const std::string &name() const { return link.name(); }
+	bool lost() const { return linkLost.load(); }
+
+	// From the loop. False if the queue is full.
+	bool request(uint32_t client, long tag, const std::string &line);
+	bool leave(uint32_t client);
+	void kick();                // wakes the worker for what was queued
+
+	// Responses from the worker
+	void event(uint32_t events);
+	int readyFd() const { return readyEv; }
+
+private:
+	enum { REQUEST, LEAVE, RESPONSE, SAMPLE };
+	struct Message {
+		uint8_t kind;
+		uint32_t client;
+		long tag;
+		std::string text;
+		std::string resource;   // a sample's
+		unsigned latencyMs;
+		bool notification;
+
+		Message() : kind(REQUEST), client(0), tag(-1), latencyMs(0), notification(false) {}
+	};
+
+	Gateway &gw;
+	ChariotLink link;
+	Broker broker;              // the worker's only
+	SpscQueue<Message, GW_QUEUE> inbox, outbox;
+	int wakeEv;                 // loop to worker
+	int readyEv;                // worker to loop
+	bool kicked;                // queued since the last kick
+	std::thread worker;
+	std::atomic<bool> stopping;
+	std::atomic<bool> linkLost;
+	std::deque<Message> overflow;   // the worker's, while the outbox is full
+	bool delivered;                 // the worker's: pushed since it last woke the loop
+
+	void run();
+	void deliver(uint32_t client, long tag, const std::string &text, unsigned latencyMs, bool notification);
+	void sample(const std::string &resource, const std::string &text);
+	void push(Message &m);
+	void signal(int ev);
+};
+
+/*
+ * Which Chariot has a mote. Each is asked for its motes ("sys/motes") now and
+ * then, and a mote not found goes to the first. Routes given on the command
+ * line come before what is found. A client's "sys/motes" gets the motes of
+ * all of them.
+ */
+class Directory : public Client {
+public:
+	Directory(Gateway &gw) : gw(gw), asking(0), asked(0) {}
+
+	void route(const std::string &mote, int shield) { routes[mote] = shield; }
+	int shieldOf(const std::string &mote) const;
+
+	void refresh(uint64_t now, size_t shields);
+	void ask(Client &client, long tag);
+	void deliver(long tag, const std::string &text, unsigned latencyMs, bool notification);
+
+private:
+	Gateway &gw;
+	std::map<std::string, int> routes;          // from the command line
+	std::map<std::string, int> found;
+	size_t asking;                              // answers still to come
+	uint64_t asked;
+	std::vector<std::pair<uint32_t, long> > waiting;
+
+	std::string list() const;
+};
+
+class CoapServer;
+class Store;
+
+/*
+ * The epoll loop, with the Chariots and the clients.
+ */
+class Gateway {
+public:
+	Gateway();
+	~Gateway();
+
+	bool addShield(const char *tty, int baud);
+	void route(const std::string &mote, int shield) { directory.route(mote, shield); }
+	size_t shieldCount() const { return shields.size(); }
+	bool listen(int port, bool websocket);
+	bool listenCoap(int port);
+	bool openStore(const char *path);
+	int run();
+	static void stop(int);      // a signal handler: run() returns
+
+	void watch(int fd, Pollable *p, uint32_t events, bool add);
+	void unwatch(int fd);
+
+	// From the clients. A detached client's requests and observes are
+	// dropped after the events in hand.
+	void attach(Client &client);
+	void detach(Client &client);
+	void request(Client &client, std::string line, long tag);
+
+	// From the connections
+	void accepted(int fd, bool websocket);
+	void closed(Conn &conn);
+
+	// From the Chariots
+	void deliver(uint32_t client, long tag, const std::string &text, unsigned latencyMs, bool notification);
+	bool send(int shield, uint32_t client, long tag, const std::string &line);
+	void sample(const std::string &resource, const std::string &text);
+
+private:
+	static volatile sig_atomic_t stopping;
+	int epfd;
+	std::vector<Shield *> shields;
+	Directory directory;
+	uint32_t nextId;
+	std::map<uint32_t, Client *> clients;
+	std::vector<uint32_t> leaving;          // detached, to leave the brokers
+	std::set<Conn *> conns;
+	std::vector<Pollable *> dead;           // deleted after the events in hand
+	std::vector<Listener *> listeners;
+	CoapServer *coap;
+	Store *store;
+
+	void storeCommand(Client &client, long tag, const std::string &line);
+};
+
+#endif /* CHARIOT_GATEWAY_H_ */
@@ -0,0 +1,76 @@
+/*
+ * Chariot gateway: main().
+ *
+ *   chariot-gw -d /dev/ttyACM0 [-d /dev/ttyACM1 ...] [-r mote=n ...] [-b 9600]
+ *              [-w 1337] [-t 1338] [-c 5683] [-s samples.db]
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include "gateway.h"
+#include "../coap-constants.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*---------------------------------------------------------------------------*/
+static void usage()
+{
+	fprintf(stderr, "usage: chariot-gw -d tty [-d tty ...] [-r mote=n ...] [-b baud]\n"
+	                "                  [-w websocket port] [-t tcp port] [-c coap port] [-s store file]\n"
+	                "       a port of 0 turns that service off\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<const char *> ttys;
+	std::vector<std::string> routes;
+	const char *storePath = NULL;
+	int baud = GW_BAUD, wsPort = GW_WS_PORT, tcpPort = GW_TCP_PORT;
+	int coapPort = COAP_DEFAULT_PORT, opt;
+	size_t i, eq;
+
+	while ((opt = getopt(argc, argv, "d:r:b:w:t:c:s:")) != -1) {
+		switch (opt) {
+		case 'd': ttys.push_back(optarg); break;
+		case 'r': routes.push_back(optarg); break;
+		case 'b': baud = atoi(optarg); break;
+		case 'w': wsPort = atoi(optarg); break;
+		case 't': tcpPort = atoi(optarg); break;
+		case 'c': coapPort = atoi(optarg); break;
+		case 's': storePath = optarg; break;
+		default:  usage();
+		}
+	}
+	if (ttys.empty())
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, Gateway::stop);
+	signal(SIGTERM, Gateway::stop);
+
+	Gateway gw;
+	for (i = 0; i < ttys.size(); i++) {
+		if (!gw.addShield(ttys[i], baud))
+			return 1;
+	}
+	// -r chariot.c350e.local=1: that mote is on the second Chariot
+	for (i = 0; i < routes.size(); i++) {
+		eq = routes[i].find('=');
+		if (eq == std::string::npos || atoi(routes[i].c_str() + eq + 1) >= (int)ttys.size())
+			usage();
+		gw.route(routes[i].substr(0, eq), atoi(routes[i].c_str() + eq + 1));
+	}
+	if (storePath && !gw.openStore(storePath))
+		return 1;
+	if ((wsPort && !gw.listen(wsPort, true)) || (tcpPort && !gw.listen(tcpPort, false)) ||
+	    (coapPort && !gw.listenCoap(coapPort)))
+		return 1;
+	for (i = 0; i < ttys.size(); i++)
+		fprintf(stderr, "chariot-gw: chariot %zu on %s\n", i, ttys[i]);
+	fprintf(stderr, "chariot-gw: websocket port %d, tcp port %d, coap port %d\n", wsPort, tcpPort, coapPort);
+	return gw.run();
+}
@@ -0,0 +1,313 @@
+/*
+ * Chariot gateway: a worker per Chariot, and the mote directory across them.
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include "gateway.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <system_error>
+
+/*---------------------------------------------------------------------------*/
+Shield::Shield(Gateway &gw) :
+	gw(gw), broker(link, *this), wakeEv(-1), readyEv(-1), kicked(false),
+	stopping(false), linkLost(false), delivered(false)
+{
+}
+
+Shield::~Shield()
+{
+	stop();
+	if (wakeEv != -1)
+		close(wakeEv);
+	if (readyEv != -1)
+		close(readyEv);
+}
+
+bool Shield::open(const char *tty, int baud)
+{
+	if (!link.open(tty, baud))
+		return false;
+	wakeEv = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	readyEv = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeEv == -1 || readyEv == -1) {
+		perror("eventfd");
+		return false;
+	}
+	return true;
+}
+
+bool Shield::start()
+{
+	try {
+		worker = std::thread(&Shield::run, this);
+	} catch (const std::system_error &e) {
+		fprintf(stderr, "%s: %s\n", name().c_str(), e.what());
+		return false;
+	}
+	return true;
+}
+
+void Shield::stop()
+{
+	if (!worker.joinable())
+		return;
+	stopping = true;
+	signal(wakeEv);
+	worker.join();
+}
+
+void Shield::signal(int ev)
+{
+	uint64_t one = 1;
+
+	if (write(ev, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		perror("eventfd write");
+}
+
+/*
+ * The loop's side
+ */
+bool Shield::request(uint32_t client, long tag, const std::string &line)
+{
+	Message m;
+
+	m.client = client;
+	m.tag = tag;
+	m.text = line;
+	if (!inbox.push(m))
+		return false;
+	kicked = true;
+	return true;
+}
+
+bool Shield::leave(uint32_t client)
+{
+	Message m;
+
+	m.kind = LEAVE;
+	m.client = client;
+	if (!inbox.push(m))
+		return false;
+	kicked = true;
+	return true;
+}
+
+// One wakeup for everything queued during the events in hand
+void Shield::kick()
+{
+	if (kicked)
+		signal(wakeEv);
+	kicked = false;
+}
+
+void Shield::event(uint32_t)
+{
+	uint64_t n;
+	Message m;
+
+	if (read(readyEv, &n, sizeof(n)) == -1 && errno != EAGAIN)
+		perror("eventfd read");
+	while (outbox.pop(m)) {
+		if (m.kind == SAMPLE)
+			gw.sample(m.resource, m.text);
+		else
+			gw.deliver(m.client, m.tag, m.text, m.latencyMs, m.notification);
+	}
+}
+
+/*
+ * The worker's side: the link and the broker, as the loop had them when there
+ * was one Chariot.
+ */
+void Shield::deliver(uint32_t client, long tag, const std::string &text, unsigned latencyMs, bool notification)
+{
+	Message m;
+
+	m.kind = RESPONSE;
+	m.client = client;
+	m.tag = tag;
+	m.text = text;
+	m.latencyMs = latencyMs;
+	m.notification = notification;
+	push(m);
+}
+
+void Shield::sample(const std::string &resource, const std::string &text)
+{
+	Message m;
+
+	m.kind = SAMPLE;
+	m.resource = resource;
+	m.text = text;
+	push(m);
+}
+
+void Shield::push(Message &m)
+{
+	// Keep order behind anything already waiting for room
+	if (!overflow.empty() || !outbox.push(m))
+		overflow.push_back(m);
+	else
+		delivered = true;
+}
+
+void Shield::run()
+{
+	struct epoll_event ev, events[4];
+	std::vector<std::string> responses;
+	uint64_t now, lastTick = nowMs(), count;
+	bool linkOut = false;
+	int epfd, n, i;
+	size_t r;
+	Message m;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = link.fd();
+	epoll_ctl(epfd, EPOLL_CTL_ADD, link.fd(), &ev);
+	ev.data.fd = wakeEv;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakeEv, &ev);
+
+	while (!stopping && !linkLost) {
+		n = epoll_wait(epfd, events, 4, overflow.empty() ? GW_TICK_MS : 1);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == wakeEv) {
+				if (read(wakeEv, &count, sizeof(count)) == -1 && errno != EAGAIN)
+					perror("eventfd read");
+				continue;
+			}
+			if ((events[i].events & EPOLLOUT) && !link.flush())
+				linkLost = true;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				responses.clear();
+				if (!link.readable(responses))
+					linkLost = true;
+				for (r = 0; r < responses.size(); r++)
+					broker.response(responses[r]);
+			}
+		}
+
+		while (inbox.pop(m)) {
+			if (m.kind == LEAVE)
+				broker.leave(m.client);
+			else if (!broker.request(m.client, m.tag, m.text))
+				deliver(m.client, m.tag, "5.03 Service Unavailable: too many requests waiting", 0, false);
+		}
+
+		now = nowMs();
+		if (now - lastTick >= GW_TICK_MS) {
+			broker.tick(now);
+			lastTick = now;
+		}
+
+		// Requests the broker wrote to the link
+		if (link.pending() && !link.flush())
+			linkLost = true;
+		if (linkOut != link.pending()) {
+			linkOut = link.pending();
+			ev.events = EPOLLIN | (linkOut ? (uint32_t)EPOLLOUT : 0);
+			ev.data.fd = link.fd();
+			epoll_ctl(epfd, EPOLL_CTL_MOD, link.fd(), &ev);
+		}
+
+		// Responses to the loop, with one wakeup
+		while (!overflow.empty() && outbox.push(overflow.front())) {
+			overflow.pop_front();
+			delivered = true;
+		}
+		if (delivered)
+			signal(readyEv);
+		delivered = false;
+	}
+	if (linkLost)
+		signal(readyEv);	// the loop notices, and stops
+	close(epfd);
+}
+
+/*---------------------------------------------------------------------------*/
+int Directory::shieldOf(const std::string &mote) const
+{
+	std::map<std::string, int>::const_iterator r = routes.find(mote);
+
+	if (r != routes.end() || (r = found.find(mote)) != found.end())
+		return r->second;
+	return 0;
+}
+
+// Every Chariot is asked for its motes; the answers come tagged with its number
+void Directory::refresh(uint64_t now, size_t shields)
+{
+	size_t i;
+
+	if (asking || (asked && now - asked < GW_DIRECTORY_MS))
+		return;
+	asked = now;
+	for (i = 0; i < shields; i++) {
+		if (gw.send(i, id(), i, "sys/motes"))
+			asking++;
+	}
+}
+
+void Directory::ask(Client &client, long tag)
+{
+	if (asking) {
+		waiting.push_back(std::make_pair(client.id(), tag));
+		return;
+	}
+	client.deliver(tag, list(), 0, false);
+}
+
+// As Chariot gives it: "motes:", then a name per line
+std::string Directory::list() const
+{
+	std::map<std::string, int>::const_iterator m;
+	std::string text = "2.05 CONTENT motes:";
+
+	for (m = found.begin(); m != found.end(); ++m)
+		text += "\n" + m->first;
+	return text;
+}
+
+void Directory::deliver(long tag, const std::string &text, unsigned, bool)
+{
+	std::map<std::string, int>::iterator m, next;
+	size_t at = text.find("motes:"), b, e;
+	size_t i;
+
+	if (at != std::string::npos && text.compare(0, 4, "2.05") == 0) {
+		// What this Chariot had before is replaced
+		for (m = found.begin(); m != found.end(); m = next) {
+			next = m;
+			++next;
+			if (m->second == tag)
+				found.erase(m);
+		}
+		for (b = at + 6; ; b = e) {
+			b = text.find_first_not_of(" \t\r\n", b);
+			if (b == std::string::npos)
+				break;
+			e = text.find_first_of(" \t\r\n", b);
+			if (e == std::string::npos)
+				e = text.size();
+			found[text.substr(b, e - b)] = tag;
+		}
+	} else {
+		fprintf(stderr, "chariot %ld: sys/motes: %s\n", tag, text.c_str());
+	}
+
+	if (asking && --asking)
+		return;
+	for (i = 0; i < waiting.size(); i++)
+		gw.deliver(waiting[i].first, waiting[i].second, list(), 0, false);
+	waiting.clear();
+}
@@ -0,0 +1,216 @@
+/*
+ * Chariot simulator: a pty that answers like a Chariot on its serial channel,
+ * for running the gateway without one.
+ *
+ *   chariot-sim [-r mesh round trip ms] [-n notification period ms] [-b baud]
+ *               [-m mote,mote,...]
+ *
+ * It prints the pty's name; give that to chariot-gw -d. Requests are answered
+ * one at a time in the order they come, each after the mesh round trip plus
+ * the time its response takes on the serial line:
+ *   coap://<mote>/<resource>?get    2.05 CONTENT <value>
+ *   coap://<mote>/<resource>?obs    2.05 CONTENT TKN=<token> <value>, then
+ *                                   the same every notification period
+ *   ?put ?post ?del                 2.04 CHANGED, 2.01 CREATED, 2.02 DELETED
+ *   coap://<mote>/.well-known/core?get   the mote's resources, in link format
+ *   sys/motes                       2.05 CONTENT motes:, then the -m motes
+ * A ?get of an observed resource cancels its observe. Motes whose name has
+ * "offline" in it never answer. Given -m, a mote not in it is 4.04 NOT_FOUND,
+ * as on a Chariot whose mesh doesn't have it. Values are a slow wave per
+ * resource.
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <map>
+#include <string>
+
+static uint64_t nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct Pending {
+	std::string text;
+	uint64_t due;
+};
+
+static int master;
+static unsigned rtt = 50, period = 1000, baud = 9600;
+static std::deque<Pending> out;
+static uint64_t lineFree;                           // serial line idle from
+static std::map<std::string, std::string> observed;  // resource: token
+static unsigned nextToken = 0x1000;
+static std::string motes;                           // -m, "," around each
+
+// Responses go out in order, each after the line is free
+static void respond(const std::string &text, uint64_t ready)
+{
+	Pending p;
+	uint64_t start = ready > lineFree ? ready : lineFree;
+
+	p.text = text + "<<";
+	p.due = start + (p.text.size() * 10 * 1000) / baud;
+	lineFree = p.due;
+	out.push_back(p);
+}
+
+static std::string value(const std::string &resource)
+{
+	unsigned h = 0;
+	char buf[32];
+	size_t i;
+
+	for (i = 0; i < resource.size(); i++)
+		h = h * 31 + (unsigned char)resource[i];
+	snprintf(buf, sizeof(buf), "%.2f", 20 + 5 * sin(nowMs() / 10000.0 + h % 100));
+	return buf;
+}
+
+// Enough resources that the list takes more than one CoAP block
+static std::string core()
+{
+	std::string links;
+	char link[64];
+	int i;
+
+	for (i = 0; i < 40; i++) {
+		snprintf(link, sizeof(link), "%s</sensors/s%02d>;obs;rt=\"sensor\"", i ? "," : "", i);
+		links += link;
+	}
+	return links;
+}
+
+static void request(const std::string &line)
+{
+	size_t q = line.find('?');
+	std::string resource = line.substr(0, q), method = q == std::string::npos ? "" : line.substr(q + 1, 3);
+	uint64_t ready = nowMs() + rtt;
+	char token[16];
+
+	if (line.compare(0, 4, "coap") != 0) {
+		if (line == "sys/motes") {
+			std::string list = "2.05 CONTENT motes:";
+			for (size_t b = 1, e; b < motes.size(); b = e + 1) {
+				e = motes.find(',', b);
+				list += "\n" + motes.substr(b, e - b);
+			}
+			respond(list, ready);
+		} else {
+			respond(line == "sys/health" ? "OK" : "Unknown command: " + line, nowMs());
+		}
+		return;
+	}
+	if (line.find("offline") != std::string::npos)
+		return;
+	if (!motes.empty() && motes.find("," + line.substr(7, line.find_first_of("/?", 7) - 7) + ",") == std::string::npos) {
+		respond("4.04 NOT_FOUND", ready);
+		return;
+	}
+
+	if (method == "get" && resource.find("/.well-known/core") != std::string::npos) {
+		respond("2.05 CONTENT " + core(), ready);
+	} else if (method == "get") {
+		observed.erase(resource);
+		respond("2.05 CONTENT " + value(resource), ready);
+	} else if (method == "obs") {
+		snprintf(token, sizeof(token), "%x", nextToken++);
+		observed[resource] = token;
+		respond(std::string("2.05 CONTENT TKN=") + token + " " + value(resource), ready);
+	} else if (method == "put") {
+		respond("2.04 CHANGED", ready);
+	} else if (method == "pos") {
+		respond("2.01 CREATED", ready);
+	} else if (method == "del") {
+		respond("2.02 DELETED", ready);
+	} else {
+		respond("4.05 METHOD_NOT_ALLOWED", ready);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct termios tio;
+	std::string rx;
+	uint64_t now, nextNotify;
+	std::map<std::string, std::string>::iterator o;
+	struct pollfd pfd;
+	char buf[512];
+	ssize_t n;
+	int opt, slave;
+	size_t nl;
+
+	while ((opt = getopt(argc, argv, "r:n:b:m:")) != -1) {
+		switch (opt) {
+		case 'r': rtt = atoi(optarg); break;
+		case 'n': period = atoi(optarg); break;
+		case 'b': baud = atoi(optarg); break;
+		case 'm': motes = std::string(",") + optarg + ","; break;
+		default:
+			fprintf(stderr, "usage: chariot-sim [-r round trip ms] [-n notification period ms] [-b baud] [-m mote,...]\n");
+			return 2;
+		}
+	}
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) || unlockpt(master)) {
+		perror("pty");
+		return 1;
+	}
+	// Keep the slave open, raw, so the master never sees a hangup
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (slave != -1 && tcgetattr(slave, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(slave, TCSANOW, &tio);
+	}
+	printf("%s\n", ptsname(master));
+	fflush(stdout);
+
+	nextNotify = nowMs() + period;
+	pfd.fd = master;
+	pfd.events = POLLIN;
+	for (;;) {
+		poll(&pfd, 1, 5);
+		now = nowMs();
+
+		if (pfd.revents & POLLIN) {
+			n = read(master, buf, sizeof(buf));
+			if (n > 0)
+				rx.append(buf, n);
+			while ((nl = rx.find('\n')) != std::string::npos) {
+				std::string line = rx.substr(0, nl);
+				rx.erase(0, nl + 1);
+				if (!line.empty() && line[line.size() - 1] == '\r')
+					line.erase(line.size() - 1);
+				if (!line.empty())
+					request(line);
+			}
+		}
+
+		if (period && now >= nextNotify) {
+			for (o = observed.begin(); o != observed.end(); ++o)
+				respond("2.05 CONTENT TKN=" + o->second + " " + value(o->first), now);
+			nextNotify = now + period;
+		}
+
+		while (!out.empty() && out.front().due <= now) {
+			if (write(master, out.front().text.data(), out.front().text.size()) < 0)
+				perror("write");
+			out.pop_front();
+		}
+	}
+}
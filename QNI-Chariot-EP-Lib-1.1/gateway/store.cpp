@@ -0,0 +1,450 @@
+/*
+ * Chariot gateway: the store of reported values.
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include "store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#define STORE_MAGIC         0x53544843  // "CHTS"
+#define STORE_HEADER_LEN    32
+
+// Block kinds
+#define KIND_NAME           0           // a series' name, which is its number
+#define KIND_NUMBER         1
+#define KIND_TEXT           2
+
+/*
+ * A block header, little-endian:
+ *   0 magic  4 series  8 body length  12 count  14 kind  15 decimal places
+ *  16 first time  24 last time (ms)
+ * The magic is written last, so a block cut short never counts.
+ */
+static uint32_t get32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static uint16_t get16(const uint8_t *p) { uint16_t v; memcpy(&v, p, 2); return v; }
+static uint64_t get64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+
+static void putVarint(std::string &out, uint64_t v)
+{
+	while (v >= 0x80) {
+		out += (char)(v | 0x80);
+		v >>= 7;
+	}
+	out += (char)v;
+}
+
+static bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v)
+{
+	int shift;
+
+	v = 0;
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// A decimal as its digits and places, "-21.50" -> -2150, 2
+static std::string decimal(int64_t mantissa, unsigned places)
+{
+	char digits[32];
+	std::string s;
+	uint64_t m = mantissa < 0 ? -(uint64_t)mantissa : mantissa;
+
+	snprintf(digits, sizeof(digits), "%0*llu", places + 1, (unsigned long long)m);
+	s = digits;
+	if (places)
+		s.insert(s.size() - places, ".");
+	return mantissa < 0 ? "-" + s : s;
+}
+
+// Only if it reads back as it came, in 18 digits at most--any int64_t
+static bool parseDecimal(const std::string &value, int64_t &mantissa, unsigned &places)
+{
+	size_t i = value[0] == '-' ? 1 : 0, dot = value.find('.');
+	int64_t m = 0;
+	unsigned digits = 0;
+
+	if (i == value.size())
+		return false;
+	places = dot == std::string::npos ? 0 : value.size() - dot - 1;
+	for (; i < value.size(); i++) {
+		if (i == dot)
+			continue;
+		if (value[i] < '0' || value[i] > '9' || ++digits > 18)
+			return false;
+		m = m * 10 + (value[i] - '0');
+	}
+	mantissa = value[0] == '-' ? -m : m;
+	return digits > 0 && decimal(mantissa, places) == value;
+}
+
+/*---------------------------------------------------------------------------*/
+Store::Store() : fd(-1), map(NULL), mapped(0), end(0)
+{
+}
+
+Store::~Store()
+{
+	flush();
+	if (map)
+		munmap(map, mapped);
+	if (fd != -1)
+		close(fd);
+}
+
+uint64_t Store::wallMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool Store::open(const char *path)
+{
+	struct stat st;
+	const uint8_t *h;
+	uint32_t id, len;
+	Block block;
+
+	fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+	mapped = st.st_size;
+	if (mapped == 0) {
+		mapped = GW_STORE_GROW;
+		if (ftruncate(fd, mapped) == -1) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			return false;
+		}
+	}
+	map = (uint8_t *)mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	// The blocks end at the first that isn't whole
+	for (end = 0; end + STORE_HEADER_LEN <= mapped; end = (end + STORE_HEADER_LEN + len + 7) & ~(size_t)7) {
+		h = map + end;
+		len = get32(h + 8);
+		id = get32(h + 4);
+		if (get32(h) != STORE_MAGIC || end + STORE_HEADER_LEN + len > mapped)
+			break;
+		if (h[14] == KIND_NAME) {
+			if (id != series.size())
+				break;
+			series.push_back(Series());
+			series.back().name.assign((const char *)h + STORE_HEADER_LEN, len);
+			series.back().samples = 0;
+			series.back().first = series.back().last = 0;
+			series.back().ordered = true;
+			ids[series.back().name] = id;
+			continue;
+		}
+		if (id >= series.size())
+			break;
+		block.offset = end;
+		block.t0 = get64(h + 16);
+		block.t1 = get64(h + 24);
+		Series &s = series[id];
+		if (!s.blocks.empty() && block.t0 < s.blocks.back().t1)
+			s.ordered = false;
+		s.blocks.push_back(block);
+		s.first = s.samples ? std::min(s.first, block.t0) : block.t0;
+		s.samples += get16(h + 12);
+		s.last = std::max(s.last, block.t1);
+	}
+	return true;
+}
+
+bool Store::append(uint32_t id, uint8_t kind, uint8_t scale, uint16_t count, uint64_t t0, uint64_t t1,
+                   const std::string &body)
+{
+	size_t need = end + STORE_HEADER_LEN + body.size(), size;
+	uint32_t magic = STORE_MAGIC, len = body.size();
+	uint8_t *h, *m;
+
+	if (need > mapped) {
+		size = (need + GW_STORE_GROW - 1) / GW_STORE_GROW * GW_STORE_GROW;
+		if (ftruncate(fd, size) == -1 ||
+		    (m = (uint8_t *)mremap(map, mapped, size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+			perror("store");
+			return false;
+		}
+		map = m;
+		mapped = size;
+	}
+	h = map + end;
+	memset(h, 0, STORE_HEADER_LEN);
+	memcpy(h + 4, &id, 4);
+	memcpy(h + 8, &len, 4);
+	memcpy(h + 12, &count, 2);
+	h[14] = kind;
+	h[15] = scale;
+	memcpy(h + 16, &t0, 8);
+	memcpy(h + 24, &t1, 8);
+	memcpy(h + STORE_HEADER_LEN, body.data(), body.size());
+	memcpy(h, &magic, 4);
+	end = (need + 7) & ~(size_t)7;
+	return true;
+}
+
+void Store::add(const std::string &resource, const std::string &value, uint64_t t)
+{
+	std::map<std::string, uint32_t>::iterator i = ids.find(resource);
+	uint32_t id;
+	Sample sample;
+
+	if (!map)
+		return;
+	if (i == ids.end()) {
+		id = series.size();
+		if (!append(id, KIND_NAME, 0, 0, 0, 0, resource))
+			return;
+		series.push_back(Series());
+		series.back().name = resource;
+		series.back().samples = 0;
+		series.back().first = series.back().last = 0;
+		series.back().ordered = true;
+		ids[resource] = id;
+	} else {
+		id = i->second;
+	}
+
+	Series &s = series[id];
+	sample.t = t;
+	sample.value = value;
+	s.pending.push_back(sample);
+	s.first = s.samples ? std::min(s.first, t) : t;
+	s.samples++;
+	s.last = std::max(s.last, t);
+	if (s.pending.size() >= GW_STORE_BLOCK)
+		write(id);
+}
+
+// A series' pending samples as a block
+bool Store::write(uint32_t id)
+{
+	Series &s = series[id];
+	std::vector<Sample> &p = s.pending;
+	std::map<std::string, uint64_t> dict;
+	std::vector<int64_t> numbers(p.size());
+	std::string times, values;
+	int64_t delta, lastDelta = 0, lastNumber = 0;
+	uint64_t t0 = p[0].t, t1 = p[0].t;
+	unsigned places, scale = 0;
+	bool numeric = true;
+	Block block;
+	size_t i;
+
+	for (i = 0; i < p.size(); i++) {
+		t0 = std::min(t0, p[i].t);
+		t1 = std::max(t1, p[i].t);
+		if (i > 0) {
+			delta = p[i].t - p[i - 1].t;
+			putVarint(times, zigzag(delta - lastDelta));
+			lastDelta = delta;
+		}
+		if (numeric && parseDecimal(p[i].value, numbers[i], places) && (i == 0 || places == scale))
+			scale = places;
+		else
+			numeric = false;
+	}
+
+	if (numeric) {
+		for (i = 0; i < p.size(); i++) {
+			putVarint(values, zigzag(numbers[i] - lastNumber));
+			lastNumber = numbers[i];
+		}
+	} else {
+		scale = 0;
+		for (i = 0; i < p.size(); i++)
+			dict.insert(std::make_pair(p[i].value, dict.size()));
+		std::vector<const std::string *> words(dict.size());
+		for (std::map<std::string, uint64_t>::iterator d = dict.begin(); d != dict.end(); ++d)
+			words[d->second] = &d->first;
+		putVarint(values, words.size());
+		for (i = 0; i < words.size(); i++) {
+			putVarint(values, words[i]->size());
+			values += *words[i];
+		}
+		for (i = 0; i < p.size(); i++)
+			putVarint(values, dict[p[i].value]);
+	}
+
+	// The first sample's time leads; the header has the block's span
+	times.insert(0, std::string(8, '\0'));
+	memcpy(&times[0], &p[0].t, 8);
+	block.offset = end;
+	if (!append(id, numeric ? KIND_NUMBER : KIND_TEXT, scale, p.size(), t0, t1, times + values))
+		return false;
+	block.t0 = t0;
+	block.t1 = t1;
+	if (!s.blocks.empty() && t0 < s.blocks.back().t1)
+		s.ordered = false;	// the wall clock went back
+	s.blocks.push_back(block);
+	p.clear();
+	return true;
+}
+
+void Store::tick()
+{
+	uint64_t now = wallMs();
+	size_t i;
+
+	for (i = 0; i < series.size(); i++) {
+		if (!series[i].pending.empty() && now - series[i].pending[0].t >= GW_STORE_FLUSH_MS)
+			write(i);
+	}
+}
+
+void Store::flush()
+{
+	size_t i;
+
+	for (i = 0; i < series.size(); i++) {
+		if (!series[i].pending.empty())
+			write(i);
+	}
+	if (map)
+		msync(map, end, MS_ASYNC);
+}
+
+/*---------------------------------------------------------------------------*/
+void Store::decode(const Block &block, uint64_t from, uint64_t to, std::string &out, size_t &n, size_t max) const
+{
+	const uint8_t *h = map + block.offset, *p = h + STORE_HEADER_LEN, *e = p + get32(h + 8);
+	std::vector<std::string> words;
+	std::vector<uint64_t> times;
+	uint16_t count = get16(h + 12), i;
+	uint64_t v, t, len;
+	int64_t delta = 0, number = 0;
+	char ms[24];
+
+	if (e - p < 8)
+		return;
+	t = get64(p);
+	p += 8;
+	times.push_back(t);
+	for (i = 1; i < count; i++) {
+		if (!getVarint(p, e, v))
+			return;
+		delta += unzigzag(v);
+		t += delta;
+		times.push_back(t);
+	}
+	if (h[14] == KIND_TEXT) {
+		if (!getVarint(p, e, len))
+			return;
+		while (len-- > 0) {
+			if (!getVarint(p, e, v) || v > (uint64_t)(e - p))
+				return;
+			words.push_back(std::string((const char *)p, v));
+			p += v;
+		}
+	}
+
+	for (i = 0; i < count && n < max; i++) {
+		if (!getVarint(p, e, v))
+			return;
+		// Every delta counts, in the range or not
+		if (h[14] == KIND_NUMBER)
+			number += unzigzag(v);
+		if (times[i] < from || times[i] > to)
+			continue;
+		snprintf(ms, sizeof(ms), "%llu ", (unsigned long long)times[i]);
+		out += ms;
+		if (h[14] == KIND_NUMBER) {
+			out += decimal(number, h[15]);
+		} else if (v < words.size()) {
+			out += words[v];
+		}
+		out += "\n";
+		n++;
+	}
+}
+
+static bool endsBefore(const Store::Block &block, uint64_t t)
+{
+	return block.t1 < t;
+}
+
+std::string Store::query(const std::string &prefix, uint64_t from, uint64_t to, size_t max) const
+{
+	std::vector<Block>::const_iterator b;
+	std::string out;
+	size_t i, j, n = 0, named = 0, before = 0;
+	char ms[24];
+
+	// One sample past max is read, to know whether there are more
+	for (i = 0; i < series.size() && n <= max; i++) {
+		const Series &s = series[i];
+		if (s.name.compare(0, prefix.size(), prefix) != 0 || !s.samples || s.last < from || s.first > to)
+			continue;
+		named = out.size();
+		before = n;
+		out += s.name + "\n";
+		// Blocks in time order: only those the range touches are read. Else all are.
+		b = s.ordered ? std::lower_bound(s.blocks.begin(), s.blocks.end(), from, endsBefore) : s.blocks.begin();
+		for (; b != s.blocks.end() && (b->t0 <= to || !s.ordered) && n <= max; ++b) {
+			if (b->t1 >= from && b->t0 <= to)
+				decode(*b, from, to, out, n, max + 1);
+		}
+		for (j = 0; j < s.pending.size() && n <= max; j++) {
+			if (s.pending[j].t < from || s.pending[j].t > to)
+				continue;
+			snprintf(ms, sizeof(ms), "%llu ", (unsigned long long)s.pending[j].t);
+			out += ms + s.pending[j].value + "\n";
+			n++;
+		}
+	}
+	if (n > max) {
+		if (before == max)
+			out.erase(named);	// its series had only that one
+		else
+			out.erase(out.rfind('\n', out.size() - 2) + 1);
+		out += "(more)\n";
+	}
+	return out;
+}
+
+std::string Store::list() const
+{
+	std::string out;
+	char line[80];
+	size_t i;
+
+	for (i = 0; i < series.size(); i++) {
+		snprintf(line, sizeof(line), " %llu %llu %llu\n", (unsigned long long)series[i].samples,
+		         (unsigned long long)series[i].first, (unsigned long long)series[i].last);
+		out += series[i].name + line;
+	}
+	return out;
+}
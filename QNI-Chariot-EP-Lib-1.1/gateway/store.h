@@ -0,0 +1,92 @@
+/*
+ * Chariot gateway: a store of the values motes report, kept on disk.
+ *
+ * Every notification, and every response to a ?get or ?obs, is a sample of
+ * its resource ("coap://<mote>/<path>") at the time it came. Samples are kept
+ * per resource--a series--and written in blocks to one append-only file,
+ * which is memory-mapped. A block holds one series' samples over a stretch
+ * of time:
+ *   timestamps     varint delta of deltas; a steady observe costs a byte
+ *   numbers        varint deltas, when every value is a decimal with the
+ *                  same number of places, so they read back as they came
+ *   anything else  a dictionary of the block's distinct values, and an
+ *                  index per sample
+ * Each block's header has its time span, and an index of them is kept in
+ * memory, so a query over a time range reads only the blocks in it--unless
+ * the wall clock went back, and a series' blocks are out of order. A series'
+ * name is written once, in a block of its own, and blocks refer to it by
+ * number.
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#ifndef CHARIOT_GATEWAY_STORE_H_
+#define CHARIOT_GATEWAY_STORE_H_
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define GW_STORE_BLOCK      512         // samples per block at most
+#define GW_STORE_FLUSH_MS   300000      // a block is written when it is this old, if not full
+#define GW_STORE_GROW       (1 << 20)   // the file grows this much at a time
+#define GW_STORE_MAX_QUERY  10000       // samples a query returns at most
+
+class Store {
+public:
+	Store();
+	~Store();
+
+	// Opens the file, or creates it, and indexes the blocks in it
+	bool open(const char *path);
+
+	// A sample at a wall clock time in ms
+	void add(const std::string &resource, const std::string &value, uint64_t t);
+	void tick();                // writes blocks old enough
+	void flush();               // writes them all
+
+	/*
+	 * Samples of each series whose name starts with the prefix, from and to
+	 * wall clock times in ms: a "<series>" line, then "<ms> <value>" lines.
+	 * A "(more)" line ends it if there were more than max.
+	 */
+	std::string query(const std::string &prefix, uint64_t from, uint64_t to, size_t max) const;
+	// The series, with their samples and time spans
+	std::string list() const;
+
+	static uint64_t wallMs();
+
+	struct Block {
+		size_t offset;
+		uint64_t t0, t1;        // its span
+	};
+
+private:
+	struct Sample {
+		uint64_t t;
+		std::string value;
+	};
+	struct Series {
+		std::string name;
+		std::vector<Block> blocks;
+		std::vector<Sample> pending;    // not yet written
+		uint64_t samples;
+		uint64_t first, last;
+		bool ordered;                   // each block starts after the one before ends
+	};
+
+	int fd;
+	uint8_t *map;
+	size_t mapped;              // the file's size
+	size_t end;                 // where the next block goes
+	std::vector<Series> series;
+	std::map<std::string, uint32_t> ids;
+
+	bool append(uint32_t id, uint8_t kind, uint8_t scale, uint16_t count, uint64_t t0, uint64_t t1,
+	            const std::string &body);
+	bool write(uint32_t id);
+	void decode(const Block &block, uint64_t from, uint64_t to, std::string &out, size_t &n, size_t max) const;
+};
+
+#endif /* CHARIOT_GATEWAY_STORE_H_ */
@@ -0,0 +1,107 @@
+/*
+ * Chariot gateway: CoAP message parsing, and what CoAP requests become.
+ *
+ *   g++ -std=c++11 -Wall -pthread -I.. -o coap-test coap-test.cpp ../gateway.cpp ../broker.cpp \
+ *       ../clients.cpp ../coap.cpp ../shield.cpp ../store.cpp
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include "coap.h"
+#include "../coap-constants.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+static int failed = 0;
+
+static void check(bool ok, const char *what, const std::string &got)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL %s: %s\n", what, got.c_str());
+		failed++;
+	}
+}
+
+static CoapMessage request(uint8_t code)
+{
+	CoapMessage req;
+
+	req.type = COAP_TYPE_CON;
+	req.code = code;
+	req.mid = 0x1234;
+	req.token = "tk";
+	return req;
+}
+
+// What the request becomes, or "error <code>"
+static std::string translate(const CoapMessage &req)
+{
+	std::string resource, line, why;
+	uint8_t error = 0;
+
+	if (!CoapServer::translate(req, resource, line, error, why))
+		return "error " + std::to_string(error);
+	return resource + " " + line;
+}
+
+static void proxyUri(const char *uri, uint8_t code, const char *payload, const char *expect)
+{
+	CoapMessage req = request(code);
+
+	req.add(COAP_OPTION_PROXY_URI, uri);
+	req.payload = payload;
+	check(translate(req) == expect, uri, translate(req));
+}
+
+int main()
+{
+	CoapMessage req, parsed;
+	std::string wire;
+
+	alarm(5);	// a parse that never ends fails too
+
+	// Round trip, with an option delta and a length past 12
+	req = request(COAP_GET);
+	req.add(COAP_OPTION_URI_HOST, "chariot.c350e.local");
+	req.add(COAP_OPTION_URI_PATH, "sensors");
+	req.add(COAP_OPTION_URI_PATH, "tmp275-c");
+	req.addUint(COAP_OPTION_OBSERVE, 0);
+	wire = req.serialize();
+	check(parsed.parse((const uint8_t *)wire.data(), wire.size()), "parse", "false");
+	check(parsed.serialize() == wire, "round trip", parsed.serialize());
+	check(parsed.token == "tk" && parsed.mid == 0x1234, "token and mid", parsed.token);
+	check(translate(parsed) == "coap://chariot.c350e.local/sensors/tmp275-c "
+	                           "coap://chariot.c350e.local/sensors/tmp275-c?obs", "uri-host", translate(parsed));
+
+	// The mote as the first path segment; a command
+	req = request(COAP_GET);
+	req.add(COAP_OPTION_URI_PATH, "m3.local");
+	req.add(COAP_OPTION_URI_PATH, "sensors");
+	check(translate(req) == "coap://m3.local/sensors coap://m3.local/sensors?get", "path", translate(req));
+	req = request(COAP_GET);
+	req.add(COAP_OPTION_URI_PATH, "chariot");
+	req.add(COAP_OPTION_URI_PATH, "sys");
+	req.add(COAP_OPTION_URI_PATH, "health");
+	check(translate(req) == "sys/health sys/health", "command", translate(req));
+
+	// Proxy-Uri, with and without a query
+	proxyUri("coap://chariot.c350e.local/sensors/tmp", COAP_GET, "",
+	         "coap://chariot.c350e.local/sensors/tmp coap://chariot.c350e.local/sensors/tmp?get");
+	proxyUri("coap://chariot.c350e.local/sensors/tmp?x=1", COAP_GET, "",
+	         "coap://chariot.c350e.local/sensors/tmp coap://chariot.c350e.local/sensors/tmp?get&x=1");
+	proxyUri("coap://m3.local/arduino/digital?pin=13", COAP_PUT, "1",
+	         "coap://m3.local/arduino/digital coap://m3.local/arduino/digital?put&pin=13&val=1");
+	proxyUri("coap://m3.local/sensors/", COAP_GET, "", "coap://m3.local/sensors/ coap://m3.local/sensors/?get");
+	proxyUri("coap://m3.local/", COAP_GET, "", "coap://m3.local/ coap://m3.local/?get");
+	proxyUri("coap://m3.local", COAP_GET, "", "coap://m3.local/ coap://m3.local/?get");
+	proxyUri("coap://m3.local?x=1", COAP_GET, "", "coap://m3.local/ coap://m3.local/?get&x=1");
+	proxyUri("coap://127.0.0.1/chariot/sys/health", COAP_GET, "", "sys/health sys/health");
+	proxyUri("coap://127.0.0.1/chariot/sys/health?x=1", COAP_GET, "", "sys/health sys/health?x=1");
+	proxyUri("http://m3.local/sensors", COAP_GET, "", "error 165");
+
+	if (failed)
+		return 1;
+	printf("coap-test: ok\n");
+	return 0;
+}
@@ -0,0 +1,438 @@
+#!/usr/bin/env python3
+#
+# Chariot gateway, end to end: chariot-gw against chariot-sim, over raw TCP,
+# WebSocket and CoAP. Responses go back to the request that asked, observes
+# are shared, and what motes report can be queried from the store. Then with
+# two chariot-sims, motes go to the Chariot that has them.
+#
+#   cd .. && g++ -std=c++11 -O2 -Wall -pthread -o chariot-gw main.cpp gateway.cpp broker.cpp clients.cpp \
+#       coap.cpp shield.cpp store.cpp && g++ -std=c++11 -O2 -Wall -o chariot-sim sim/chariot-sim.cpp
+#   cd test && ./gateway-test.py [chariot-gw [chariot-sim]]
+#
+# Only the Python 3 standard library is needed. The gateway runs on ports
+# 21337 (WebSocket), 21338 (raw TCP) and 25683 (CoAP).
+#
+# Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+# Copyright 2016, Qualia Networks, Inc.
+
+import base64, hashlib, os, random, re, socket, struct, subprocess, sys, tempfile, time
+
+WS_PORT, TCP_PORT, COAP_PORT = 21337, 21338, 25683
+MOTE = 'm3.local'
+failed = 0
+
+def check(ok, what, got):
+    global failed
+    if not ok:
+        sys.stderr.write('FAIL %s: %r\n' % (what, got))
+        failed += 1
+
+# Raw TCP: a request per line, each response ending "<<"
+class Raw:
+    def __init__(self):
+        self.s = socket.create_connection(('127.0.0.1', TCP_PORT))
+        self.buf = b''
+
+    def send(self, line):
+        self.s.sendall(line.encode() + b'\n')
+
+    # Responses that come within secs
+    def read(self, secs):
+        end = time.time() + secs
+        while time.time() < end:
+            self.s.settimeout(max(end - time.time(), 0.01))
+            try:
+                data = self.s.recv(65536)
+            except socket.timeout:
+                break
+            if not data:
+                break
+            self.buf += data
+        out = self.buf.decode().split('<<\n')
+        self.buf = out.pop().encode()
+        return out
+
+    # The answer to the request tagged tag, passing over notifications
+    def answer(self, tag, secs=5):
+        end = time.time() + secs
+        while time.time() < end:
+            for r in self.read(min(0.2, end - time.time())):
+                if r.startswith('#%d ' % tag):
+                    return r[len('#%d ' % tag):]
+        return None
+
+    # The next n responses
+    def responses(self, n, secs=5):
+        out = []
+        end = time.time() + secs
+        while len(out) < n and time.time() < end:
+            out += self.read(min(0.2, end - time.time()))
+        return out
+
+    def close(self):
+        self.s.close()
+
+# WebSocket, as the websocket-js frontend speaks it
+class Ws:
+    def __init__(self):
+        key = base64.b64encode(os.urandom(16)).decode()
+        self.s = socket.create_connection(('127.0.0.1', WS_PORT))
+        self.s.sendall(('GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n'
+                        'Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n' % key).encode())
+        self.buf = b''
+        while b'\r\n\r\n' not in self.buf:
+            self.buf += self.s.recv(4096)
+        head, self.buf = self.buf.split(b'\r\n\r\n', 1)
+        accept = base64.b64encode(hashlib.sha1((key + '258EAFA5-E914-47DA-95CA-C5AB0DC85B11').encode()).digest())
+        check(accept in head, 'websocket handshake', head)
+
+    def send(self, data, op=1):
+        if isinstance(data, str):
+            data = data.encode()
+        mask = os.urandom(4)
+        head = bytes([0x80 | op]) + (bytes([0x80 | len(data)]) if len(data) < 126
+                                     else bytes([0x80 | 126]) + struct.pack('>H', len(data)))
+        self.s.sendall(head + mask + bytes(b ^ mask[i % 4] for i, b in enumerate(data)))
+
+    # The next frame: (opcode and FIN, payload)
+    def recv(self, secs=5):
+        self.s.settimeout(secs)
+        while True:
+            if len(self.buf) >= 2:
+                n, at = self.buf[1] & 0x7f, 2
+                if n == 126:
+                    n, at = struct.unpack('>H', self.buf[2:4])[0], 4
+                if len(self.buf) >= at + n:
+                    frame = (self.buf[0], self.buf[at:at + n])
+                    self.buf = self.buf[at + n:]
+                    return frame
+            self.buf += self.s.recv(65536)
+
+    def close(self):
+        self.s.close()
+
+# CoAP over UDP (RFC 7252)
+CON, NON, ACK, RST = 0, 1, 2, 3
+GET, PUT = 1, 3
+URI_HOST, OBSERVE, URI_PATH, URI_QUERY, PROXY_URI = 3, 6, 11, 15, 35
+
+def coapCode(c):
+    return '%d.%02d' % (c >> 5, c & 31)
+
+class Coap:
+    def __init__(self):
+        self.s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.mid = random.randint(0, 0xffff)
+
+    def request(self, typ, code, token, opts=(), payload=b''):
+        def nibble(v):
+            if v < 13:
+                return v, b''
+            if v < 269:
+                return 13, bytes([v - 13])
+            return 14, struct.pack('>H', v - 269)
+
+        self.mid = (self.mid + 1) & 0xffff
+        msg = bytes([0x40 | typ << 4 | len(token), code]) + struct.pack('>H', self.mid) + token
+        last = 0
+        for num, val in sorted(opts, key=lambda o: o[0]):
+            (d, dx), (l, lx) = nibble(num - last), nibble(len(val))
+            msg += bytes([d << 4 | l]) + dx + lx + val
+            last = num
+        if payload:
+            msg += b'\xff' + payload
+        self.s.sendto(msg, ('127.0.0.1', COAP_PORT))
+        return self.mid
+
+    def recv(self, secs=5):
+        self.s.settimeout(secs)
+        b = self.s.recvfrom(2048)[0]
+        m = dict(type=(b[0] >> 4) & 3, code=coapCode(b[1]), mid=struct.unpack('>H', b[2:4])[0],
+                 token=b[4:4 + (b[0] & 15)], opts={}, payload=b'')
+        p, num = 4 + (b[0] & 15), 0
+        while p < len(b):
+            if b[p] == 0xff:
+                m['payload'] = b[p + 1:]
+                break
+            d, l = b[p] >> 4, b[p] & 15
+            p += 1
+            if d == 13:
+                d, p = 13 + b[p], p + 1
+            elif d == 14:
+                d, p = 269 + struct.unpack('>H', b[p:p + 2])[0], p + 2
+            if l == 13:
+                l, p = 13 + b[p], p + 1
+            elif l == 14:
+                l, p = 269 + struct.unpack('>H', b[p:p + 2])[0], p + 2
+            num += d
+            m['opts'][num] = b[p:p + l]
+            p += l
+        return m
+
+    # The response to a confirmable request, piggybacked or separate
+    def response(self, mid):
+        m = self.recv()
+        if m['type'] == ACK and m['mid'] == mid and m['code'] == '0.00':
+            m = self.recv()
+            if m['type'] == CON:
+                self.s.sendto(bytes([0x40 | ACK << 4, 0]) + struct.pack('>H', m['mid']), ('127.0.0.1', COAP_PORT))
+        return m
+
+def path(p):
+    return [(URI_PATH, s.encode()) for s in p.split('/')]
+
+def correlation():
+    raw = Raw()
+    # Pipelined and tagged: each answer goes with its own tag, in order
+    for i in range(1, 9):
+        raw.send('#%d coap://%s/sensors/s%02d?get' % (i, MOTE, i))
+    got = raw.responses(8)
+    check([r.split(' ')[0] for r in got] == ['#%d' % i for i in range(1, 9)], 'tags in order', got)
+    check(all(' 2.05 CONTENT ' in r for r in got), 'pipelined answers', got)
+    raw.send('#9 coap://%s/arduino/digital?put&pin=13&val=1' % MOTE)
+    got = raw.answer(9)
+    check(got == '2.04 CHANGED', 'put', got)
+
+    # Two websockets at once: each gets its own answer, then its time
+    a, b = Ws(), Ws()
+    a.send('#1 coap://%s/sensors/s01?get' % MOTE)
+    b.send('#2 coap://%s/sensors/battery?get' % MOTE)
+    for ws, tag in ((a, '#1 '), (b, '#2 ')):
+        op, text = ws.recv()
+        check(op == 0x81 and text.startswith(tag.encode() + b'2.05 CONTENT '), 'websocket ' + tag, text)
+        op, text = ws.recv()
+        check(op == 0x81 and re.match(br'^\d+\(ms\)\n$', text), 'websocket time ' + tag, text)
+
+    # Binary: the request id comes back in a response header
+    a.send(b'\x01\x00\x07coap://' + MOTE.encode() + b'/sensors/s02?get', op=2)
+    op, msg = a.recv()
+    check(op == 0x82 and msg[:3] == b'\x02\x00\x07' and msg[3] == 0x45, 'binary', msg)
+    a.close()
+    b.close()
+
+    raw.close()
+
+# A mote that never answers is answered for, after GW_REQ_TIMEOUT_MS. Chariot
+# answers in order, so nothing else may be in flight meanwhile.
+def timeout():
+    raw = Raw()
+    raw.send('#1 coap://offline.local/sensors/s01?get')
+    got = raw.answer(1, 40)
+    check(got == '5.04 Gateway Timeout', 'timeout', got)
+    raw.send('#2 coap://%s/sensors/s01?get' % MOTE)
+    got = raw.answer(2)
+    check(got and got.startswith('2.05 CONTENT '), 'after a timeout', got)
+    raw.close()
+
+def fanOut():
+    res = 'coap://%s/sensors/s05' % MOTE
+    a, b, c = Raw(), Raw(), Raw()
+
+    a.send('#1 %s?obs' % res)
+    got = a.answer(1)
+    token = re.search(r'TKN=(\w+)', got) if got else None
+    check(token and got.startswith('2.05 CONTENT TKN='), 'first observer', got)
+    token = token.group(1) if token else '?'
+    b.send('#2 %s?obs' % res)
+    got = b.answer(2)
+    check(got and got.startswith('2.05 CONTENT TKN=' + token), 'second observer joins', got)
+
+    # Notifications go to both, with the one token
+    got = a.responses(2, 5)
+    check(len(got) == 2 and all(('TKN=' + token) in n for n in got), 'notifications to the first', got)
+    got = b.responses(2, 5)
+    check(len(got) == 2 and all(('TKN=' + token) in n for n in got), 'notifications to the second', got)
+
+    # A ?get by someone not observing gets the latest, less its token
+    c.send('#3 %s?get' % res)
+    got = c.answer(3)
+    check(got and got.startswith('2.05 CONTENT ') and 'TKN=' not in got, 'get of an observed resource', got)
+
+    # The first leaves; the second still gets them
+    a.send('#4 %s?get' % res)
+    got = a.answer(4)
+    check(got and got.startswith('2.05 CONTENT ') and 'TKN=' not in got, 'first out', got)
+    a.read(0.5)
+    b.read(0.5)
+    got = b.responses(2, 5)
+    check(len(got) >= 2, 'notifications after the first left', got)
+    got = a.read(1.5)
+    check(got == [], 'none to the one that left', got)
+
+    # The last out cancels upstream
+    b.send('#5 %s?get' % res)
+    got = b.answer(5)
+    check(got and got.startswith('2.05 CONTENT ') and 'TKN=' not in got, 'last out', got)
+    b.read(0.5)
+    got = b.read(1.5)
+    check(got == [], 'observe cancelled', got)
+    a.close()
+    b.close()
+    c.close()
+
+def coap():
+    c = Coap()
+
+    mid = c.request(CON, GET, b'\x01', [(URI_HOST, MOTE.encode())] + path('sensors/tmp275-c'))
+    m = c.response(mid)
+    check(m['code'] == '2.05' and m['token'] == b'\x01' and re.match(br'^-?\d+\.\d+$', m['payload']), 'uri-host', m)
+
+    mid = c.request(CON, GET, b'\x02', path(MOTE + '/sensors/battery'))
+    m = c.response(mid)
+    check(m['code'] == '2.05' and m['token'] == b'\x02', 'mote in the path', m)
+
+    mid = c.request(CON, GET, b'\x03', [(PROXY_URI, ('coap://%s/sensors/s01' % MOTE).encode())])
+    m = c.response(mid)
+    check(m['code'] == '2.05' and m['token'] == b'\x03', 'proxy-uri', m)
+
+    mid = c.request(CON, PUT, b'\x04', [(PROXY_URI, ('coap://%s/arduino/digital?pin=13' % MOTE).encode())], b'1')
+    m = c.response(mid)
+    check(m['code'] == '2.04', 'proxy-uri put', m)
+
+    mid = c.request(CON, GET, b'\x05', [(PROXY_URI, b'coap://127.0.0.1/chariot/sys/health')])
+    m = c.response(mid)
+    check(m['code'] == '2.05', 'proxy-uri command', m)
+
+    mid = c.request(CON, GET, b'\x06', [(PROXY_URI, b'http://%s/sensors/s01' % MOTE.encode())])
+    m = c.response(mid)
+    check(m['code'] == '5.05', 'proxy-uri not coap', m)
+
+    mid = c.request(CON, GET, b'\x07', [])
+    m = c.response(mid)
+    check(m['code'] == '4.00', 'no mote', m)
+
+    # A retransmission gets the first one's answer, not another trip to Chariot
+    c.mid -= 1
+    mid = c.request(CON, GET, b'\x07', [])
+    m2 = c.recv()
+    check(m2 == m, 'duplicate', m2)
+
+    # An observation: notifications carry its token and a rising Observe
+    mid = c.request(CON, GET, b'\x08', [(OBSERVE, b'')] + path(MOTE + '/sensors/s09'))
+    m = c.response(mid)
+    check(m['code'] == '2.05' and OBSERVE in m['opts'], 'observe', m)
+    seqs = []
+    for i in range(2):
+        m = c.recv()
+        if m['type'] == CON:
+            c.s.sendto(bytes([0x40 | ACK << 4, 0]) + struct.pack('>H', m['mid']), ('127.0.0.1', COAP_PORT))
+        seqs.append(int.from_bytes(m['opts'].get(OBSERVE, b''), 'big'))
+        check(m['token'] == b'\x08' and m['code'] == '2.05', 'notification', m)
+    check(seqs == sorted(seqs) and len(set(seqs)) == 2, 'observe numbers rise', seqs)
+    mid = c.request(CON, GET, b'\x08', [(OBSERVE, b'\x01')] + path(MOTE + '/sensors/s09'))
+    while True:
+        m = c.recv()
+        if m['type'] == ACK and m['mid'] == mid:
+            break
+    check(m['code'] == '2.05' and OBSERVE not in m['opts'], 'observe ended', m)
+
+def store():
+    raw = Raw()
+    # Each 2.05 a mote sends is a sample--notifications and answers alike
+    raw.send('#1 coap://%s/sensors/s20?obs' % MOTE)
+    raw.answer(1)
+    raw.responses(3, 5)
+    raw.send('#2 coap://%s/sensors/s20?get' % MOTE)
+    raw.answer(2)
+    raw.send('#3 coap://%s/sensors/s21?get' % MOTE)
+    raw.answer(3)
+
+    raw.send('#4 store/series')
+    got = raw.answer(4)
+    check(got and got.startswith('2.05 CONTENT ') and ('coap://%s/sensors/s20' % MOTE) in got and
+          ('coap://%s/sensors/s21' % MOTE) in got, 'series', got)
+
+    raw.send('#5 store/query?res=coap://%s/sensors/s20&from=-60' % MOTE)
+    got = raw.answer(5)
+    lines = got.strip().split('\n') if got else []
+    samples = [l for l in lines[1:] if re.match(r'^\d+ -?\d+\.\d+$', l)]
+    check(lines and lines[0] == '2.05 CONTENT coap://%s/sensors/s20' % MOTE and len(samples) == len(lines) - 1 and
+          len(samples) >= 5, 'query', got)
+    check([int(s.split()[0]) for s in samples] == sorted(int(s.split()[0]) for s in samples), 'query in time order',
+          samples)
+
+    raw.send('#6 store/query?res=coap://%s/sensors/s20&from=-60&max=2' % MOTE)
+    got = raw.answer(6)
+    lines = got.strip().split('\n') if got else []
+    check(len(lines) == 4 and lines[3] == '(more)', 'query max', got)
+
+    raw.send('#7 store/query?res=coap://%s/sensors/none' % MOTE)
+    got = raw.answer(7)
+    check(got and not re.search(r'\n\d+ ', got), 'query of nothing', got)
+    raw.close()
+
+# Two Chariots: each mote goes to the one that has it, and "sys/motes" is all
+# of them unless one is named
+def twoShields():
+    raw = Raw()
+    motes = []
+    for i in range(50):
+        raw.send('#1 sys/motes')
+        got = raw.answer(1)
+        motes = sorted(got.split('\n')[1:]) if got and got.startswith('2.05 CONTENT motes:') else []
+        if len(motes) == 3:
+            break
+        time.sleep(0.1)
+    check(motes == [MOTE, 'm4.local', 'm7.local'], 'motes of both', motes)
+
+    raw.send('#2 chariot/0/sys/motes')
+    got = raw.answer(2)
+    check(got and sorted(got.split('\n')[1:]) == [MOTE, 'm4.local'], 'motes of the first', got)
+    raw.send('#3 chariot/1/sys/motes')
+    got = raw.answer(3)
+    check(got and got.split('\n')[1:] == ['m7.local'], 'motes of the second', got)
+    raw.send('#4 chariot/2/sys/motes')
+    got = raw.answer(4)
+    check(got and got.startswith('4.04 '), 'no such Chariot', got)
+
+    for tag, mote in ((5, MOTE), (6, 'm7.local'), (7, 'm4.local')):
+        raw.send('#%d coap://%s/sensors/s01?get' % (tag, mote))
+        got = raw.answer(tag)
+        check(got and got.startswith('2.05 CONTENT '), 'routed to ' + mote, got)
+    raw.close()
+
+# chariot-gw against a chariot-sim for each -m list; None for any mote
+def gateway(gw, sim, db, moteLists, tests):
+    sims, ttys = [], []
+    for motes in moteLists:
+        # Mesh round trip 20ms, notifications every 300ms
+        sims.append(subprocess.Popen([sim, '-r', '20', '-n', '300'] + (['-m', motes] if motes else []),
+                                     stdout=subprocess.PIPE))
+        ttys += ['-d', sims[-1].stdout.readline().decode().strip()]
+    gwProc = subprocess.Popen([gw] + ttys + ['-w', str(WS_PORT), '-t', str(TCP_PORT), '-c', str(COAP_PORT),
+                                             '-s', db])
+    try:
+        for i in range(50):
+            try:
+                socket.create_connection(('127.0.0.1', TCP_PORT)).close()
+                break
+            except OSError:
+                time.sleep(0.1)
+        for test in tests:
+            test()
+    finally:
+        gwProc.terminate()
+        gwProc.wait()
+        for simProc in sims:
+            simProc.terminate()
+            simProc.wait()
+    check(gwProc.returncode == 0 or gwProc.returncode == -15, 'gateway exit', gwProc.returncode)
+
+def main():
+    gw = sys.argv[1] if len(sys.argv) > 1 else '../chariot-gw'
+    sim = sys.argv[2] if len(sys.argv) > 2 else '../chariot-sim'
+    db = os.path.join(tempfile.mkdtemp(prefix='gateway-test.'), 'samples.db')
+
+    try:
+        gateway(gw, sim, db, [None], [correlation, fanOut, coap, store, timeout])
+        gateway(gw, sim, db, [MOTE + ',m4.local', 'm7.local'], [twoShields])
+    finally:
+        if os.path.exists(db):
+            os.unlink(db)
+        os.rmdir(os.path.dirname(db))
+
+    if failed:
+        sys.exit(1)
+    print('gateway-test: ok')
+
+main()
@@ -0,0 +1,146 @@
+/*
+ * Chariot gateway: samples read back from the store as they went in,
+ * whatever part of a block a query asks for.
+ *
+ *   g++ -std=c++11 -Wall -I.. -o store-test store-test.cpp ../store.cpp
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include "store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define T0      1500000000000ULL
+
+static const char *numbers[] = { "10.0", "20.0", "30.0", "40.0", "50.0", "60.0", "70.0", "80.0", "90.0", "100.0" };
+static const char *signs[] = { "-0.50", "0.25", "-21.75", "3.00", "-3.00" };
+static const char *words[] = { "on", "off", "on", "15.5", "15.50", "on" };     // not one kind of decimal
+static const char *bigs[] = { "999999999999999999", "9999999999999999999", "-9999999999999999999", "1.000000000000000000" };
+static int failed = 0;
+
+static void check(bool ok, const char *what, const std::string &got)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL %s:\n%s\n", what, got.c_str());
+		failed++;
+	}
+}
+
+// What a query should give: samples first..last of values, a second apart
+static std::string expect(const char *series, const char **values, int first, int last)
+{
+	std::string out = std::string(series) + "\n";
+	char line[64];
+	int i;
+
+	for (i = first; i <= last; i++) {
+		snprintf(line, sizeof(line), "%llu %s\n", (unsigned long long)(T0 + i * 1000), values[i]);
+		out += line;
+	}
+	return out;
+}
+
+static void queries(Store &store, const char *when)
+{
+	std::string got;
+
+	got = store.query("coap://m3.local/n", 0, ~0ULL, 100);
+	check(got == expect("coap://m3.local/n", numbers, 0, 9), when, got);
+	// From the middle of a block
+	got = store.query("coap://m3.local/n", T0 + 5000, ~0ULL, 100);
+	check(got == expect("coap://m3.local/n", numbers, 5, 9), when, got);
+	got = store.query("coap://m3.local/n", T0 + 2500, T0 + 7000, 100);
+	check(got == expect("coap://m3.local/n", numbers, 3, 7), when, got);
+	got = store.query("coap://m3.local/n", T0 + 9000, ~0ULL, 100);
+	check(got == expect("coap://m3.local/n", numbers, 9, 9), when, got);
+
+	got = store.query("coap://m3.local/signed", T0 + 1000, ~0ULL, 100);
+	check(got == expect("coap://m3.local/signed", signs, 1, 4), when, got);
+	got = store.query("coap://m3.local/text", T0 + 2000, T0 + 4000, 100);
+	check(got == expect("coap://m3.local/text", words, 2, 4), when, got);
+
+	got = store.query("coap://m3.local/n", T0 + 5000, ~0ULL, 2);
+	check(got == expect("coap://m3.local/n", numbers, 5, 6) + "(more)\n", when, got);
+	got = store.query("coap://m3.local/n", T0 + 5000, ~0ULL, 5);
+	check(got == expect("coap://m3.local/n", numbers, 5, 9), when, got);
+	// The one more is in the next series
+	got = store.query("coap://m3.local/", T0 + 9000, T0 + 9000, 1);
+	check(got == expect("coap://m3.local/n", numbers, 9, 9) + "(more)\n", when, got);
+
+	// Too many digits for an int64_t: as text
+	got = store.query("coap://m3.local/big", 0, ~0ULL, 100);
+	check(got == expect("coap://m3.local/big", bigs, 0, 3), when, got);
+}
+
+int main()
+{
+	char path[] = "/tmp/store-test.XXXXXX";
+	std::string got, want;
+	char value[16];
+	int fd, i;
+
+	fd = mkstemp(path);
+	if (fd == -1) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	unlink(path);
+
+	{
+		Store store;
+		check(store.open(path), "open", path);
+		for (i = 0; i < 10; i++)
+			store.add("coap://m3.local/n", numbers[i], T0 + i * 1000);
+		for (i = 0; i < 5; i++)
+			store.add("coap://m3.local/signed", signs[i], T0 + i * 1000);
+		for (i = 0; i < 6; i++)
+			store.add("coap://m3.local/text", words[i], T0 + i * 1000);
+		for (i = 0; i < 4; i++)
+			store.add("coap://m3.local/big", bigs[i], T0 + i * 1000);
+		store.add("coap://m3.local/z", "1", T0 + 9000);
+		queries(store, "pending");
+		store.flush();
+		queries(store, "written");
+	}
+	{
+		Store store;
+		check(store.open(path), "reopen", path);
+		queries(store, "reopened");
+
+		// Blocks of GW_STORE_BLOCK; a query across them
+		for (i = 0; i < 3 * GW_STORE_BLOCK; i++) {
+			snprintf(value, sizeof(value), "%d.%02d", 20 + i / 100, i % 100);
+			store.add("coap://m3.local/long", value, T0 + i * 1000);
+		}
+		got = store.query("coap://m3.local/long", T0 + (GW_STORE_BLOCK - 2) * 1000ULL,
+		                  T0 + (GW_STORE_BLOCK + 1) * 1000ULL, 100);
+		want = "coap://m3.local/long\n";
+		for (i = GW_STORE_BLOCK - 2; i <= GW_STORE_BLOCK + 1; i++) {
+			snprintf(value, sizeof(value), "%d.%02d", 20 + i / 100, i % 100);
+			want += std::to_string(T0 + i * 1000) + " " + value + "\n";
+		}
+		check(got == want, "across blocks", got);
+
+		// The wall clock went back: a block before the one before it
+		store.add("coap://m3.local/back", numbers[5], T0 + 5000);
+		store.flush();
+		store.add("coap://m3.local/back", numbers[2], T0 + 2000);
+		store.flush();
+		store.add("coap://m3.local/back", numbers[7], T0 + 7000);
+		store.flush();
+		got = store.query("coap://m3.local/back", T0 + 1000, T0 + 3000, 100);
+		check(got == expect("coap://m3.local/back", numbers, 2, 2), "clock back", got);
+		got = store.query("coap://m3.local/back", T0 + 6000, ~0ULL, 100);
+		check(got == expect("coap://m3.local/back", numbers, 7, 7), "clock back", got);
+	}
+
+	unlink(path);
+	if (failed)
+		return 1;
+	printf("store-test: ok\n");
+	return 0;
+}
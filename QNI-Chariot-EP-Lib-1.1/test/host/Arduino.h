@@ -0,0 +1,193 @@
+/*
+ * Just enough of the Arduino core, for an UNO, to build the library on a
+ * desktop--see ../pincmd-test.cpp. Nothing here talks to hardware: pins
+ * read high, millis() moves only in delay(), and serial output is dropped.
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <avr/interrupt.h>
+
+#ifndef F_CPU
+#define F_CPU				16000000UL
+#endif
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint16_t word;
+
+#define HIGH				1
+#define LOW					0
+#define INPUT				0
+#define OUTPUT				1
+#define INPUT_PULLUP		2
+#define CHANGE				1
+#define FALLING				2
+#define RISING				3
+#define DEC					10
+#define HEX					16
+#define BIN					2
+
+#define NOT_AN_INTERRUPT	-1
+#define NOT_ON_TIMER		0
+#define TIMER1A				3
+#define TIMER1B				4
+#define NOT_A_PORT			0
+#define A0					14
+
+#define PROGMEM
+#define PSTR(s)				(s)
+#define F(s)				((const __FlashStringHelper *)(s))
+#define pgm_read_byte(p)	(*(const uint8_t *)(p))
+#define pgm_read_word(p)	(*(const uint16_t *)(p))
+#define strcmp_P			strcmp
+#define strncmp_P			strncmp
+#define strlen_P			strlen
+#define memcpy_P			memcpy
+#define strstr_P			strstr
+#define strcat_P			strcat
+#define strcpy_P			strcpy
+#define strncpy_P			strncpy
+#define snprintf_P			snprintf
+
+#define _BV(b)				(1u << (b))
+#define bitRead(v, b)		(((v) >> (b)) & 1)
+#define constrain(x, lo, hi) ((x) < (lo) ? (lo) : ((x) > (hi) ? (hi) : (x)))
+#define word(h, l)			((word)(((h) << 8) | (l)))
+
+template<class A, class B> auto min(A a, B b) -> decltype(a + b) { return a < b ? a : b; }
+template<class A, class B> auto max(A a, B b) -> decltype(a + b) { return a > b ? a : b; }
+
+#define digitalPinToInterrupt(p)	((p) == 2 ? 0 : ((p) == 3 ? 1 : NOT_AN_INTERRUPT))
+#define digitalPinToPort(p)			(((p) < 8) ? 4 : (((p) < 14) ? 2 : 3))
+#define digitalPinToBitMask(p)		((uint8_t)(1 << (((p) < 14) ? (p) % 8 : (p) - 14)))
+#define digitalPinToTimer(p)		(((p) == 9) ? TIMER1A : (((p) == 10) ? TIMER1B : NOT_ON_TIMER))
+extern volatile uint8_t host_ports[8];
+extern const uint16_t PROGMEM port_to_input_PGM[];
+#define portOutputRegister(P)		(&host_ports[P])
+#define portInputRegister(P)		(&host_ports[P])
+#define portModeRegister(P)			(&host_ports[P])
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int val);
+void noInterrupts();
+void interrupts();
+void yield();
+void attachInterrupt(uint8_t irq, void (*fn)(void), int mode);
+void detachInterrupt(uint8_t irq);
+
+class __FlashStringHelper;
+class String;
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual void flush() {}
+	size_t write(const uint8_t *b, size_t n) { for (size_t i = 0; i < n; i++) write(b[i]); return n; }
+	size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+	size_t print(const char *s) { return write(s); }
+	size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+	size_t print(const String &s);
+	size_t print(char c) { return write((uint8_t)c); }
+	size_t print(long v, int base = DEC) { char t[24]; snprintf(t, sizeof(t), base == HEX ? "%lx" : "%ld", v); return write(t); }
+	size_t print(int v, int base = DEC) { return print((long)v, base); }
+	size_t print(unsigned int v, int base = DEC) { return print((long)v, base); }
+	size_t print(unsigned long v, int base = DEC) { return print((long)v, base); }
+	size_t print(double v, int digits = 2) { char t[40]; snprintf(t, sizeof(t), "%.*f", digits, v); return write(t); }
+	template<class T> size_t println(T v) { return print(v) + println(); }
+	template<class T> size_t println(T v, int base) { return print(v, base) + println(); }
+	size_t println() { return write("\r\n"); }
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	size_t readBytes(char *b, size_t n) { size_t i = 0; int c; while ((i < n) && ((c = read()) != -1)) b[i++] = c; return i; }
+	String readStringUntil(char end);
+};
+
+class String {
+public:
+	std::string s;
+
+	String() {}
+	String(const char *c) { if (c) s = c; }
+	String(const __FlashStringHelper *c) : s((const char *)c) {}
+	String(char c) : s(1, c) {}
+	String(long v, int base = DEC) { char t[24]; snprintf(t, sizeof(t), base == HEX ? "%lx" : "%ld", v); s = t; }
+	String(int v, int base = DEC) : String((long)v, base) {}
+	String(unsigned char v, int base = DEC) : String((long)v, base) {}
+	String(unsigned int v, int base = DEC) : String((long)v, base) {}
+	String(unsigned long v, int base = DEC) : String((long)v, base) {}
+	String(double v, int digits = 2) { char t[40]; snprintf(t, sizeof(t), "%.*f", digits, v); s = t; }
+
+	String &operator=(const char *c) { s = c ? c : ""; return *this; }
+	String &operator+=(const String &o) { s += o.s; return *this; }
+	String &operator+=(const char *c) { s += c; return *this; }
+	String &operator+=(const __FlashStringHelper *c) { s += (const char *)c; return *this; }
+	String &operator+=(char c) { s += c; return *this; }
+	template<class T> String &operator+=(T v) { return *this += String(v); }
+	bool concat(const char *c, unsigned n) { s.append(c, n); return true; }
+	bool concat(const String &o) { s += o.s; return true; }
+	bool concat(char c) { s += c; return true; }
+	bool concat(int v) { s += String(v).s; return true; }
+
+	unsigned length() const { return s.size(); }
+	const char *c_str() const { return s.c_str(); }
+	bool reserve(unsigned n) { s.reserve(n); return true; }
+	char operator[](unsigned i) const { return s[i]; }
+	char charAt(unsigned i) const { return s[i]; }
+	void setCharAt(unsigned i, char c) { if (i < s.size()) s[i] = c; }
+	int indexOf(char c, unsigned from = 0) const { size_t r = s.find(c, from); return r == std::string::npos ? -1 : (int)r; }
+	int indexOf(const String &c, unsigned from = 0) const { size_t r = s.find(c.s, from); return r == std::string::npos ? -1 : (int)r; }
+	int indexOf(const char *c) const { return indexOf(String(c)); }
+	bool startsWith(const String &p, unsigned off = 0) const { return s.compare(off, p.s.size(), p.s) == 0; }
+	bool endsWith(const String &p) const { return (s.size() >= p.s.size()) && (s.compare(s.size() - p.s.size(), p.s.size(), p.s) == 0); }
+	void remove(unsigned i) { if (i < s.size()) s.erase(i); }
+	void remove(unsigned i, unsigned n) { if (i < s.size()) s.erase(i, n); }
+	String substring(unsigned a) const { return a < s.size() ? String(s.substr(a).c_str()) : String(); }
+	String substring(unsigned a, unsigned b) const { if (a > b) std::swap(a, b); return a < s.size() ? String(s.substr(a, b - a).c_str()) : String(); }
+	long toInt() const { return atol(s.c_str()); }
+	float toFloat() const { return atof(s.c_str()); }
+	void trim() { while (!s.empty() && isspace((unsigned char)s[s.size() - 1])) s.erase(s.size() - 1); size_t i = 0; while ((i < s.size()) && isspace((unsigned char)s[i])) i++; s.erase(0, i); }
+	void toLowerCase() { for (size_t i = 0; i < s.size(); i++) s[i] = tolower(s[i]); }
+	void toCharArray(char *b, unsigned n) const { strncpy(b, s.c_str(), n); if (n) b[n - 1] = 0; }
+	bool equals(const String &o) const { return s == o.s; }
+	bool operator==(const String &o) const { return s == o.s; }
+	bool operator!=(const String &o) const { return s != o.s; }
+	bool operator==(const char *c) const { return s == (c ? c : ""); }
+	bool operator!=(const char *c) const { return !(*this == c); }
+};
+
+template<class T> inline String operator+(const String &a, T b) { String r(a); r += b; return r; }
+inline String operator+(const char *a, const String &b) { String r(a); r += b; return r; }
+inline size_t Print::print(const String &s) { return write(s.c_str()); }
+
+class HardwareSerial : public Stream {
+public:
+	void begin(long) {}
+	int available() { return 0; }
+	int read() { return -1; }
+	int peek() { return -1; }
+	size_t write(uint8_t) { return 1; }
+	using Print::write;
+};
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef HOST_EEPROM_H
+#define HOST_EEPROM_H
+#include <Arduino.h>
+
+#define E2END	0x3FF
+
+class EEPROMClass {
+public:
+	uint8_t mem[E2END + 1];
+	uint8_t read(int a) { return mem[a]; }
+	void write(int a, uint8_t v) { mem[a] = v; }
+	void update(int a, uint8_t v) { mem[a] = v; }
+	uint16_t length() { return E2END + 1; }
+	template<class T> T &get(int a, T &t) { memcpy(&t, &mem[a], sizeof(T)); return t; }
+	template<class T> const T &put(int a, const T &t) { memcpy(&mem[a], &t, sizeof(T)); return t; }
+};
+extern EEPROMClass EEPROM;
+
+#endif
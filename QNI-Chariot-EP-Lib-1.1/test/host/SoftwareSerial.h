@@ -0,0 +1,20 @@
+#ifndef HOST_SOFTWARE_SERIAL_H
+#define HOST_SOFTWARE_SERIAL_H
+#include <Arduino.h>
+
+// The Chariot channel: host_rx is what Chariot "sends", host_tx collects our side
+extern std::string host_rx, host_tx;
+
+class SoftwareSerial : public Stream {
+public:
+	SoftwareSerial(uint8_t, uint8_t) {}
+	void begin(long) {}
+	bool listen() { return true; }
+	int available() { return host_rx.size(); }
+	int read() { int c = peek(); if (c != -1) host_rx.erase(0, 1); return c; }
+	int peek() { return host_rx.empty() ? -1 : (uint8_t)host_rx[0]; }
+	size_t write(uint8_t c) { host_tx += (char)c; return 1; }
+	using Print::write;
+};
+
+#endif
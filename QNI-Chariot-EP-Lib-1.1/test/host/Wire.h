@@ -0,0 +1,18 @@
+#ifndef HOST_WIRE_H
+#define HOST_WIRE_H
+#include <Arduino.h>
+
+// An I2C bus with nothing on it
+class TwoWire {
+public:
+	void begin() {}
+	void beginTransmission(uint8_t) {}
+	size_t write(uint8_t) { return 1; }
+	uint8_t endTransmission(bool = true) { return 2; }	// address NACK
+	uint8_t requestFrom(int, int) { return 0; }
+	int available() { return 0; }
+	int read() { return -1; }
+};
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+#include <avr/io.h>
+
+#define ISR(v)				extern "C" void v(void)
+#define EMPTY_INTERRUPT(v)	extern "C" void v(void) {}
+#define cli()
+#define sei()
+
+#endif
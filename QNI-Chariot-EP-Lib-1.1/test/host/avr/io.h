@@ -0,0 +1,40 @@
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+#include <stdint.h>
+
+// ATmega328P registers the library touches, as plain variables
+extern volatile uint8_t ADMUX, ADCSRA, ADCSRB, ADCL, ADCH, DIDR0, SREG, MCUSR, WDTCSR;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern volatile uint16_t OCR1A, OCR1B, TCNT1, ADC;
+
+#define REFS0	6
+#define ADLAR	5
+#define MUX5	3
+#define ADEN	7
+#define ADSC	6
+#define ADATE	5
+#define ADIF	4
+#define ADIE	3
+#define ADPS2	2
+#define ADPS1	1
+#define ADPS0	0
+#define ADTS2	2
+#define ADTS1	1
+#define ADTS0	0
+#define WGM10	0
+#define WGM12	3
+#define CS10	0
+#define CS11	1
+#define CS12	2
+#define OCF1B	2
+#define OCIE1B	2
+#define WDP0	0
+#define WDP1	1
+#define WDP2	2
+#define WDP3	5
+#define WDCE	4
+#define WDE		3
+#define WDIE	6
+#define WDRF	3
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef HOST_AVR_SLEEP_H
+#define HOST_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE		0
+#define SLEEP_MODE_PWR_DOWN	2
+#define set_sleep_mode(m)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()
+
+#endif
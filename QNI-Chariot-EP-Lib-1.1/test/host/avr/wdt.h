@@ -0,0 +1,8 @@
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+#include <avr/io.h>
+
+#define wdt_reset()
+#define wdt_disable()
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * The Arduino core behind host/Arduino.h
+ */
+#include <Arduino.h>
+#include <Wire.h>
+#include <SoftwareSerial.h>
+#include <EEPROM.h>
+
+HardwareSerial Serial;
+TwoWire Wire;
+EEPROMClass EEPROM;
+std::string host_rx, host_tx;
+
+volatile uint8_t host_ports[8];
+const uint16_t PROGMEM port_to_input_PGM[] = { NOT_A_PORT, NOT_A_PORT, 0x23, 0x26, 0x29 };	// PINB, PINC, PIND
+volatile uint8_t ADMUX, ADCSRA, ADCSRB, ADCL, ADCH, DIDR0, SREG, MCUSR, WDTCSR;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t OCR1A, OCR1B, TCNT1, ADC;
+
+volatile unsigned long timer0_millis;		// wiring.c's, which dutySleep() advances
+static unsigned long now;
+
+unsigned long millis() { return now; }
+unsigned long micros() { return now * 1000; }
+void delay(unsigned long ms) { now += ms; }
+void delayMicroseconds(unsigned int) {}
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return HIGH; }
+int analogRead(uint8_t) { return 512; }
+void analogWrite(uint8_t, int) {}
+void noInterrupts() {}
+void interrupts() {}
+void yield() {}
+void attachInterrupt(uint8_t, void (*)(void), int) {}
+void detachInterrupt(uint8_t) {}
+
+String Stream::readStringUntil(char end)
+{
+	String s;
+	int c;
+
+	while (((c = read()) != -1) && (c != end))
+		s += (char)c;
+	return s;
+}
@@ -0,0 +1,130 @@
+/*
+ * ChariotEPLib: remote pin commands as pinCmdParse() reads them, for an UNO.
+ * Also times the parser, and is a libFuzzer target with -DFUZZ.
+ *
+ *   g++ -std=gnu++11 -O2 -Wall -DHAVE_HWSERIAL0 -D__AVR__ -D__AVR_ATmega328P__ -Ihost -I.. \
+ *       -o pincmd-test pincmd-test.cpp host/host.cpp ../ChariotEPLib.cpp
+ *   clang++ -std=gnu++11 -g -O1 -fsanitize=fuzzer,address -DFUZZ -DHAVE_HWSERIAL0 -D__AVR__ \
+ *       -D__AVR_ATmega328P__ -Ihost -I.. -o pincmd-fuzz pincmd-test.cpp host/host.cpp ../ChariotEPLib.cpp
+ *
+ * Qualia Networks Incorporated -- Chariot IoT Shield and software for Arduino
+ * Copyright 2016, Qualia Networks, Inc.
+ */
+#include <ChariotEPLib.h>
+
+#include <chrono>
+
+typedef struct {
+	const char	*command;
+	uint8_t		kind;
+	uint8_t		status;
+	int			pin;
+	int			value;
+} pin_case_t;
+
+static const pin_case_t cases[] = {
+	// Path form
+	{ "13",					PIN_KIND_DIGITAL,	PIN_CMD_OK,			13,	-1 },
+	{ "13/1",				PIN_KIND_DIGITAL,	PIN_CMD_OK,			13,	1 },
+	{ "13/output",			PIN_KIND_MODE,		PIN_CMD_OK,			13,	OUTPUT },
+	{ "13/input",			PIN_KIND_MODE,		PIN_CMD_OK,			13,	INPUT },
+	{ "13/input_pullup",	PIN_KIND_MODE,		PIN_CMD_OK,			13,	INPUT_PULLUP },
+	{ "5",					PIN_KIND_ANALOG,	PIN_CMD_OK,			5,	-1 },
+	{ "5/255",				PIN_KIND_ANALOG,	PIN_CMD_OK,			5,	255 },
+	// Query form
+	{ "?get&pin=13",		PIN_KIND_DIGITAL,	PIN_CMD_OK,			13,	-1 },
+	{ "put&pin=13&val=0",	PIN_KIND_DIGITAL,	PIN_CMD_OK,			13,	0 },
+	{ "get&foo=3&pin=2",	PIN_KIND_ANY,		PIN_CMD_OK,			2,	-1 },
+	{ "put&pin=7&val=output", PIN_KIND_MODE,	PIN_CMD_OK,			7,	OUTPUT },
+	{ "get&pin=3/x",		PIN_KIND_ANY,		PIN_CMD_OK,			3,	-1 },	// once looped forever
+	// Syntax
+	{ "13abc",				PIN_KIND_ANY,		PIN_CMD_BAD_SYNTAX,	-1,	-1 },
+	{ "?get",				PIN_KIND_ANY,		PIN_CMD_BAD_SYNTAX,	-1,	-1 },
+	{ "pin=",				PIN_KIND_ANY,		PIN_CMD_BAD_SYNTAX,	-1,	-1 },
+	{ "get&pin=99999",		PIN_KIND_ANY,		PIN_CMD_BAD_SYNTAX,	-1,	-1 },
+	{ "get&pin=13x",		PIN_KIND_ANY,		PIN_CMD_BAD_SYNTAX,	-1,	-1 },
+	{ "",					PIN_KIND_ANY,		PIN_CMD_BAD_SYNTAX,	-1,	-1 },
+	// Board pin tables
+	{ "20/1",				PIN_KIND_DIGITAL,	PIN_CMD_BAD_PIN,	20,	1 },
+	{ "6",					PIN_KIND_ANALOG,	PIN_CMD_BAD_PIN,	6,	-1 },
+	{ "13/2",				PIN_KIND_DIGITAL,	PIN_CMD_BAD_VALUE,	13,	2 },
+	{ "5/300",				PIN_KIND_ANALOG,	PIN_CMD_BAD_VALUE,	5,	300 },
+	{ "13/1",				PIN_KIND_MODE,		PIN_CMD_OK,			13,	OUTPUT },
+	{ "11/1",				PIN_KIND_DIGITAL,	PIN_CMD_RESERVED,	11,	1 },
+	{ "put&pin=8&val=0",	PIN_KIND_DIGITAL,	PIN_CMD_RESERVED,	8,	0 },
+	{ "8",					PIN_KIND_DIGITAL,	PIN_CMD_OK,			8,	-1 },	// reading is fine
+};
+#define NUM_CASES	(sizeof(cases) / sizeof(cases[0]))
+
+/*
+ * What holds for any command: a parse that passed the board checks
+ * names a pin and value that board has.
+ */
+static bool sane(uint8_t kind, const pin_cmd_t *cmd)
+{
+	if (cmd->status != PIN_CMD_OK)
+		return cmd->status <= PIN_CMD_RESERVED;
+	if (cmd->pin < 0)
+		return false;
+	switch (kind) {
+		case PIN_KIND_DIGITAL:
+			return (cmd->pin < CHARIOT_NUM_DIGITAL) && (cmd->value <= HIGH);
+		case PIN_KIND_ANALOG:
+			if (cmd->value < 0)
+				return cmd->pin < CHARIOT_NUM_ANALOG;
+			return (cmd->pin < CHARIOT_NUM_DIGITAL) && (cmd->value <= CHARIOT_PWM_MAX);
+		case PIN_KIND_MODE:
+			return (cmd->pin < CHARIOT_NUM_DIGITAL) && (cmd->value >= 0) && (cmd->value <= INPUT_PULLUP);
+	}
+	return cmd->value >= -1;
+}
+
+#ifdef FUZZ
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	std::string command((const char *)data, size);	// NUL terminated, as the library's are
+	pin_cmd_t cmd;
+	uint8_t kind;
+
+	for (kind = PIN_KIND_ANY; kind <= PIN_KIND_MODE; kind++) {
+		ChariotEP.pinCmdParse(command.c_str(), kind, &cmd);
+		if (!sane(kind, &cmd))
+			abort();
+	}
+	return 0;
+}
+
+#else
+
+int main()
+{
+	std::chrono::steady_clock::time_point start;
+	unsigned long rounds = 200000, i;
+	const pin_case_t *c;
+	pin_cmd_t cmd;
+	int failed = 0;
+	double ns;
+
+	for (c = cases; c < cases + NUM_CASES; c++) {
+		ChariotEP.pinCmdParse(c->command, c->kind, &cmd);
+		if ((cmd.status != c->status) || (cmd.pin != c->pin) || (cmd.value != c->value) || !sane(c->kind, &cmd)) {
+			fprintf(stderr, "FAIL \"%s\" kind %d: status %d pin %d value %d\n", c->command, c->kind,
+			        cmd.status, cmd.pin, cmd.value);
+			failed++;
+		}
+	}
+	if (failed)
+		return 1;
+
+	start = std::chrono::steady_clock::now();
+	for (i = 0; i < rounds; i++) {
+		for (c = cases; c < cases + NUM_CASES; c++)
+			ChariotEP.pinCmdParse(c->command, c->kind, &cmd);
+	}
+	ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	printf("pincmd-test: ok, %.1f ns a command\n", ns / (rounds * NUM_CASES));
+	return 0;
+}
+
+#endif
@@ -5,15 +5,24 @@ $(function () {
     var content = $('#content');
     var input = $('#input');
     var status = $('#status');
+    var dashboard = $('#dashboard');
 
     // my color assigned by the server
     var myColor = true;
     // my name sent to the server
     var myName = true;
-	
+
+    // Lines kept in the chat window--older ones are dropped
+    var MAX_LINES = 200;
+    // Samples kept per charted resource
+    var MAX_SAMPLES = 2000;
+
+    // Binary messages from the bridge (see the sketch's README)
+    var BIN_REQUEST = 1, BIN_RESPONSE = 2, BIN_NOTIFICATION = 3, BIN_HEADER_LEN = 7;
+
     // if user is running mozilla then use it's built-in WebSocket
     window.WebSocket = window.WebSocket || window.MozWebSocket;
-	
+
     // if browser doesn't support WebSocket, just show some notification and exit
     if (!window.WebSocket) {
         content.html($('<p>', { text: 'Sorry, but your browser doesn\'t '
@@ -26,7 +35,8 @@ $(function () {
     // open connection--overwrite default string for your value.
 	var chariot = prompt("Please enter Chariot WS server: ", "ws://192.168.0.77:1337");
 	var connection = new WebSocket(chariot);
- 
+    connection.binaryType = 'arraybuffer';
+
     connection.onopen = function () {
         // first we want users to enter their names
         input.removeAttr('disabled');
@@ -42,10 +52,11 @@ $(function () {
     // most important part - incoming messages
     connection.onmessage = function (event) {
 		input.removeAttr('disabled'); // let the user write another message
-		//content.prepend('<p> ' +
-        //     + 'Arduino IoT: ' + event.data + '</p>');
-		content.prepend('<p> ' + event.data + '</p>');
-		//addMessage();
+        if (event.data instanceof ArrayBuffer) {
+            binaryMessage(event.data);
+        } else {
+            addMessage(event.data);
+        }
     };
 
     /**
@@ -57,10 +68,23 @@ $(function () {
             if (!msg) {
                 return;
             }
-            // send the message as an ordinary text
-			content.prepend('<p> ' + msg + '</p>');
-            connection.send(msg);
             $(this).val('');
+
+            // 'dashboard' toggles between the chat window and the charts
+            if (msg.trim().toLowerCase() === 'dashboard') {
+                dashboardMode = !dashboardMode;
+                content.toggle(!dashboardMode);
+                dashboard.toggle(dashboardMode);
+                redraw();
+                return;
+            }
+            addMessage(msg);
+            if (dashboardMode) {
+                sendBinary(msg);
+            } else {
+                // send the message as an ordinary text
+                connection.send(msg);
+            }
             // disable the input field to make the user wait until server
             // sends back response
             //input.attr('disabled', 'disabled');
@@ -86,10 +110,231 @@ $(function () {
     }, 60000);
 
     /**
-     * Add message to the chat window
+     * Messages wait here for the next animation frame, which puts them
+     * all in the window at once. A burst larger than the window only
+     * keeps its newest MAX_LINES.
      */
-    function addMessage() {
-        content.prepend('<p> ' +
-             + 'Arduino IoT: ' + message.data + '</p>');
+    var pending = new Array(MAX_LINES);
+    var pendingHead = 0, pendingCount = 0;
+    var framePending = false;
+
+    function addMessage(text) {
+        pending[(pendingHead + pendingCount) % MAX_LINES] = text;
+        if (pendingCount < MAX_LINES) {
+            pendingCount++;
+        } else {
+            pendingHead = (pendingHead + 1) % MAX_LINES;
+        }
+        redraw();
+    }
+
+    function redraw() {
+        if (!framePending) {
+            framePending = true;
+            window.requestAnimationFrame(render);
+        }
+    }
+
+    function render() {
+        var lines = document.createDocumentFragment();
+        var p, i, excess;
+
+        framePending = false;
+        if (pendingCount) {
+            // newest first, as prepend() would have had them
+            for (i = pendingCount - 1; i >= 0; i--) {
+                p = document.createElement('p');
+                p.textContent = ' ' + pending[(pendingHead + i) % MAX_LINES];
+                lines.appendChild(p);
+            }
+            pendingHead = pendingCount = 0;
+            content[0].insertBefore(lines, content[0].firstChild);
+
+            excess = content[0].childNodes.length - MAX_LINES;
+            while (excess-- > 0) {
+                content[0].removeChild(content[0].lastChild);
+            }
+        }
+        if (dashboardMode) {
+            drawPanels();
+        }
+    }
+
+    /**
+     * Dashboard mode. Requests go to the bridge as binary messages, so each
+     * response comes back with its request's id, its CoAP code and its
+     * latency. Observe notifications carry the token their registration was
+     * answered with; both map to the mote and resource asked for. Numeric
+     * values are charted per mote, a panel each.
+     */
+    var dashboardMode = false;
+    var nextId = 1;
+    var requests = {};      // id: URL
+    var tokens = {};        // observe token: URL
+    var motes = {};         // host: panel
+
+    function sendBinary(msg) {
+        var url = msg.trim();
+        var id = nextId;
+        var buf = new Uint8Array(3 + url.length);
+        var i;
+
+        nextId = (nextId % 0xffff) + 1;
+        requests[id] = url;
+        buf[0] = BIN_REQUEST;
+        buf[1] = id >> 8;
+        buf[2] = id & 0xff;
+        for (i = 0; i < url.length; i++) {
+            buf[3 + i] = url.charCodeAt(i) & 0xff;
+        }
+        connection.send(buf.buffer);
+    }
+
+    function binaryMessage(data) {
+        var view = new DataView(data);
+        var type, id, code, latency, text, url, token;
+
+        if (data.byteLength < BIN_HEADER_LEN) {
+            return;
+        }
+        type = view.getUint8(0);
+        id = view.getUint16(1);
+        code = view.getUint8(3);
+        latency = view.getUint16(5);
+        text = String.fromCharCode.apply(null, new Uint8Array(data, BIN_HEADER_LEN));
+        token = (text.match(/TKN=(\w+)/) || [])[1];
+
+        if (type === BIN_RESPONSE) {
+            url = requests[id];
+            delete requests[id];
+            if (url && token) {
+                tokens[token] = url;
+            }
+        } else if (type === BIN_NOTIFICATION) {
+            url = token && tokens[token];
+        }
+        addMessage((code ? (code >> 5) + '.' + ('0' + (code & 0x1f)).slice(-2) + ' ' : '') + text
+                   + (type === BIN_RESPONSE ? ' ' + latency + '(ms)' : ''));
+        if (url) {
+            sample(url, text.replace(/TKN=\w+/, ''), type === BIN_RESPONSE ? latency : -1);
+        }
+    }
+
+    // coap://host/resource?query
+    function parseUrl(url) {
+        var m = url.match(/^\w+:\/\/([^\/]+)\/([^?]*)/);
+        return m ? { host: m[1], resource: m[2] } : { host: 'chariot', resource: url };
+    }
+
+    function sample(url, text, latency) {
+        var where = parseUrl(url);
+        var panel = motes[where.host] || (motes[where.host] = newPanel(where.host));
+        var series, value;
+
+        if (latency >= 0) {
+            panel.latency = latency;
+            panel.dirty = true;
+        }
+        value = parseFloat((text.match(/-?\d+(\.\d+)?/) || [])[0]);
+        if (isNaN(value)) {
+            redraw();
+            return;
+        }
+        series = panel.series[where.resource] || (panel.series[where.resource] = newSeries(panel, where.resource));
+        series.t[series.head] = Date.now();
+        series.v[series.head] = value;
+        series.head = (series.head + 1) % MAX_SAMPLES;
+        if (series.count < MAX_SAMPLES) {
+            series.count++;
+        }
+        series.dirty = panel.dirty = true;
+        redraw();
+    }
+
+    function newPanel(host) {
+        var div = $('<div>', { 'class': 'mote' }).appendTo(dashboard);
+        $('<h3>', { text: host }).appendTo(div);
+        return { div: div, latencyText: $('<span>', { 'class': 'latency' }).appendTo(div),
+                 latency: -1, series: {}, dirty: true };
+    }
+
+    function newSeries(panel, resource) {
+        var row = $('<p>').appendTo(panel.div);
+        var canvas = $('<canvas>', { width: 600, height: 80 }).attr({ width: 600, height: 80 });
+
+        $('<span>', { text: resource + ' ' }).appendTo(row);
+        return { label: $('<span>', { 'class': 'value' }).appendTo(row),
+                 canvas: canvas.appendTo(panel.div)[0],
+                 t: new Float64Array(MAX_SAMPLES), v: new Float64Array(MAX_SAMPLES),
+                 head: 0, count: 0, dirty: true };
+    }
+
+    function drawPanels() {
+        var host, resource, panel, series;
+
+        for (host in motes) {
+            panel = motes[host];
+            if (!panel.dirty) {
+                continue;
+            }
+            panel.dirty = false;
+            if (panel.latency >= 0) {
+                panel.latencyText.text('latency ' + panel.latency + '(ms)');
+            }
+            for (resource in panel.series) {
+                series = panel.series[resource];
+                if (series.dirty) {
+                    series.dirty = false;
+                    drawSeries(series);
+                }
+            }
+        }
+    }
+
+    /**
+     * Draw a series downsampled to the canvas: each pixel column gets the
+     * min and max of the samples that fall in it, so peaks survive however
+     * many samples there are.
+     */
+    function drawSeries(series) {
+        var canvas = series.canvas, ctx = canvas.getContext('2d');
+        var w = canvas.width, h = canvas.height;
+        var first = (series.head - series.count + MAX_SAMPLES) % MAX_SAMPLES;
+        var t0 = series.t[first], span, lo = Infinity, hi = -Infinity;
+        var colMin = new Float64Array(w), colMax = new Float64Array(w);
+        var i, n, x, v, y;
+
+        series.label.text(series.v[(series.head - 1 + MAX_SAMPLES) % MAX_SAMPLES]);
+        span = Math.max(series.t[(series.head - 1 + MAX_SAMPLES) % MAX_SAMPLES] - t0, 1);
+        for (x = 0; x < w; x++) {
+            colMin[x] = Infinity;
+            colMax[x] = -Infinity;
+        }
+        for (n = 0; n < series.count; n++) {
+            i = (first + n) % MAX_SAMPLES;
+            x = Math.min(w - 1, Math.floor((series.t[i] - t0) * (w - 1) / span));
+            v = series.v[i];
+            colMin[x] = Math.min(colMin[x], v);
+            colMax[x] = Math.max(colMax[x], v);
+            lo = Math.min(lo, v);
+            hi = Math.max(hi, v);
+        }
+        if (hi === lo) {
+            hi += 1;
+            lo -= 1;
+        }
+
+        ctx.clearRect(0, 0, w, h);
+        ctx.strokeStyle = '#203060';
+        ctx.beginPath();
+        for (x = 0; x < w; x++) {
+            if (colMin[x] === Infinity) {
+                continue;
+            }
+            y = h - 1 - (colMax[x] - lo) * (h - 2) / (hi - lo);
+            ctx.moveTo(x + 0.5, y);
+            ctx.lineTo(x + 0.5, h - 1 - (colMin[x] - lo) * (h - 2) / (hi - lo) + 1);
+        }
+        ctx.stroke();
     }
-});
\ No newline at end of file
+});